@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "btstack_run_loop_virtual.c"
+
+/*
+ *  btstack_run_loop_virtual.c
+ *
+ *  Timers are kept by the run loop base. After all due timers and callbacks ran, the virtual clock is set to the
+ *  timeout of the first timer. The run loop returns when exit is triggered or when no timer is left.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "btstack_linked_list.h"
+#include "btstack_run_loop.h"
+#include "btstack_util.h"
+
+#include "btstack_run_loop_virtual.h"
+
+// FNV-1a
+#define VIRTUAL_DIGEST_OFFSET   0x811c9dc5u
+#define VIRTUAL_DIGEST_PRIME    0x01000193u
+
+static uint32_t virtual_time_ms;
+static bool     virtual_exit;
+static bool     virtual_callbacks_pending;
+static btstack_run_loop_virtual_stats_t virtual_stats;
+
+static void virtual_digest_add(uint32_t value){
+    uint8_t i;
+    for (i = 0; i < 4; i++){
+        virtual_stats.digest = (virtual_stats.digest ^ ((value >> (i * 8)) & 0xff)) * VIRTUAL_DIGEST_PRIME;
+    }
+}
+
+static void btstack_run_loop_virtual_init(void){
+    btstack_run_loop_base_init();
+    virtual_time_ms           = 0;
+    virtual_exit              = false;
+    virtual_callbacks_pending = false;
+    memset(&virtual_stats, 0, sizeof(virtual_stats));
+    virtual_stats.digest = VIRTUAL_DIGEST_OFFSET;
+}
+
+static uint32_t btstack_run_loop_virtual_get_time_ms(void){
+    return virtual_time_ms;
+}
+
+static void btstack_run_loop_virtual_set_timer(btstack_timer_source_t * ts, uint32_t timeout_in_ms){
+    ts->timeout = virtual_time_ms + timeout_in_ms;
+}
+
+static void btstack_run_loop_virtual_add_timer(btstack_timer_source_t * ts){
+    btstack_run_loop_base_add_timer(ts);
+    virtual_stats.timers_active = (uint16_t) btstack_linked_list_count(&btstack_run_loop_base_timers);
+    virtual_stats.timers_active_max = btstack_max(virtual_stats.timers_active_max, virtual_stats.timers_active);
+}
+
+static void btstack_run_loop_virtual_execute_on_main_thread(btstack_context_callback_registration_t * callback_registration){
+    // single threaded, called from a timer or callback of this run loop
+    btstack_run_loop_base_add_callback(callback_registration);
+    virtual_callbacks_pending = true;
+}
+
+static void btstack_run_loop_virtual_trigger_exit(void){
+    virtual_exit = true;
+}
+
+static void btstack_run_loop_virtual_process_timers(void){
+    while (!virtual_exit && (btstack_run_loop_base_timers != NULL)){
+        btstack_timer_source_t * ts = (btstack_timer_source_t *) btstack_run_loop_base_timers;
+        if (btstack_time_delta(ts->timeout, virtual_time_ms) > 0) break;
+        btstack_run_loop_base_remove_timer(ts);
+        virtual_stats.timers_fired++;
+        virtual_digest_add(virtual_time_ms);
+        ts->process(ts);
+    }
+}
+
+static void btstack_run_loop_virtual_execute(void){
+    virtual_exit = false;
+    while (!virtual_exit){
+        btstack_run_loop_base_poll_data_sources();
+        while (virtual_callbacks_pending){
+            virtual_callbacks_pending = false;
+            virtual_stats.callbacks++;
+            btstack_run_loop_base_execute_callbacks();
+        }
+        btstack_run_loop_virtual_process_timers();
+        if (virtual_exit || virtual_callbacks_pending) continue;
+
+        // nothing left to do now, jump to next timer
+        int32_t timeout_ms = btstack_run_loop_base_get_time_until_timeout(virtual_time_ms);
+        if (timeout_ms < 0) break;
+        virtual_time_ms += (uint32_t) timeout_ms;
+    }
+}
+
+static const btstack_run_loop_t btstack_run_loop_virtual = {
+    &btstack_run_loop_virtual_init,
+    &btstack_run_loop_base_add_data_source,
+    &btstack_run_loop_base_remove_data_source,
+    &btstack_run_loop_base_enable_data_source_callbacks,
+    &btstack_run_loop_base_disable_data_source_callbacks,
+    &btstack_run_loop_virtual_set_timer,
+    &btstack_run_loop_virtual_add_timer,
+    &btstack_run_loop_base_remove_timer,
+    &btstack_run_loop_virtual_execute,
+    &btstack_run_loop_base_dump_timer,
+    &btstack_run_loop_virtual_get_time_ms,
+    NULL, /* poll data sources from irq */
+    &btstack_run_loop_virtual_execute_on_main_thread,
+    &btstack_run_loop_virtual_trigger_exit,
+};
+
+const btstack_run_loop_t * btstack_run_loop_virtual_get_instance(void){
+    return &btstack_run_loop_virtual;
+}
+
+uint32_t btstack_run_loop_virtual_get_time_us(void){
+    return virtual_time_ms * 1000;
+}
+
+const btstack_run_loop_virtual_stats_t * btstack_run_loop_virtual_get_stats(void){
+    virtual_stats.timers_active = (uint16_t) btstack_linked_list_count(&btstack_run_loop_base_timers);
+    return &virtual_stats;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  btstack_run_loop_virtual.h
+ *
+ *  Run loop on a virtual clock for soak tests on the host. There is no waiting: when nothing is left to do at the
+ *  current time, the clock jumps to the next timer. A run of several hours of simulated time takes seconds and,
+ *  as no wall-clock time is involved, every run with the same inputs takes the same path. Data sources are accepted
+ *  but only polled, file descriptors like stdin are never read.
+ */
+
+#ifndef BTSTACK_RUN_LOOP_VIRTUAL_H
+#define BTSTACK_RUN_LOOP_VIRTUAL_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "btstack_run_loop.h"
+
+typedef struct {
+    uint32_t timers_fired;
+    uint32_t callbacks;
+    uint16_t timers_active;
+    uint16_t timers_active_max;
+    // hash over the time of all fired timers, equal for equal runs
+    uint32_t digest;
+} btstack_run_loop_virtual_stats_t;
+
+/* API_START */
+
+/**
+ * @brief Provide virtual run loop, time starts at 0
+ * @return run loop instance
+ */
+const btstack_run_loop_t * btstack_run_loop_virtual_get_instance(void);
+
+/**
+ * @brief Get virtual time
+ * @return time in us
+ */
+uint32_t btstack_run_loop_virtual_get_time_us(void);
+
+/**
+ * @brief Get statistics
+ * @return stats, timers_active is updated on each call
+ */
+const btstack_run_loop_virtual_stats_t * btstack_run_loop_virtual_get_stats(void);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // BTSTACK_RUN_LOOP_VIRTUAL_H
@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "main.c"
+
+/*
+ *  main.c
+ *
+ *  Host build of the Spark 40 foot pedal: runs spark_control.c on the POSIX run loop against the mock
+ *  HCI/GATT layer and one or more emulated Spark 40 amps. Buttons are simulated via the console keys '1'-'4' or
+ *  periodically for load tests. Optionally, an emulated Spark app connects through the relay and an expression
+ *  pedal is swept heel to toe and back with noisy ADC samples. For soak tests, a scenario drives presses and
+ *  dropouts and the virtual run loop replaces the POSIX one to cover hours of simulated time in seconds.
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "btstack.h"
+#include "btstack_run_loop_posix.h"
+
+#include "btstack_run_loop_virtual.h"
+#include "expression_pedal.h"
+#include "mock_btstack.h"
+#include "spark_app_emulator.h"
+#include "spark_control.h"
+#include "spark_emulator.h"
+#include "spark_scenario.h"
+#include "trace_log.h"
+
+static const bd_addr_t spark_40_addr = { 0x08, 0x3A, 0xF2, 0x53, 0x4D, 0x01 };
+
+static uint32_t press_period_ms;
+static uint8_t  press_button;
+static uint32_t power_cycle_off_ms;
+static uint32_t power_cycle_period_ms;
+static uint8_t  power_cycle_amp;
+static uint32_t app_period_ms;
+static uint32_t sweep_period_ms;
+static uint32_t sweep_start_us;
+static uint32_t sweep_noise_state = 1;
+static expression_pedal_t sweep_pedal;
+static bool     virtual_time;
+static uint32_t virtual_start_us;
+static const char * scenario_path;
+static bool     scenario_failed;
+
+static btstack_timer_source_t press_timer;
+static btstack_timer_source_t power_cycle_timer;
+static btstack_timer_source_t stop_timer;
+static btstack_timer_source_t sweep_timer;
+
+// 12 bit ADC as on the ESP32
+#define SWEEP_SAMPLE_PERIOD_MS  2
+#define SWEEP_RAW_MIN           100
+#define SWEEP_RAW_MAX           4000
+#define SWEEP_NOISE_LSB         8
+
+static uint32_t clock_us(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) ((uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000);
+}
+
+// shared with the pedal
+static uint32_t time_us(void){
+    return virtual_time ? btstack_run_loop_virtual_get_time_us() : clock_us();
+}
+
+static void press_timeout(btstack_timer_source_t * ts){
+    spark_control_button_pressed(press_button, time_us());
+    // includes the macro on the 4th button
+    press_button = (press_button + 1) % 4;
+    btstack_run_loop_set_timer(ts, press_period_ms);
+    btstack_run_loop_add_timer(ts);
+}
+
+// triangle from heel to toe and back, plus noise
+static void sweep_timeout(btstack_timer_source_t * ts){
+    uint32_t now_us = time_us();
+    uint32_t period_us = sweep_period_ms * 1000;
+    uint32_t phase_us = (now_us - sweep_start_us) % period_us;
+    uint32_t half_us = period_us / 2;
+    uint32_t travel_us = (phase_us < half_us) ? phase_us : (period_us - phase_us);
+    int32_t raw = SWEEP_RAW_MIN + (int32_t) (((uint64_t) travel_us * (SWEEP_RAW_MAX - SWEEP_RAW_MIN)) / half_us);
+    sweep_noise_state = sweep_noise_state * 1103515245u + 12345u;
+    raw += (int32_t) ((sweep_noise_state >> 16) % (2 * SWEEP_NOISE_LSB + 1)) - SWEEP_NOISE_LSB;
+    raw = btstack_max(0, btstack_min(4095, raw));
+    if (expression_pedal_sample(&sweep_pedal, (uint16_t) raw, now_us)){
+        spark_control_expression_changed(expression_pedal_get_position(&sweep_pedal), now_us);
+    }
+    btstack_run_loop_set_timer(ts, SWEEP_SAMPLE_PERIOD_MS);
+    btstack_run_loop_add_timer(ts);
+}
+
+static void power_cycle_timeout(btstack_timer_source_t * ts){
+    // one amp after the other
+    spark_emulator_power_cycle(power_cycle_amp, power_cycle_off_ms);
+    power_cycle_amp = (power_cycle_amp + 1) % spark_emulator_get_num_amps();
+    btstack_run_loop_set_timer(ts, power_cycle_period_ms);
+    btstack_run_loop_add_timer(ts);
+}
+
+static void stop_timeout(btstack_timer_source_t * ts){
+    UNUSED(ts);
+    // flush trace log of the pedal before the statistics
+    trace_log_process();
+    spark_control_dump_stats();
+    spark_emulator_dump_stats();
+    if (sweep_period_ms > 0){
+        const expression_pedal_stats_t * stats = expression_pedal_get_stats(&sweep_pedal);
+        printf("[-] Sweep: samples %"PRIu32", undetected %"PRIu32", changes %"PRIu32", in deadband %"PRIu32"\n",
+               stats->samples, stats->undetected, stats->changes, stats->suppressed);
+    }
+    if (app_period_ms > 0){
+        spark_app_emulator_dump_stats();
+    }
+    if (scenario_path != NULL){
+        spark_scenario_dump_stats();
+        scenario_failed = !spark_scenario_passed();
+    }
+    if (virtual_time){
+        const btstack_run_loop_virtual_stats_t * stats = btstack_run_loop_virtual_get_stats();
+        printf("[-] Virtual time: %"PRIu32" s in %"PRIu32" ms, timers fired %"PRIu32", callbacks %"PRIu32", active timers %u (max %u), digest %08"PRIx32"\n",
+               btstack_run_loop_get_time_ms() / 1000, (clock_us() - virtual_start_us) / 1000, stats->timers_fired,
+               stats->callbacks, stats->timers_active, stats->timers_active_max, stats->digest);
+    }
+    btstack_run_loop_trigger_exit();
+}
+
+static void start_timer(btstack_timer_source_t * ts, void (*handler)(btstack_timer_source_t * ts), uint32_t timeout_ms){
+    btstack_run_loop_set_timer_handler(ts, handler);
+    btstack_run_loop_set_timer(ts, timeout_ms);
+    btstack_run_loop_add_timer(ts);
+}
+
+static void usage(const char * name){
+    printf("Usage: %s [options]\n", name);
+    printf(" -e count              number of emulated amps, up to %u\n", SPARK_EMULATOR_MAX_AMPS);
+    printf(" -a delay_ms           delay of responses from the amp\n");
+    printf(" -g delay_ms           delay of GATT responses\n");
+    printf(" -m mtu                max ATT MTU of the amp\n");
+    printf(" -d                    amp does not support LE Data Length Extension\n");
+    printf(" -1                    amp only supports LE 1M PHY\n");
+    printf(" -r                    amp only supports Write With Response\n");
+    printf(" -f len                max size of notifications\n");
+    printf(" -n count              notifications per connection event\n");
+    printf(" -b count,period_ms    bursts of unsolicited notifications\n");
+    printf(" -l percent            packet loss\n");
+    printf(" -s seed               seed for packet loss\n");
+    printf(" -c off_ms,period_ms   power cycle amps periodically, one at a time\n");
+    printf(" -p period_ms          press buttons periodically\n");
+    printf(" -A period_ms          emulated Spark app connects through relay and selects presets periodically\n");
+    printf(" -x period_ms          sweep expression pedal heel to toe and back\n");
+    printf(" -N devices            unrelated devices advertising next to the amps\n");
+    printf(" -S file               run scenario of presses and dropouts with checks for stuck links, leaks and drift\n");
+    printf(" -V                    virtual time, runs as fast as possible and reproducible, requires -t\n");
+    printf(" -t seconds            print statistics and exit after given time\n");
+}
+
+int main(int argc, const char * argv[]){
+    uint8_t num_amps = 1;
+    uint32_t amp_delay_ms = 0;
+    uint32_t gatt_delay_ms = 0;
+    uint16_t mtu = MOCK_BTSTACK_DEFAULT_MTU;
+    bool write_without_response = true;
+    bool data_length_extension = true;
+    bool phy_2m = true;
+    uint16_t fragment_size = 0;
+    uint8_t per_event = 0;
+    unsigned int burst_count = 0;
+    unsigned int burst_period_ms = 0;
+    uint8_t loss_percent = 0;
+    uint32_t seed = 1;
+    uint32_t run_time_s = 0;
+    uint16_t crowd_devices = 0;
+
+    int i;
+    for (i = 1; i < argc; i++){
+        const char * arg = argv[i];
+        const char * value = ((i + 1) < argc) ? argv[i + 1] : NULL;
+        if ((strcmp(arg, "-r") == 0)){
+            write_without_response = false;
+            continue;
+        }
+        if ((strcmp(arg, "-d") == 0)){
+            data_length_extension = false;
+            continue;
+        }
+        if ((strcmp(arg, "-1") == 0)){
+            phy_2m = false;
+            continue;
+        }
+        if ((strcmp(arg, "-V") == 0)){
+            virtual_time = true;
+            continue;
+        }
+        if (value == NULL){
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        i++;
+        if (strcmp(arg, "-e") == 0){
+            num_amps = (uint8_t) atoi(value);
+        } else if (strcmp(arg, "-a") == 0){
+            amp_delay_ms = (uint32_t) atoi(value);
+        } else if (strcmp(arg, "-g") == 0){
+            gatt_delay_ms = (uint32_t) atoi(value);
+        } else if (strcmp(arg, "-m") == 0){
+            mtu = (uint16_t) atoi(value);
+        } else if (strcmp(arg, "-f") == 0){
+            fragment_size = (uint16_t) atoi(value);
+        } else if (strcmp(arg, "-n") == 0){
+            per_event = (uint8_t) atoi(value);
+        } else if (strcmp(arg, "-b") == 0){
+            if (sscanf(value, "%u,%u", &burst_count, &burst_period_ms) != 2){
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(arg, "-l") == 0){
+            loss_percent = (uint8_t) atoi(value);
+        } else if (strcmp(arg, "-s") == 0){
+            seed = (uint32_t) atoi(value);
+        } else if (strcmp(arg, "-c") == 0){
+            if (sscanf(value, "%u,%u", &power_cycle_off_ms, &power_cycle_period_ms) != 2){
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(arg, "-p") == 0){
+            press_period_ms = (uint32_t) atoi(value);
+        } else if (strcmp(arg, "-A") == 0){
+            app_period_ms = (uint32_t) atoi(value);
+        } else if (strcmp(arg, "-x") == 0){
+            sweep_period_ms = (uint32_t) atoi(value);
+        } else if (strcmp(arg, "-N") == 0){
+            crowd_devices = (uint16_t) atoi(value);
+        } else if (strcmp(arg, "-S") == 0){
+            scenario_path = value;
+        } else if (strcmp(arg, "-t") == 0){
+            run_time_s = (uint32_t) atoi(value);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // virtual time never ends on its own
+    if (virtual_time && (run_time_s == 0)){
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (virtual_time){
+        virtual_start_us = clock_us();
+        btstack_run_loop_init(btstack_run_loop_virtual_get_instance());
+    } else {
+        btstack_run_loop_init(btstack_run_loop_posix_get_instance());
+    }
+    spark_control_set_time_source(&time_us);
+
+    mock_btstack_init();
+    mock_btstack_set_response_delay(gatt_delay_ms);
+    mock_btstack_set_mtu(mtu);
+    mock_btstack_set_link_features(data_length_extension, phy_2m);
+    mock_btstack_set_write_without_response(write_without_response);
+    mock_btstack_set_crowd(crowd_devices);
+
+    spark_emulator_init(num_amps, spark_40_addr);
+    spark_emulator_set_response_delay(amp_delay_ms);
+    spark_emulator_set_fragment_size(fragment_size);
+    if (per_event > 0){
+        spark_emulator_set_notifications_per_event(per_event);
+    }
+    spark_emulator_set_burst((uint8_t) burst_count, burst_period_ms);
+    spark_emulator_set_loss(loss_percent, seed);
+
+    if (app_period_ms > 0){
+        spark_app_emulator_init(app_period_ms);
+    }
+
+    if ((scenario_path != NULL) && !spark_scenario_init(scenario_path, seed, &time_us, app_period_ms > 0)){
+        return EXIT_FAILURE;
+    }
+
+    if (press_period_ms > 0){
+        start_timer(&press_timer, &press_timeout, press_period_ms);
+    }
+    if (power_cycle_period_ms > 0){
+        start_timer(&power_cycle_timer, &power_cycle_timeout, power_cycle_period_ms);
+    }
+    if (sweep_period_ms > 0){
+        expression_pedal_init(&sweep_pedal, SWEEP_RAW_MIN, SWEEP_RAW_MAX);
+        sweep_start_us = time_us();
+        start_timer(&sweep_timer, &sweep_timeout, SWEEP_SAMPLE_PERIOD_MS);
+    }
+    if (run_time_s > 0){
+        start_timer(&stop_timer, &stop_timeout, run_time_s * 1000);
+    }
+
+    btstack_main();
+    if (app_period_ms > 0){
+        // the emulated app connects through the relay
+        spark_control_set_relay_enabled(true);
+    }
+
+    btstack_run_loop_execute();
+    return scenario_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
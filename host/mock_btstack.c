@@ -0,0 +1,1203 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "mock_btstack.c"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btstack.h"
+#include "mock_btstack.h"
+
+#define MOCK_ADVERTISING_INTERVAL_MS    100
+#define MOCK_ACCEPT_LIST_SIZE           4
+// amp caches and stored preset banks
+#define MOCK_TLV_ENTRIES                16
+#define MOCK_TLV_MAX_SIZE               1024
+
+// LE PHYs as used in HCI commands and events
+#define MOCK_PHY_1M                     1
+#define MOCK_PHY_2M                     2
+#define MOCK_PHY_MASK_2M                0x02
+
+const hci_cmd_t hci_le_set_data_length = { HCI_OPCODE_HCI_LE_SET_DATA_LENGTH, "H22" };
+
+typedef struct {
+    btstack_timer_source_t   timer;
+    // NULL for HCI events
+    btstack_packet_handler_t handler;
+    // amp whose GATT query is completed by this event
+    struct mock_amp *        completes_query;
+    uint16_t                 size;
+    uint8_t                  packet[];
+} mock_event_t;
+
+typedef struct {
+    uint32_t tag;
+    uint32_t size;
+    uint8_t  data[MOCK_TLV_MAX_SIZE];
+} mock_tlv_entry_t;
+
+typedef struct mock_amp {
+    uint8_t           index;
+    bool              configured;
+    bool              present;
+    bool              connected;
+    bd_addr_t         addr;
+    uint8_t           addr_type;
+    hci_con_handle_t  con_handle;
+
+    // per connection
+    bool              query_active;
+    bool              notifications_enabled;
+    uint16_t          mtu;
+    uint16_t          octets;
+    uint8_t           phy;
+    uint16_t          conn_interval;
+    uint32_t          anchor_ms;
+} mock_amp_t;
+
+static btstack_linked_list_t        mock_hci_event_handlers;
+static btstack_linked_list_t        mock_notification_listeners;
+static mock_btstack_write_handler_t mock_write_handler;
+static mock_btstack_connection_handler_t mock_connection_handler;
+
+static mock_amp_t                   mock_amps[MOCK_BTSTACK_MAX_AMPS];
+
+// LE Create Connection, only one at a time
+static bool                         mock_connecting;
+static bd_addr_t                    mock_connecting_addr;
+static uint8_t                      mock_connecting_addr_type;
+
+static bool                         mock_write_without_response;
+static uint16_t                     mock_amp_mtu;
+static bool                         mock_amp_data_length_extension;
+static bool                         mock_amp_phy_2m;
+static bool                         mock_mtu_auto_negotiation;
+static uint32_t                     mock_response_delay_ms;
+static uint16_t                     mock_conn_interval;
+
+static bool                         mock_scanning;
+static btstack_timer_source_t       mock_advertising_timer;
+static uint16_t                     mock_scan_interval;
+static uint16_t                     mock_scan_window;
+static uint8_t                      mock_scan_filter_policy;
+static uint32_t                     mock_scan_random;
+static uint8_t                      mock_accept_list_count;
+static bd_addr_t                    mock_accept_list[MOCK_ACCEPT_LIST_SIZE];
+static uint16_t                     mock_crowd_devices;
+static uint32_t                     mock_att_requests;
+
+static mock_tlv_entry_t             mock_tlv_entries[MOCK_TLV_ENTRIES];
+
+// ATT Server and advertising of the pedal, phone in relay mode
+static const uint8_t *              mock_att_db;
+static att_read_callback_t          mock_att_read_callback;
+static att_write_callback_t         mock_att_write_callback;
+static btstack_packet_handler_t     mock_att_packet_handler;
+static bool                         mock_advertising;
+static mock_btstack_app_handler_t   mock_app_handler;
+static bool                         mock_app_connected;
+static uint16_t                     mock_app_mtu;
+static uint32_t                     mock_app_anchor_ms;
+static uint8_t                      mock_app_tx_buffers_used;
+static bool                         mock_app_can_send_now_requested;
+static bool                         mock_app_write_pending;
+static bool                         mock_app_response_pending;
+
+static const uint8_t mock_amp_adv_data[] = {
+    0x02, BLUETOOTH_DATA_TYPE_FLAGS, 0x06,
+    0x0e, BLUETOOTH_DATA_TYPE_COMPLETE_LOCAL_NAME, ' ', 'S', 'p', 'a', 'r', 'k', ' ', '4', '0', ' ', 'B', 'L', 'E',
+};
+
+// phone in the crowd, resolvable private address
+static const uint8_t mock_crowd_adv_data[] = {
+    0x02, BLUETOOTH_DATA_TYPE_FLAGS, 0x1a,
+    0x0b, BLUETOOTH_DATA_TYPE_MANUFACTURER_SPECIFIC_DATA, 0x4c, 0x00, 0x10, 0x06, 0x31, 0x1e, 0x2a, 0x4f, 0x18, 0x68,
+};
+
+static mock_amp_t * mock_amp_for_con_handle(hci_con_handle_t con_handle){
+    if (con_handle < MOCK_BTSTACK_CON_HANDLE) return NULL;
+    uint16_t index = con_handle - MOCK_BTSTACK_CON_HANDLE;
+    if (index >= MOCK_BTSTACK_MAX_AMPS) return NULL;
+    mock_amp_t * amp = &mock_amps[index];
+    return amp->connected ? amp : NULL;
+}
+
+static mock_amp_t * mock_amp_for_addr(const bd_addr_t addr){
+    uint8_t i;
+    for (i = 0; i < MOCK_BTSTACK_MAX_AMPS; i++){
+        mock_amp_t * amp = &mock_amps[i];
+        if (amp->configured && (bd_addr_cmp(addr, amp->addr) == 0)) return amp;
+    }
+    return NULL;
+}
+
+static mock_amp_t * mock_amp_get(uint8_t index){
+    if (index >= MOCK_BTSTACK_MAX_AMPS) return NULL;
+    return &mock_amps[index];
+}
+
+// events
+
+static void mock_event_deliver(btstack_timer_source_t * ts){
+    mock_event_t * event = (mock_event_t *) btstack_run_loop_get_timer_context(ts);
+    if (event->completes_query != NULL){
+        event->completes_query->query_active = false;
+    }
+    if (event->handler != NULL){
+        (*event->handler)(HCI_EVENT_PACKET, 0, event->packet, event->size);
+    } else {
+        btstack_linked_item_t * it;
+        for (it = mock_hci_event_handlers; it != NULL; it = it->next){
+            btstack_packet_callback_registration_t * registration = (btstack_packet_callback_registration_t *) it;
+            (*registration->callback)(HCI_EVENT_PACKET, 0, event->packet, event->size);
+        }
+    }
+    free(event);
+}
+
+static void mock_event_emit(btstack_packet_handler_t handler, const uint8_t * packet, uint16_t size, uint32_t delay_ms, mock_amp_t * completes_query){
+    mock_event_t * event = (mock_event_t *) malloc(sizeof(mock_event_t) + size);
+    if (event == NULL) return;
+    memset(event, 0, sizeof(mock_event_t));
+    event->handler = handler;
+    event->completes_query = completes_query;
+    event->size = size;
+    memcpy(event->packet, packet, size);
+    btstack_run_loop_set_timer_handler(&event->timer, &mock_event_deliver);
+    btstack_run_loop_set_timer_context(&event->timer, event);
+    btstack_run_loop_set_timer(&event->timer, delay_ms);
+    btstack_run_loop_add_timer(&event->timer);
+}
+
+static void mock_emit_query_complete(btstack_packet_handler_t handler, mock_amp_t * amp, uint8_t att_status){
+    uint8_t event[5];
+    event[0] = GATT_EVENT_QUERY_COMPLETE;
+    event[1] = sizeof(event) - 2;
+    little_endian_store_16(event, 2, amp->con_handle);
+    event[4] = att_status;
+    mock_event_emit(handler, event, sizeof(event), mock_response_delay_ms, amp);
+}
+
+static void mock_emit_connection_complete(uint8_t status, hci_con_handle_t con_handle, uint8_t role, const bd_addr_t addr, uint8_t addr_type, uint16_t conn_interval){
+    uint8_t event[21];
+    memset(event, 0, sizeof(event));
+    event[0] = HCI_EVENT_LE_META;
+    event[1] = sizeof(event) - 2;
+    event[2] = HCI_SUBEVENT_LE_CONNECTION_COMPLETE;
+    event[3] = status;
+    little_endian_store_16(event, 4, con_handle);
+    event[6] = role;
+    event[7] = addr_type;
+    reverse_bd_addr(addr, &event[8]);
+    little_endian_store_16(event, 14, conn_interval);
+    little_endian_store_16(event, 18, 200);
+    mock_event_emit(NULL, event, sizeof(event), mock_response_delay_ms, NULL);
+}
+
+static void mock_emit_disconnection_complete(hci_con_handle_t con_handle, uint8_t reason){
+    uint8_t event[6];
+    event[0] = HCI_EVENT_DISCONNECTION_COMPLETE;
+    event[1] = sizeof(event) - 2;
+    event[2] = ERROR_CODE_SUCCESS;
+    little_endian_store_16(event, 3, con_handle);
+    event[5] = reason;
+    mock_event_emit(NULL, event, sizeof(event), 0, NULL);
+}
+
+static void mock_link_established(mock_amp_t * amp){
+    mock_connecting            = false;
+    amp->connected             = true;
+    amp->query_active          = false;
+    amp->notifications_enabled = false;
+    amp->mtu                   = ATT_DEFAULT_MTU;
+    amp->octets                = MOCK_BTSTACK_DEFAULT_OCTETS;
+    amp->phy                   = MOCK_PHY_1M;
+    amp->conn_interval         = mock_conn_interval;
+    amp->anchor_ms             = btstack_run_loop_get_time_ms();
+    mock_emit_connection_complete(ERROR_CODE_SUCCESS, amp->con_handle, HCI_ROLE_MASTER, amp->addr, amp->addr_type, amp->conn_interval);
+    if (mock_connection_handler != NULL){
+        (*mock_connection_handler)(amp->index, true);
+    }
+}
+
+static void mock_link_lost(mock_amp_t * amp, uint8_t reason){
+    amp->connected             = false;
+    amp->notifications_enabled = false;
+    amp->query_active          = false;
+    mock_emit_disconnection_complete(amp->con_handle, reason);
+    if (mock_connection_handler != NULL){
+        (*mock_connection_handler)(amp->index, false);
+    }
+}
+
+// advertising
+
+static void mock_advertising_timeout(btstack_timer_source_t * ts){
+    if (!mock_scanning) return;
+    uint8_t i;
+    for (i = 0; i < MOCK_BTSTACK_MAX_AMPS; i++){
+        const mock_amp_t * amp = &mock_amps[i];
+        if (!amp->present || amp->connected) continue;
+        mock_btstack_inject_advertisement(amp->addr, amp->addr_type, mock_amp_adv_data, sizeof(mock_amp_adv_data));
+    }
+    uint16_t device;
+    for (device = 0; device < mock_crowd_devices; device++){
+        bd_addr_t addr = { 0x40 | (device >> 8), device & 0xff, 0x5c, 0x11, 0x22, 0x33 };
+        mock_btstack_inject_advertisement(addr, BD_ADDR_TYPE_LE_RANDOM, mock_crowd_adv_data, sizeof(mock_crowd_adv_data));
+    }
+    btstack_run_loop_set_timer(ts, MOCK_ADVERTISING_INTERVAL_MS);
+    btstack_run_loop_add_timer(ts);
+}
+
+// TLV
+
+static mock_tlv_entry_t * mock_tlv_find(uint32_t tag){
+    uint8_t i;
+    for (i = 0; i < MOCK_TLV_ENTRIES; i++){
+        if ((mock_tlv_entries[i].size > 0) && (mock_tlv_entries[i].tag == tag)) return &mock_tlv_entries[i];
+    }
+    return NULL;
+}
+
+static int mock_tlv_get_tag(void * context, uint32_t tag, uint8_t * buffer, uint32_t buffer_size){
+    UNUSED(context);
+    mock_tlv_entry_t * entry = mock_tlv_find(tag);
+    if (entry == NULL) return 0;
+    if (buffer != NULL){
+        memcpy(buffer, entry->data, btstack_min(buffer_size, entry->size));
+    }
+    return (int) entry->size;
+}
+
+static int mock_tlv_store_tag(void * context, uint32_t tag, const uint8_t * data, uint32_t data_size){
+    UNUSED(context);
+    if ((data_size == 0) || (data_size > MOCK_TLV_MAX_SIZE)) return 1;
+    mock_tlv_entry_t * entry = mock_tlv_find(tag);
+    uint8_t i;
+    for (i = 0; (entry == NULL) && (i < MOCK_TLV_ENTRIES); i++){
+        if (mock_tlv_entries[i].size == 0){
+            entry = &mock_tlv_entries[i];
+        }
+    }
+    if (entry == NULL) return 1;
+    entry->tag  = tag;
+    entry->size = data_size;
+    memcpy(entry->data, data, data_size);
+    return 0;
+}
+
+static void mock_tlv_delete_tag(void * context, uint32_t tag){
+    UNUSED(context);
+    mock_tlv_entry_t * entry = mock_tlv_find(tag);
+    if (entry != NULL){
+        entry->size = 0;
+    }
+}
+
+static const btstack_tlv_t mock_tlv = {
+    &mock_tlv_get_tag,
+    &mock_tlv_store_tag,
+    &mock_tlv_delete_tag,
+};
+
+// HCI, L2CAP, SM
+
+void hci_add_event_handler(btstack_packet_callback_registration_t * callback_handler){
+    btstack_linked_list_add_tail(&mock_hci_event_handlers, (btstack_linked_item_t *) callback_handler);
+}
+
+int hci_power_control(HCI_POWER_MODE mode){
+    if (mode != HCI_POWER_ON) return 0;
+    uint8_t event[] = { BTSTACK_EVENT_STATE, 1, HCI_STATE_WORKING };
+    mock_event_emit(NULL, event, sizeof(event), 0, NULL);
+    return 0;
+}
+
+bool hci_can_send_command_packet_now(void){
+    return true;
+}
+
+static void mock_emit_command_complete(uint16_t opcode, uint8_t status, hci_con_handle_t con_handle){
+    uint8_t event[8];
+    event[0] = HCI_EVENT_COMMAND_COMPLETE;
+    event[1] = sizeof(event) - 2;
+    event[2] = 1;
+    little_endian_store_16(event, 3, opcode);
+    event[5] = status;
+    little_endian_store_16(event, 6, con_handle);
+    mock_event_emit(NULL, event, sizeof(event), 0, NULL);
+}
+
+static void mock_set_data_length(hci_con_handle_t con_handle, uint16_t tx_octets){
+    mock_amp_t * amp = mock_amp_for_con_handle(con_handle);
+    if (amp == NULL){
+        mock_emit_command_complete(HCI_OPCODE_HCI_LE_SET_DATA_LENGTH, ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER, con_handle);
+        return;
+    }
+    mock_emit_command_complete(HCI_OPCODE_HCI_LE_SET_DATA_LENGTH, ERROR_CODE_SUCCESS, con_handle);
+    // amp without support rejects the LL length request, no change event
+    if (!mock_amp_data_length_extension) return;
+    uint16_t octets = btstack_max(MOCK_BTSTACK_DEFAULT_OCTETS, btstack_min(tx_octets, MOCK_BTSTACK_MAX_OCTETS));
+    if (octets == amp->octets) return;
+    amp->octets = octets;
+    // max time on LE 1M incl. header and MIC
+    uint16_t time_us = (octets + 14) * 8;
+    uint8_t event[13];
+    event[0] = HCI_EVENT_LE_META;
+    event[1] = sizeof(event) - 2;
+    event[2] = HCI_SUBEVENT_LE_DATA_LENGTH_CHANGE;
+    little_endian_store_16(event, 3, con_handle);
+    little_endian_store_16(event, 5, octets);
+    little_endian_store_16(event, 7, time_us);
+    little_endian_store_16(event, 9, octets);
+    little_endian_store_16(event, 11, time_us);
+    mock_event_emit(NULL, event, sizeof(event), mock_response_delay_ms, NULL);
+}
+
+uint8_t hci_send_cmd(const hci_cmd_t * cmd, ...){
+    if (cmd != &hci_le_set_data_length) return ERROR_CODE_UNKNOWN_HCI_COMMAND;
+    va_list argptr;
+    va_start(argptr, cmd);
+    hci_con_handle_t con_handle = (hci_con_handle_t) va_arg(argptr, int);
+    uint16_t tx_octets = (uint16_t) va_arg(argptr, int);
+    va_end(argptr);
+    mock_set_data_length(con_handle, tx_octets);
+    return ERROR_CODE_SUCCESS;
+}
+
+void l2cap_init(void){
+}
+
+void sm_init(void){
+}
+
+void sm_add_event_handler(btstack_packet_callback_registration_t * callback_handler){
+    UNUSED(callback_handler);
+}
+
+void sm_just_works_confirm(hci_con_handle_t con_handle){
+    UNUSED(con_handle);
+}
+
+void sm_numeric_comparison_confirm(hci_con_handle_t con_handle){
+    UNUSED(con_handle);
+}
+
+void sm_request_pairing(hci_con_handle_t con_handle){
+    UNUSED(con_handle);
+}
+
+void gap_delete_bonding(bd_addr_type_t address_type, bd_addr_t address){
+    UNUSED(address_type);
+    UNUSED(address);
+}
+
+// GAP
+
+void gap_set_scan_parameters(uint8_t scan_type, uint16_t scan_interval, uint16_t scan_window){
+    gap_set_scan_params(scan_type, scan_interval, scan_window, 0);
+}
+
+void gap_set_scan_params(uint8_t scan_type, uint16_t scan_interval, uint16_t scan_window, uint8_t scanning_filter_policy){
+    // no scan responses, passive and active scanning get the same reports
+    UNUSED(scan_type);
+    mock_scan_interval      = scan_interval;
+    mock_scan_window        = scan_window;
+    mock_scan_filter_policy = scanning_filter_policy;
+}
+
+uint8_t gap_whitelist_clear(void){
+    mock_accept_list_count = 0;
+    return ERROR_CODE_SUCCESS;
+}
+
+uint8_t gap_whitelist_add(bd_addr_type_t address_type, const bd_addr_t address){
+    UNUSED(address_type);
+    if (mock_accept_list_count >= MOCK_ACCEPT_LIST_SIZE) return ERROR_CODE_MEMORY_CAPACITY_EXCEEDED;
+    bd_addr_copy(mock_accept_list[mock_accept_list_count++], address);
+    return ERROR_CODE_SUCCESS;
+}
+
+static bool mock_accept_list_contains(const bd_addr_t addr){
+    uint8_t i;
+    for (i = 0; i < mock_accept_list_count; i++){
+        if (bd_addr_cmp(mock_accept_list[i], addr) == 0) return true;
+    }
+    return false;
+}
+
+// advertising event falls into a scan window
+static bool mock_scan_receives(void){
+    if ((mock_scan_interval == 0) || (mock_scan_window >= mock_scan_interval)) return true;
+    mock_scan_random = mock_scan_random * 1103515245u + 12345u;
+    return ((mock_scan_random >> 8) % mock_scan_interval) < mock_scan_window;
+}
+
+void gap_start_scan(void){
+    if (mock_scanning) return;
+    mock_scanning = true;
+    btstack_run_loop_set_timer_handler(&mock_advertising_timer, &mock_advertising_timeout);
+    btstack_run_loop_set_timer(&mock_advertising_timer, MOCK_ADVERTISING_INTERVAL_MS / 2);
+    btstack_run_loop_add_timer(&mock_advertising_timer);
+}
+
+void gap_stop_scan(void){
+    mock_scanning = false;
+    btstack_run_loop_remove_timer(&mock_advertising_timer);
+}
+
+void gap_set_connection_parameters(uint16_t conn_scan_interval, uint16_t conn_scan_window,
+    uint16_t conn_interval_min, uint16_t conn_interval_max, uint16_t conn_latency,
+    uint16_t supervision_timeout, uint16_t min_ce_length, uint16_t max_ce_length){
+    UNUSED(conn_scan_interval);
+    UNUSED(conn_scan_window);
+    UNUSED(conn_interval_min);
+    UNUSED(conn_latency);
+    UNUSED(supervision_timeout);
+    UNUSED(min_ce_length);
+    UNUSED(max_ce_length);
+    mock_conn_interval = conn_interval_max;
+}
+
+uint8_t gap_connect(const bd_addr_t addr, bd_addr_type_t addr_type){
+    if (mock_connecting) return ERROR_CODE_COMMAND_DISALLOWED;
+    mock_amp_t * amp = mock_amp_for_addr(addr);
+    if ((amp != NULL) && amp->connected) return ERROR_CODE_COMMAND_DISALLOWED;
+    if ((amp != NULL) && amp->present){
+        mock_link_established(amp);
+    } else {
+        // wait for amp until cancelled
+        mock_connecting = true;
+        bd_addr_copy(mock_connecting_addr, addr);
+        mock_connecting_addr_type = addr_type;
+    }
+    return ERROR_CODE_SUCCESS;
+}
+
+uint8_t gap_connect_cancel(void){
+    if (!mock_connecting) return ERROR_CODE_COMMAND_DISALLOWED;
+    mock_connecting = false;
+    mock_emit_connection_complete(ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER, HCI_CON_HANDLE_INVALID, HCI_ROLE_MASTER,
+                                  mock_connecting_addr, mock_connecting_addr_type, 0);
+    return ERROR_CODE_SUCCESS;
+}
+
+static void mock_app_link_lost(uint8_t reason);
+
+uint8_t gap_disconnect(hci_con_handle_t handle){
+    if (mock_app_connected && (handle == MOCK_BTSTACK_APP_CON_HANDLE)){
+        mock_app_link_lost(ERROR_CODE_CONNECTION_TERMINATED_BY_LOCAL_HOST);
+        return ERROR_CODE_SUCCESS;
+    }
+    mock_amp_t * amp = mock_amp_for_con_handle(handle);
+    if (amp == NULL) return ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER;
+    mock_link_lost(amp, ERROR_CODE_CONNECTION_TERMINATED_BY_LOCAL_HOST);
+    return ERROR_CODE_SUCCESS;
+}
+
+int gap_update_connection_parameters(hci_con_handle_t con_handle, uint16_t conn_interval_min,
+    uint16_t conn_interval_max, uint16_t conn_latency, uint16_t supervision_timeout){
+    UNUSED(conn_interval_min);
+    mock_amp_t * amp = mock_amp_for_con_handle(con_handle);
+    if (amp == NULL) return ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER;
+    uint8_t event[12];
+    event[0] = HCI_EVENT_LE_META;
+    event[1] = sizeof(event) - 2;
+    event[2] = HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE;
+    event[3] = ERROR_CODE_SUCCESS;
+    little_endian_store_16(event, 4, con_handle);
+    little_endian_store_16(event, 6, conn_interval_max);
+    little_endian_store_16(event, 8, conn_latency);
+    little_endian_store_16(event, 10, supervision_timeout);
+    mock_event_emit(NULL, event, sizeof(event), mock_response_delay_ms, NULL);
+    amp->conn_interval = conn_interval_max;
+    return ERROR_CODE_SUCCESS;
+}
+
+uint8_t gap_le_set_phy(hci_con_handle_t con_handle, uint8_t all_phys, uint8_t tx_phys, uint8_t rx_phys, uint8_t phy_options){
+    UNUSED(all_phys);
+    UNUSED(phy_options);
+    mock_amp_t * amp = mock_amp_for_con_handle(con_handle);
+    if (amp == NULL) return ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER;
+    uint8_t status = ERROR_CODE_SUCCESS;
+    if (((tx_phys & rx_phys) & MOCK_PHY_MASK_2M) != 0){
+        if (mock_amp_phy_2m){
+            amp->phy = MOCK_PHY_2M;
+        } else {
+            status = ERROR_CODE_UNSUPPORTED_REMOTE_FEATURE_UNSUPPORTED_LMP_FEATURE;
+        }
+    }
+    uint8_t event[8];
+    event[0] = HCI_EVENT_LE_META;
+    event[1] = sizeof(event) - 2;
+    event[2] = HCI_SUBEVENT_LE_PHY_UPDATE_COMPLETE;
+    event[3] = status;
+    little_endian_store_16(event, 4, con_handle);
+    event[6] = amp->phy;
+    event[7] = amp->phy;
+    mock_event_emit(NULL, event, sizeof(event), mock_response_delay_ms, NULL);
+    return ERROR_CODE_SUCCESS;
+}
+
+// GAP Peripheral and ATT Server, only used for relay mode
+
+static uint32_t mock_app_next_connection_event_ms(void){
+    uint32_t interval_ms = (MOCK_BTSTACK_APP_CONN_INTERVAL * 5u + 3u) / 4u;
+    uint32_t since_anchor_ms = btstack_run_loop_get_time_ms() - mock_app_anchor_ms;
+    return interval_ms - (since_anchor_ms % interval_ms);
+}
+
+static void mock_app_emit_can_send_now(void){
+    if (!mock_app_can_send_now_requested || (mock_att_packet_handler == NULL)) return;
+    mock_app_can_send_now_requested = false;
+    uint8_t event[4];
+    event[0] = ATT_EVENT_CAN_SEND_NOW;
+    event[1] = sizeof(event) - 2;
+    little_endian_store_16(event, 2, MOCK_BTSTACK_APP_CON_HANDLE);
+    mock_event_emit(mock_att_packet_handler, event, sizeof(event), 0, NULL);
+}
+
+static void mock_app_emit_write_response(uint8_t att_status){
+    mock_app_write_pending = false;
+    if (mock_app_handler != NULL){
+        (*mock_app_handler)(MOCK_BTSTACK_APP_WRITE_RESPONSE, 0, &att_status, 1);
+    }
+}
+
+// internal events: value handle followed by value
+static void mock_app_deliver_notification(uint8_t packet_type, uint16_t channel, uint8_t * packet, uint16_t size){
+    UNUSED(packet_type);
+    UNUSED(channel);
+    if (!mock_app_connected) return;
+    mock_app_tx_buffers_used--;
+    if (mock_app_handler != NULL){
+        (*mock_app_handler)(MOCK_BTSTACK_APP_NOTIFICATION, little_endian_read_16(packet, 0), &packet[2], size - 2);
+    }
+    mock_app_emit_can_send_now();
+}
+
+static void mock_app_deliver_write(uint8_t packet_type, uint16_t channel, uint8_t * packet, uint16_t size){
+    UNUSED(packet_type);
+    UNUSED(channel);
+    if (!mock_app_connected) return;
+    bool with_response = packet[2] != 0;
+    int result = 0;
+    if (mock_att_write_callback != NULL){
+        uint16_t transaction_mode = ATT_TRANSACTION_MODE_NONE;
+        result = (*mock_att_write_callback)(MOCK_BTSTACK_APP_CON_HANDLE, little_endian_read_16(packet, 0), transaction_mode, 0,
+                                            &packet[3], size - 3);
+    }
+    if (!with_response) return;
+#ifdef ENABLE_ATT_DELAYED_RESPONSE
+    if (result == ATT_ERROR_WRITE_RESPONSE_PENDING){
+        mock_app_response_pending = true;
+        return;
+    }
+#endif
+    mock_app_emit_write_response((uint8_t) result);
+}
+
+static void mock_app_link_lost(uint8_t reason){
+    mock_app_connected = false;
+    mock_app_write_pending = false;
+    mock_app_response_pending = false;
+    mock_app_can_send_now_requested = false;
+    mock_app_tx_buffers_used = 0;
+    mock_emit_disconnection_complete(MOCK_BTSTACK_APP_CON_HANDLE, reason);
+    if (mock_app_handler != NULL){
+        (*mock_app_handler)(MOCK_BTSTACK_APP_DISCONNECTED, 0, NULL, 0);
+    }
+}
+
+void gap_advertisements_set_params(uint16_t adv_int_min, uint16_t adv_int_max, uint8_t adv_type,
+    uint8_t direct_address_typ, bd_addr_t direct_address, uint8_t channel_map, uint8_t filter_policy){
+    UNUSED(adv_int_min);
+    UNUSED(adv_int_max);
+    UNUSED(adv_type);
+    UNUSED(direct_address_typ);
+    UNUSED(direct_address);
+    UNUSED(channel_map);
+    UNUSED(filter_policy);
+}
+
+void gap_advertisements_set_data(uint8_t advertising_data_length, uint8_t * advertising_data){
+    UNUSED(advertising_data_length);
+    UNUSED(advertising_data);
+}
+
+void gap_advertisements_enable(int enabled){
+    mock_advertising = enabled != 0;
+}
+
+void att_server_init(uint8_t const * db, att_read_callback_t read_callback, att_write_callback_t write_callback){
+    mock_att_db             = db;
+    mock_att_read_callback  = read_callback;
+    mock_att_write_callback = write_callback;
+}
+
+void att_server_register_packet_handler(btstack_packet_handler_t handler){
+    mock_att_packet_handler = handler;
+}
+
+uint8_t att_server_notify(hci_con_handle_t con_handle, uint16_t attribute_handle, const uint8_t * value, uint16_t value_len){
+    if (!mock_app_connected || (con_handle != MOCK_BTSTACK_APP_CON_HANDLE)) return ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER;
+    if (value_len > (mock_app_mtu - 3)) return ERROR_CODE_INVALID_HCI_COMMAND_PARAMETERS;
+    if (mock_app_tx_buffers_used >= MOCK_BTSTACK_APP_TX_BUFFERS) return BTSTACK_ACL_BUFFERS_FULL;
+    mock_app_tx_buffers_used++;
+    uint8_t event[2 + 512];
+    little_endian_store_16(event, 0, attribute_handle);
+    memcpy(&event[2], value, value_len);
+    mock_event_emit(&mock_app_deliver_notification, event, 2 + value_len, mock_app_next_connection_event_ms(), NULL);
+    return ERROR_CODE_SUCCESS;
+}
+
+bool att_server_can_send_packet_now(hci_con_handle_t con_handle){
+    return mock_app_connected && (con_handle == MOCK_BTSTACK_APP_CON_HANDLE) && (mock_app_tx_buffers_used < MOCK_BTSTACK_APP_TX_BUFFERS);
+}
+
+uint8_t att_server_request_can_send_now_event(hci_con_handle_t con_handle){
+    if (!mock_app_connected || (con_handle != MOCK_BTSTACK_APP_CON_HANDLE)) return ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER;
+    mock_app_can_send_now_requested = true;
+    if (mock_app_tx_buffers_used < MOCK_BTSTACK_APP_TX_BUFFERS){
+        mock_app_emit_can_send_now();
+    }
+    return ERROR_CODE_SUCCESS;
+}
+
+uint8_t att_server_response_ready(hci_con_handle_t con_handle){
+    if (!mock_app_connected || (con_handle != MOCK_BTSTACK_APP_CON_HANDLE)) return ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER;
+    if (!mock_app_response_pending) return ERROR_CODE_COMMAND_DISALLOWED;
+    mock_app_response_pending = false;
+    mock_app_emit_write_response(ATT_ERROR_SUCCESS);
+    return ERROR_CODE_SUCCESS;
+}
+
+// GATT Client
+
+static uint16_t mock_mtu_negotiated(void){
+    return btstack_min(MOCK_BTSTACK_LOCAL_MTU, btstack_max(ATT_DEFAULT_MTU, mock_amp_mtu));
+}
+
+static mock_amp_t * mock_gatt_client_start_query(hci_con_handle_t con_handle, uint8_t * status){
+    mock_amp_t * amp = mock_amp_for_con_handle(con_handle);
+    if (amp == NULL){
+        *status = ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER;
+        return NULL;
+    }
+    if (amp->query_active){
+        *status = GATT_CLIENT_IN_WRONG_STATE;
+        return NULL;
+    }
+    amp->query_active = true;
+    mock_att_requests++;
+    if (mock_mtu_auto_negotiation && (amp->mtu == ATT_DEFAULT_MTU)){
+        // exchange done by GATT Client before first request
+        mock_att_requests++;
+        amp->mtu = mock_mtu_negotiated();
+    }
+    *status = ERROR_CODE_SUCCESS;
+    return amp;
+}
+
+static void mock_emit_characteristic(btstack_packet_handler_t callback, const mock_amp_t * amp, uint16_t start_handle,
+    uint16_t value_handle, uint16_t end_handle, uint16_t properties, uint16_t uuid16){
+    uint8_t event[28];
+    uint8_t uuid128[16];
+    event[0] = GATT_EVENT_CHARACTERISTIC_QUERY_RESULT;
+    event[1] = sizeof(event) - 2;
+    little_endian_store_16(event, 2, amp->con_handle);
+    little_endian_store_16(event, 4, start_handle);
+    little_endian_store_16(event, 6, value_handle);
+    little_endian_store_16(event, 8, end_handle);
+    little_endian_store_16(event, 10, properties);
+    uuid_add_bluetooth_prefix(uuid128, uuid16);
+    reverse_128(uuid128, &event[12]);
+    mock_event_emit(callback, event, sizeof(event), mock_response_delay_ms, NULL);
+}
+
+static void mock_enable_notifications(btstack_packet_handler_t callback, mock_amp_t * amp, uint16_t configuration){
+    amp->notifications_enabled = (configuration & GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION) != 0;
+    mock_emit_query_complete(callback, amp, ATT_ERROR_SUCCESS);
+}
+
+void gatt_client_init(void){
+}
+
+uint8_t gatt_client_discover_primary_services_by_uuid16(btstack_packet_handler_t callback, hci_con_handle_t con_handle, uint16_t uuid16){
+    uint8_t status;
+    mock_amp_t * amp = mock_gatt_client_start_query(con_handle, &status);
+    if (amp == NULL) return status;
+    if (uuid16 == 0xffc0){
+        uint8_t event[24];
+        uint8_t uuid128[16];
+        event[0] = GATT_EVENT_SERVICE_QUERY_RESULT;
+        event[1] = sizeof(event) - 2;
+        little_endian_store_16(event, 2, con_handle);
+        little_endian_store_16(event, 4, MOCK_BTSTACK_SERVICE_START);
+        little_endian_store_16(event, 6, MOCK_BTSTACK_SERVICE_END);
+        uuid_add_bluetooth_prefix(uuid128, uuid16);
+        reverse_128(uuid128, &event[8]);
+        mock_event_emit(callback, event, sizeof(event), mock_response_delay_ms, NULL);
+    }
+    mock_emit_query_complete(callback, amp, ATT_ERROR_SUCCESS);
+    return ERROR_CODE_SUCCESS;
+}
+
+uint8_t gatt_client_discover_characteristics_for_service(btstack_packet_handler_t callback, hci_con_handle_t con_handle, gatt_client_service_t * service){
+    uint8_t status;
+    mock_amp_t * amp = mock_gatt_client_start_query(con_handle, &status);
+    if (amp == NULL) return status;
+    if (service->start_group_handle == MOCK_BTSTACK_SERVICE_START){
+        uint16_t tx_properties = ATT_PROPERTY_WRITE | (mock_write_without_response ? ATT_PROPERTY_WRITE_WITHOUT_RESPONSE : 0);
+        mock_emit_characteristic(callback, amp, MOCK_BTSTACK_TX_DECLARATION, MOCK_BTSTACK_TX_VALUE, MOCK_BTSTACK_TX_VALUE, tx_properties, 0xffc1);
+        mock_emit_characteristic(callback, amp, MOCK_BTSTACK_RX_DECLARATION, MOCK_BTSTACK_RX_VALUE, MOCK_BTSTACK_SERVICE_END,
+                                 ATT_PROPERTY_READ | ATT_PROPERTY_NOTIFY, 0xffc2);
+    }
+    mock_emit_query_complete(callback, amp, ATT_ERROR_SUCCESS);
+    return ERROR_CODE_SUCCESS;
+}
+
+uint8_t gatt_client_discover_characteristics_for_service_by_uuid16(btstack_packet_handler_t callback, hci_con_handle_t con_handle,
+    gatt_client_service_t * service, uint16_t uuid16){
+    uint8_t status;
+    mock_amp_t * amp = mock_gatt_client_start_query(con_handle, &status);
+    if (amp == NULL) return status;
+    if (service->start_group_handle == MOCK_BTSTACK_SERVICE_START){
+        if (uuid16 == 0xffc1){
+            uint16_t tx_properties = ATT_PROPERTY_WRITE | (mock_write_without_response ? ATT_PROPERTY_WRITE_WITHOUT_RESPONSE : 0);
+            mock_emit_characteristic(callback, amp, MOCK_BTSTACK_TX_DECLARATION, MOCK_BTSTACK_TX_VALUE, MOCK_BTSTACK_TX_VALUE, tx_properties, 0xffc1);
+        }
+        if (uuid16 == 0xffc2){
+            mock_emit_characteristic(callback, amp, MOCK_BTSTACK_RX_DECLARATION, MOCK_BTSTACK_RX_VALUE, MOCK_BTSTACK_SERVICE_END,
+                                     ATT_PROPERTY_READ | ATT_PROPERTY_NOTIFY, 0xffc2);
+        }
+    }
+    mock_emit_query_complete(callback, amp, ATT_ERROR_SUCCESS);
+    return ERROR_CODE_SUCCESS;
+}
+
+uint8_t gatt_client_write_client_characteristic_configuration(btstack_packet_handler_t callback, hci_con_handle_t con_handle,
+    gatt_client_characteristic_t * characteristic, uint16_t configuration){
+    uint8_t status;
+    mock_amp_t * amp = mock_gatt_client_start_query(con_handle, &status);
+    if (amp == NULL) return status;
+    // CCCD lookup and write
+    mock_att_requests++;
+    if (characteristic->value_handle != MOCK_BTSTACK_RX_VALUE){
+        mock_emit_query_complete(callback, amp, ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+        return ERROR_CODE_SUCCESS;
+    }
+    mock_enable_notifications(callback, amp, configuration);
+    return ERROR_CODE_SUCCESS;
+}
+
+uint8_t gatt_client_write_characteristic_descriptor_using_descriptor_handle(btstack_packet_handler_t callback, hci_con_handle_t con_handle,
+    uint16_t descriptor_handle, uint16_t value_length, uint8_t * value){
+    uint8_t status;
+    mock_amp_t * amp = mock_gatt_client_start_query(con_handle, &status);
+    if (amp == NULL) return status;
+    if ((descriptor_handle != MOCK_BTSTACK_RX_CCCD) || (value_length != 2)){
+        mock_emit_query_complete(callback, amp, ATT_ERROR_INVALID_HANDLE);
+        return ERROR_CODE_SUCCESS;
+    }
+    mock_enable_notifications(callback, amp, little_endian_read_16(value, 0));
+    return ERROR_CODE_SUCCESS;
+}
+
+uint8_t gatt_client_write_value_of_characteristic(btstack_packet_handler_t callback, hci_con_handle_t con_handle,
+    uint16_t value_handle, uint16_t value_length, uint8_t * value){
+    mock_amp_t * amp = mock_amp_for_con_handle(con_handle);
+    if ((amp != NULL) && (value_length > (amp->mtu - 3))) return GATT_CLIENT_VALUE_TOO_LONG;
+    uint8_t status;
+    amp = mock_gatt_client_start_query(con_handle, &status);
+    if (amp == NULL) return status;
+    if (value_handle != MOCK_BTSTACK_TX_VALUE){
+        mock_emit_query_complete(callback, amp, ATT_ERROR_INVALID_HANDLE);
+        return ERROR_CODE_SUCCESS;
+    }
+    if (mock_write_handler != NULL){
+        (*mock_write_handler)(amp->index, value_handle, value, value_length);
+    }
+    mock_emit_query_complete(callback, amp, ATT_ERROR_SUCCESS);
+    return ERROR_CODE_SUCCESS;
+}
+
+uint8_t gatt_client_write_value_of_characteristic_without_response(hci_con_handle_t con_handle, uint16_t value_handle,
+    uint16_t value_length, uint8_t * value){
+    mock_amp_t * amp = mock_amp_for_con_handle(con_handle);
+    if (amp == NULL) return ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER;
+    if (value_length > (amp->mtu - 3)) return GATT_CLIENT_VALUE_TOO_LONG;
+    // Write Command to unknown handle is ignored by the amp
+    if ((value_handle == MOCK_BTSTACK_TX_VALUE) && (mock_write_handler != NULL)){
+        (*mock_write_handler)(amp->index, value_handle, value, value_length);
+    }
+    return ERROR_CODE_SUCCESS;
+}
+
+uint8_t gatt_client_request_can_write_without_response_event(btstack_packet_handler_t callback, hci_con_handle_t con_handle){
+    uint8_t event[4];
+    event[0] = GATT_EVENT_CAN_WRITE_WITHOUT_RESPONSE;
+    event[1] = sizeof(event) - 2;
+    little_endian_store_16(event, 2, con_handle);
+    mock_event_emit(callback, event, sizeof(event), 0, NULL);
+    return ERROR_CODE_SUCCESS;
+}
+
+void gatt_client_listen_for_characteristic_value_updates(gatt_client_notification_t * notification, btstack_packet_handler_t callback,
+    hci_con_handle_t con_handle, gatt_client_characteristic_t * characteristic){
+    notification->callback = callback;
+    notification->con_handle = con_handle;
+    notification->attribute_handle = characteristic->value_handle;
+    btstack_linked_list_remove(&mock_notification_listeners, (btstack_linked_item_t *) notification);
+    btstack_linked_list_add(&mock_notification_listeners, (btstack_linked_item_t *) notification);
+}
+
+void gatt_client_stop_listening_for_characteristic_value_updates(gatt_client_notification_t * notification){
+    btstack_linked_list_remove(&mock_notification_listeners, (btstack_linked_item_t *) notification);
+}
+
+void gatt_client_mtu_enable_auto_negotiation(uint8_t enabled){
+    mock_mtu_auto_negotiation = enabled != 0;
+}
+
+uint8_t gatt_client_send_mtu_negotiation(btstack_packet_handler_t callback, hci_con_handle_t con_handle){
+    mock_amp_t * amp = mock_amp_for_con_handle(con_handle);
+    if (amp == NULL) return ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER;
+    // only once per connection
+    if (amp->query_active || mock_mtu_auto_negotiation || (amp->mtu != ATT_DEFAULT_MTU)) return GATT_CLIENT_IN_WRONG_STATE;
+    amp->query_active = true;
+    mock_att_requests++;
+    amp->mtu = mock_mtu_negotiated();
+    uint8_t event[6];
+    event[0] = GATT_EVENT_MTU;
+    event[1] = sizeof(event) - 2;
+    little_endian_store_16(event, 2, con_handle);
+    little_endian_store_16(event, 4, amp->mtu);
+    mock_event_emit(callback, event, sizeof(event), mock_response_delay_ms, amp);
+    return ERROR_CODE_SUCCESS;
+}
+
+uint8_t gatt_client_get_mtu(hci_con_handle_t con_handle, uint16_t * mtu){
+    mock_amp_t * amp = mock_amp_for_con_handle(con_handle);
+    if (amp == NULL) return ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER;
+    *mtu = amp->mtu;
+    return ERROR_CODE_SUCCESS;
+}
+
+// used by getters in btstack_event.h
+void gatt_client_deserialize_service(const uint8_t * packet, int offset, gatt_client_service_t * service){
+    service->start_group_handle = little_endian_read_16(packet, offset);
+    service->end_group_handle   = little_endian_read_16(packet, offset + 2);
+    reverse_128(&packet[offset + 4], service->uuid128);
+    if (uuid_has_bluetooth_prefix(service->uuid128)){
+        service->uuid16 = (uint16_t) big_endian_read_32(service->uuid128, 0);
+    } else {
+        service->uuid16 = 0;
+    }
+}
+
+void gatt_client_deserialize_characteristic(const uint8_t * packet, int offset, gatt_client_characteristic_t * characteristic){
+    characteristic->start_handle = little_endian_read_16(packet, offset);
+    characteristic->value_handle = little_endian_read_16(packet, offset + 2);
+    characteristic->end_handle   = little_endian_read_16(packet, offset + 4);
+    characteristic->properties   = little_endian_read_16(packet, offset + 6);
+    reverse_128(&packet[offset + 8], characteristic->uuid128);
+    if (uuid_has_bluetooth_prefix(characteristic->uuid128)){
+        characteristic->uuid16 = (uint16_t) big_endian_read_32(characteristic->uuid128, 0);
+    } else {
+        characteristic->uuid16 = 0;
+    }
+}
+
+// mock API
+
+void mock_btstack_init(void){
+    mock_hci_event_handlers     = NULL;
+    mock_notification_listeners = NULL;
+    mock_write_handler          = NULL;
+    mock_connection_handler     = NULL;
+    mock_connecting             = false;
+    mock_scanning               = false;
+    mock_scan_interval          = 0;
+    mock_scan_window            = 0;
+    mock_scan_filter_policy     = 0;
+    mock_scan_random            = 1;
+    mock_accept_list_count      = 0;
+    mock_crowd_devices          = 0;
+    mock_att_requests           = 0;
+    mock_write_without_response = true;
+    mock_amp_mtu                = MOCK_BTSTACK_DEFAULT_MTU;
+    mock_amp_data_length_extension = true;
+    mock_amp_phy_2m             = true;
+    mock_mtu_auto_negotiation   = true;
+    mock_response_delay_ms      = 0;
+    mock_conn_interval          = 24;
+    memset(mock_amps, 0, sizeof(mock_amps));
+    uint8_t i;
+    for (i = 0; i < MOCK_BTSTACK_MAX_AMPS; i++){
+        mock_amps[i].index      = i;
+        mock_amps[i].con_handle = MOCK_BTSTACK_CON_HANDLE + i;
+        mock_amps[i].mtu        = ATT_DEFAULT_MTU;
+    }
+    memset(mock_tlv_entries, 0, sizeof(mock_tlv_entries));
+    btstack_tlv_set_instance(&mock_tlv, NULL);
+    mock_att_db                 = NULL;
+    mock_att_read_callback      = NULL;
+    mock_att_write_callback     = NULL;
+    mock_att_packet_handler     = NULL;
+    mock_advertising            = false;
+    mock_app_handler            = NULL;
+    mock_app_connected          = false;
+    mock_app_mtu                = ATT_DEFAULT_MTU;
+    mock_app_tx_buffers_used    = 0;
+    mock_app_can_send_now_requested = false;
+    mock_app_write_pending      = false;
+    mock_app_response_pending   = false;
+}
+
+void mock_btstack_set_amp(uint8_t index, const bd_addr_t addr, uint8_t addr_type, bool present){
+    mock_amp_t * amp = mock_amp_get(index);
+    if (amp == NULL) return;
+    amp->configured = true;
+    bd_addr_copy(amp->addr, addr);
+    amp->addr_type = addr_type;
+    amp->present = present;
+    if (!present && amp->connected){
+        mock_link_lost(amp, ERROR_CODE_CONNECTION_TIMEOUT);
+    }
+    if (present && mock_connecting && (bd_addr_cmp(mock_connecting_addr, addr) == 0)){
+        mock_link_established(amp);
+    }
+}
+
+void mock_btstack_set_write_without_response(bool enabled){
+    mock_write_without_response = enabled;
+}
+
+void mock_btstack_set_mtu(uint16_t mtu){
+    mock_amp_mtu = mtu;
+}
+
+void mock_btstack_set_link_features(bool data_length_extension, bool phy_2m){
+    mock_amp_data_length_extension = data_length_extension;
+    mock_amp_phy_2m                = phy_2m;
+}
+
+void mock_btstack_set_response_delay(uint32_t delay_ms){
+    mock_response_delay_ms = delay_ms;
+}
+
+void mock_btstack_set_crowd(uint16_t devices){
+    mock_crowd_devices = devices;
+}
+
+void mock_btstack_register_write_handler(mock_btstack_write_handler_t handler){
+    mock_write_handler = handler;
+}
+
+void mock_btstack_register_connection_handler(mock_btstack_connection_handler_t handler){
+    mock_connection_handler = handler;
+}
+
+uint16_t mock_btstack_get_mtu(uint8_t index){
+    mock_amp_t * amp = mock_amp_get(index);
+    return (amp != NULL) ? amp->mtu : ATT_DEFAULT_MTU;
+}
+
+uint16_t mock_btstack_get_conn_interval(uint8_t index){
+    mock_amp_t * amp = mock_amp_get(index);
+    return (amp != NULL) ? amp->conn_interval : mock_conn_interval;
+}
+
+uint32_t mock_btstack_get_next_connection_event_ms(uint8_t index){
+    mock_amp_t * amp = mock_amp_get(index);
+    uint16_t conn_interval = (amp != NULL) ? amp->conn_interval : mock_conn_interval;
+    // connection interval in 1.25 ms units, rounded up
+    uint32_t interval_ms = (conn_interval * 5u + 3u) / 4u;
+    if ((amp == NULL) || !amp->connected || (interval_ms == 0)) return interval_ms;
+    uint32_t since_anchor_ms = btstack_run_loop_get_time_ms() - amp->anchor_ms;
+    return interval_ms - (since_anchor_ms % interval_ms);
+}
+
+uint32_t mock_btstack_get_notification_air_time_us(uint8_t index, uint16_t len){
+    mock_amp_t * amp = mock_amp_get(index);
+    uint8_t  phy    = (amp != NULL) ? amp->phy : MOCK_PHY_1M;
+    uint16_t octets = (amp != NULL) ? amp->octets : MOCK_BTSTACK_DEFAULT_OCTETS;
+    // preamble, access address, LL header and CRC
+    uint16_t pdu_overhead = (phy == MOCK_PHY_2M) ? 11 : 10;
+    uint16_t us_per_byte  = (phy == MOCK_PHY_2M) ? 4 : 8;
+    // ATT opcode and handle, L2CAP header
+    uint16_t remaining = len + 3 + 4;
+    uint32_t air_time_us = 0;
+    while (remaining > 0){
+        uint16_t chunk = btstack_min(remaining, octets);
+        remaining -= chunk;
+        // data PDU, inter frame space, empty PDU, inter frame space
+        air_time_us += (chunk + pdu_overhead) * us_per_byte + 150 + pdu_overhead * us_per_byte + 150;
+    }
+    return air_time_us;
+}
+
+void mock_btstack_inject_advertisement(const bd_addr_t addr, uint8_t addr_type, const uint8_t * adv_data, uint8_t adv_len){
+    if (!mock_scanning) return;
+    if ((mock_scan_filter_policy & 1) && !mock_accept_list_contains(addr)) return;
+    if (!mock_scan_receives()) return;
+    uint8_t event[12 + 31];
+    if (adv_len > 31) return;
+    event[0] = GAP_EVENT_ADVERTISING_REPORT;
+    event[1] = 10 + adv_len;
+    event[2] = 0;   // ADV_IND
+    event[3] = addr_type;
+    reverse_bd_addr(addr, &event[4]);
+    event[10] = (uint8_t) -60;
+    event[11] = adv_len;
+    memcpy(&event[12], adv_data, adv_len);
+    mock_event_emit(NULL, event, 12 + adv_len, 0, NULL);
+}
+
+bool mock_btstack_inject_notification(uint8_t index, const uint8_t * data, uint16_t len){
+    mock_amp_t * amp = mock_amp_get(index);
+    if ((amp == NULL) || !amp->connected || !amp->notifications_enabled) return false;
+    if (len > (amp->mtu - 3)) return false;
+    uint8_t event[8 + 512];
+    event[0] = GATT_EVENT_NOTIFICATION;
+    event[1] = (uint8_t) (6 + len);
+    little_endian_store_16(event, 2, amp->con_handle);
+    little_endian_store_16(event, 4, MOCK_BTSTACK_RX_VALUE);
+    little_endian_store_16(event, 6, len);
+    memcpy(&event[8], data, len);
+    btstack_linked_item_t * it;
+    for (it = mock_notification_listeners; it != NULL; it = it->next){
+        gatt_client_notification_t * listener = (gatt_client_notification_t *) it;
+        if (listener->con_handle != amp->con_handle) continue;
+        if (listener->attribute_handle != MOCK_BTSTACK_RX_VALUE) continue;
+        mock_event_emit(listener->callback, event, 8 + len, 0, NULL);
+    }
+    return true;
+}
+
+void mock_btstack_inject_disconnect(uint8_t index, uint8_t reason){
+    mock_amp_t * amp = mock_amp_get(index);
+    if ((amp == NULL) || !amp->connected) return;
+    mock_link_lost(amp, reason);
+}
+
+bool mock_btstack_notifications_enabled(uint8_t index){
+    mock_amp_t * amp = mock_amp_get(index);
+    return (amp != NULL) && amp->connected && amp->notifications_enabled;
+}
+
+uint32_t mock_btstack_get_att_request_count(void){
+    return mock_att_requests;
+}
+
+void mock_btstack_app_register_handler(mock_btstack_app_handler_t handler){
+    mock_app_handler = handler;
+}
+
+bool mock_btstack_app_pedal_advertising(void){
+    return mock_advertising;
+}
+
+uint8_t mock_btstack_app_connect(uint16_t mtu){
+    static const bd_addr_t app_addr = { 0x5A, 0x11, 0x22, 0x33, 0x44, 0x55 };
+    if (!mock_advertising || mock_app_connected) return ERROR_CODE_COMMAND_DISALLOWED;
+    // controller stops advertising on connect
+    mock_advertising         = false;
+    mock_app_connected       = true;
+    mock_app_mtu             = btstack_min(MOCK_BTSTACK_LOCAL_MTU, btstack_max(ATT_DEFAULT_MTU, mtu));
+    mock_app_anchor_ms       = btstack_run_loop_get_time_ms();
+    mock_app_tx_buffers_used = 0;
+    mock_emit_connection_complete(ERROR_CODE_SUCCESS, MOCK_BTSTACK_APP_CON_HANDLE, HCI_ROLE_SLAVE, app_addr,
+                                  BD_ADDR_TYPE_LE_RANDOM, MOCK_BTSTACK_APP_CONN_INTERVAL);
+    if (mock_att_packet_handler != NULL){
+        // MTU exchange started by the phone
+        uint8_t event[6];
+        event[0] = ATT_EVENT_MTU_EXCHANGE_COMPLETE;
+        event[1] = sizeof(event) - 2;
+        little_endian_store_16(event, 2, MOCK_BTSTACK_APP_CON_HANDLE);
+        little_endian_store_16(event, 4, mock_app_mtu);
+        mock_event_emit(mock_att_packet_handler, event, sizeof(event), mock_app_next_connection_event_ms(), NULL);
+    }
+    if (mock_app_handler != NULL){
+        (*mock_app_handler)(MOCK_BTSTACK_APP_CONNECTED, 0, NULL, 0);
+    }
+    return ERROR_CODE_SUCCESS;
+}
+
+void mock_btstack_app_disconnect(void){
+    if (!mock_app_connected) return;
+    mock_app_link_lost(ERROR_CODE_REMOTE_USER_TERMINATED_CONNECTION);
+}
+
+bool mock_btstack_app_connected(void){
+    return mock_app_connected;
+}
+
+uint16_t mock_btstack_app_get_value_handle(uint16_t uuid16){
+    if (mock_att_db == NULL) return 0;
+    // skip version, entries: size, flags, handle, uuid16, value. Characteristic declaration: properties, value handle, uuid
+    const uint8_t * entry = &mock_att_db[1];
+    uint16_t entry_size;
+    while ((entry_size = little_endian_read_16(entry, 0)) != 0){
+        if ((entry_size == 13) && (little_endian_read_16(entry, 6) == GATT_CHARACTERISTICS_UUID)
+            && (little_endian_read_16(entry, 11) == uuid16)){
+            return little_endian_read_16(entry, 9);
+        }
+        entry += entry_size;
+    }
+    return 0;
+}
+
+uint8_t mock_btstack_app_write(uint16_t attribute_handle, const uint8_t * data, uint16_t len, bool with_response){
+    if (!mock_app_connected) return ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER;
+    if (len > (mock_app_mtu - 3)) return GATT_CLIENT_VALUE_TOO_LONG;
+    if (with_response && mock_app_write_pending) return GATT_CLIENT_IN_WRONG_STATE;
+    mock_app_write_pending = with_response;
+    uint8_t event[3 + 512];
+    little_endian_store_16(event, 0, attribute_handle);
+    event[2] = with_response ? 1 : 0;
+    memcpy(&event[3], data, len);
+    mock_event_emit(&mock_app_deliver_write, event, 3 + len, mock_app_next_connection_event_ms(), NULL);
+    return ERROR_CODE_SUCCESS;
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  mock_btstack.h
+ *
+ *  Stand-in for BTstack's HCI, GAP, SM and GATT Client layers for the host build. The mock models up to
+ *  MOCK_BTSTACK_MAX_AMPS Spark 40 that advertise while the pedal scans, accept connections and provide the
+ *  0xFFC0 service. Like a controller, it runs only one LE Create Connection at a time. MTU exchange, data
+ *  length and PHY updates are negotiated per connection against the features configured for the amps.
+ *  Events are delivered asynchronously via the run loop. Tests and tools inject advertisements,
+ *  disconnects and notifications and capture the values written by the pedal. Advertising reports are
+ *  subject to the scan duty cycle and the filter accept list, and a crowd of unrelated devices can be added.
+ *
+ *  For relay mode, the mock also provides the ATT Server and advertising of the pedal and a phone that connects
+ *  to it. The phone side is driven through the mock_btstack_app_* functions, e.g. by the emulated Spark app.
+ */
+
+#ifndef MOCK_BTSTACK_H
+#define MOCK_BTSTACK_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "btstack.h"
+
+#define MOCK_BTSTACK_MAX_AMPS           3
+
+// connection handle of first amp, amp n uses MOCK_BTSTACK_CON_HANDLE + n
+#define MOCK_BTSTACK_CON_HANDLE         0x0040
+
+// attribute handles of the Spark 40 service
+#define MOCK_BTSTACK_SERVICE_START      0x0010
+#define MOCK_BTSTACK_TX_DECLARATION     0x0011
+#define MOCK_BTSTACK_TX_VALUE           0x0012
+#define MOCK_BTSTACK_RX_DECLARATION     0x0013
+#define MOCK_BTSTACK_RX_VALUE           0x0014
+#define MOCK_BTSTACK_RX_CCCD            0x0015
+#define MOCK_BTSTACK_SERVICE_END        0x0015
+
+// max ATT MTU of the amp, connections start with the default MTU of 23 until the MTU exchange
+#define MOCK_BTSTACK_DEFAULT_MTU        247
+
+// max ATT MTU of the pedal
+#define MOCK_BTSTACK_LOCAL_MTU          517
+
+// connection handle of the phone connected to the pedal in relay mode
+#define MOCK_BTSTACK_APP_CON_HANDLE     0x0080
+
+// connection interval used by the phone, 15 ms
+#define MOCK_BTSTACK_APP_CONN_INTERVAL  12
+
+// notifications the pedal can queue towards the phone, further ones return BTSTACK_ACL_BUFFERS_FULL
+#define MOCK_BTSTACK_APP_TX_BUFFERS     4
+
+// LL payload without and with LE Data Length Extension
+#define MOCK_BTSTACK_DEFAULT_OCTETS     27
+#define MOCK_BTSTACK_MAX_OCTETS         251
+
+/**
+ * @brief Callback for values written by the pedal
+ * @param amp index
+ * @param value_handle
+ * @param data
+ * @param len
+ */
+typedef void (*mock_btstack_write_handler_t)(uint8_t amp, uint16_t value_handle, const uint8_t * data, uint16_t len);
+
+/**
+ * @brief Callback for link state changes as seen by the amp
+ * @param amp index
+ * @param connected
+ */
+typedef void (*mock_btstack_connection_handler_t)(uint8_t amp, bool connected);
+
+typedef enum {
+    MOCK_BTSTACK_APP_CONNECTED,
+    MOCK_BTSTACK_APP_DISCONNECTED,
+    MOCK_BTSTACK_APP_NOTIFICATION,
+    // data[0] is the ATT status
+    MOCK_BTSTACK_APP_WRITE_RESPONSE,
+} mock_btstack_app_event_t;
+
+/**
+ * @brief Callback for the phone connected to the pedal in relay mode
+ * @param event
+ * @param value_handle of notification or write
+ * @param data
+ * @param len
+ */
+typedef void (*mock_btstack_app_handler_t)(mock_btstack_app_event_t event, uint16_t value_handle, const uint8_t * data, uint16_t len);
+
+/* API_START */
+
+/**
+ * @brief Init mock, also sets in-memory TLV instance. Call after btstack_run_loop_init
+ */
+void mock_btstack_init(void);
+
+/**
+ * @brief Configure amp
+ * @param amp index, less than MOCK_BTSTACK_MAX_AMPS
+ * @param addr
+ * @param addr_type
+ * @param present if false, amp neither advertises nor accepts connections
+ */
+void mock_btstack_set_amp(uint8_t amp, const bd_addr_t addr, uint8_t addr_type, bool present);
+
+/**
+ * @brief Use Write Without Response for TX characteristic, default: true
+ * @param enabled
+ */
+void mock_btstack_set_write_without_response(bool enabled);
+
+/**
+ * @brief Set max ATT MTU of the amps used for the MTU exchange, default: MOCK_BTSTACK_DEFAULT_MTU
+ * @param mtu
+ */
+void mock_btstack_set_mtu(uint16_t mtu);
+
+/**
+ * @brief Set link layer features of the amps, default: both supported
+ * @param data_length_extension if false, data length stays at MOCK_BTSTACK_DEFAULT_OCTETS
+ * @param phy_2m if false, PHY update is rejected and link stays on LE 1M
+ */
+void mock_btstack_set_link_features(bool data_length_extension, bool phy_2m);
+
+/**
+ * @brief Set delay for events emitted in response to pedal requests, default: 0 ms
+ * @param delay_ms
+ */
+void mock_btstack_set_response_delay(uint32_t delay_ms);
+
+/**
+ * @brief Set number of unrelated devices that advertise next to the amps, default: 0
+ * @param devices
+ */
+void mock_btstack_set_crowd(uint16_t devices);
+
+/**
+ * @brief Register handler for captured writes
+ * @param handler
+ */
+void mock_btstack_register_write_handler(mock_btstack_write_handler_t handler);
+
+/**
+ * @brief Register handler for link state changes
+ * @param handler
+ */
+void mock_btstack_register_connection_handler(mock_btstack_connection_handler_t handler);
+
+/**
+ * @brief Get ATT MTU of the connection, 23 until MTU exchange
+ * @param amp index
+ * @return mtu
+ */
+uint16_t mock_btstack_get_mtu(uint8_t amp);
+
+/**
+ * @brief Get current connection interval
+ * @param amp index
+ * @return interval in 1.25 ms units
+ */
+uint16_t mock_btstack_get_conn_interval(uint8_t amp);
+
+/**
+ * @brief Get time until next connection event. Each connection has its own anchor point, set when connected
+ * @param amp index
+ * @return time in ms, 1 - connection interval
+ */
+uint32_t mock_btstack_get_next_connection_event_ms(uint8_t amp);
+
+/**
+ * @brief Get air time of a notification incl. ATT and L2CAP headers, LL fragmentation according to the
+ *        negotiated data length, PHY and the empty PDU sent by the pedal in return
+ * @param amp index
+ * @param len of value
+ * @return air time in us
+ */
+uint32_t mock_btstack_get_notification_air_time_us(uint8_t amp, uint16_t len);
+
+/**
+ * @brief Inject advertising report if pedal is scanning
+ * @param addr
+ * @param addr_type
+ * @param adv_data
+ * @param adv_len
+ */
+void mock_btstack_inject_advertisement(const bd_addr_t addr, uint8_t addr_type, const uint8_t * adv_data, uint8_t adv_len);
+
+/**
+ * @brief Inject notification of RX characteristic if connected and notifications are enabled
+ * @param amp index
+ * @param data
+ * @param len
+ * @return true if delivered
+ */
+bool mock_btstack_inject_notification(uint8_t amp, const uint8_t * data, uint16_t len);
+
+/**
+ * @brief Inject link loss or remote disconnect
+ * @param amp index
+ * @param reason
+ */
+void mock_btstack_inject_disconnect(uint8_t amp, uint8_t reason);
+
+/**
+ * @brief Check if amp is connected and pedal enabled notifications
+ * @param amp index
+ * @return true if ready
+ */
+bool mock_btstack_notifications_enabled(uint8_t amp);
+
+/**
+ * @brief Get number of ATT requests (discovery, CCCD and write requests) since init
+ * @return count
+ */
+uint32_t mock_btstack_get_att_request_count(void);
+
+/**
+ * @brief Register handler for the phone connected to the pedal
+ * @param handler
+ */
+void mock_btstack_app_register_handler(mock_btstack_app_handler_t handler);
+
+/**
+ * @brief Check if pedal advertises
+ * @return true if advertising
+ */
+bool mock_btstack_app_pedal_advertising(void);
+
+/**
+ * @brief Connect phone to the advertising pedal. Connection complete and MTU exchange are reported to the pedal
+ * @param mtu of the phone
+ * @return ERROR_CODE_SUCCESS or ERROR_CODE_COMMAND_DISALLOWED if not advertising or already connected
+ */
+uint8_t mock_btstack_app_connect(uint16_t mtu);
+
+/**
+ * @brief Disconnect phone
+ */
+void mock_btstack_app_disconnect(void);
+
+/**
+ * @brief Check if phone is connected
+ * @return true if connected
+ */
+bool mock_btstack_app_connected(void);
+
+/**
+ * @brief Get value handle of characteristic in the ATT DB of the pedal, replaces service discovery
+ * @param uuid16
+ * @return value handle or 0 if not found
+ */
+uint16_t mock_btstack_app_get_value_handle(uint16_t uuid16);
+
+/**
+ * @brief Write attribute of the pedal, delivered at the next connection event of the phone. Writes with response
+ *        are completed by MOCK_BTSTACK_APP_WRITE_RESPONSE, only one can be pending
+ * @param attribute_handle
+ * @param data
+ * @param len up to ATT MTU - 3
+ * @param with_response
+ * @return ERROR_CODE_SUCCESS, GATT_CLIENT_VALUE_TOO_LONG, GATT_CLIENT_IN_WRONG_STATE or
+ *         ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER
+ */
+uint8_t mock_btstack_app_write(uint16_t attribute_handle, const uint8_t * data, uint16_t len, bool with_response);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // MOCK_BTSTACK_H
@@ -0,0 +1,398 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+
+#define BTSTACK_FILE__ "spark_adv_filter_benchmark.c"
+
+/*
+ *  spark_adv_filter_benchmark.c
+ *
+ *  Feeds synthetic advertising traffic of a crowded room through the advertisement filter and through the
+ *  former walk over all AD structures with a name compare. The room has phones, watches, beacons, earbuds,
+ *  trackers, name lookalikes and malformed reports next to a few amps. Reports ns/report for both, the
+ *  rejections per filter stage and checks that exactly the amps are accepted.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ad_parser.h"
+
+#include "spark_adv_filter.h"
+
+#define BENCHMARK_DEFAULT_PASSES        2000
+#define BENCHMARK_DEVICES               400
+#define BENCHMARK_MAX_ADV_LEN           31
+
+typedef struct {
+    uint8_t       event_type;
+    uint8_t       addr_type;
+    uint8_t       addr[6];
+    uint8_t       adv_len;
+    uint8_t       adv_data[BENCHMARK_MAX_ADV_LEN];
+    spark_model_t expected;
+} benchmark_report_t;
+
+typedef enum {
+    DEVICE_APPLE_CONTINUITY = 0,
+    DEVICE_APPLE_FIND_MY,
+    DEVICE_IBEACON,
+    DEVICE_EDDYSTONE,
+    DEVICE_MICROSOFT_SWIFT_PAIR,
+    DEVICE_SAMSUNG,
+    DEVICE_GOOGLE_FAST_PAIR,
+    DEVICE_HEART_RATE,
+    DEVICE_EARBUDS,
+    DEVICE_SCAN_RESPONSE,
+    DEVICE_DIRECTED,
+    DEVICE_FLAGS_ONLY,
+    DEVICE_MALFORMED,
+    DEVICE_LOOKALIKE,
+    DEVICE_COUNT
+} device_kind_t;
+
+typedef struct {
+    const char * name;
+    uint8_t      weight;
+} device_kind_info_t;
+
+// share of reports in a crowded room, in percent
+static const device_kind_info_t device_kinds[DEVICE_COUNT] = {
+    [DEVICE_APPLE_CONTINUITY]     = { "phone (Apple)",    28 },
+    [DEVICE_APPLE_FIND_MY]        = { "Find My tag",      10 },
+    [DEVICE_IBEACON]              = { "iBeacon",           5 },
+    [DEVICE_EDDYSTONE]            = { "Eddystone",         4 },
+    [DEVICE_MICROSOFT_SWIFT_PAIR] = { "Swift Pair",        4 },
+    [DEVICE_SAMSUNG]              = { "phone (Samsung)",   9 },
+    [DEVICE_GOOGLE_FAST_PAIR]     = { "Fast Pair",         5 },
+    [DEVICE_HEART_RATE]           = { "heart rate",        7 },
+    [DEVICE_EARBUDS]              = { "earbuds",           9 },
+    [DEVICE_SCAN_RESPONSE]        = { "scan response",     8 },
+    [DEVICE_DIRECTED]             = { "directed",          3 },
+    [DEVICE_FLAGS_ONLY]           = { "flags only",        4 },
+    [DEVICE_MALFORMED]            = { "malformed",         2 },
+    [DEVICE_LOOKALIKE]            = { "name lookalike",    2 },
+};
+
+static const char * lookalike_names[] = { " Spark Control", " Spark 40 Audio", " Sparkle", "Spark 40 BLE" };
+static const char * earbud_names[]    = { "JBL Tune 510BT", "Galaxy Buds2", "WH-1000XM4", "Jabra Elite 75t", "LE-Bose QC" };
+static const char * amp_names[]       = { " Spark 40 BLE", " Spark MINI BLE", " Spark GO BLE" };
+
+static benchmark_report_t reports[BENCHMARK_DEVICES];
+static uint32_t benchmark_random_state = 1;
+
+static uint32_t benchmark_random(uint32_t range){
+    benchmark_random_state = benchmark_random_state * 1103515245u + 12345u;
+    return (benchmark_random_state >> 8) % range;
+}
+
+static uint64_t time_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+// builders
+
+static void report_add(benchmark_report_t * report, uint8_t type, const uint8_t * data, uint8_t len){
+    if ((report->adv_len + 2 + len) > BENCHMARK_MAX_ADV_LEN) return;
+    report->adv_data[report->adv_len++] = len + 1;
+    report->adv_data[report->adv_len++] = type;
+    memcpy(&report->adv_data[report->adv_len], data, len);
+    report->adv_len += len;
+}
+
+static void report_add_flags(benchmark_report_t * report){
+    static const uint8_t flags = 0x06;
+    report_add(report, 0x01, &flags, 1);
+}
+
+static void report_add_name(benchmark_report_t * report, const char * name){
+    report_add(report, 0x09, (const uint8_t *) name, (uint8_t) strlen(name));
+}
+
+static void report_add_manufacturer(benchmark_report_t * report, uint16_t company_id, uint8_t len){
+    uint8_t data[BENCHMARK_MAX_ADV_LEN];
+    data[0] = company_id & 0xff;
+    data[1] = company_id >> 8;
+    uint8_t i;
+    for (i = 2; i < len; i++){
+        data[i] = (uint8_t) benchmark_random(256);
+    }
+    report_add(report, 0xff, data, len);
+}
+
+static void report_add_uuid16(benchmark_report_t * report, uint8_t type, uint16_t uuid){
+    uint8_t data[2] = { uuid & 0xff, uuid >> 8 };
+    report_add(report, type, data, 2);
+}
+
+static void report_set_addr(benchmark_report_t * report, uint8_t addr_type, uint8_t top_bits){
+    uint8_t i;
+    for (i = 0; i < 6; i++){
+        report->addr[i] = (uint8_t) benchmark_random(256);
+    }
+    report->addr_type = addr_type;
+    if (addr_type == 1){
+        report->addr[0] = (report->addr[0] & 0x3f) | top_bits;
+    }
+}
+
+static void report_init_device(benchmark_report_t * report, device_kind_t kind){
+    memset(report, 0, sizeof(benchmark_report_t));
+    report->expected = SPARK_MODEL_NONE;
+    // resolvable private addresses by default
+    report_set_addr(report, 1, 0x40);
+    switch (kind){
+        case DEVICE_APPLE_CONTINUITY:
+            report_add_flags(report);
+            report_add_manufacturer(report, 0x004c, 2 + 14);
+            break;
+        case DEVICE_APPLE_FIND_MY:
+            report->event_type = SPARK_ADV_FILTER_EVENT_ADV_NONCONN_IND;
+            report_add_manufacturer(report, 0x004c, 2 + 27);
+            break;
+        case DEVICE_IBEACON:
+            report->event_type = SPARK_ADV_FILTER_EVENT_ADV_NONCONN_IND;
+            report_set_addr(report, 0, 0);
+            report_add_flags(report);
+            report_add_manufacturer(report, 0x004c, 2 + 23);
+            break;
+        case DEVICE_EDDYSTONE:
+            report->event_type = SPARK_ADV_FILTER_EVENT_ADV_NONCONN_IND;
+            report_add_flags(report);
+            report_add_uuid16(report, 0x03, 0xfeaa);
+            report_add_manufacturer(report, 0xfeaa, 2 + 16);
+            break;
+        case DEVICE_MICROSOFT_SWIFT_PAIR:
+            report->event_type = SPARK_ADV_FILTER_EVENT_ADV_IND;
+            report_add_manufacturer(report, 0x0006, 2 + 8);
+            report_add_name(report, "Surface Pen");
+            break;
+        case DEVICE_SAMSUNG:
+            report_add_flags(report);
+            report_add_manufacturer(report, 0x0075, 2 + 24);
+            break;
+        case DEVICE_GOOGLE_FAST_PAIR:
+            report->event_type = SPARK_ADV_FILTER_EVENT_ADV_SCAN_IND;
+            report_add_flags(report);
+            report_add_uuid16(report, 0x03, 0xfe2c);
+            break;
+        case DEVICE_HEART_RATE:
+            report_set_addr(report, 0, 0);
+            report_add_flags(report);
+            report_add_uuid16(report, 0x03, 0x180d);
+            report_add_name(report, "Charge 5");
+            break;
+        case DEVICE_EARBUDS:
+            report_set_addr(report, 1, 0xc0);
+            report_add_flags(report);
+            report_add_name(report, earbud_names[benchmark_random(sizeof(earbud_names) / sizeof(earbud_names[0]))]);
+            report_add_uuid16(report, 0x02, 0x110b);
+            break;
+        case DEVICE_SCAN_RESPONSE:
+            report->event_type = SPARK_ADV_FILTER_EVENT_SCAN_RSP;
+            report_set_addr(report, 0, 0);
+            report_add_name(report, earbud_names[benchmark_random(sizeof(earbud_names) / sizeof(earbud_names[0]))]);
+            break;
+        case DEVICE_DIRECTED:
+            report->event_type = SPARK_ADV_FILTER_EVENT_ADV_DIRECT_IND;
+            break;
+        case DEVICE_FLAGS_ONLY:
+            report_set_addr(report, 0, 0);
+            report_add_flags(report);
+            break;
+        case DEVICE_MALFORMED:
+            report_set_addr(report, 0, 0);
+            report_add_flags(report);
+            report_add_name(report, " Spark 40 BLE");
+            // name claims more bytes than the report holds
+            report->adv_data[3] = 0x1e;
+            break;
+        case DEVICE_LOOKALIKE:
+            report_set_addr(report, 0, 0);
+            report_add_flags(report);
+            report_add_name(report, lookalike_names[benchmark_random(sizeof(lookalike_names) / sizeof(lookalike_names[0]))]);
+            break;
+        default:
+            break;
+    }
+}
+
+static void report_init_amp(benchmark_report_t * report, spark_model_t model){
+    memset(report, 0, sizeof(benchmark_report_t));
+    report_set_addr(report, 0, 0);
+    report->addr[0] = 0x08;
+    report_add_flags(report);
+    report_add_name(report, amp_names[model]);
+    report_add_uuid16(report, 0x03, 0xffc0);
+    report->expected = model;
+}
+
+// former filter: walk all AD structures with the BTstack AD iterator and compare the name of the Spark 40
+static bool former_contains_name(const char * name, const uint8_t * adv_data, uint8_t adv_len){
+    uint16_t name_len = (uint8_t) strlen(name);
+    ad_context_t context;
+    for (ad_iterator_init(&context, adv_len, adv_data) ; ad_iterator_has_more(&context) ; ad_iterator_next(&context)){
+        uint8_t data_type    = ad_iterator_get_data_type(&context);
+        uint8_t data_size    = ad_iterator_get_data_len(&context);
+        const uint8_t * data = ad_iterator_get_data(&context);
+        switch (data_type){
+            case 0x08:
+            case 0x09:
+                if (data_size >= name_len){
+                    if (memcmp(data, name, name_len) == 0){
+                        return true;
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char * argv[]){
+    uint32_t passes = BENCHMARK_DEFAULT_PASSES;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:h")) != -1){
+        switch (opt){
+            case 'n':
+                passes = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                benchmark_random_state = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            default:
+                printf("Usage: %s [-n passes] [-s seed]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (passes == 0){
+        passes = 1;
+    }
+
+    // one of each amp model, rest of the room by weight
+    uint16_t i;
+    uint8_t model;
+    for (model = 0; model < SPARK_MODEL_COUNT; model++){
+        report_init_amp(&reports[model], (spark_model_t) model);
+    }
+    for (i = SPARK_MODEL_COUNT; i < BENCHMARK_DEVICES; i++){
+        uint32_t pick = benchmark_random(100);
+        uint8_t kind = 0;
+        while ((kind < (DEVICE_COUNT - 1)) && (pick >= device_kinds[kind].weight)){
+            pick -= device_kinds[kind].weight;
+            kind++;
+        }
+        report_init_device(&reports[i], (device_kind_t) kind);
+    }
+    // amps are somewhere in the middle of the traffic
+    for (model = 0; model < SPARK_MODEL_COUNT; model++){
+        uint16_t other = (uint16_t) (SPARK_MODEL_COUNT + benchmark_random(BENCHMARK_DEVICES - SPARK_MODEL_COUNT));
+        benchmark_report_t swap = reports[model];
+        reports[model] = reports[other];
+        reports[other] = swap;
+    }
+
+    printf("Advertisement filter, %u reports per pass, %u passes\n", BENCHMARK_DEVICES, passes);
+
+    // former walk
+    uint32_t pass;
+    uint32_t former_matches = 0;
+    uint64_t start_ns = time_ns();
+    for (pass = 0; pass < passes; pass++){
+        for (i = 0; i < BENCHMARK_DEVICES; i++){
+            if (former_contains_name(" Spark 40 BLE", reports[i].adv_data, reports[i].adv_len)){
+                former_matches++;
+            }
+        }
+    }
+    uint64_t former_ns = time_ns() - start_ns;
+
+    // layered filter
+    spark_adv_filter_init();
+    uint32_t filter_matches = 0;
+    start_ns = time_ns();
+    for (pass = 0; pass < passes; pass++){
+        for (i = 0; i < BENCHMARK_DEVICES; i++){
+            const benchmark_report_t * report = &reports[i];
+            if (spark_adv_filter_match(report->event_type, report->addr_type, report->addr, report->adv_data, report->adv_len) != SPARK_MODEL_NONE){
+                filter_matches++;
+            }
+        }
+    }
+    uint64_t filter_ns = time_ns() - start_ns;
+
+    double reports_total = (double) passes * BENCHMARK_DEVICES;
+    printf("%-24s %10s %12s\n", "", "ns/report", "matches/pass");
+    printf("%-24s %10.1f %12.1f\n", "former name walk", (double) former_ns / reports_total, (double) former_matches / passes);
+    printf("%-24s %10.1f %12.1f\n", "layered filter", (double) filter_ns / reports_total, (double) filter_matches / passes);
+
+    const spark_adv_filter_stats_t * stats = spark_adv_filter_get_stats();
+    printf("Rejected per stage:\n");
+    uint8_t stage;
+    for (stage = 0; stage < SPARK_ADV_FILTER_STAGE_COUNT; stage++){
+        printf("    %-20s %6.2f%%\n", spark_adv_filter_stage_name((spark_adv_filter_stage_t) stage),
+               100.0 * (double) stats->rejected[stage] / (double) stats->reports);
+    }
+
+    // every report once more, checked against the expected model
+    bool pass_ok = true;
+    spark_adv_filter_reset_stats();
+    for (i = 0; i < BENCHMARK_DEVICES; i++){
+        const benchmark_report_t * report = &reports[i];
+        spark_model_t result = spark_adv_filter_match(report->event_type, report->addr_type, report->addr, report->adv_data, report->adv_len);
+        if (result != report->expected){
+            printf("Report %u: expected %s, got %s\n", i, spark_adv_filter_model_name(report->expected), spark_adv_filter_model_name(result));
+            pass_ok = false;
+        }
+    }
+    for (model = 0; model < SPARK_MODEL_COUNT; model++){
+        printf("Accepted %-12s %"PRIu32"\n", spark_adv_filter_model_name((spark_model_t) model), stats->accepted[model]);
+    }
+    printf("%s\n", pass_ok ? "ok" : "FAILED");
+    return pass_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
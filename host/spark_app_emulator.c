@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "spark_app_emulator.c"
+
+/*
+ *  spark_app_emulator.c
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "btstack.h"
+#include "mock_btstack.h"
+#include "spark_app_emulator.h"
+#include "spark_protocol.h"
+
+#define APP_POLL_INTERVAL_MS            100
+#define APP_NUM_PRESETS                 4
+// every n-th action requests preset details instead of selecting a preset
+#define APP_PRESET_REQUEST_INTERVAL     4
+
+typedef enum {
+    APP_STATE_IDLE,
+    APP_STATE_W4_CCCD,
+    APP_STATE_READY,
+} app_state_t;
+
+static app_state_t                app_state;
+static uint32_t                   app_period_ms;
+static uint16_t                   app_tx_value_handle;
+static uint16_t                   app_rx_value_handle;
+static bool                       app_write_pending;
+static uint8_t                    app_sequence;
+static uint8_t                    app_preset;
+static uint32_t                   app_actions;
+static uint8_t                    app_select_sequence;
+static uint32_t                   app_select_ms;
+static bool                       app_select_pending;
+// quiet after half a message until
+static bool                       app_stalled;
+static uint32_t                   app_stalled_until_ms;
+static spark_reader_t             app_reader;
+static btstack_timer_source_t     app_poll_timer;
+static btstack_timer_source_t     app_action_timer;
+static spark_app_emulator_stats_t app_stats;
+
+// len less than the frame leaves the message incomplete
+static bool app_write_message(uint8_t command, uint8_t sub_command, const uint8_t * payload, uint8_t payload_len, uint16_t len){
+    uint8_t frame[32];
+    uint16_t frame_len = spark_short_frame_init(frame, SPARK_DIRECTION_TO_AMP, command, sub_command, payload_len);
+    spark_short_frame_patch(frame, app_sequence, payload, payload_len);
+    // the Spark app uses Write Requests
+    uint8_t status = mock_btstack_app_write(app_tx_value_handle, frame, btstack_min(len, frame_len), true);
+    if (status != ERROR_CODE_SUCCESS){
+        app_stats.write_errors++;
+        return false;
+    }
+    app_write_pending = true;
+    app_stats.writes++;
+    app_sequence = (app_sequence + 1) & 0x7f;
+    return true;
+}
+
+static void app_action_timeout(btstack_timer_source_t * ts){
+    if (app_state != APP_STATE_READY) return;
+    if (!app_write_pending && !spark_app_emulator_is_stalled()){
+        app_actions++;
+        if ((app_actions % APP_PRESET_REQUEST_INTERVAL) == 0){
+            const uint8_t get_preset[] = { 0x00, app_preset };
+            app_write_message(SPARK_CMD_REQUEST, SPARK_SUB_PRESET, get_preset, sizeof(get_preset), UINT16_MAX);
+            app_stats.preset_requests++;
+        } else {
+            app_preset = (app_preset + 1) % APP_NUM_PRESETS;
+            const uint8_t select_preset[] = { 0x00, app_preset };
+            app_select_sequence = app_sequence;
+            app_select_ms = btstack_run_loop_get_time_ms();
+            app_write_message(SPARK_CMD_WRITE, SPARK_SUB_SELECT_PRESET, select_preset, sizeof(select_preset), UINT16_MAX);
+            app_select_pending = app_write_pending;
+            app_stats.selects++;
+        }
+    }
+    btstack_run_loop_set_timer(ts, app_period_ms);
+    btstack_run_loop_add_timer(ts);
+}
+
+static void app_handle_message(void * context, const spark_message_t * message){
+    UNUSED(context);
+    if (message->direction != SPARK_DIRECTION_FROM_AMP) return;
+    switch (message->command){
+        case SPARK_CMD_ACK:
+            app_stats.acks++;
+            if ((message->sub_command != SPARK_SUB_SELECT_PRESET) || !app_select_pending) break;
+            if (message->sequence != app_select_sequence) break;
+            app_select_pending = false;
+            latency_histogram_add(&app_stats.round_trip, (btstack_run_loop_get_time_ms() - app_select_ms) * 1000);
+            break;
+        case SPARK_CMD_RESPONSE:
+            if (message->sub_command == SPARK_SUB_PRESET){
+                app_stats.presets++;
+            }
+            // preset changed on the amp or by the pedal
+            if ((message->sub_command == SPARK_SUB_SELECT_PRESET) && (message->payload_len >= 2)){
+                app_stats.preset_reports++;
+                app_preset = message->payload[1];
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void app_handler(mock_btstack_app_event_t event, uint16_t value_handle, const uint8_t * data, uint16_t len){
+    const uint8_t enable_notifications[] = { 0x01, 0x00 };
+    switch (event){
+        case MOCK_BTSTACK_APP_CONNECTED:
+            app_stats.connections++;
+            app_write_pending  = false;
+            app_select_pending = false;
+            spark_reader_reset(&app_reader);
+            // handles are known from earlier connections to the amp
+            app_tx_value_handle = mock_btstack_app_get_value_handle(0xffc1);
+            app_rx_value_handle = mock_btstack_app_get_value_handle(0xffc2);
+            if ((app_tx_value_handle == 0) || (app_rx_value_handle == 0)){
+                printf("[!] App: Spark 40 service not found\n");
+                mock_btstack_app_disconnect();
+                break;
+            }
+            app_state = APP_STATE_W4_CCCD;
+            mock_btstack_app_write(app_rx_value_handle + 1, enable_notifications, sizeof(enable_notifications), true);
+            break;
+        case MOCK_BTSTACK_APP_DISCONNECTED:
+            app_state   = APP_STATE_IDLE;
+            app_stalled = false;
+            btstack_run_loop_remove_timer(&app_action_timer);
+            break;
+        case MOCK_BTSTACK_APP_WRITE_RESPONSE:
+            app_write_pending = false;
+            if (data[0] != ATT_ERROR_SUCCESS){
+                app_stats.write_errors++;
+            }
+            if (app_state != APP_STATE_W4_CCCD) break;
+            app_state = APP_STATE_READY;
+            btstack_run_loop_set_timer_handler(&app_action_timer, &app_action_timeout);
+            btstack_run_loop_set_timer(&app_action_timer, app_period_ms);
+            btstack_run_loop_add_timer(&app_action_timer);
+            break;
+        case MOCK_BTSTACK_APP_NOTIFICATION:
+            if (value_handle != app_rx_value_handle) break;
+            app_stats.notifications++;
+            app_stats.notification_bytes += len;
+            spark_reader_process(&app_reader, data, len);
+            break;
+        default:
+            break;
+    }
+}
+
+static void app_poll_timeout(btstack_timer_source_t * ts){
+    if ((app_state == APP_STATE_IDLE) && mock_btstack_app_pedal_advertising()){
+        mock_btstack_app_connect(SPARK_APP_EMULATOR_MTU);
+    }
+    btstack_run_loop_set_timer(ts, APP_POLL_INTERVAL_MS);
+    btstack_run_loop_add_timer(ts);
+}
+
+void spark_app_emulator_init(uint32_t period_ms){
+    memset(&app_stats, 0, sizeof(app_stats));
+    latency_histogram_reset(&app_stats.round_trip);
+    app_state     = APP_STATE_IDLE;
+    app_period_ms = period_ms;
+    app_sequence  = 0;
+    app_preset    = 0;
+    app_actions   = 0;
+    spark_reader_init(&app_reader, &app_handle_message, NULL);
+    mock_btstack_app_register_handler(&app_handler);
+    btstack_run_loop_set_timer_handler(&app_poll_timer, &app_poll_timeout);
+    btstack_run_loop_set_timer(&app_poll_timer, APP_POLL_INTERVAL_MS);
+    btstack_run_loop_add_timer(&app_poll_timer);
+}
+
+const spark_app_emulator_stats_t * spark_app_emulator_get_stats(void){
+    return &app_stats;
+}
+
+bool spark_app_emulator_is_ready(void){
+    return app_state == APP_STATE_READY;
+}
+
+void spark_app_emulator_stall(uint32_t duration_ms){
+    if ((app_state != APP_STATE_READY) || app_write_pending) return;
+    // first half of a preset change, the rest never follows
+    const uint8_t select_preset[] = { 0x00, app_preset };
+    if (!app_write_message(SPARK_CMD_WRITE, SPARK_SUB_SELECT_PRESET, select_preset, sizeof(select_preset), 8)) return;
+    app_stats.stalls++;
+    app_stalled          = true;
+    app_stalled_until_ms = btstack_run_loop_get_time_ms() + duration_ms;
+}
+
+bool spark_app_emulator_is_stalled(void){
+    if (!app_stalled) return false;
+    app_stalled = btstack_time_delta(app_stalled_until_ms, btstack_run_loop_get_time_ms()) > 0;
+    return app_stalled;
+}
+
+void spark_app_emulator_dump_stats(void){
+    const latency_histogram_t * histogram = &app_stats.round_trip;
+    printf("[-] App: connections %"PRIu32", writes %"PRIu32" (errors %"PRIu32"), selects %"PRIu32", acks %"PRIu32", preset requests %"PRIu32", presets %"PRIu32", preset reports %"PRIu32", stalls %"PRIu32"\n",
+           app_stats.connections, app_stats.writes, app_stats.write_errors, app_stats.selects, app_stats.acks,
+           app_stats.preset_requests, app_stats.presets, app_stats.preset_reports, app_stats.stalls);
+    printf("[-] App: notifications %"PRIu32", %"PRIu32" bytes, reader resyncs %"PRIu32", checksum errors %"PRIu32", dropped %"PRIu32"\n",
+           app_stats.notifications, app_stats.notification_bytes, app_reader.stats.resyncs,
+           app_reader.stats.checksum_errors, app_reader.stats.dropped);
+    printf("[-] App: select to ack count %"PRIu32", min/p50/p99/max %"PRIu32"/%"PRIu32"/%"PRIu32"/%"PRIu32" us\n",
+           histogram->count, histogram->min_us, latency_histogram_get_percentile(histogram, 50),
+           latency_histogram_get_percentile(histogram, 99), histogram->max_us);
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  spark_app_emulator.h
+ *
+ *  Stand-in for the Spark app on a phone for relay mode tests on the host. The emulated app connects to the pedal
+ *  when it advertises, enables notifications and then selects presets periodically, like a user tapping through
+ *  presets in the app. It also requests preset details now and then, which the amp answers with large multi-chunk
+ *  messages. Everything received is decoded to check the forwarded stream and to measure round trips through the relay.
+ */
+
+#ifndef SPARK_APP_EMULATOR_H
+#define SPARK_APP_EMULATOR_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "latency_histogram.h"
+
+// ATT MTU requested by the app
+#define SPARK_APP_EMULATOR_MTU          247
+
+typedef struct {
+    uint32_t connections;
+    uint32_t writes;
+    uint32_t write_errors;
+    uint32_t selects;
+    uint32_t acks;
+    uint32_t preset_requests;
+    uint32_t presets;
+    uint32_t preset_reports;
+    uint32_t stalls;
+    uint32_t notifications;
+    uint32_t notification_bytes;
+    // select preset written to acknowledgement received
+    latency_histogram_t round_trip;
+} spark_app_emulator_stats_t;
+
+/* API_START */
+
+/**
+ * @brief Init emulated app. Call after mock_btstack_init
+ * @param period_ms between preset changes
+ */
+void spark_app_emulator_init(uint32_t period_ms);
+
+/**
+ * @brief Get statistics
+ * @return stats
+ */
+const spark_app_emulator_stats_t * spark_app_emulator_get_stats(void);
+
+/**
+ * @brief Check if app is connected to the pedal and has enabled notifications
+ * @return true if ready
+ */
+bool spark_app_emulator_is_ready(void);
+
+/**
+ * @brief Write the first 8 bytes of a preset change and then nothing for a while, like an app sent to the background
+ * @param duration_ms without further writes
+ */
+void spark_app_emulator_stall(uint32_t duration_ms);
+
+/**
+ * @brief Check if app is quiet after an incomplete message
+ * @return true while stalled
+ */
+bool spark_app_emulator_is_stalled(void);
+
+/**
+ * @brief Print statistics
+ */
+void spark_app_emulator_dump_stats(void);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // SPARK_APP_EMULATOR_H
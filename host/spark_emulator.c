@@ -0,0 +1,729 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "spark_emulator.c"
+
+/*
+ *  spark_emulator.c
+ *
+ *  Strings in message payloads are encoded as 0xA0 | len (up to 31 chars) or 0xD9 len, floats as 0xCA followed
+ *  by the big endian IEEE 754 value, booleans as 0xC2 (off) and 0xC3 (on), and arrays as 0x90 | count.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btstack.h"
+#include "mock_btstack.h"
+#include "spark_emulator.h"
+#include "spark_protocol.h"
+
+#define EMULATOR_NUM_EFFECTS            7
+#define EMULATOR_MAX_PARAMETERS         5
+#define EMULATOR_MAX_PAYLOAD            1024
+#define EMULATOR_MAX_STREAM             (EMULATOR_MAX_PAYLOAD * 2)
+#define EMULATOR_DEFAULT_PER_EVENT      4
+
+// first byte of preset request and response
+#define EMULATOR_PRESET_TYPE_HARDWARE   0x00
+#define EMULATOR_PRESET_TYPE_CURRENT    0x01
+
+typedef struct {
+    const char * name;
+    bool         on;
+    uint8_t      num_parameters;
+    float        parameters[EMULATOR_MAX_PARAMETERS];
+} emulator_effect_t;
+
+typedef struct {
+    const char *      uuid;
+    const char *      name;
+    const char *      description;
+    float             bpm;
+    emulator_effect_t effects[EMULATOR_NUM_EFFECTS];
+} emulator_preset_t;
+
+typedef struct {
+    uint8_t * data;
+    uint16_t  size;
+    uint16_t  len;
+} emulator_writer_t;
+
+typedef struct {
+    btstack_linked_item_t item;
+    uint16_t              len;
+    uint8_t               data[];
+} emulator_fragment_t;
+
+typedef struct {
+    btstack_linked_item_t  item;
+    btstack_timer_source_t timer;
+    struct emulator_amp *  amp;
+    uint8_t                command;
+    uint8_t                sub_command;
+    uint8_t                sequence;
+    uint16_t               payload_len;
+    uint8_t                payload[];
+} emulator_pending_t;
+
+static const emulator_preset_t emulator_default_presets[SPARK_EMULATOR_NUM_PRESETS] = {
+    {
+        "07079063-4C1C-4D4B-8E8F-6D3D6E7F0A00", "Silver Ship", "Clean tone", 120.0f, {
+            { "bias.noisegate", false, 3, { 0.5f, 0.5f, 0.0f } },
+            { "LA2AComp",       true,  3, { 0.0f, 0.6f, 0.5f } },
+            { "Booster",        false, 1, { 0.5f } },
+            { "RolandJC120",    true,  5, { 0.6f, 0.5f, 0.5f, 0.6f, 0.7f } },
+            { "ChorusAnalog",   true,  4, { 0.3f, 0.4f, 0.5f, 0.5f } },
+            { "DelayMono",      false, 5, { 0.2f, 0.3f, 0.4f, 0.5f, 1.0f } },
+            { "bias.reverb",    true,  5, { 0.4f, 0.3f, 0.5f, 0.6f, 0.3f } },
+        }
+    },
+    {
+        "2C0F7E10-5B3B-4A7A-9D2B-6C1A0E4F1A01", "Sweet Memory", "Crunch", 110.0f, {
+            { "bias.noisegate", true,  3, { 0.4f, 0.5f, 0.0f } },
+            { "BlueComp",       false, 4, { 0.5f, 0.5f, 0.5f, 0.5f } },
+            { "DistortionTS9",  true,  3, { 0.3f, 0.6f, 0.7f } },
+            { "Twin",           true,  5, { 0.7f, 0.4f, 0.5f, 0.6f, 0.6f } },
+            { "Tremolo",        false, 3, { 0.5f, 0.5f, 0.5f } },
+            { "VintageDelay",   true,  4, { 0.3f, 0.4f, 0.5f, 1.0f } },
+            { "bias.reverb",    true,  5, { 0.3f, 0.3f, 0.4f, 0.6f, 0.3f } },
+        }
+    },
+    {
+        "5E1B8B2A-3D4C-4F5E-8A6B-7C8D9E0F1A02", "Fire in the Hole", "Lead", 140.0f, {
+            { "bias.noisegate", true,  3, { 0.6f, 0.5f, 0.0f } },
+            { "LA2AComp",       false, 3, { 0.0f, 0.5f, 0.5f } },
+            { "Overdrive",      true,  3, { 0.6f, 0.5f, 0.8f } },
+            { "94MatchDCV2",    true,  5, { 0.8f, 0.5f, 0.6f, 0.7f, 0.7f } },
+            { "Flanger",        false, 3, { 0.5f, 0.5f, 0.5f } },
+            { "DelayMono",      true,  5, { 0.3f, 0.4f, 0.4f, 0.5f, 1.0f } },
+            { "bias.reverb",    true,  5, { 0.5f, 0.4f, 0.5f, 0.7f, 0.4f } },
+        }
+    },
+    {
+        "6A7B8C9D-0E1F-4A2B-9C3D-4E5F6A7B1A03", "Dancing in the Room", "Ambient", 90.0f, {
+            { "bias.noisegate", false, 3, { 0.5f, 0.5f, 0.0f } },
+            { "BlueComp",       true,  4, { 0.4f, 0.5f, 0.5f, 0.5f } },
+            { "Booster",        false, 1, { 0.3f } },
+            { "Bogner",         true,  5, { 0.5f, 0.5f, 0.6f, 0.6f, 0.6f } },
+            { "ChorusAnalog",   true,  4, { 0.6f, 0.6f, 0.5f, 0.5f } },
+            { "VintageDelay",   true,  4, { 0.6f, 0.6f, 0.7f, 1.0f } },
+            { "bias.reverb",    true,  5, { 0.8f, 0.6f, 0.7f, 0.8f, 0.6f } },
+        }
+    },
+};
+
+static const char emulator_serial_number[] = "S999C999B999";
+
+typedef struct emulator_amp {
+    uint8_t                index;
+    bd_addr_t              addr;
+    spark_reader_t         reader;
+    emulator_preset_t      presets[SPARK_EMULATOR_NUM_PRESETS];
+    emulator_preset_t      current;
+    uint8_t                current_preset;
+    uint8_t                sequence;
+
+    // preset uploaded by pedal, replaces current preset until next preset change
+    uint8_t                upload[EMULATOR_MAX_PAYLOAD];
+    uint16_t               upload_len;
+
+    btstack_linked_list_t  tx_fragments;
+    btstack_linked_list_t  pending_responses;
+    btstack_timer_source_t tx_timer;
+    bool                   tx_active;
+    btstack_timer_source_t power_timer;
+
+    spark_emulator_stats_t stats;
+} emulator_amp_t;
+
+static emulator_amp_t         emulator_amps[SPARK_EMULATOR_MAX_AMPS];
+static uint8_t                emulator_num_amps;
+
+static uint32_t               emulator_response_delay_ms;
+static uint16_t               emulator_fragment_size;
+static uint8_t                emulator_per_event;
+static uint8_t                emulator_loss_percent;
+static uint32_t               emulator_random_state;
+static uint8_t                emulator_burst_count;
+static uint32_t               emulator_burst_period_ms;
+static btstack_timer_source_t emulator_burst_timer;
+
+// payload writer
+
+static void writer_byte(emulator_writer_t * writer, uint8_t value){
+    if (writer->len < writer->size){
+        writer->data[writer->len++] = value;
+    }
+}
+
+static void writer_string(emulator_writer_t * writer, const char * string){
+    uint16_t len = (uint16_t) strlen(string);
+    if (len < 32){
+        writer_byte(writer, 0xa0 | len);
+    } else {
+        writer_byte(writer, 0xd9);
+        writer_byte(writer, (uint8_t) len);
+    }
+    uint16_t i;
+    for (i = 0; i < len; i++){
+        writer_byte(writer, (uint8_t) string[i]);
+    }
+}
+
+static void writer_long_string(emulator_writer_t * writer, const char * string){
+    uint16_t len = (uint16_t) strlen(string);
+    writer_byte(writer, 0xd9);
+    writer_byte(writer, (uint8_t) len);
+    uint16_t i;
+    for (i = 0; i < len; i++){
+        writer_byte(writer, (uint8_t) string[i]);
+    }
+}
+
+static void writer_float(emulator_writer_t * writer, float value){
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    writer_byte(writer, 0xca);
+    writer_byte(writer, (uint8_t)(bits >> 24));
+    writer_byte(writer, (uint8_t)(bits >> 16));
+    writer_byte(writer, (uint8_t)(bits >> 8));
+    writer_byte(writer, (uint8_t) bits);
+}
+
+static void writer_bool(emulator_writer_t * writer, bool value){
+    writer_byte(writer, value ? 0xc3 : 0xc2);
+}
+
+static uint16_t emulator_encode_preset(const emulator_preset_t * preset, uint8_t preset_type, uint8_t preset_number, uint8_t * buffer, uint16_t size){
+    emulator_writer_t writer = { buffer, size, 0 };
+    writer_byte(&writer, preset_type);
+    writer_byte(&writer, preset_number);
+    writer_long_string(&writer, preset->uuid);
+    writer_string(&writer, preset->name);
+    writer_string(&writer, "0.7");
+    writer_string(&writer, preset->description);
+    writer_string(&writer, "icon.png");
+    writer_float(&writer, preset->bpm);
+    writer_byte(&writer, 0x90 | EMULATOR_NUM_EFFECTS);
+    uint8_t i;
+    for (i = 0; i < EMULATOR_NUM_EFFECTS; i++){
+        const emulator_effect_t * effect = &preset->effects[i];
+        writer_string(&writer, effect->name);
+        writer_bool(&writer, effect->on);
+        writer_byte(&writer, 0x90 | effect->num_parameters);
+        uint8_t j;
+        for (j = 0; j < effect->num_parameters; j++){
+            writer_byte(&writer, j);
+            writer_byte(&writer, 0x91);
+            writer_float(&writer, effect->parameters[j]);
+        }
+    }
+    uint8_t checksum = 0;
+    uint16_t pos;
+    for (pos = 0; pos < writer.len; pos++){
+        checksum ^= buffer[pos];
+    }
+    writer_byte(&writer, checksum);
+    return writer.len;
+}
+
+// payload reader
+
+static bool reader_string(const uint8_t * payload, uint16_t payload_len, uint16_t * pos, char * string, uint16_t size){
+    if (*pos >= payload_len) return false;
+    uint8_t marker = payload[(*pos)++];
+    uint16_t len;
+    if ((marker & 0xe0) == 0xa0){
+        len = marker & 0x1f;
+    } else if ((marker == 0xd9) && (*pos < payload_len)){
+        len = payload[(*pos)++];
+    } else {
+        return false;
+    }
+    if (((*pos + len) > payload_len) || (len >= size)) return false;
+    memcpy(string, &payload[*pos], len);
+    string[len] = 0;
+    *pos += len;
+    return true;
+}
+
+static bool reader_float(const uint8_t * payload, uint16_t payload_len, uint16_t * pos, float * value){
+    if (((*pos + 5) > payload_len) || (payload[*pos] != 0xca)) return false;
+    uint32_t bits = big_endian_read_32(payload, *pos + 1);
+    memcpy(value, &bits, sizeof(bits));
+    *pos += 5;
+    return true;
+}
+
+static emulator_effect_t * emulator_find_effect(emulator_amp_t * amp, const char * name){
+    uint8_t i;
+    for (i = 0; i < EMULATOR_NUM_EFFECTS; i++){
+        if (strcmp(amp->current.effects[i].name, name) == 0) return &amp->current.effects[i];
+    }
+    return NULL;
+}
+
+static emulator_amp_t * emulator_get_amp(uint8_t index){
+    if (index >= emulator_num_amps) return NULL;
+    return &emulator_amps[index];
+}
+
+// packet loss
+
+static bool emulator_packet_lost(void){
+    if (emulator_loss_percent == 0) return false;
+    // xorshift32
+    emulator_random_state ^= emulator_random_state << 13;
+    emulator_random_state ^= emulator_random_state >> 17;
+    emulator_random_state ^= emulator_random_state << 5;
+    return (emulator_random_state % 100) < emulator_loss_percent;
+}
+
+// transmit path
+
+static uint32_t emulator_connection_event_ms(const emulator_amp_t * amp){
+    // connection interval in 1.25 ms units, rounded up
+    return (mock_btstack_get_conn_interval(amp->index) * 5u + 3u) / 4u;
+}
+
+static void emulator_tx_flush(emulator_amp_t * amp){
+    emulator_fragment_t * fragment;
+    while ((fragment = (emulator_fragment_t *) btstack_linked_list_pop(&amp->tx_fragments)) != NULL){
+        free(fragment);
+    }
+    btstack_run_loop_remove_timer(&amp->tx_timer);
+    amp->tx_active = false;
+}
+
+static void emulator_tx_timeout(btstack_timer_source_t * ts){
+    emulator_amp_t * amp = (emulator_amp_t *) btstack_run_loop_get_timer_context(ts);
+    // notifications have to fit into the connection event, at least one is sent
+    uint32_t budget_us = mock_btstack_get_conn_interval(amp->index) * 1250u;
+    uint32_t air_time_us = 0;
+    uint8_t sent;
+    amp->stats.connection_events++;
+    for (sent = 0; sent < emulator_per_event; sent++){
+        emulator_fragment_t * fragment = (emulator_fragment_t *) btstack_linked_list_get_first_item(&amp->tx_fragments);
+        if (fragment == NULL) break;
+        air_time_us += mock_btstack_get_notification_air_time_us(amp->index, fragment->len);
+        if ((sent > 0) && (air_time_us > budget_us)) break;
+        btstack_linked_list_pop(&amp->tx_fragments);
+        if (emulator_packet_lost()){
+            amp->stats.notifications_lost++;
+        } else if (mock_btstack_inject_notification(amp->index, fragment->data, fragment->len)){
+            amp->stats.notifications++;
+            amp->stats.notification_bytes += fragment->len;
+        }
+        free(fragment);
+    }
+    if (btstack_linked_list_empty(&amp->tx_fragments)){
+        amp->tx_active = false;
+        return;
+    }
+    btstack_run_loop_set_timer(ts, emulator_connection_event_ms(amp));
+    btstack_run_loop_add_timer(ts);
+}
+
+static void emulator_tx_start(emulator_amp_t * amp){
+    if (amp->tx_active) return;
+    amp->tx_active = true;
+    // data is sent in the next connection event of this amp
+    btstack_run_loop_set_timer_handler(&amp->tx_timer, &emulator_tx_timeout);
+    btstack_run_loop_set_timer_context(&amp->tx_timer, amp);
+    btstack_run_loop_set_timer(&amp->tx_timer, mock_btstack_get_next_connection_event_ms(amp->index));
+    btstack_run_loop_add_timer(&amp->tx_timer);
+}
+
+static void emulator_queue_block(emulator_amp_t * amp, const uint8_t * block, uint16_t block_len){
+    uint16_t fragment_size = mock_btstack_get_mtu(amp->index) - 3;
+    if ((emulator_fragment_size > 0) && (emulator_fragment_size < fragment_size)){
+        fragment_size = emulator_fragment_size;
+    }
+    uint16_t pos;
+    for (pos = 0; pos < block_len; pos += fragment_size){
+        uint16_t len = btstack_min(fragment_size, block_len - pos);
+        emulator_fragment_t * fragment = (emulator_fragment_t *) malloc(sizeof(emulator_fragment_t) + len);
+        if (fragment == NULL) return;
+        fragment->len = len;
+        memcpy(fragment->data, &block[pos], len);
+        btstack_linked_list_add_tail(&amp->tx_fragments, (btstack_linked_item_t *) fragment);
+    }
+}
+
+static void emulator_queue_message(emulator_amp_t * amp, uint8_t command, uint8_t sub_command, uint8_t sequence,
+                                   const uint8_t * payload, uint16_t payload_len){
+    static uint8_t stream[EMULATOR_MAX_STREAM];
+    spark_writer_t writer;
+    spark_writer_init(&writer, stream, sizeof(stream), SPARK_DIRECTION_FROM_AMP, SPARK_BLOCK_MAX_LEN_FROM_AMP);
+    if (!spark_writer_add_message(&writer, command, sub_command, sequence, payload, payload_len)){
+        printf("[!] Emulator %u: response %02x/%02x too large\n", amp->index, command, sub_command);
+        return;
+    }
+
+    // queue blocks, block length is stored in its header
+    uint16_t stream_len = spark_writer_get_len(&writer);
+    uint16_t pos = 0;
+    while (pos < stream_len){
+        uint16_t block_len = stream[pos + 6];
+        emulator_queue_block(amp, &stream[pos], block_len);
+        pos += block_len;
+    }
+
+    amp->stats.responses++;
+    emulator_tx_start(amp);
+}
+
+static void emulator_pending_timeout(btstack_timer_source_t * ts){
+    emulator_pending_t * pending = (emulator_pending_t *) btstack_run_loop_get_timer_context(ts);
+    emulator_amp_t * amp = pending->amp;
+    btstack_linked_list_remove(&amp->pending_responses, (btstack_linked_item_t *) pending);
+    emulator_queue_message(amp, pending->command, pending->sub_command, pending->sequence, pending->payload, pending->payload_len);
+    free(pending);
+}
+
+static void emulator_respond(emulator_amp_t * amp, uint8_t command, uint8_t sub_command, uint8_t sequence,
+                             const uint8_t * payload, uint16_t payload_len){
+    if (emulator_response_delay_ms == 0){
+        emulator_queue_message(amp, command, sub_command, sequence, payload, payload_len);
+        return;
+    }
+    emulator_pending_t * pending = (emulator_pending_t *) malloc(sizeof(emulator_pending_t) + payload_len);
+    if (pending == NULL) return;
+    pending->amp         = amp;
+    pending->command     = command;
+    pending->sub_command = sub_command;
+    pending->sequence    = sequence;
+    pending->payload_len = payload_len;
+    memcpy(pending->payload, payload, payload_len);
+    btstack_linked_list_add_tail(&amp->pending_responses, (btstack_linked_item_t *) pending);
+    btstack_run_loop_set_timer_handler(&pending->timer, &emulator_pending_timeout);
+    btstack_run_loop_set_timer_context(&pending->timer, pending);
+    btstack_run_loop_set_timer(&pending->timer, emulator_response_delay_ms);
+    btstack_run_loop_add_timer(&pending->timer);
+}
+
+static void emulator_pending_flush(emulator_amp_t * amp){
+    emulator_pending_t * pending;
+    while ((pending = (emulator_pending_t *) btstack_linked_list_pop(&amp->pending_responses)) != NULL){
+        btstack_run_loop_remove_timer(&pending->timer);
+        free(pending);
+    }
+}
+
+static uint8_t emulator_next_sequence(emulator_amp_t * amp){
+    amp->sequence = (amp->sequence + 1) & 0x7f;
+    return amp->sequence;
+}
+
+// command handling
+
+static void emulator_change_preset(emulator_amp_t * amp, uint8_t preset){
+    amp->current_preset = preset;
+    amp->current = amp->presets[preset];
+    amp->upload_len = 0;
+}
+
+static void emulator_send_preset(emulator_amp_t * amp, uint8_t sequence, uint8_t preset_type, uint8_t preset_number){
+    static uint8_t payload[EMULATOR_MAX_PAYLOAD];
+    uint16_t len;
+    if (preset_type == EMULATOR_PRESET_TYPE_CURRENT){
+        if (amp->upload_len > 0){
+            memcpy(payload, amp->upload, amp->upload_len);
+            payload[0] = EMULATOR_PRESET_TYPE_CURRENT;
+            emulator_respond(amp, SPARK_CMD_RESPONSE, SPARK_SUB_PRESET, sequence, payload, amp->upload_len);
+            return;
+        }
+        len = emulator_encode_preset(&amp->current, preset_type, amp->current_preset, payload, sizeof(payload));
+    } else {
+        if (preset_number >= SPARK_EMULATOR_NUM_PRESETS) return;
+        len = emulator_encode_preset(&amp->presets[preset_number], preset_type, preset_number, payload, sizeof(payload));
+    }
+    emulator_respond(amp, SPARK_CMD_RESPONSE, SPARK_SUB_PRESET, sequence, payload, len);
+}
+
+static void emulator_handle_write(emulator_amp_t * amp, const spark_message_t * message){
+    char name[32];
+    uint16_t pos = 0;
+    emulator_effect_t * effect;
+    uint8_t parameter;
+    float value;
+    switch (message->sub_command){
+        case SPARK_SUB_SELECT_PRESET:
+            if ((message->payload_len < 2) || (message->payload[1] >= SPARK_EMULATOR_NUM_PRESETS)) return;
+            emulator_change_preset(amp, message->payload[1]);
+            break;
+        case SPARK_SUB_PRESET:
+            if ((message->payload_len < 2) || (message->payload_len > sizeof(amp->upload))) return;
+            memcpy(amp->upload, message->payload, message->payload_len);
+            amp->upload_len = message->payload_len;
+            break;
+        case SPARK_SUB_EFFECT_ONOFF:
+            if (!reader_string(message->payload, message->payload_len, &pos, name, sizeof(name))) return;
+            if (pos >= message->payload_len) return;
+            effect = emulator_find_effect(amp, name);
+            if (effect == NULL) return;
+            effect->on = message->payload[pos] == 0xc3;
+            break;
+        case SPARK_SUB_EFFECT_PARAMETER:
+            if (!reader_string(message->payload, message->payload_len, &pos, name, sizeof(name))) return;
+            if (pos >= message->payload_len) return;
+            effect = emulator_find_effect(amp, name);
+            if (effect == NULL) return;
+            parameter = message->payload[pos++];
+            if (parameter >= effect->num_parameters) return;
+            if (!reader_float(message->payload, message->payload_len, &pos, &value)) return;
+            effect->parameters[parameter] = value;
+            break;
+        default:
+            return;
+    }
+    emulator_respond(amp, SPARK_CMD_ACK, message->sub_command, message->sequence, NULL, 0);
+}
+
+static void emulator_handle_request(emulator_amp_t * amp, const spark_message_t * message){
+    uint8_t payload[2 + sizeof(emulator_serial_number)];
+    emulator_writer_t writer = { payload, sizeof(payload), 0 };
+    switch (message->sub_command){
+        case SPARK_SUB_PRESET:
+            if (message->payload_len < 2) return;
+            emulator_send_preset(amp, message->sequence, message->payload[0], message->payload[1]);
+            break;
+        case SPARK_SUB_CURRENT_PRESET:
+            writer_byte(&writer, 0x00);
+            writer_byte(&writer, amp->current_preset);
+            emulator_respond(amp, SPARK_CMD_RESPONSE, message->sub_command, message->sequence, payload, writer.len);
+            break;
+        case SPARK_SUB_HARDWARE_ID:
+            writer_string(&writer, emulator_serial_number);
+            emulator_respond(amp, SPARK_CMD_RESPONSE, message->sub_command, message->sequence, payload, writer.len);
+            break;
+        default:
+            break;
+    }
+}
+
+static void emulator_handle_message(void * context, const spark_message_t * message){
+    emulator_amp_t * amp = (emulator_amp_t *) context;
+    if (message->direction != SPARK_DIRECTION_TO_AMP) return;
+    amp->stats.messages++;
+    switch (message->command){
+        case SPARK_CMD_WRITE:
+            emulator_handle_write(amp, message);
+            break;
+        case SPARK_CMD_REQUEST:
+            emulator_handle_request(amp, message);
+            break;
+        default:
+            break;
+    }
+}
+
+static void emulator_write_handler(uint8_t index, uint16_t value_handle, const uint8_t * data, uint16_t len){
+    UNUSED(value_handle);
+    emulator_amp_t * amp = emulator_get_amp(index);
+    if (amp == NULL) return;
+    amp->stats.writes++;
+    if (emulator_packet_lost()){
+        amp->stats.writes_lost++;
+        return;
+    }
+    spark_reader_process(&amp->reader, data, len);
+}
+
+static void emulator_connection_handler(uint8_t index, bool connected){
+    emulator_amp_t * amp = emulator_get_amp(index);
+    if (amp == NULL) return;
+    spark_reader_reset(&amp->reader);
+    emulator_tx_flush(amp);
+    emulator_pending_flush(amp);
+    if (connected){
+        amp->stats.connections++;
+    }
+}
+
+// knobs
+
+static void emulator_send_burst(emulator_amp_t * amp, uint8_t count){
+    if (!mock_btstack_notifications_enabled(amp->index)) return;
+    // amp knob turned: report changes of the amp parameters
+    emulator_effect_t * effect = &amp->current.effects[3];
+    uint8_t i;
+    for (i = 0; i < count; i++){
+        uint8_t payload[40];
+        emulator_writer_t writer = { payload, sizeof(payload), 0 };
+        uint8_t parameter = i % effect->num_parameters;
+        effect->parameters[parameter] = (float)(emulator_random_state % 1000) / 1000.0f;
+        emulator_random_state = emulator_random_state * 1103515245u + 12345u;
+        writer_string(&writer, effect->name);
+        writer_byte(&writer, parameter);
+        writer_float(&writer, effect->parameters[parameter]);
+        emulator_queue_message(amp, SPARK_CMD_RESPONSE, SPARK_SUB_PARAMETER_CHANGED, emulator_next_sequence(amp), payload, writer.len);
+    }
+    amp->stats.bursts++;
+}
+
+static void emulator_burst_timeout(btstack_timer_source_t * ts){
+    if (emulator_burst_count == 0) return;
+    uint8_t index;
+    for (index = 0; index < emulator_num_amps; index++){
+        emulator_send_burst(&emulator_amps[index], emulator_burst_count);
+    }
+    btstack_run_loop_set_timer(ts, emulator_burst_period_ms);
+    btstack_run_loop_add_timer(ts);
+}
+
+static void emulator_power_on(btstack_timer_source_t * ts){
+    emulator_amp_t * amp = (emulator_amp_t *) btstack_run_loop_get_timer_context(ts);
+    printf("[-] Emulator %u: power on\n", amp->index);
+    mock_btstack_set_amp(amp->index, amp->addr, BD_ADDR_TYPE_LE_PUBLIC, true);
+}
+
+void spark_emulator_init(uint8_t num_amps, const bd_addr_t base_addr){
+    emulator_num_amps          = btstack_max(1, btstack_min(num_amps, SPARK_EMULATOR_MAX_AMPS));
+    emulator_response_delay_ms = 0;
+    emulator_fragment_size     = 0;
+    emulator_per_event         = EMULATOR_DEFAULT_PER_EVENT;
+    emulator_loss_percent      = 0;
+    emulator_random_state      = 1;
+    emulator_burst_count       = 0;
+
+    mock_btstack_register_write_handler(&emulator_write_handler);
+    mock_btstack_register_connection_handler(&emulator_connection_handler);
+
+    memset(emulator_amps, 0, sizeof(emulator_amps));
+    uint8_t index;
+    for (index = 0; index < emulator_num_amps; index++){
+        emulator_amp_t * amp = &emulator_amps[index];
+        amp->index = index;
+        bd_addr_copy(amp->addr, base_addr);
+        amp->addr[5] += index;
+        memcpy(amp->presets, emulator_default_presets, sizeof(amp->presets));
+        emulator_change_preset(amp, 0);
+        spark_reader_init(&amp->reader, &emulator_handle_message, amp);
+        mock_btstack_set_amp(index, amp->addr, BD_ADDR_TYPE_LE_PUBLIC, true);
+    }
+}
+
+void spark_emulator_set_response_delay(uint32_t delay_ms){
+    emulator_response_delay_ms = delay_ms;
+}
+
+void spark_emulator_set_fragment_size(uint16_t len){
+    emulator_fragment_size = len;
+}
+
+void spark_emulator_set_notifications_per_event(uint8_t count){
+    emulator_per_event = (count > 0) ? count : 1;
+}
+
+void spark_emulator_set_burst(uint8_t count, uint32_t period_ms){
+    emulator_burst_count     = count;
+    emulator_burst_period_ms = period_ms;
+    btstack_run_loop_remove_timer(&emulator_burst_timer);
+    if ((count == 0) || (period_ms == 0)) return;
+    btstack_run_loop_set_timer_handler(&emulator_burst_timer, &emulator_burst_timeout);
+    btstack_run_loop_set_timer(&emulator_burst_timer, period_ms);
+    btstack_run_loop_add_timer(&emulator_burst_timer);
+}
+
+void spark_emulator_set_loss(uint8_t percent, uint32_t seed){
+    emulator_loss_percent = btstack_min(percent, 100);
+    emulator_random_state = (seed != 0) ? seed : 1;
+}
+
+uint8_t spark_emulator_get_num_amps(void){
+    return emulator_num_amps;
+}
+
+void spark_emulator_burst(uint8_t index, uint8_t count){
+    emulator_amp_t * amp = emulator_get_amp(index);
+    if (amp == NULL) return;
+    emulator_send_burst(amp, count);
+}
+
+void spark_emulator_power_cycle(uint8_t index, uint32_t off_ms){
+    emulator_amp_t * amp = emulator_get_amp(index);
+    if (amp == NULL) return;
+    printf("[-] Emulator %u: power off for %u ms\n", index, off_ms);
+    amp->stats.power_cycles++;
+    mock_btstack_set_amp(index, amp->addr, BD_ADDR_TYPE_LE_PUBLIC, false);
+    emulator_change_preset(amp, 0);
+    btstack_run_loop_remove_timer(&amp->power_timer);
+    btstack_run_loop_set_timer_handler(&amp->power_timer, &emulator_power_on);
+    btstack_run_loop_set_timer_context(&amp->power_timer, amp);
+    btstack_run_loop_set_timer(&amp->power_timer, off_ms);
+    btstack_run_loop_add_timer(&amp->power_timer);
+}
+
+void spark_emulator_select_preset(uint8_t index, uint8_t preset){
+    emulator_amp_t * amp = emulator_get_amp(index);
+    if ((amp == NULL) || (preset >= SPARK_EMULATOR_NUM_PRESETS)) return;
+    emulator_change_preset(amp, preset);
+    if (!mock_btstack_notifications_enabled(index)) return;
+    uint8_t payload[2] = { 0x00, preset };
+    emulator_queue_message(amp, SPARK_CMD_RESPONSE, SPARK_SUB_SELECT_PRESET, emulator_next_sequence(amp), payload, sizeof(payload));
+}
+
+uint8_t spark_emulator_get_preset(uint8_t index){
+    emulator_amp_t * amp = emulator_get_amp(index);
+    return (amp != NULL) ? amp->current_preset : 0;
+}
+
+const spark_emulator_stats_t * spark_emulator_get_stats(uint8_t index){
+    emulator_amp_t * amp = emulator_get_amp(index);
+    return (amp != NULL) ? &amp->stats : NULL;
+}
+
+void spark_emulator_dump_stats(void){
+    uint8_t index;
+    for (index = 0; index < emulator_num_amps; index++){
+        const emulator_amp_t * amp = &emulator_amps[index];
+        const spark_emulator_stats_t * stats = &amp->stats;
+        printf("[-] Emulator %u: connections %u, power cycles %u, writes %u (lost %u), messages %u, responses %u, preset %u\n",
+               index, stats->connections, stats->power_cycles, stats->writes, stats->writes_lost,
+               stats->messages, stats->responses, amp->current_preset);
+        printf("[-] Emulator %u: notifications %u (lost %u), %u bytes in %u connection events, bursts %u, reader resyncs %u, checksum errors %u, dropped %u\n",
+               index, stats->notifications, stats->notifications_lost, stats->notification_bytes,
+               stats->connection_events,
+               stats->bursts, amp->reader.stats.resyncs, amp->reader.stats.checksum_errors,
+               amp->reader.stats.dropped);
+    }
+}
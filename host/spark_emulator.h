@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  spark_emulator.h
+ *
+ *  Software Spark 40 amps on top of the mock HCI/GATT layer. Each emulated amp decodes the commands written by the pedal,
+ *  keeps four hardware presets and answers with the messages of a real amp: acknowledgements, current preset,
+ *  preset details as multi-chunk message and hardware ID. Responses are split into blocks and notifications
+ *  and sent with a limited number of notifications per connection event of its own connection.
+ *
+ *  Knobs for adverse conditions: response delay, unsolicited notification bursts, packet loss and power cycles.
+ */
+
+#ifndef SPARK_EMULATOR_H
+#define SPARK_EMULATOR_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "btstack.h"
+#include "mock_btstack.h"
+
+#define SPARK_EMULATOR_NUM_PRESETS      4
+#define SPARK_EMULATOR_MAX_AMPS         MOCK_BTSTACK_MAX_AMPS
+
+typedef struct {
+    uint32_t writes;
+    uint32_t writes_lost;
+    uint32_t messages;
+    uint32_t responses;
+    uint32_t notifications;
+    uint32_t notifications_lost;
+    uint32_t notification_bytes;
+    uint32_t connection_events;
+    uint32_t bursts;
+    uint32_t power_cycles;
+    uint32_t connections;
+} spark_emulator_stats_t;
+
+/* API_START */
+
+/**
+ * @brief Init emulator and announce amps to the mock. Call after mock_btstack_init
+ * @param num_amps up to SPARK_EMULATOR_MAX_AMPS
+ * @param base_addr of first amp, last byte is incremented for further amps
+ */
+void spark_emulator_init(uint8_t num_amps, const bd_addr_t base_addr);
+
+/**
+ * @brief Get number of emulated amps
+ * @return num_amps
+ */
+uint8_t spark_emulator_get_num_amps(void);
+
+/**
+ * @brief Set delay between receiving a command and queuing its response for all amps, default: 0 ms
+ * @param delay_ms
+ */
+void spark_emulator_set_response_delay(uint32_t delay_ms);
+
+/**
+ * @brief Limit size of notifications, default: 0 = ATT MTU - 3
+ * @param len
+ */
+void spark_emulator_set_fragment_size(uint16_t len);
+
+/**
+ * @brief Set max number of notifications sent per connection event, default: 4. Fewer are sent if
+ *        their air time exceeds the connection interval
+ * @param count
+ */
+void spark_emulator_set_notifications_per_event(uint8_t count);
+
+/**
+ * @brief Send bursts of unsolicited parameter change messages, e.g. knobs turned on the amp
+ * @param count messages per burst, 0 to disable
+ * @param period_ms between bursts
+ */
+void spark_emulator_set_burst(uint8_t count, uint32_t period_ms);
+
+/**
+ * @brief Send a single burst of parameter change messages now, if the pedal is connected
+ * @param amp index
+ * @param count messages
+ */
+void spark_emulator_burst(uint8_t amp, uint8_t count);
+
+/**
+ * @brief Drop writes and notifications
+ * @param percent of packets lost
+ * @param seed for pseudo-random generator
+ */
+void spark_emulator_set_loss(uint8_t percent, uint32_t seed);
+
+/**
+ * @brief Turn amp off and on again
+ * @param amp index
+ * @param off_ms
+ */
+void spark_emulator_power_cycle(uint8_t amp, uint32_t off_ms);
+
+/**
+ * @brief Select preset on the amp, reported to the pedal
+ * @param amp index
+ * @param preset
+ */
+void spark_emulator_select_preset(uint8_t amp, uint8_t preset);
+
+/**
+ * @brief Get current preset
+ * @param amp index
+ * @return preset
+ */
+uint8_t spark_emulator_get_preset(uint8_t amp);
+
+/**
+ * @brief Get statistics
+ * @param amp index
+ * @return stats or NULL for unknown amp
+ */
+const spark_emulator_stats_t * spark_emulator_get_stats(uint8_t amp);
+
+/**
+ * @brief Print statistics of all amps
+ */
+void spark_emulator_dump_stats(void);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // SPARK_EMULATOR_H
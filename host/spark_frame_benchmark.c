@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "spark_frame_benchmark.c"
+
+/*
+ *  spark_frame_benchmark.c
+ *
+ *  Compares the ways to build outgoing Spark frames: the former memcpy of prefix, length, middle and
+ *  pre-packed command into a new buffer, patching a short frame in place and encoding with spark_writer,
+ *  including a multi-chunk preset upload encoded on demand or copied from a prefetched frame. Reports frames
+ *  per second and bytes written per frame and checks each frame with spark_reader.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spark_protocol.h"
+
+#define BENCHMARK_DEFAULT_ITERATIONS    1000000
+#define BENCHMARK_PRESET_PAYLOAD_LEN    640
+#define BENCHMARK_LARGE_FRAME_LEN       1536
+
+typedef struct {
+    const char * name;
+    // returns frame, either in buffer or kept by the method
+    const uint8_t * (*build)(uint8_t * buffer, uint32_t iteration, uint16_t * len);
+    uint8_t      command;
+    uint8_t      sub_command;
+    const uint8_t * payload;
+    uint16_t     payload_len;
+} benchmark_t;
+
+static uint8_t  preset_payload[BENCHMARK_PRESET_PAYLOAD_LEN];
+static uint8_t  select_payload[] = { 0x00, 0x01 };
+static uint8_t  short_frame[SPARK_SHORT_FRAME_MAX_LEN];
+static uint16_t short_frame_len;
+static uint8_t  prefetched_frame[BENCHMARK_LARGE_FRAME_LEN];
+static uint16_t prefetched_frame_len;
+
+static uint8_t  verify_payload[BENCHMARK_PRESET_PAYLOAD_LEN];
+static uint16_t verify_payload_len;
+static uint8_t  verify_command;
+static uint8_t  verify_sub_command;
+static uint32_t verify_messages;
+
+static uint64_t time_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+// send_command before the frame builder: pre-packed command, constant sequence and checksum
+static const uint8_t * build_legacy(uint8_t * buffer, uint32_t iteration, uint16_t * frame_len){
+    static const uint8_t prefix[] = { 0x01, 0xFE, 0x00, 0x00, 0x53, 0xFE };
+    static const uint8_t middle[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0, 0x00, 0xf0, 0x01, 0x01, 0x01 };
+    uint8_t command[] = { 0x01, 0x38, 0x00, 0x00, 0x01 };
+    select_payload[1] = (uint8_t)(iteration & 0x03);
+    command[4] = select_payload[1];
+    uint8_t message[100];
+    uint16_t len = sizeof(prefix) + 1 + sizeof(middle) + sizeof(command) + 1;
+    uint16_t pos = 0;
+    memcpy(&message[pos], prefix, sizeof(prefix));
+    pos += sizeof(prefix);
+    message[pos++] = len;
+    memcpy(&message[pos], middle, sizeof(middle));
+    pos += sizeof(middle);
+    memcpy(&message[pos], command, sizeof(command));
+    pos += sizeof(command);
+    message[pos++] = 0xf7;
+    // queued copy
+    memcpy(buffer, message, len);
+    *frame_len = len;
+    return buffer;
+}
+
+static const uint8_t * build_short_frame(uint8_t * buffer, uint32_t iteration, uint16_t * frame_len){
+    (void) buffer;
+    select_payload[1] = (uint8_t)(iteration & 0x03);
+    spark_short_frame_patch(short_frame, (uint8_t)(iteration & 0x7f), select_payload, sizeof(select_payload));
+    *frame_len = short_frame_len;
+    return short_frame;
+}
+
+static const uint8_t * build_writer_select(uint8_t * buffer, uint32_t iteration, uint16_t * frame_len){
+    select_payload[1] = (uint8_t)(iteration & 0x03);
+    spark_writer_t writer;
+    spark_writer_init(&writer, buffer, SPARK_BLOCK_MAX_LEN_TO_AMP, SPARK_DIRECTION_TO_AMP, SPARK_BLOCK_MAX_LEN_TO_AMP);
+    spark_writer_add_message(&writer, SPARK_CMD_WRITE, SPARK_SUB_SELECT_PRESET, (uint8_t)(iteration & 0x7f), select_payload, sizeof(select_payload));
+    *frame_len = spark_writer_get_len(&writer);
+    return buffer;
+}
+
+static const uint8_t * build_writer_preset(uint8_t * buffer, uint32_t iteration, uint16_t * frame_len){
+    spark_writer_t writer;
+    spark_writer_init(&writer, buffer, BENCHMARK_LARGE_FRAME_LEN, SPARK_DIRECTION_TO_AMP, SPARK_BLOCK_MAX_LEN_TO_AMP);
+    spark_writer_add_message(&writer, SPARK_CMD_WRITE, SPARK_SUB_PRESET, (uint8_t)(iteration & 0x7f), preset_payload, sizeof(preset_payload));
+    *frame_len = spark_writer_get_len(&writer);
+    return buffer;
+}
+
+// preset bank switch: frame was encoded ahead of time, only the sequence changes
+static const uint8_t * build_prefetched_preset(uint8_t * buffer, uint32_t iteration, uint16_t * frame_len){
+    memcpy(buffer, prefetched_frame, prefetched_frame_len);
+    spark_frame_patch_sequence(buffer, prefetched_frame_len, (uint8_t)(iteration & 0x7f));
+    *frame_len = prefetched_frame_len;
+    return buffer;
+}
+
+static void verify_handler(void * context, const spark_message_t * message){
+    (void) context;
+    verify_messages++;
+    verify_command     = message->command;
+    verify_sub_command = message->sub_command;
+    verify_payload_len = message->payload_len;
+    memcpy(verify_payload, message->payload, message->payload_len);
+}
+
+static bool verify(const benchmark_t * benchmark, const uint8_t * frame, uint16_t len, uint32_t * checksum_errors){
+    spark_reader_t reader;
+    spark_reader_init(&reader, &verify_handler, NULL);
+    verify_messages = 0;
+    spark_reader_process(&reader, frame, len);
+    *checksum_errors = reader.stats.checksum_errors;
+    if (verify_messages != 1) return false;
+    if ((verify_command != benchmark->command) || (verify_sub_command != benchmark->sub_command)) return false;
+    if (verify_payload_len != benchmark->payload_len) return false;
+    return memcmp(verify_payload, benchmark->payload, verify_payload_len) == 0;
+}
+
+int main(int argc, char * argv[]){
+    uint32_t iterations = BENCHMARK_DEFAULT_ITERATIONS;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:h")) != -1){
+        switch (opt){
+            case 'n':
+                iterations = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            default:
+                printf("Usage: %s [-n iterations]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (iterations == 0){
+        iterations = 1;
+    }
+
+    // synthetic preset, includes bytes with MSB set
+    uint16_t i;
+    for (i = 0; i < sizeof(preset_payload); i++){
+        preset_payload[i] = (uint8_t)(i * 37 + 11);
+    }
+    short_frame_len = spark_short_frame_init(short_frame, SPARK_DIRECTION_TO_AMP, SPARK_CMD_WRITE, SPARK_SUB_SELECT_PRESET, sizeof(select_payload));
+    build_writer_preset(prefetched_frame, 0, &prefetched_frame_len);
+
+    const benchmark_t benchmarks[] = {
+        { "select: legacy memcpy",   &build_legacy,            SPARK_CMD_WRITE, SPARK_SUB_SELECT_PRESET, select_payload, sizeof(select_payload) },
+        { "select: short frame",     &build_short_frame,       SPARK_CMD_WRITE, SPARK_SUB_SELECT_PRESET, select_payload, sizeof(select_payload) },
+        { "select: writer",          &build_writer_select,     SPARK_CMD_WRITE, SPARK_SUB_SELECT_PRESET, select_payload, sizeof(select_payload) },
+        { "preset upload: writer",   &build_writer_preset,     SPARK_CMD_WRITE, SPARK_SUB_PRESET,        preset_payload, sizeof(preset_payload) },
+        { "preset upload: prefetch", &build_prefetched_preset, SPARK_CMD_WRITE, SPARK_SUB_PRESET,        preset_payload, sizeof(preset_payload) },
+    };
+
+    printf("Spark frame builder, %u iterations\n", iterations);
+    printf("%-24s %12s %10s %12s %8s %10s %s\n", "", "frames/s", "frame len", "bytes/frame", "blocks", "checksum", "decoded");
+    static uint8_t buffer[BENCHMARK_LARGE_FRAME_LEN];
+    uint8_t b;
+    for (b = 0; b < sizeof(benchmarks) / sizeof(benchmark_t); b++){
+        const benchmark_t * benchmark = &benchmarks[b];
+        const uint8_t * frame;
+        uint32_t iteration;
+        uint32_t sink = 0;
+        uint16_t len = 0;
+        uint64_t start_ns = time_ns();
+        for (iteration = 0; iteration < iterations; iteration++){
+            frame = (*benchmark->build)(buffer, iteration, &len);
+            sink += frame[len - 2];
+        }
+        uint64_t duration_ns = time_ns() - start_ns;
+        if (duration_ns == 0){
+            duration_ns = 1;
+        }
+
+        // build once more with payload used for verification
+        uint32_t last = iterations - 1;
+        frame = (*benchmark->build)(buffer, last, &len);
+        uint32_t checksum_errors = 0;
+        bool decoded = verify(benchmark, frame, len, &checksum_errors);
+
+        // legacy builds the frame on the stack and copies it into the queue, the short frame only updates
+        // sequence, checksum, MSBs and payload, the writer stores each byte once
+        uint16_t bytes_per_frame;
+        if (benchmark->build == &build_legacy){
+            bytes_per_frame = 2 * len;
+        } else if (benchmark->build == &build_short_frame){
+            bytes_per_frame = 3 + benchmark->payload_len;
+        } else {
+            bytes_per_frame = len;
+        }
+        uint16_t blocks = 0;
+        uint16_t pos = 0;
+        while (pos < len){
+            blocks++;
+            pos += frame[pos + 6];
+        }
+        printf("%-24s %12.0f %10u %12u %8u %10s %s\n", benchmark->name, (double) iterations * 1e9 / (double) duration_ns,
+               len, bytes_per_frame, blocks, (checksum_errors == 0) ? "ok" : "constant", decoded ? "ok" : "FAILED");
+        if (sink == 0xffffffff){
+            printf("\n");
+        }
+    }
+    return 0;
+}
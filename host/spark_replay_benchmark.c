@@ -0,0 +1,775 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "spark_replay_benchmark.c"
+
+/*
+ *  spark_replay_benchmark.c
+ *
+ *  Replays Spark traffic at host speed through the receive path of the pedal, i.e. spark_reader and
+ *  spark_amp_state as used by process_update, and through the frame stage of send_command, i.e. short
+ *  frame patching and spark_writer. Built-in scenarios cover an app sync burst, rapid preset switching and
+ *  malformed frames; captured traffic can be added from PacketLogger files (hci_dump_posix_fs) or from text
+ *  logs with hci_dump_embedded_stdout packets or the RX/TX hexdumps of the trace log. Reports ns/message,
+ *  bytes/s and heap allocations. Decoded messages, reader errors and allocations are compared against a stored
+ *  baseline and fail on a mismatch; timing depends on the machine and is only reported relative to the baseline.
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spark_protocol.h"
+#include "spark_amp_state.h"
+
+#define REPLAY_DEFAULT_PASSES       200
+
+// runs per scenario, the fastest one counts as it is least disturbed by other processes
+#define REPLAY_REPEATS              5
+#define REPLAY_MAX_SCENARIOS        8
+#define REPLAY_MAX_RECORDS          4096
+#define REPLAY_DATA_SIZE            (256 * 1024)
+#define REPLAY_LARGE_FRAME_LEN      1536
+
+// default ATT MTU 23
+#define REPLAY_NOTIFICATION_LEN     20
+
+#define REPLAY_RX                   0
+#define REPLAY_TX                   1
+
+// ATT opcodes
+#define REPLAY_ATT_WRITE_REQUEST    0x12
+#define REPLAY_ATT_NOTIFICATION     0x1b
+#define REPLAY_ATT_WRITE_COMMAND    0x52
+
+// RX: notification data, TX: decoded message to build
+typedef struct {
+    uint8_t  direction;
+    uint8_t  command;
+    uint8_t  sub_command;
+    uint8_t  sequence;
+    uint32_t offset;
+    uint16_t len;
+} replay_record_t;
+
+typedef struct {
+    char            name[32];
+    replay_record_t records[REPLAY_MAX_RECORDS];
+    uint16_t        num_records;
+    uint8_t         data[REPLAY_DATA_SIZE];
+    uint32_t        data_len;
+} replay_trace_t;
+
+typedef struct {
+    uint32_t messages;
+    uint32_t bytes;
+    uint64_t duration_ns;
+    uint32_t allocations;
+    spark_reader_stats_t reader;
+} replay_result_t;
+
+static replay_trace_t  traces[REPLAY_MAX_SCENARIOS];
+static uint8_t         num_traces;
+static uint32_t        random_state = 1;
+
+static uint32_t        rx_messages;
+static spark_amp_state_t amp_state;
+
+// TX message being collected while loading a capture
+static replay_trace_t * load_trace;
+
+static uint64_t time_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+static uint32_t random_next(void){
+    random_state = random_state * 1103515245u + 12345u;
+    return random_state >> 16;
+}
+
+// heap allocations, counted if linked with --wrap=malloc,--wrap=calloc,--wrap=realloc
+
+static uint32_t allocations;
+
+#ifdef REPLAY_COUNT_ALLOCATIONS
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t count, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+
+void * __wrap_malloc(size_t size){
+    allocations++;
+    return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t count, size_t size){
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void * __wrap_realloc(void * ptr, size_t size){
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+// trace
+
+static replay_trace_t * trace_new(const char * name){
+    if (num_traces == REPLAY_MAX_SCENARIOS) return NULL;
+    replay_trace_t * trace = &traces[num_traces++];
+    memset(trace, 0, sizeof(replay_trace_t));
+    snprintf(trace->name, sizeof(trace->name), "%s", name);
+    return trace;
+}
+
+static replay_record_t * trace_add(replay_trace_t * trace, uint8_t direction, const uint8_t * data, uint16_t len){
+    if (trace->num_records == REPLAY_MAX_RECORDS) return NULL;
+    if ((trace->data_len + len) > REPLAY_DATA_SIZE) return NULL;
+    replay_record_t * record = &trace->records[trace->num_records++];
+    memset(record, 0, sizeof(replay_record_t));
+    record->direction = direction;
+    record->offset    = trace->data_len;
+    record->len       = len;
+    memcpy(&trace->data[trace->data_len], data, len);
+    trace->data_len += len;
+    return record;
+}
+
+static void trace_add_tx(replay_trace_t * trace, uint8_t command, uint8_t sub_command, uint8_t sequence, const uint8_t * payload, uint16_t payload_len){
+    replay_record_t * record = trace_add(trace, REPLAY_TX, payload, payload_len);
+    if (record == NULL) return;
+    record->command     = command;
+    record->sub_command = sub_command;
+    record->sequence    = sequence;
+}
+
+// amp response split into notifications
+static void trace_add_rx_stream(replay_trace_t * trace, const uint8_t * stream, uint16_t len, uint16_t fragment_len){
+    uint16_t pos = 0;
+    while (pos < len){
+        uint16_t chunk = ((len - pos) < fragment_len) ? (len - pos) : fragment_len;
+        trace_add(trace, REPLAY_RX, &stream[pos], chunk);
+        pos += chunk;
+    }
+}
+
+static uint16_t encode_from_amp(uint8_t * stream, uint16_t size, uint8_t command, uint8_t sub_command, uint8_t sequence,
+                                const uint8_t * payload, uint16_t payload_len){
+    spark_writer_t writer;
+    spark_writer_init(&writer, stream, size, SPARK_DIRECTION_FROM_AMP, SPARK_BLOCK_MAX_LEN_FROM_AMP);
+    if (!spark_writer_add_message(&writer, command, sub_command, sequence, payload, payload_len)) return 0;
+    return spark_writer_get_len(&writer);
+}
+
+static void trace_add_rx(replay_trace_t * trace, uint8_t command, uint8_t sub_command, uint8_t sequence,
+                         const uint8_t * payload, uint16_t payload_len){
+    static uint8_t stream[REPLAY_LARGE_FRAME_LEN];
+    uint16_t len = encode_from_amp(stream, sizeof(stream), command, sub_command, sequence, payload, payload_len);
+    trace_add_rx_stream(trace, stream, len, REPLAY_NOTIFICATION_LEN);
+}
+
+// synthetic presets, encoded like the amp does
+
+typedef struct {
+    uint8_t * data;
+    uint16_t  size;
+    uint16_t  len;
+} payload_writer_t;
+
+static void payload_byte(payload_writer_t * writer, uint8_t value){
+    if (writer->len < writer->size){
+        writer->data[writer->len++] = value;
+    }
+}
+
+static void payload_string(payload_writer_t * writer, const char * string, bool long_string){
+    uint16_t len = (uint16_t) strlen(string);
+    if (long_string || (len >= 32)){
+        payload_byte(writer, 0xd9);
+        payload_byte(writer, (uint8_t) len);
+    } else {
+        payload_byte(writer, 0xa0 | len);
+    }
+    uint16_t i;
+    for (i = 0; i < len; i++){
+        payload_byte(writer, (uint8_t) string[i]);
+    }
+}
+
+static void payload_float(payload_writer_t * writer, float value){
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    payload_byte(writer, 0xca);
+    payload_byte(writer, (uint8_t)(bits >> 24));
+    payload_byte(writer, (uint8_t)(bits >> 16));
+    payload_byte(writer, (uint8_t)(bits >> 8));
+    payload_byte(writer, (uint8_t) bits);
+}
+
+static uint16_t encode_preset(uint8_t * buffer, uint16_t size, uint8_t preset_type, uint8_t preset_number){
+    static const char * effects[SPARK_AMP_STATE_NUM_EFFECTS] = {
+        "bias.noisegate", "LA2AComp", "Booster", "RolandJC120", "ChorusAnalog", "DelayMono", "bias.reverb"
+    };
+    char name[24];
+    payload_writer_t writer = { buffer, size, 0 };
+    payload_byte(&writer, preset_type);
+    payload_byte(&writer, preset_number);
+    payload_string(&writer, "07079063-94A9-41B1-AB1D-02CBC5D00790", true);
+    snprintf(name, sizeof(name), "Replay %u", preset_number);
+    payload_string(&writer, name, false);
+    payload_string(&writer, "0.7", false);
+    payload_string(&writer, "Synthetic preset for replay", false);
+    payload_string(&writer, "icon.png", false);
+    payload_float(&writer, 120.0f);
+    payload_byte(&writer, 0x90 | SPARK_AMP_STATE_NUM_EFFECTS);
+    uint8_t i;
+    for (i = 0; i < SPARK_AMP_STATE_NUM_EFFECTS; i++){
+        payload_string(&writer, effects[i], false);
+        payload_byte(&writer, ((i + preset_number) & 1) ? 0xc3 : 0xc2);
+        payload_byte(&writer, 0x90 | 5);
+        uint8_t j;
+        for (j = 0; j < 5; j++){
+            payload_byte(&writer, j);
+            payload_byte(&writer, 0x91);
+            payload_float(&writer, (float) (j + i) / 10.0f);
+        }
+    }
+    uint8_t checksum = 0;
+    uint16_t pos;
+    for (pos = 0; pos < writer.len; pos++){
+        checksum ^= buffer[pos];
+    }
+    payload_byte(&writer, checksum);
+    return writer.len;
+}
+
+// built-in scenarios
+
+// pedal queries current preset and all hardware presets, the amp answers with multi-chunk responses
+static void scenario_app_sync(replay_trace_t * trace, uint8_t sequence){
+    uint8_t payload[1024];
+    uint8_t request[2] = { SPARK_AMP_STATE_PRESET_TYPE_CURRENT, 0x00 };
+    trace_add_tx(trace, SPARK_CMD_REQUEST, SPARK_SUB_CURRENT_PRESET, sequence, NULL, 0);
+    trace_add_tx(trace, SPARK_CMD_REQUEST, SPARK_SUB_PRESET, sequence + 1, request, sizeof(request));
+    uint8_t i;
+    for (i = 0; i < SPARK_AMP_STATE_NUM_PRESETS; i++){
+        request[0] = SPARK_AMP_STATE_PRESET_TYPE_HARDWARE;
+        request[1] = i;
+        trace_add_tx(trace, SPARK_CMD_REQUEST, SPARK_SUB_PRESET, sequence + 2 + i, request, sizeof(request));
+    }
+    const uint8_t current[] = { 0x00, 0x01 };
+    trace_add_rx(trace, SPARK_CMD_RESPONSE, SPARK_SUB_CURRENT_PRESET, sequence, current, sizeof(current));
+    uint16_t len = encode_preset(payload, sizeof(payload), SPARK_AMP_STATE_PRESET_TYPE_CURRENT, 1);
+    trace_add_rx(trace, SPARK_CMD_RESPONSE, SPARK_SUB_PRESET, sequence + 1, payload, len);
+    for (i = 0; i < SPARK_AMP_STATE_NUM_PRESETS; i++){
+        len = encode_preset(payload, sizeof(payload), SPARK_AMP_STATE_PRESET_TYPE_HARDWARE, i);
+        trace_add_rx(trace, SPARK_CMD_RESPONSE, SPARK_SUB_PRESET, sequence + 2 + i, payload, len);
+    }
+}
+
+static void scenario_preset_switching(replay_trace_t * trace){
+    uint16_t i;
+    for (i = 0; i < 256; i++){
+        uint8_t sequence = (uint8_t) (i & 0x7f);
+        uint8_t select[] = { 0x00, (uint8_t) (i & 0x03) };
+        trace_add_tx(trace, SPARK_CMD_WRITE, SPARK_SUB_SELECT_PRESET, sequence, select, sizeof(select));
+        trace_add_rx(trace, SPARK_CMD_ACK, SPARK_SUB_SELECT_PRESET, sequence, NULL, 0);
+        // every 4th switch is done on the amp
+        if ((i & 3) == 3){
+            trace_add_rx(trace, SPARK_CMD_WRITE, SPARK_SUB_SELECT_PRESET, sequence, select, sizeof(select));
+        }
+    }
+}
+
+// truncated frames, corrupted checksums and garbage between valid responses
+static void scenario_malformed(replay_trace_t * trace){
+    static uint8_t stream[REPLAY_LARGE_FRAME_LEN];
+    uint8_t payload[1024];
+    uint16_t i;
+    for (i = 0; i < 64; i++){
+        uint8_t preset = (uint8_t) (i % SPARK_AMP_STATE_NUM_PRESETS);
+        uint16_t payload_len = encode_preset(payload, sizeof(payload), SPARK_AMP_STATE_PRESET_TYPE_HARDWARE, preset);
+        uint16_t len = encode_from_amp(stream, sizeof(stream), SPARK_CMD_RESPONSE, SPARK_SUB_PRESET, (uint8_t) (i & 0x7f), payload, payload_len);
+        uint16_t pos = (uint16_t) (random_next() % len);
+        switch (i % 4){
+            case 0:
+                // truncated, next frame follows
+                len = pos;
+                break;
+            case 1:
+                // corrupted payload byte
+                stream[SPARK_BLOCK_HEADER_LEN + SPARK_CHUNK_HEADER_LEN + (pos % 32)] ^= 0x01;
+                break;
+            case 2:
+                // garbage before frame
+                trace_add(trace, REPLAY_RX, payload, 13);
+                break;
+            default:
+                // valid
+                break;
+        }
+        trace_add_rx_stream(trace, stream, len, REPLAY_NOTIFICATION_LEN);
+        const uint8_t ack_sequence = (uint8_t) (i & 0x7f);
+        trace_add_rx(trace, SPARK_CMD_ACK, SPARK_SUB_EFFECT_ONOFF, ack_sequence, NULL, 0);
+    }
+}
+
+// captures
+
+static void load_tx_handler(void * context, const spark_message_t * message){
+    (void) context;
+    trace_add_tx(load_trace, message->command, message->sub_command, message->sequence, message->payload, message->payload_len);
+}
+
+static spark_reader_t load_tx_reader;
+
+static void load_value(replay_trace_t * trace, uint8_t direction, const uint8_t * data, uint16_t len){
+    if (direction == REPLAY_RX){
+        trace_add(trace, REPLAY_RX, data, len);
+    } else {
+        // decode writes once, replay builds them again
+        spark_reader_process(&load_tx_reader, data, len);
+    }
+}
+
+// ACL packet with L2CAP fragments, only ATT notifications and writes are used
+typedef struct {
+    uint8_t  data[1024];
+    uint16_t len;
+} acl_reassembly_t;
+
+static acl_reassembly_t acl_reassembly[2];
+
+static void load_acl(replay_trace_t * trace, uint8_t direction, const uint8_t * packet, uint16_t len){
+    if (len < 4) return;
+    acl_reassembly_t * reassembly = &acl_reassembly[direction];
+    uint8_t packet_boundary = (packet[1] >> 4) & 0x03;
+    uint16_t acl_len = packet[2] | (packet[3] << 8);
+    if ((acl_len + 4) > len) return;
+    if (packet_boundary != 0x01){
+        reassembly->len = 0;
+    }
+    if ((reassembly->len + acl_len) > sizeof(reassembly->data)){
+        reassembly->len = 0;
+        return;
+    }
+    memcpy(&reassembly->data[reassembly->len], &packet[4], acl_len);
+    reassembly->len += acl_len;
+    if (reassembly->len < 4) return;
+    uint16_t l2cap_len = reassembly->data[0] | (reassembly->data[1] << 8);
+    uint16_t cid = reassembly->data[2] | (reassembly->data[3] << 8);
+    if (reassembly->len < (l2cap_len + 4)) return;
+    reassembly->len = 0;
+    if ((cid != 0x0004) || (l2cap_len < 3)) return;
+    const uint8_t * att = &reassembly->data[4];
+    switch (att[0]){
+        case REPLAY_ATT_NOTIFICATION:
+            if (direction == REPLAY_RX){
+                load_value(trace, REPLAY_RX, &att[3], l2cap_len - 3);
+            }
+            break;
+        case REPLAY_ATT_WRITE_REQUEST:
+        case REPLAY_ATT_WRITE_COMMAND:
+            if (direction == REPLAY_TX){
+                load_value(trace, REPLAY_TX, &att[3], l2cap_len - 3);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static uint16_t parse_hex(const char * text, uint8_t * buffer, uint16_t size){
+    uint16_t len = 0;
+    while (*text && (len < size)){
+        unsigned int value;
+        int consumed;
+        if (sscanf(text, " %2x%n", &value, &consumed) != 1) break;
+        buffer[len++] = (uint8_t) value;
+        text += consumed;
+    }
+    return len;
+}
+
+// hci_dump_embedded_stdout: "ACL <= xx xx ..", trace log at debug level: "RX amp 0: xx xx .."
+static void load_text_line(replay_trace_t * trace, const char * line){
+    static uint8_t buffer[1024];
+    const char * pos;
+    if ((pos = strstr(line, "ACL <= ")) != NULL){
+        load_acl(trace, REPLAY_RX, buffer, parse_hex(pos + 7, buffer, sizeof(buffer)));
+    } else if ((pos = strstr(line, "ACL => ")) != NULL){
+        load_acl(trace, REPLAY_TX, buffer, parse_hex(pos + 7, buffer, sizeof(buffer)));
+    } else if (((pos = strstr(line, "RX amp ")) != NULL) && ((pos = strchr(pos, ':')) != NULL)){
+        load_value(trace, REPLAY_RX, buffer, parse_hex(pos + 1, buffer, sizeof(buffer)));
+    } else if (((pos = strstr(line, "TX amp ")) != NULL) && ((pos = strchr(pos, ':')) != NULL)){
+        load_value(trace, REPLAY_TX, buffer, parse_hex(pos + 1, buffer, sizeof(buffer)));
+    }
+}
+
+// PacketLogger: 32 bit len, 32 bit seconds, 32 bit microseconds, type, packet; big endian
+static bool load_packet_logger(replay_trace_t * trace, FILE * file){
+    uint8_t header[13];
+    static uint8_t packet[2048];
+    while (fread(header, 1, sizeof(header), file) == sizeof(header)){
+        uint32_t len = ((uint32_t) header[0] << 24) | ((uint32_t) header[1] << 16) | ((uint32_t) header[2] << 8) | header[3];
+        if ((len < 9) || ((len - 9) > sizeof(packet))) return false;
+        if (fread(packet, 1, len - 9, file) != (len - 9)) return false;
+        switch (header[12]){
+            case 0x02:
+                load_acl(trace, REPLAY_TX, packet, (uint16_t) (len - 9));
+                break;
+            case 0x03:
+                load_acl(trace, REPLAY_RX, packet, (uint16_t) (len - 9));
+                break;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+static bool load_capture(const char * path){
+    FILE * file = fopen(path, "rb");
+    if (file == NULL){
+        printf("Cannot open %s\n", path);
+        return false;
+    }
+    const char * base = strrchr(path, '/');
+    char name[32];
+    snprintf(name, sizeof(name), "file %s", (base != NULL) ? (base + 1) : path);
+    replay_trace_t * trace = trace_new(name);
+    if (trace == NULL){
+        fclose(file);
+        return false;
+    }
+    load_trace = trace;
+    spark_reader_init(&load_tx_reader, &load_tx_handler, NULL);
+    memset(acl_reassembly, 0, sizeof(acl_reassembly));
+
+    // PacketLogger files start with a length, text logs with printable characters
+    int first = fgetc(file);
+    rewind(file);
+    bool ok = true;
+    if ((first == 0x00) && (first != EOF)){
+        ok = load_packet_logger(trace, file);
+    } else {
+        char line[4096];
+        while (fgets(line, sizeof(line), file) != NULL){
+            load_text_line(trace, line);
+        }
+    }
+    fclose(file);
+    if (!ok || (trace->num_records == 0)){
+        printf("No Spark traffic found in %s\n", path);
+        num_traces--;
+        return false;
+    }
+    return true;
+}
+
+// replay
+
+static void state_handler(void * context, uint16_t dirty){
+    (void) context;
+    (void) dirty;
+}
+
+static void rx_handler(void * context, const spark_message_t * message){
+    (void) context;
+    rx_messages++;
+    spark_amp_state_process_message(&amp_state, message);
+}
+
+static void replay_run(const replay_trace_t * trace, uint32_t passes, replay_result_t * result){
+    static uint8_t large_frame[REPLAY_LARGE_FRAME_LEN];
+    static spark_reader_t reader;
+    // short frames are initialized once per command and payload length, like the command pool entries
+    uint8_t  short_frame[SPARK_SHORT_FRAME_MAX_LEN];
+    uint32_t short_frame_key = 0;
+    uint32_t sink = 0;
+
+    memset(result, 0, sizeof(replay_result_t));
+    spark_reader_init(&reader, &rx_handler, NULL);
+    spark_amp_state_init(&amp_state, &state_handler, NULL);
+    rx_messages = 0;
+    uint32_t tx_messages = 0;
+    uint32_t allocations_start = allocations;
+    uint64_t start_ns = time_ns();
+
+    uint32_t pass;
+    for (pass = 0; pass < passes; pass++){
+        spark_amp_state_query_started(&amp_state);
+        uint16_t i;
+        for (i = 0; i < trace->num_records; i++){
+            const replay_record_t * record = &trace->records[i];
+            const uint8_t * data = &trace->data[record->offset];
+            if (record->direction == REPLAY_RX){
+                spark_reader_process(&reader, data, record->len);
+                result->bytes += record->len;
+                continue;
+            }
+            // frame stage of send_command
+            tx_messages++;
+            if ((record->len <= SPARK_SHORT_MAX_PAYLOAD) && !spark_message_is_multi_chunk(record->command, record->sub_command)){
+                uint32_t key = 0x1000000u | ((uint32_t) record->command << 16) | ((uint32_t) record->sub_command << 8) | record->len;
+                uint16_t frame_len = SPARK_SHORT_FRAME_MAX_LEN;
+                if (key != short_frame_key){
+                    short_frame_key = key;
+                    frame_len = spark_short_frame_init(short_frame, SPARK_DIRECTION_TO_AMP, record->command, record->sub_command, (uint8_t) record->len);
+                }
+                spark_short_frame_patch(short_frame, record->sequence, data, (uint8_t) record->len);
+                sink += short_frame[6];
+                result->bytes += frame_len;
+            } else {
+                spark_writer_t writer;
+                spark_writer_init(&writer, large_frame, sizeof(large_frame), SPARK_DIRECTION_TO_AMP, SPARK_BLOCK_MAX_LEN_TO_AMP);
+                spark_writer_add_message(&writer, record->command, record->sub_command, record->sequence, data, record->len);
+                result->bytes += spark_writer_get_len(&writer);
+                sink += large_frame[6];
+            }
+        }
+    }
+
+    result->duration_ns = time_ns() - start_ns;
+    if (result->duration_ns == 0){
+        result->duration_ns = 1;
+    }
+    result->allocations = allocations - allocations_start;
+    result->messages    = rx_messages + tx_messages;
+    result->reader      = reader.stats;
+    if (sink == 0xffffffff){
+        printf("\n");
+    }
+}
+
+static void replay_measure(const replay_trace_t * trace, uint32_t passes, replay_result_t * result){
+    // warm up caches, then measure
+    replay_run(trace, 1, result);
+    replay_run(trace, passes, result);
+    uint8_t repeat;
+    for (repeat = 1; repeat < REPLAY_REPEATS; repeat++){
+        replay_result_t run;
+        replay_run(trace, passes, &run);
+        run.allocations += result->allocations;
+        if (run.duration_ns < result->duration_ns){
+            *result = run;
+        } else {
+            result->allocations = run.allocations;
+        }
+    }
+}
+
+static uint32_t replay_ns_per_message(const replay_result_t * result){
+    return (uint32_t) (result->duration_ns / (result->messages ? result->messages : 1));
+}
+
+// allocations are summed over all repeats of a measurement, rounded up so a single one is not lost
+static uint32_t replay_allocations_per_pass(const replay_result_t * result, uint32_t passes){
+    uint32_t passes_run = REPLAY_REPEATS * passes;
+    return (result->allocations + passes_run - 1) / passes_run;
+}
+
+// baseline: name, ns/message for reference, messages, resyncs, checksum errors, dropped and allocations per pass
+
+typedef struct {
+    char     name[32];
+    uint32_t ns_per_message;
+    uint32_t messages;
+    uint32_t resyncs;
+    uint32_t checksum_errors;
+    uint32_t dropped;
+    uint32_t allocations;
+} replay_baseline_t;
+
+static replay_baseline_t baselines[REPLAY_MAX_SCENARIOS];
+static uint8_t           num_baselines;
+
+static bool baseline_read(const char * path){
+    FILE * file = fopen(path, "r");
+    if (file == NULL){
+        printf("Cannot open baseline %s\n", path);
+        return false;
+    }
+    char line[256];
+    while ((fgets(line, sizeof(line), file) != NULL) && (num_baselines < REPLAY_MAX_SCENARIOS)){
+        if (line[0] == '#') continue;
+        replay_baseline_t * baseline = &baselines[num_baselines];
+        // name may contain spaces and is terminated by ';'
+        char * end = strchr(line, ';');
+        if (end == NULL) continue;
+        *end = '\0';
+        if ((size_t) (end - line) >= sizeof(baseline->name)) continue;
+        memcpy(baseline->name, line, (size_t) (end - line) + 1);
+        if (sscanf(end + 1, "%" SCNu32 " %" SCNu32 " %" SCNu32 " %" SCNu32 " %" SCNu32 " %" SCNu32, &baseline->ns_per_message,
+                   &baseline->messages, &baseline->resyncs, &baseline->checksum_errors, &baseline->dropped,
+                   &baseline->allocations) != 6) continue;
+        num_baselines++;
+    }
+    fclose(file);
+    return true;
+}
+
+static const replay_baseline_t * baseline_find(const char * name){
+    uint8_t i;
+    for (i = 0; i < num_baselines; i++){
+        if (strcmp(baselines[i].name, name) == 0) return &baselines[i];
+    }
+    return NULL;
+}
+
+// decoded messages, errors and allocations must match exactly, time is not checked
+static bool baseline_check(const replay_baseline_t * baseline, const replay_result_t * result, uint32_t passes){
+    bool ok = true;
+    if ((result->messages / passes) != baseline->messages){
+        printf("    messages per pass %"PRIu32", baseline %"PRIu32"\n", result->messages / passes, baseline->messages);
+        ok = false;
+    }
+    if (((result->reader.resyncs / passes) != baseline->resyncs) || ((result->reader.checksum_errors / passes) != baseline->checksum_errors) ||
+        ((result->reader.dropped / passes) != baseline->dropped)){
+        printf("    reader resyncs/checksum errors/dropped %"PRIu32"/%"PRIu32"/%"PRIu32", baseline %"PRIu32"/%"PRIu32"/%"PRIu32"\n",
+               result->reader.resyncs / passes, result->reader.checksum_errors / passes, result->reader.dropped / passes,
+               baseline->resyncs, baseline->checksum_errors, baseline->dropped);
+        ok = false;
+    }
+#ifdef REPLAY_COUNT_ALLOCATIONS
+    if (replay_allocations_per_pass(result, passes) != baseline->allocations){
+        printf("    heap allocations per pass %"PRIu32", baseline %"PRIu32"\n", replay_allocations_per_pass(result, passes),
+               baseline->allocations);
+        ok = false;
+    }
+#endif
+    return ok;
+}
+
+static void usage(const char * name){
+    printf("Usage: %s [options]\n", name);
+    printf(" -n passes             replay each scenario this many times, default %u\n", REPLAY_DEFAULT_PASSES);
+    printf(" -f file               add capture, PacketLogger file or text log with hci_dump or debug trace output\n");
+    printf(" -b file               compare against baseline, fail if messages, reader errors or allocations differ\n");
+    printf(" -w file               write results as new baseline\n");
+}
+
+int main(int argc, char * argv[]){
+    uint32_t passes = REPLAY_DEFAULT_PASSES;
+    const char * baseline_path = NULL;
+    const char * write_path = NULL;
+
+    scenario_app_sync(trace_new("app sync"), 0);
+    scenario_preset_switching(trace_new("preset switching"));
+    scenario_malformed(trace_new("malformed frames"));
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:f:b:w:h")) != -1){
+        switch (opt){
+            case 'n':
+                passes = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                if (!load_capture(optarg)) return EXIT_FAILURE;
+                break;
+            case 'b':
+                baseline_path = optarg;
+                break;
+            case 'w':
+                write_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (passes == 0){
+        passes = 1;
+    }
+    if ((baseline_path != NULL) && !baseline_read(baseline_path)) return EXIT_FAILURE;
+    FILE * write_file = NULL;
+    if (write_path != NULL){
+        write_file = fopen(write_path, "w");
+        if (write_file == NULL){
+            printf("Cannot write baseline %s\n", write_path);
+            return EXIT_FAILURE;
+        }
+        fprintf(write_file, "# scenario; ns/message for reference, messages, resyncs, checksum errors, dropped, allocations per pass\n");
+    }
+
+    printf("Spark replay, %"PRIu32" passes\n", passes);
+    printf("%-24s %8s %8s %10s %10s %8s %8s %8s %8s %s\n", "", "records", "messages", "ns/msg", "MB/s", "allocs",
+           "resyncs", "checksum", "dropped", "baseline");
+    bool passed = true;
+    uint8_t i;
+    for (i = 0; i < num_traces; i++){
+        const replay_trace_t * trace = &traces[i];
+        const replay_baseline_t * baseline = baseline_find(trace->name);
+        replay_result_t result;
+        replay_measure(trace, passes, &result);
+        uint32_t ns_per_message = replay_ns_per_message(&result);
+        double mb_per_s = (double) result.bytes * 1000.0 / (double) result.duration_ns;
+
+        char allocs[12] = "n/a";
+#ifdef REPLAY_COUNT_ALLOCATIONS
+        snprintf(allocs, sizeof(allocs), "%"PRIu32, replay_allocations_per_pass(&result, passes));
+#endif
+        printf("%-24s %8u %8"PRIu32" %10"PRIu32" %10.1f %8s %8"PRIu32" %8"PRIu32" %8"PRIu32" %s\n", trace->name,
+               trace->num_records, result.messages / passes, ns_per_message, mb_per_s, allocs,
+               result.reader.resyncs / passes, result.reader.checksum_errors / passes, result.reader.dropped / passes, (baseline != NULL) ? "" : "-");
+        if (baseline != NULL){
+            bool ok = baseline_check(baseline, &result, passes);
+            // other machine, load or build type, for information only
+            int32_t change_percent = (int32_t) (((int64_t) ns_per_message - baseline->ns_per_message) * 100 /
+                                                (baseline->ns_per_message ? baseline->ns_per_message : 1));
+            printf("    baseline: %s, time %+"PRIi32"%% (%"PRIu32" ns/message recorded)\n", ok ? "ok" : "REGRESSION",
+                   change_percent, baseline->ns_per_message);
+            passed = passed && ok;
+        }
+        if (write_file != NULL){
+            fprintf(write_file, "%s; %"PRIu32" %"PRIu32" %"PRIu32" %"PRIu32" %"PRIu32" %"PRIu32"\n", trace->name, ns_per_message,
+                    result.messages / passes, result.reader.resyncs / passes, result.reader.checksum_errors / passes,
+                    result.reader.dropped / passes, replay_allocations_per_pass(&result, passes));
+        }
+    }
+    if (write_file != NULL){
+        fclose(write_file);
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,646 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "spark_scenario.c"
+
+/*
+ *  spark_scenario.c
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btstack.h"
+#include "latency_histogram.h"
+#include "mock_btstack.h"
+#include "spark_app_emulator.h"
+#include "spark_control.h"
+#include "spark_emulator.h"
+#include "spark_scenario.h"
+
+#define SCENARIO_MONITOR_PERIOD_MS      10
+#define SCENARIO_DEFAULT_WINDOW_MS      600000
+#define SCENARIO_DEFAULT_STUCK_MS       30000
+#define SCENARIO_LINE_SIZE              128
+#define SCENARIO_DELIMITERS             " \t\r\n"
+#define SCENARIO_NUM_BUTTONS            4
+// footswitches with long press for bank switch, the last one is tap tempo
+#define SCENARIO_PRESET_BUTTONS         3
+#define SCENARIO_ALL                    0xff
+// drift: reconnect p50 of a window above 1.5 x p50 of the first window with reconnects plus margin. Amps back from a
+// power cycle are found by the background scan if another amp is linked, at 6% duty cycle a single return takes from
+// 0.1 to a few seconds, so returns are only reported and covered by the stuck check
+#define SCENARIO_DRIFT_MARGIN_MS        250
+// number of timers varies with the link states
+#define SCENARIO_TIMER_SLACK            4
+// amps plus relay app
+#define SCENARIO_MAX_LINKS              (SPARK_EMULATOR_MAX_AMPS + 1)
+
+typedef enum {
+    SCENARIO_ACTION_PRESS = 0,
+    SCENARIO_ACTION_DISCONNECT,
+    SCENARIO_ACTION_POWER_CYCLE,
+    SCENARIO_ACTION_BURST,
+    SCENARIO_ACTION_APP_DISCONNECT,
+    SCENARIO_ACTION_HOLD,
+    SCENARIO_ACTION_APP_STALL,
+    SCENARIO_ACTION_COUNT
+} scenario_action_t;
+
+static const char * const scenario_action_names[SCENARIO_ACTION_COUNT] = {
+    "press", "disconnect", "power_cycle", "burst", "app_disconnect", "hold", "app_stall"
+};
+
+typedef struct {
+    btstack_timer_source_t timer;
+    scenario_action_t      action;
+    uint32_t               at_ms;
+    uint32_t               period_ms;
+    uint32_t               jitter_ms;
+    // amp or button, SCENARIO_ALL
+    uint8_t                target;
+    // off_ms, count, hold_ms or stall_ms
+    uint32_t               value;
+    uint32_t               runs;
+    // hold: release and counts at press
+    btstack_timer_source_t release_timer;
+    uint32_t               hold_presses;
+    uint32_t               hold_switches;
+    uint32_t               long_presses;
+} scenario_step_t;
+
+typedef struct {
+    char     name[8];
+    bool     up;
+    bool     was_up;
+    bool     stuck;
+    uint32_t down_since_ms;
+    // power cycled amps are not expected back before
+    uint32_t off_until_ms;
+    // app only: actions taken and time of last one
+    uint32_t progress;
+    uint32_t progress_ms;
+} scenario_link_t;
+
+typedef struct {
+    uint32_t            start_ms;
+    latency_histogram_t amp_reconnect_ms;
+    latency_histogram_t amp_return_ms;
+    latency_histogram_t app_reconnect_ms;
+    uint16_t            commands_free_min;
+    uint16_t            commands_free_max;
+    uint16_t            timers_min;
+    uint16_t            timers_max;
+} scenario_window_t;
+
+static scenario_step_t        scenario_steps[SPARK_SCENARIO_MAX_STEPS];
+static uint8_t                scenario_num_steps;
+static uint32_t               scenario_window_ms;
+static uint32_t               scenario_stuck_ms;
+static uint32_t               scenario_random_state;
+static uint32_t            (* scenario_time_us)(void);
+static uint8_t                scenario_next_button;
+static uint8_t                scenario_num_amps;
+static bool                   scenario_with_app;
+static scenario_link_t        scenario_links[SCENARIO_MAX_LINKS];
+static btstack_timer_source_t scenario_monitor_timer;
+
+static scenario_window_t      scenario_window;
+static scenario_window_t      scenario_first_window;
+static latency_histogram_t    scenario_amp_baseline_ms;
+static latency_histogram_t    scenario_app_baseline_ms;
+static uint16_t               scenario_windows;
+static uint32_t               scenario_stuck;
+static uint32_t               scenario_leaks;
+static uint32_t               scenario_drifts;
+// one foot: a hold is skipped while another one is in progress
+static scenario_step_t *      scenario_holding;
+static uint32_t               scenario_hold_errors;
+// preset or effect writes without acknowledgement since
+static uint32_t               scenario_unconfirmed_ms;
+static bool                   scenario_unconfirmed_reported;
+static uint32_t               scenario_unconfirmed;
+
+// xorshift32
+static uint32_t scenario_random(void){
+    scenario_random_state ^= scenario_random_state << 13;
+    scenario_random_state ^= scenario_random_state >> 17;
+    scenario_random_state ^= scenario_random_state << 5;
+    return scenario_random_state;
+}
+
+// actions
+
+// released footswitch ran either its slot or macro or, held long enough, the bank switch, never both
+static void scenario_release_timeout(btstack_timer_source_t * ts){
+    scenario_step_t * step = (scenario_step_t *) btstack_run_loop_get_timer_context(ts);
+    scenario_holding = NULL;
+    spark_control_footswitch_changed(step->target, false, (*scenario_time_us)());
+    spark_control_status_t status;
+    spark_control_get_status(&status);
+    uint32_t presses  = status.footswitch_presses - step->hold_presses;
+    uint32_t switches = status.bank_switches - step->hold_switches;
+    step->long_presses += switches;
+    bool long_press = (step->target < SCENARIO_PRESET_BUTTONS) && (step->value > SPARK_CONTROL_LONG_PRESS_MS);
+    if ((presses + switches) == 1){
+        if ((step->target < SCENARIO_PRESET_BUTTONS) && (step->value == SPARK_CONTROL_LONG_PRESS_MS)) return;
+        if ((switches == 1) == long_press) return;
+    }
+    scenario_hold_errors++;
+    printf("[!] Scenario: button %u held %"PRIu32" ms: %"PRIu32" presses, %"PRIu32" bank switches\n", step->target,
+           step->value, presses, switches);
+}
+
+static void scenario_hold(scenario_step_t * step){
+    if (scenario_holding != NULL) return;
+    spark_control_status_t status;
+    spark_control_get_status(&status);
+    step->hold_presses  = status.footswitch_presses;
+    step->hold_switches = status.bank_switches;
+    scenario_holding = step;
+    spark_control_footswitch_changed(step->target, true, (*scenario_time_us)());
+    btstack_run_loop_set_timer_handler(&step->release_timer, &scenario_release_timeout);
+    btstack_run_loop_set_timer_context(&step->release_timer, step);
+    btstack_run_loop_set_timer(&step->release_timer, step->value);
+    btstack_run_loop_add_timer(&step->release_timer);
+}
+
+static void scenario_run_action(scenario_step_t * step){
+    uint8_t first = step->target;
+    uint8_t last  = step->target;
+    if (step->target == SCENARIO_ALL){
+        first = 0;
+        last  = scenario_num_amps - 1;
+    }
+    uint8_t button;
+    uint8_t i;
+    switch (step->action){
+        case SCENARIO_ACTION_PRESS:
+            button = step->target;
+            if (button == SCENARIO_ALL){
+                button = scenario_next_button;
+                scenario_next_button = (scenario_next_button + 1) % SCENARIO_NUM_BUTTONS;
+            }
+            spark_control_button_pressed(button, (*scenario_time_us)());
+            break;
+        case SCENARIO_ACTION_DISCONNECT:
+            for (i = first; i <= last; i++){
+                mock_btstack_inject_disconnect(i, ERROR_CODE_CONNECTION_TIMEOUT);
+            }
+            break;
+        case SCENARIO_ACTION_POWER_CYCLE:
+            for (i = first; i <= last; i++){
+                scenario_links[i].off_until_ms = btstack_run_loop_get_time_ms() + step->value;
+                spark_emulator_power_cycle(i, step->value);
+            }
+            break;
+        case SCENARIO_ACTION_BURST:
+            for (i = first; i <= last; i++){
+                spark_emulator_burst(i, (uint8_t) step->value);
+            }
+            break;
+        case SCENARIO_ACTION_APP_DISCONNECT:
+            if (mock_btstack_app_connected()){
+                mock_btstack_app_disconnect();
+            }
+            break;
+        case SCENARIO_ACTION_HOLD:
+            scenario_hold(step);
+            break;
+        case SCENARIO_ACTION_APP_STALL:
+            spark_app_emulator_stall(step->value);
+            break;
+        default:
+            btstack_assert(false);
+            break;
+    }
+}
+
+static void scenario_step_schedule(scenario_step_t * step, uint32_t delay_ms){
+    if (step->jitter_ms > 0){
+        delay_ms += scenario_random() % (step->jitter_ms + 1);
+    }
+    btstack_run_loop_set_timer(&step->timer, delay_ms);
+    btstack_run_loop_add_timer(&step->timer);
+}
+
+static void scenario_step_timeout(btstack_timer_source_t * ts){
+    scenario_step_t * step = (scenario_step_t *) btstack_run_loop_get_timer_context(ts);
+    step->runs++;
+    scenario_run_action(step);
+    if (step->period_ms == 0) return;
+    scenario_step_schedule(step, step->period_ms);
+}
+
+// checks
+
+static uint32_t scenario_link_outage_start(const scenario_link_t * link){
+    if (btstack_time_delta(link->off_until_ms, link->down_since_ms) > 0) return link->off_until_ms;
+    return link->down_since_ms;
+}
+
+static void scenario_link_update(scenario_link_t * link, bool up, bool expected, latency_histogram_t * reconnect_ms,
+                                 latency_histogram_t * return_ms, uint32_t now){
+    if (up != link->up){
+        link->up = up;
+        if (!up){
+            link->down_since_ms = now;
+            return;
+        }
+        // first connection is not a reconnect
+        if (link->was_up){
+            int32_t outage_ms = btstack_time_delta(now, scenario_link_outage_start(link));
+            bool power_cycled = btstack_time_delta(link->off_until_ms, link->down_since_ms) > 0;
+            latency_histogram_add(power_cycled ? return_ms : reconnect_ms, (uint32_t) btstack_max(0, outage_ms));
+        }
+        link->was_up      = true;
+        link->stuck       = false;
+        link->progress_ms = now;
+        return;
+    }
+    if (up) return;
+    // nothing to connect to, outage starts later
+    if (!expected){
+        link->down_since_ms = now;
+        return;
+    }
+    int32_t outage_ms = btstack_time_delta(now, scenario_link_outage_start(link));
+    if (link->stuck || (outage_ms <= (int32_t) scenario_stuck_ms)) return;
+    link->stuck = true;
+    scenario_stuck++;
+    printf("[!] Scenario: %s not ready after %"PRIi32" ms\n", link->name, outage_ms);
+}
+
+static void scenario_app_check_progress(scenario_link_t * link, uint32_t now){
+    if (!link->up) return;
+    // quiet on purpose
+    if (spark_app_emulator_is_stalled()){
+        link->progress_ms = now;
+        return;
+    }
+    const spark_app_emulator_stats_t * stats = spark_app_emulator_get_stats();
+    uint32_t progress = stats->selects + stats->preset_requests;
+    if (progress != link->progress){
+        link->progress    = progress;
+        link->progress_ms = now;
+        link->stuck       = false;
+        return;
+    }
+    if (link->stuck || ((now - link->progress_ms) <= scenario_stuck_ms)) return;
+    link->stuck = true;
+    scenario_stuck++;
+    printf("[!] Scenario: %s without progress for %"PRIu32" ms\n", link->name, now - link->progress_ms);
+}
+
+// writes lost on the air or with the link are sent again until the amp acknowledges them
+static void scenario_check_unconfirmed(const spark_control_status_t * status, uint32_t now){
+    if (status->tone_writes_unconfirmed == 0){
+        scenario_unconfirmed_ms       = now;
+        scenario_unconfirmed_reported = false;
+        return;
+    }
+    if (scenario_unconfirmed_reported || ((now - scenario_unconfirmed_ms) <= scenario_stuck_ms)) return;
+    scenario_unconfirmed_reported = true;
+    scenario_unconfirmed++;
+    printf("[!] Scenario: %u preset or effect writes not acknowledged for %"PRIu32" ms\n", status->tone_writes_unconfirmed,
+           now - scenario_unconfirmed_ms);
+}
+
+static void scenario_window_open(uint32_t now){
+    memset(&scenario_window, 0, sizeof(scenario_window));
+    scenario_window.start_ms          = now;
+    scenario_window.commands_free_min = UINT16_MAX;
+    scenario_window.timers_min        = UINT16_MAX;
+}
+
+static void scenario_check_drift(const char * name, const latency_histogram_t * histogram, latency_histogram_t * baseline){
+    if (histogram->count == 0) return;
+    if (baseline->count == 0){
+        *baseline = *histogram;
+        return;
+    }
+    uint32_t p50_ms = latency_histogram_get_percentile(histogram, 50);
+    uint32_t baseline_p50_ms = latency_histogram_get_percentile(baseline, 50);
+    if (p50_ms <= (baseline_p50_ms + (baseline_p50_ms / 2) + SCENARIO_DRIFT_MARGIN_MS)) return;
+    scenario_drifts++;
+    printf("[!] Scenario window %u: %s reconnect p50 %"PRIu32" ms, first %"PRIu32" ms\n", scenario_windows, name,
+           p50_ms, baseline_p50_ms);
+}
+
+static void scenario_window_check(void){
+    scenario_check_drift("amp", &scenario_window.amp_reconnect_ms, &scenario_amp_baseline_ms);
+    scenario_check_drift("app", &scenario_window.app_reconnect_ms, &scenario_app_baseline_ms);
+    if (scenario_windows == 0){
+        scenario_first_window = scenario_window;
+        return;
+    }
+    // all entries are returned whenever the queues run empty
+    if (scenario_window.commands_free_max < scenario_first_window.commands_free_max){
+        scenario_leaks++;
+        printf("[!] Scenario window %u: at most %u free commands, first %u\n", scenario_windows,
+               scenario_window.commands_free_max, scenario_first_window.commands_free_max);
+    }
+    if (scenario_window.timers_max > (scenario_first_window.timers_max + SCENARIO_TIMER_SLACK)){
+        scenario_leaks++;
+        printf("[!] Scenario window %u: up to %u timers, first %u\n", scenario_windows,
+               scenario_window.timers_max, scenario_first_window.timers_max);
+    }
+}
+
+static void scenario_window_close(uint32_t now, bool complete){
+    const scenario_window_t * window = &scenario_window;
+    printf("[-] Scenario window %u, %"PRIu32"-%"PRIu32" s%s: amp reconnects %"PRIu32" p50/max %"PRIu32"/%"PRIu32" ms, "
+           "amp returns %"PRIu32" p50/max %"PRIu32"/%"PRIu32" ms, "
+           "app reconnects %"PRIu32" p50/max %"PRIu32"/%"PRIu32" ms, free commands %u-%u, timers %u-%u\n",
+           scenario_windows, window->start_ms / 1000, now / 1000, complete ? "" : " (partial)",
+           window->amp_reconnect_ms.count, latency_histogram_get_percentile(&window->amp_reconnect_ms, 50),
+           window->amp_reconnect_ms.max_us, window->amp_return_ms.count,
+           latency_histogram_get_percentile(&window->amp_return_ms, 50), window->amp_return_ms.max_us,
+           window->app_reconnect_ms.count,
+           latency_histogram_get_percentile(&window->app_reconnect_ms, 50), window->app_reconnect_ms.max_us,
+           window->commands_free_min, window->commands_free_max, window->timers_min, window->timers_max);
+    if (complete){
+        scenario_window_check();
+    }
+    scenario_windows++;
+    scenario_window_open(now);
+}
+
+static void scenario_monitor_timeout(btstack_timer_source_t * ts){
+    uint32_t now = btstack_run_loop_get_time_ms();
+    bool amp_up = false;
+    uint8_t i;
+    for (i = 0; i < scenario_num_amps; i++){
+        scenario_link_t * link = &scenario_links[i];
+        scenario_link_update(link, mock_btstack_notifications_enabled(i), true, &scenario_window.amp_reconnect_ms,
+                             &scenario_window.amp_return_ms, now);
+        amp_up |= link->up;
+    }
+    if (scenario_with_app){
+        // app can only connect through the relay while the pedal is connected to an amp
+        scenario_link_t * link = &scenario_links[scenario_num_amps];
+        scenario_link_update(link, spark_app_emulator_is_ready(), amp_up, &scenario_window.app_reconnect_ms,
+                             &scenario_window.app_reconnect_ms, now);
+        scenario_app_check_progress(link, now);
+    }
+
+    spark_control_status_t status;
+    spark_control_get_status(&status);
+    uint16_t timers = (uint16_t) btstack_linked_list_count(&btstack_run_loop_base_timers);
+    scenario_window.commands_free_min = btstack_min(scenario_window.commands_free_min, status.commands_free);
+    scenario_window.commands_free_max = btstack_max(scenario_window.commands_free_max, status.commands_free);
+    scenario_window.timers_min        = btstack_min(scenario_window.timers_min, timers);
+    scenario_window.timers_max        = btstack_max(scenario_window.timers_max, timers);
+    scenario_check_unconfirmed(&status, now);
+    if ((now - scenario_window.start_ms) >= scenario_window_ms){
+        scenario_window_close(now, true);
+    }
+
+    btstack_run_loop_set_timer(ts, SCENARIO_MONITOR_PERIOD_MS);
+    btstack_run_loop_add_timer(ts);
+}
+
+// parser
+
+static bool scenario_parse_value(const char * token, uint32_t * value){
+    if (token == NULL) return false;
+    char * end;
+    *value = (uint32_t) strtoul(token, &end, 10);
+    return (end != token) && (*end == '\0');
+}
+
+static bool scenario_parse_amp(const char * token, uint8_t * amp){
+    if ((token != NULL) && (strcmp(token, "*") == 0)){
+        *amp = SCENARIO_ALL;
+        return true;
+    }
+    uint32_t value;
+    if (!scenario_parse_value(token, &value) || (value >= scenario_num_amps)) return false;
+    *amp = (uint8_t) value;
+    return true;
+}
+
+static bool scenario_parse_action(scenario_step_t * step){
+    const char * name = strtok(NULL, SCENARIO_DELIMITERS);
+    if (name == NULL) return false;
+    uint8_t action;
+    for (action = 0; action < SCENARIO_ACTION_COUNT; action++){
+        if (strcmp(name, scenario_action_names[action]) == 0) break;
+    }
+    step->action = (scenario_action_t) action;
+    const char * target = strtok(NULL, SCENARIO_DELIMITERS);
+    const char * value  = strtok(NULL, SCENARIO_DELIMITERS);
+    if (strtok(NULL, SCENARIO_DELIMITERS) != NULL) return false;
+    uint32_t button;
+    switch (step->action){
+        case SCENARIO_ACTION_PRESS:
+            step->target = SCENARIO_ALL;
+            if (target == NULL) return value == NULL;
+            if (!scenario_parse_value(target, &button) || (button >= SCENARIO_NUM_BUTTONS)) return false;
+            step->target = (uint8_t) button;
+            return value == NULL;
+        case SCENARIO_ACTION_DISCONNECT:
+            return scenario_parse_amp(target, &step->target) && (value == NULL);
+        case SCENARIO_ACTION_POWER_CYCLE:
+            return scenario_parse_amp(target, &step->target) && scenario_parse_value(value, &step->value);
+        case SCENARIO_ACTION_BURST:
+            return scenario_parse_amp(target, &step->target) && scenario_parse_value(value, &step->value) &&
+                   (step->value <= UINT8_MAX);
+        case SCENARIO_ACTION_APP_DISCONNECT:
+            step->target = SCENARIO_ALL;
+            return target == NULL;
+        case SCENARIO_ACTION_APP_STALL:
+            step->target = SCENARIO_ALL;
+            return scenario_parse_value(target, &step->value) && (value == NULL);
+        case SCENARIO_ACTION_HOLD:
+            if (!scenario_parse_value(target, &button) || (button >= SCENARIO_NUM_BUTTONS)) return false;
+            step->target = (uint8_t) button;
+            return scenario_parse_value(value, &step->value);
+        default:
+            return false;
+    }
+}
+
+static bool scenario_parse_line(char * line){
+    char * comment = strchr(line, '#');
+    if (comment != NULL){
+        *comment = '\0';
+    }
+    const char * keyword = strtok(line, SCENARIO_DELIMITERS);
+    if (keyword == NULL) return true;
+    char * arg = strtok(NULL, SCENARIO_DELIMITERS);
+    if (strcmp(keyword, "window") == 0){
+        return scenario_parse_value(arg, &scenario_window_ms) && (scenario_window_ms > 0) && (strtok(NULL, SCENARIO_DELIMITERS) == NULL);
+    }
+    if (strcmp(keyword, "stuck") == 0){
+        return scenario_parse_value(arg, &scenario_stuck_ms) && (strtok(NULL, SCENARIO_DELIMITERS) == NULL);
+    }
+    if ((scenario_num_steps >= SPARK_SCENARIO_MAX_STEPS) || (arg == NULL)) return false;
+    scenario_step_t * step = &scenario_steps[scenario_num_steps];
+    memset(step, 0, sizeof(scenario_step_t));
+    if (strcmp(keyword, "at") == 0){
+        if (!scenario_parse_value(arg, &step->at_ms)) return false;
+    } else if (strcmp(keyword, "every") == 0){
+        char * jitter = strchr(arg, '~');
+        if (jitter != NULL){
+            *jitter++ = '\0';
+            if (!scenario_parse_value(jitter, &step->jitter_ms)) return false;
+        }
+        if (!scenario_parse_value(arg, &step->period_ms) || (step->period_ms == 0)) return false;
+        step->at_ms = step->period_ms;
+    } else {
+        return false;
+    }
+    if (!scenario_parse_action(step)) return false;
+    scenario_num_steps++;
+    return true;
+}
+
+bool spark_scenario_init(const char * path, uint32_t seed, uint32_t (*time_us)(void), bool with_app){
+    scenario_num_steps    = 0;
+    scenario_window_ms    = SCENARIO_DEFAULT_WINDOW_MS;
+    scenario_stuck_ms     = SCENARIO_DEFAULT_STUCK_MS;
+    scenario_num_amps     = spark_emulator_get_num_amps();
+    scenario_with_app     = with_app;
+    scenario_time_us      = time_us;
+    scenario_next_button  = 0;
+    scenario_random_state = (seed != 0) ? seed : 1;
+    scenario_windows      = 0;
+    scenario_stuck        = 0;
+    scenario_leaks        = 0;
+    scenario_drifts       = 0;
+    scenario_holding      = NULL;
+    scenario_hold_errors  = 0;
+    scenario_unconfirmed  = 0;
+    scenario_unconfirmed_ms       = btstack_run_loop_get_time_ms();
+    scenario_unconfirmed_reported = false;
+    latency_histogram_reset(&scenario_amp_baseline_ms);
+    latency_histogram_reset(&scenario_app_baseline_ms);
+
+    FILE * file = fopen(path, "r");
+    if (file == NULL){
+        printf("[!] Scenario: cannot open %s\n", path);
+        return false;
+    }
+    char line[SCENARIO_LINE_SIZE];
+    uint16_t line_number = 0;
+    bool ok = true;
+    while (ok && (fgets(line, sizeof(line), file) != NULL)){
+        line_number++;
+        ok = scenario_parse_line(line);
+    }
+    fclose(file);
+    if (!ok){
+        printf("[!] Scenario: %s:%u: invalid line\n", path, line_number);
+        return false;
+    }
+
+    uint32_t now = btstack_run_loop_get_time_ms();
+    uint8_t i;
+    memset(scenario_links, 0, sizeof(scenario_links));
+    for (i = 0; i < SCENARIO_MAX_LINKS; i++){
+        scenario_link_t * link = &scenario_links[i];
+        link->down_since_ms = now;
+        link->off_until_ms  = now;
+        if (i < scenario_num_amps){
+            snprintf(link->name, sizeof(link->name), "amp %u", i);
+        } else {
+            strcpy(link->name, "app");
+        }
+    }
+    for (i = 0; i < scenario_num_steps; i++){
+        scenario_step_t * step = &scenario_steps[i];
+        btstack_run_loop_set_timer_handler(&step->timer, &scenario_step_timeout);
+        btstack_run_loop_set_timer_context(&step->timer, step);
+        scenario_step_schedule(step, step->at_ms);
+    }
+    scenario_window_open(now);
+    btstack_run_loop_set_timer_handler(&scenario_monitor_timer, &scenario_monitor_timeout);
+    btstack_run_loop_set_timer(&scenario_monitor_timer, SCENARIO_MONITOR_PERIOD_MS);
+    btstack_run_loop_add_timer(&scenario_monitor_timer);
+    printf("[-] Scenario: %u steps from %s, window %"PRIu32" s, stuck after %"PRIu32" ms\n", scenario_num_steps, path,
+           scenario_window_ms / 1000, scenario_stuck_ms);
+    return true;
+}
+
+void spark_scenario_dump_stats(void){
+    uint32_t now = btstack_run_loop_get_time_ms();
+    if (now != scenario_window.start_ms){
+        scenario_window_close(now, false);
+    }
+    uint8_t i;
+    for (i = 0; i < scenario_num_steps; i++){
+        const scenario_step_t * step = &scenario_steps[i];
+        char target[5] = "";
+        if (step->target != SCENARIO_ALL){
+            snprintf(target, sizeof(target), " %u", step->target);
+        } else if ((step->action != SCENARIO_ACTION_PRESS) && (step->action != SCENARIO_ACTION_APP_DISCONNECT)){
+            strcpy(target, " *");
+        }
+        if (step->period_ms == 0){
+            printf("[-] Scenario step %u: at %"PRIu32" ms", i, step->at_ms);
+        } else {
+            printf("[-] Scenario step %u: every %"PRIu32"~%"PRIu32" ms", i, step->period_ms, step->jitter_ms);
+        }
+        printf(" %s%s", scenario_action_names[step->action], target);
+        if ((step->action == SCENARIO_ACTION_POWER_CYCLE) || (step->action == SCENARIO_ACTION_BURST) ||
+            (step->action == SCENARIO_ACTION_HOLD) || (step->action == SCENARIO_ACTION_APP_STALL)){
+            printf(" %"PRIu32, step->value);
+        }
+        printf(", runs %"PRIu32, step->runs);
+        if (step->action == SCENARIO_ACTION_HOLD){
+            printf(", bank switches %"PRIu32, step->long_presses);
+        }
+        printf("\n");
+    }
+    printf("[-] Scenario: %u windows, stuck %"PRIu32", leaks %"PRIu32", drifts %"PRIu32", hold errors %"PRIu32", unconfirmed %"PRIu32"\n",
+           scenario_windows, scenario_stuck, scenario_leaks, scenario_drifts, scenario_hold_errors, scenario_unconfirmed);
+    if (spark_scenario_passed()){
+        printf("[-] Scenario: passed\n");
+    } else {
+        printf("[!] Scenario: failed\n");
+    }
+}
+
+bool spark_scenario_passed(void){
+    return (scenario_stuck == 0) && (scenario_leaks == 0) && (scenario_drifts == 0) && (scenario_hold_errors == 0) &&
+           (scenario_unconfirmed == 0);
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  spark_scenario.h
+ *
+ *  Scripted soak tests for the host build. A scenario file lists steps that run once or periodically with
+ *  seeded jitter: button presses, link drops, amp power cycles, notification bursts, relay app drops and an app that
+ *  stops in the middle of a message.
+ *  Meanwhile, links and preset or effect writes not acknowledged by the amps are watched for states that never resolve
+ *  and the run is split into windows, each compared against the first, to find leaked command queue entries or
+ *  timers and reconnects that get slower.
+ *
+ *  Format, one step or setting per line, '#' starts a comment:
+ *
+ *      window <ms>                             length of a check window, default 10 min
+ *      stuck <ms>                              max time to reconnect, without app progress or with unacknowledged
+ *                                              preset or effect writes, default 30 s
+ *      at <ms> <action>                        run action once
+ *      every <ms>[~<jitter_ms>] <action>       run action periodically, adding up to jitter_ms each time
+ *
+ *  Actions: press [button], disconnect <amp>, power_cycle <amp> <off_ms>, burst <amp> <count>, app_disconnect,
+ *  hold <button> <ms>, app_stall <ms>. Without button, press cycles through all buttons. Amp is an index or '*' for
+ *  all. Press runs the macro right away like a console key, hold reports press and release of a footswitch and checks
+ *  that it ran either its slot or a bank switch. App_stall writes half a message and keeps the app quiet for ms,
+ *  presses meanwhile still have to reach the amps.
+ *
+ *  With the virtual run loop, several hours of a gig are covered in seconds and runs are reproducible from the seed.
+ */
+
+#ifndef SPARK_SCENARIO_H
+#define SPARK_SCENARIO_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SPARK_SCENARIO_MAX_STEPS        16
+
+/* API_START */
+
+/**
+ * @brief Load scenario and start its steps and checks. Call after emulators are set up
+ * @param path of scenario file
+ * @param seed for jitter
+ * @param time_us clock for button edges, same as used by the pedal
+ * @param with_app if the emulated Spark app is running, to watch its link and progress as well
+ * @return true if scenario is valid
+ */
+bool spark_scenario_init(const char * path, uint32_t seed, uint32_t (*time_us)(void), bool with_app);
+
+/**
+ * @brief Print per step counts, totals and verdict
+ */
+void spark_scenario_dump_stats(void);
+
+/**
+ * @brief Check result
+ * @return true if no link or write got stuck, no leaks or latency drift were found in complete windows and all holds
+ *         ran one action
+ */
+bool spark_scenario_passed(void);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // SPARK_SCENARIO_H
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+
+#define BTSTACK_FILE__ "tap_tempo_check.c"
+
+/*
+ *  tap_tempo_check.c
+ *
+ *  Feeds synthetic tap sequences with microsecond timestamps into the tap tempo of the pedal: steady taps, human
+ *  timing jitter, doubled and missed taps and a tempo change. Reports the estimated tempo, its error, the taps
+ *  needed to get within 1% and the drift of the beat grid after 16 beats, e.g. for the LED that blinks in time.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "tap_tempo.h"
+
+#define CHECK_MAX_TAPS          32
+#define CHECK_BEATS             16
+#define CHECK_START_US          1000000
+
+// pass limit for tempo error, the beat grid may only drift by tempo error and jitter of the last tap
+#define CHECK_MAX_ERROR_PERMILLE    10
+
+typedef struct {
+    const char * name;
+    uint32_t     period_us;
+    // period after tap change_at, 0 for steady tempo
+    uint32_t     period_changed_us;
+    uint8_t      change_at;
+    uint8_t      num_taps;
+    // max random deviation of each tap
+    uint32_t     jitter_us;
+    // tap index with an extra tap shortly after it and tap index that is left out, 0 for none
+    uint8_t      doubled_at;
+    uint8_t      missed_at;
+} check_sequence_t;
+
+static const check_sequence_t check_sequences[] = {
+    { "120 BPM steady",             500000,      0,  0,  8,     0, 0, 0 },
+    { "120 BPM +/- 10 ms",          500000,      0,  0,  8, 10000, 0, 0 },
+    { "90 BPM +/- 15 ms",           666667,      0,  0, 10, 15000, 0, 0 },
+    { "120 BPM doubled tap",        500000,      0,  0, 10,  5000, 4, 0 },
+    { "120 BPM missed tap",         500000,      0,  0, 10,  5000, 0, 5 },
+    { "120 -> 100 BPM",             500000, 600000,  6, 16,  5000, 0, 0 },
+    { "200 BPM +/- 5 ms",           300000,      0,  0, 12,  5000, 0, 0 },
+};
+
+static uint32_t check_random_state = 1;
+
+// uniform in [-range, range]
+static int32_t check_random(uint32_t range){
+    if (range == 0) return 0;
+    check_random_state = check_random_state * 1103515245u + 12345u;
+    return (int32_t) ((check_random_state >> 8) % (2 * range + 1)) - (int32_t) range;
+}
+
+static bool check_run(const check_sequence_t * sequence){
+    tap_tempo_t tempo;
+    tap_tempo_init(&tempo);
+
+    uint32_t ideal_us  = CHECK_START_US;
+    uint32_t period_us = sequence->period_us;
+    uint32_t last_tap_us = 0;
+    int8_t   converged_tap = -1;
+    uint8_t  tap;
+    for (tap = 0; tap < sequence->num_taps; tap++){
+        if ((sequence->change_at > 0) && (tap == sequence->change_at)){
+            period_us = sequence->period_changed_us;
+            converged_tap = -1;
+        }
+        if (tap > 0){
+            ideal_us += period_us;
+        }
+        if ((sequence->missed_at > 0) && (tap == sequence->missed_at)) continue;
+        last_tap_us = ideal_us + check_random(sequence->jitter_us);
+        tap_tempo_tap(&tempo, last_tap_us);
+        if ((sequence->doubled_at > 0) && (tap == sequence->doubled_at)){
+            tap_tempo_tap(&tempo, last_tap_us + 30000);
+        }
+        uint32_t estimate_us = tap_tempo_get_period_us(&tempo);
+        uint32_t error_us = (estimate_us > period_us) ? (estimate_us - period_us) : (period_us - estimate_us);
+        bool within = (estimate_us > 0) && (((uint64_t) error_us * 100) <= period_us);
+        if (!within){
+            converged_tap = -1;
+        } else if (converged_tap < 0){
+            converged_tap = (int8_t) (tap + 1);
+        }
+    }
+
+    uint32_t estimate_us = tap_tempo_get_period_us(&tempo);
+    uint32_t error_us = (estimate_us > period_us) ? (estimate_us - period_us) : (period_us - estimate_us);
+    uint32_t error_permille = (uint32_t) (((uint64_t) error_us * 1000) / period_us);
+
+    // beat grid of the LED vs. ideal grid after CHECK_BEATS beats
+    uint32_t beat_us = tap_tempo_get_next_beat_us(&tempo, last_tap_us);
+    uint8_t beat;
+    for (beat = 1; beat < CHECK_BEATS; beat++){
+        beat_us = tap_tempo_get_next_beat_us(&tempo, beat_us);
+    }
+    uint32_t ideal_beat_us = ideal_us + CHECK_BEATS * period_us;
+    int32_t drift_us = (int32_t) (beat_us - ideal_beat_us);
+
+    const tap_tempo_stats_t * stats = tap_tempo_get_stats(&tempo);
+    uint32_t max_drift_us = CHECK_BEATS * error_us + sequence->jitter_us + 1;
+    bool pass = (error_permille <= CHECK_MAX_ERROR_PERMILLE) && ((uint32_t) abs(drift_us) <= max_drift_us);
+    printf("%-22s %7u.%u %7u.%u %8u %6u.%u%% %9d %7d %9u %s\n", sequence->name,
+           60000000u * 10u / period_us / 10, 60000000u * 10u / period_us % 10,
+           tap_tempo_get_bpm_x10(&tempo) / 10, tap_tempo_get_bpm_x10(&tempo) % 10,
+           error_us, error_permille / 10, error_permille % 10, converged_tap, drift_us,
+           stats->outliers + stats->bounces, pass ? "ok" : "FAILED");
+    return pass;
+}
+
+int main(int argc, char * argv[]){
+    int opt;
+    while ((opt = getopt(argc, argv, "s:h")) != -1){
+        switch (opt){
+            case 's':
+                check_random_state = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            default:
+                printf("Usage: %s [-s seed]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    printf("Tap tempo, window %u intervals, tolerance %u%%\n", TAP_TEMPO_WINDOW, TAP_TEMPO_TOLERANCE_PERCENT);
+    printf("%-22s %9s %9s %8s %8s %9s %7s %9s %s\n", "", "true BPM", "tapped", "err us", "err", "1% after", "drift", "rejected", "result");
+    bool pass = true;
+    uint8_t i;
+    for (i = 0; i < sizeof(check_sequences) / sizeof(check_sequence_t); i++){
+        if (!check_run(&check_sequences[i])){
+            pass = false;
+        }
+    }
+    return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
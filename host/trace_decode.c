@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+
+#define BTSTACK_FILE__ "trace_decode.c"
+
+/*
+ *  trace_decode.c
+ *
+ *  Decodes the binary trace log of the pedal ('b' on the console) into text, using the same formats as the
+ *  pedal itself. Reads a captured console log from a file or stdin, "TRC" lines are decoded, all other lines
+ *  are passed through, e.g. stats dumps.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace_log.h"
+
+#define DECODE_LINE_SIZE        (2 * (sizeof(trace_log_record_t) + TRACE_LOG_MAX_DATA) + 256)
+
+static char    decode_input[DECODE_LINE_SIZE];
+static char    decode_text[TRACE_LOG_LINE_SIZE];
+static uint8_t decode_bytes[sizeof(trace_log_record_t) + TRACE_LOG_MAX_DATA];
+
+static int decode_nibble(char c){
+    if ((c >= '0') && (c <= '9')) return c - '0';
+    if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+    return -1;
+}
+
+// returns number of bytes
+static uint16_t decode_hex(const char * hex, uint8_t * bytes, uint16_t size){
+    uint16_t len = 0;
+    while (len < size){
+        int high = decode_nibble(hex[0]);
+        if (high < 0) break;
+        int low = decode_nibble(hex[1]);
+        if (low < 0) break;
+        bytes[len++] = (uint8_t) ((high << 4) | low);
+        hex += 2;
+    }
+    return len;
+}
+
+static bool decode_line(const char * line, bool relative, uint32_t * first_us, bool * first_seen){
+    const char * pos = strstr(line, TRACE_LOG_BINARY_PREFIX);
+    if (pos == NULL) return false;
+    pos += strlen(TRACE_LOG_BINARY_PREFIX);
+    uint16_t len = decode_hex(pos, decode_bytes, sizeof(decode_bytes));
+    if (len < sizeof(trace_log_record_t)) return false;
+
+    trace_log_record_t record;
+    memcpy(&record, decode_bytes, sizeof(record));
+    if (record.data_len > (len - sizeof(trace_log_record_t))){
+        // truncated capture
+        record.data_len = (uint16_t)(len - sizeof(trace_log_record_t));
+    }
+    uint32_t time_us = record.time_us;
+    if (relative){
+        if (!*first_seen){
+            *first_us = time_us;
+            *first_seen = true;
+        }
+        time_us -= *first_us;
+    }
+    trace_log_format(&record, &decode_bytes[sizeof(trace_log_record_t)], decode_text, sizeof(decode_text));
+    printf("%4"PRIu32".%06"PRIu32" %s\n", time_us / 1000000, time_us % 1000000, decode_text);
+    return true;
+}
+
+int main(int argc, char * argv[]){
+    bool relative = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "rh")) != -1){
+        switch (opt){
+            case 'r':
+                relative = true;
+                break;
+            default:
+                printf("Usage: %s [-r] [log]\n", argv[0]);
+                printf(" -r                    timestamps relative to first record\n");
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    FILE * input = stdin;
+    if (optind < argc){
+        input = fopen(argv[optind], "r");
+        if (input == NULL){
+            printf("Cannot open %s\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint32_t first_us = 0;
+    bool first_seen = false;
+    uint32_t records = 0;
+    while (fgets(decode_input, sizeof(decode_input), input) != NULL){
+        if (decode_line(decode_input, relative, &first_us, &first_seen)){
+            records++;
+        } else {
+            fputs(decode_input, stdout);
+        }
+    }
+    if (input != stdin){
+        fclose(input);
+    }
+    fprintf(stderr, "%"PRIu32" records decoded\n", records);
+    return EXIT_SUCCESS;
+}
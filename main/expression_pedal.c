@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+
+
+#define BTSTACK_FILE__ "expression_pedal.c"
+
+#include <string.h>
+
+#include "expression_pedal.h"
+
+static uint32_t expression_pedal_scale(const expression_pedal_t * pedal, uint16_t raw){
+    if (raw <= pedal->raw_min) return 0;
+    if (raw >= pedal->raw_max) return EXPRESSION_PEDAL_RANGE << 8;
+    return (((uint32_t) (raw - pedal->raw_min) * EXPRESSION_PEDAL_RANGE) << 8) / (pedal->raw_max - pedal->raw_min);
+}
+
+void expression_pedal_init(expression_pedal_t * pedal, uint16_t raw_min, uint16_t raw_max){
+    memset(pedal, 0, sizeof(expression_pedal_t));
+    pedal->raw_min = raw_min;
+    pedal->raw_max = (raw_max > raw_min) ? raw_max : (raw_min + 1);
+}
+
+bool expression_pedal_sample(expression_pedal_t * pedal, uint16_t raw, uint32_t time_us){
+    pedal->stats.samples++;
+    uint32_t scaled = expression_pedal_scale(pedal, raw);
+    if (!pedal->has_sample){
+        // start at current position, no ramp from heel
+        pedal->has_sample = true;
+        pedal->filtered   = scaled;
+    } else {
+        int32_t delta = (int32_t) scaled - (int32_t) pedal->filtered;
+        pedal->filtered = (uint32_t) ((int32_t) pedal->filtered + delta / (1 << EXPRESSION_PEDAL_FILTER_SHIFT));
+    }
+
+    uint16_t position = (uint16_t) ((pedal->filtered + 128) >> 8);
+    if (!expression_pedal_detected(pedal)){
+        pedal->heel_seen |= (position == 0);
+        pedal->toe_seen  |= (position == EXPRESSION_PEDAL_RANGE);
+        if (!expression_pedal_detected(pedal)){
+            pedal->stats.undetected++;
+            return false;
+        }
+        // report the end stop that completed the sweep
+        pedal->position = (position == 0) ? EXPRESSION_PEDAL_RANGE : 0;
+    }
+    uint16_t distance = (position > pedal->position) ? (position - pedal->position) : (pedal->position - position);
+    bool end_stop = (position == 0) || (position == EXPRESSION_PEDAL_RANGE);
+    if ((distance == 0) || ((distance < EXPRESSION_PEDAL_DEADBAND) && !end_stop)){
+        if (distance != 0){
+            pedal->stats.suppressed++;
+        }
+        return false;
+    }
+    pedal->position    = position;
+    pedal->position_us = time_us;
+    pedal->stats.changes++;
+    return true;
+}
+
+bool expression_pedal_detected(const expression_pedal_t * pedal){
+    return pedal->heel_seen && pedal->toe_seen;
+}
+
+uint16_t expression_pedal_get_position(const expression_pedal_t * pedal){
+    return pedal->position;
+}
+
+uint32_t expression_pedal_get_position_time_us(const expression_pedal_t * pedal){
+    return pedal->position_us;
+}
+
+const expression_pedal_stats_t * expression_pedal_get_stats(const expression_pedal_t * pedal){
+    return &pedal->stats;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+
+/*
+ *  expression_pedal.h
+ *  Sample pipeline of an expression pedal on an ADC input: raw samples are scaled to the calibrated heel/toe
+ *  range, smoothed by a first order low-pass and reported as position only if they leave a deadband around
+ *  the last reported position. The end stops are always reported, so heel and toe are reached exactly.
+ *  Nothing is reported until the filtered position has reached heel and toe once: an open input reads noise
+ *  around mid-range, which the low-pass keeps away from the end stops, so a missing pedal stays silent.
+ */
+
+#ifndef EXPRESSION_PEDAL_H
+#define EXPRESSION_PEDAL_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// positions from heel to toe
+#define EXPRESSION_PEDAL_RANGE          1000
+
+// low-pass: filtered += (sample - filtered) / 2^shift
+#define EXPRESSION_PEDAL_FILTER_SHIFT   2
+
+// min change of filtered position that is reported
+#define EXPRESSION_PEDAL_DEADBAND       4
+
+typedef struct {
+    uint32_t samples;
+    uint32_t changes;
+    uint32_t suppressed;
+    // samples before the pedal was detected
+    uint32_t undetected;
+} expression_pedal_stats_t;
+
+typedef struct {
+    uint16_t raw_min;
+    uint16_t raw_max;
+    bool     has_sample;
+    bool     heel_seen;
+    bool     toe_seen;
+    // position in 1/256
+    uint32_t filtered;
+    uint16_t position;
+    uint32_t position_us;
+    expression_pedal_stats_t stats;
+} expression_pedal_t;
+
+/* API_START */
+
+/**
+ * @brief Init expression pedal with calibrated range of raw samples
+ * @param pedal
+ * @param raw_min at heel
+ * @param raw_max at toe
+ */
+void expression_pedal_init(expression_pedal_t * pedal, uint16_t raw_min, uint16_t raw_max);
+
+/**
+ * @brief Process raw ADC sample
+ * @param pedal
+ * @param raw sample
+ * @param time_us of sample
+ * @return true if reported position changed
+ */
+bool expression_pedal_sample(expression_pedal_t * pedal, uint16_t raw, uint32_t time_us);
+
+/**
+ * @brief Check if pedal was detected by a sweep from heel to toe
+ * @param pedal
+ * @return true if positions are reported
+ */
+bool expression_pedal_detected(const expression_pedal_t * pedal);
+
+/**
+ * @brief Get last reported position
+ * @param pedal
+ * @return position 0..EXPRESSION_PEDAL_RANGE
+ */
+uint16_t expression_pedal_get_position(const expression_pedal_t * pedal);
+
+/**
+ * @brief Get time of sample that changed the reported position
+ * @param pedal
+ * @return time_us
+ */
+uint32_t expression_pedal_get_position_time_us(const expression_pedal_t * pedal);
+
+/**
+ * @brief Get statistics
+ * @param pedal
+ * @return stats
+ */
+const expression_pedal_stats_t * expression_pedal_get_stats(const expression_pedal_t * pedal);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // EXPRESSION_PEDAL_H
@@ -0,0 +1,677 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "io_task.c"
+
+/*
+ *  io_task.c
+ *
+ *  The task sleeps on its task notification. GPIO and RMT ISRs wake it up, as does the BTstack thread when
+ *  it queues an LED transmission. Debounce deadlines become the wait timeout. Events for the BTstack thread
+ *  are queued and the run loop is woken with btstack_run_loop_execute_on_main_thread, which ignores a
+ *  registration that is already pending, so there is at most one wakeup per batch of events.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_adc/adc_oneshot.h"
+#include "driver/rmt_tx.h"
+#include "driver/gpio.h"
+
+#include "btstack_run_loop.h"
+#include "btstack_util.h"
+
+#include "expression_pedal.h"
+#include "io_task.h"
+#include "led_strip_encoder.h"
+#include "spsc_queue.h"
+
+#define RMT_LED_STRIP_RESOLUTION_HZ 10000000 // 10MHz resolution, 1 tick = 0.1us (led strip needs a high resolution)
+#define RMT_LED_STRIP_GPIO_NUM      0
+
+#define BUTTON_GPIO_A_NUM     18
+#define BUTTON_GPIO_B_NUM     19
+#define BUTTON_GPIO_C_NUM     21
+#define BUTTON_GPIO_D_NUM     22
+
+// expression pedal on ADC1 channel 6 (GPIO 34), 12 bit samples, heel/toe range of the pot
+// set to 0 if GPIO 34 is not wired, positions are only reported after a sweep from heel to toe anyway
+#ifndef EXPRESSION_PEDAL_ENABLED
+#define EXPRESSION_PEDAL_ENABLED    1
+#endif
+#define EXPRESSION_ADC_CHANNEL      ADC_CHANNEL_6
+#define EXPRESSION_SAMPLE_PERIOD_US 2000
+#define EXPRESSION_RAW_MIN          100
+#define EXPRESSION_RAW_MAX          4000
+
+// edges within this time after an accepted transition are contact bounce
+#define BUTTON_DEBOUNCE_US    20000
+
+// task notification bits
+#define IO_NOTIFY_EDGE        0x01
+#define IO_NOTIFY_LED_REQUEST 0x02
+#define IO_NOTIFY_LED_DONE    0x04
+#define IO_NOTIFY_TEMPO       0x08
+#define IO_NOTIFY_BEAT        0x10
+#define IO_NOTIFY_ADC         0x20
+
+// tempo LED: on time per beat and GRB level
+#define IO_BEAT_ON_US         60000
+#define IO_BEAT_LEVEL         0x60
+
+// retry failed LED transmission after this many ticks
+#define IO_LED_RETRY_TICKS    1
+
+// tasks in system state snapshot for core usage
+#define IO_STATS_MAX_TASKS    24
+
+static const char *TAG = "io_task";
+
+typedef struct {
+    uint8_t  button;
+    uint8_t  level;
+    uint32_t time_us;
+} button_edge_t;
+
+typedef struct {
+    const uint8_t * pixels;
+    uint16_t        len;
+} led_request_t;
+
+typedef struct {
+    uint8_t  led;
+    uint32_t period_us;
+    uint32_t first_beat_us;
+} tempo_request_t;
+
+typedef struct {
+    gpio_num_t gpio;
+    bool       pressed;
+    bool       settling;
+    uint32_t   last_transition_us;
+    uint32_t   settle_deadline_us;
+} button_t;
+
+static button_t buttons[] = {
+    { .gpio = BUTTON_GPIO_A_NUM },
+    { .gpio = BUTTON_GPIO_B_NUM },
+    { .gpio = BUTTON_GPIO_C_NUM },
+    { .gpio = BUTTON_GPIO_D_NUM },
+};
+static const uint8_t buttons_count = sizeof(buttons) / sizeof(button_t);
+
+static const uint8_t gpio_pins[] = { 4, 13, 14, 18, 19, 21, 22, 23, 25, 26, 27, 32, 33, 35, 36};
+static const uint8_t gpio_pins_count = sizeof(gpio_pins);
+
+#ifdef RMT_LED_STRIP_GPIO_NUM
+static rmt_channel_handle_t led_chan = NULL;
+static rmt_encoder_handle_t led_encoder = NULL;
+static rmt_transmit_config_t tx_config = {
+        .loop_count = 0, // no transfer loop
+};
+#endif
+
+static TaskHandle_t       io_task_handle;
+static TaskHandle_t       io_btstack_task_handle;
+static io_event_handler_t io_event_handler;
+static io_task_stats_t    io_stats;
+
+// ISR -> I/O task
+static button_edge_t      io_edges_storage[IO_TASK_EDGE_QUEUE_SIZE];
+static spsc_queue_t       io_edges;
+// I/O task -> BTstack thread
+static io_event_t         io_events_storage[IO_TASK_EVENT_QUEUE_SIZE];
+static spsc_queue_t       io_events;
+static btstack_context_callback_registration_t io_events_callback;
+// BTstack thread -> I/O task
+static led_request_t      io_led_requests_storage[IO_TASK_LED_QUEUE_SIZE];
+static spsc_queue_t       io_led_requests;
+static tempo_request_t    io_tempo_requests_storage[IO_TASK_TEMPO_QUEUE_SIZE];
+static spsc_queue_t       io_tempo_requests;
+
+// owned by I/O task
+static bool               io_led_busy;
+static bool               io_led_retry;
+static led_request_t      io_led_request;
+static bool               io_events_posted;
+// last frame of LED engine and transmitted frame incl. tempo LED
+static uint8_t            io_led_pixels[IO_TASK_MAX_LED_BYTES];
+static uint8_t            io_led_frame[IO_TASK_MAX_LED_BYTES];
+static uint16_t           io_led_len;
+static bool               io_led_engine_frame;
+
+// tempo LED
+static esp_timer_handle_t io_beat_timer;
+static tempo_request_t    io_tempo;
+static bool               io_beat_on;
+static bool               io_beat_changed;
+static uint32_t           io_beat_target_us;
+// beat waiting for the LED frame that shows it, measured at rmt_transmit
+static bool               io_beat_pending;
+static uint32_t           io_beat_pending_us;
+static bool               io_led_frame_beat;
+
+// expression pedal
+static adc_oneshot_unit_handle_t io_adc_handle;
+static esp_timer_handle_t io_adc_timer;
+static expression_pedal_t io_expression_pedal;
+
+// latest position for BTstack thread, shared
+static portMUX_TYPE       io_expression_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint16_t           io_expression_position;
+static uint32_t           io_expression_time_us;
+static bool               io_expression_posted;
+static uint32_t           io_expression_dropped;
+
+static uint32_t io_time_us(void){
+    return (uint32_t) esp_timer_get_time();
+}
+
+// BTstack thread
+
+static void io_events_process(void * context){
+    UNUSED(context);
+    io_event_t event;
+    while (spsc_queue_pop(&io_events, &event)){
+        (*io_event_handler)(&event);
+    }
+}
+
+bool io_task_led_transmit(const uint8_t * pixels, uint16_t len){
+    led_request_t request = { .pixels = pixels, .len = len };
+    if (!spsc_queue_push(&io_led_requests, &request)) return false;
+    xTaskNotify(io_task_handle, IO_NOTIFY_LED_REQUEST, eSetBits);
+    return true;
+}
+
+void io_task_tempo_start(uint8_t led, uint32_t period_us, uint32_t first_beat_us){
+    tempo_request_t request = { .led = led, .period_us = period_us, .first_beat_us = first_beat_us };
+    if (!spsc_queue_push(&io_tempo_requests, &request)) return;
+    xTaskNotify(io_task_handle, IO_NOTIFY_TEMPO, eSetBits);
+}
+
+void io_task_get_expression(uint16_t * position, uint32_t * time_us){
+    taskENTER_CRITICAL(&io_expression_lock);
+    *position = io_expression_position;
+    *time_us  = io_expression_time_us;
+    io_expression_posted = false;
+    taskEXIT_CRITICAL(&io_expression_lock);
+}
+
+// esp_timer task
+
+static void io_beat_timer_callback(void * arg){
+    UNUSED(arg);
+    xTaskNotify(io_task_handle, IO_NOTIFY_BEAT, eSetBits);
+}
+
+static void io_adc_timer_callback(void * arg){
+    UNUSED(arg);
+    xTaskNotify(io_task_handle, IO_NOTIFY_ADC, eSetBits);
+}
+
+// ISRs
+
+static void button_isr_handler(void * arg){
+    uint8_t button = (uint8_t)(uintptr_t) arg;
+    button_edge_t edge;
+    edge.button  = button;
+    edge.level   = (uint8_t) gpio_get_level(buttons[button].gpio);
+    edge.time_us = io_time_us();
+    if (!spsc_queue_push(&io_edges, &edge)) return;
+    BaseType_t task_woken = pdFALSE;
+    xTaskNotifyFromISR(io_task_handle, IO_NOTIFY_EDGE, eSetBits, &task_woken);
+    portYIELD_FROM_ISR(task_woken);
+}
+
+#ifdef RMT_LED_STRIP_GPIO_NUM
+static bool led_transmit_done_isr(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t * event_data, void * user_context){
+    UNUSED(channel);
+    UNUSED(event_data);
+    UNUSED(user_context);
+    BaseType_t task_woken = pdFALSE;
+    xTaskNotifyFromISR(io_task_handle, IO_NOTIFY_LED_DONE, eSetBits, &task_woken);
+    return task_woken == pdTRUE;
+}
+#endif
+
+// I/O task
+
+static void io_post_event(io_event_type_t type, uint8_t button, uint32_t time_us){
+    io_event_t event = { .type = (uint8_t) type, .button = button, .time_us = time_us };
+    if (!spsc_queue_push(&io_events, &event)){
+        ESP_LOGW(TAG, "Event queue full, drop event %u", type);
+        return;
+    }
+    io_events_posted = true;
+}
+
+static void io_button_transition(uint8_t button, bool pressed, uint32_t time_us){
+    buttons[button].pressed = pressed;
+    buttons[button].last_transition_us = time_us;
+    io_stats.transitions++;
+    io_post_event(pressed ? IO_EVENT_BUTTON_PRESSED : IO_EVENT_BUTTON_RELEASED, button, time_us);
+}
+
+static void io_button_handle_edge(const button_edge_t * edge){
+    button_t * button = &buttons[edge->button];
+    bool pressed = edge->level == 0;
+    io_stats.edges++;
+    if ((uint32_t)(edge->time_us - button->last_transition_us) < BUTTON_DEBOUNCE_US){
+        // bouncing, sample level after debounce period
+        button->settling = true;
+        button->settle_deadline_us = edge->time_us + BUTTON_DEBOUNCE_US;
+        return;
+    }
+    if (pressed == button->pressed) return;
+    io_button_transition(edge->button, pressed, edge->time_us);
+}
+
+static void io_buttons_process(uint32_t now_us){
+    button_edge_t edge;
+    while (spsc_queue_pop(&io_edges, &edge)){
+        io_button_handle_edge(&edge);
+    }
+    uint8_t i;
+    for (i = 0; i < buttons_count; i++){
+        button_t * button = &buttons[i];
+        if (!button->settling) continue;
+        if ((int32_t)(now_us - button->settle_deadline_us) < 0) continue;
+        // bounce is over, check if we missed the final transition
+        button->settling = false;
+        bool pressed = gpio_get_level(button->gpio) == 0;
+        if (pressed != button->pressed){
+            io_button_transition(i, pressed, now_us);
+        }
+    }
+}
+
+// the beat replaces the color of the tempo LED for its on time, the LED shows preset/bank color in between
+static void io_led_render(void){
+    memcpy(io_led_frame, io_led_pixels, io_led_len);
+    io_led_frame_beat = false;
+    uint16_t pos = io_tempo.led * 3;
+    if (!io_beat_on || ((pos + 3) > io_led_len)) return;
+    memset(&io_led_frame[pos], IO_BEAT_LEVEL, 3);
+    io_led_frame_beat = io_beat_pending;
+}
+
+static void io_beat_transmitted(uint32_t transmit_us){
+    uint32_t jitter_us = transmit_us - io_beat_pending_us;
+    io_beat_pending = false;
+    io_led_frame_beat = false;
+    io_stats.beats++;
+    io_stats.beat_jitter_total_us += jitter_us;
+    if (jitter_us > io_stats.beat_jitter_max_us){
+        io_stats.beat_jitter_max_us = jitter_us;
+    }
+}
+
+static void io_led_process(uint32_t notifications){
+    if (notifications & IO_NOTIFY_LED_DONE){
+        io_led_busy = false;
+        // LED engine only waits for its own frames
+        if (io_led_engine_frame){
+            io_post_event(IO_EVENT_LED_DONE, 0, 0);
+        }
+    }
+    if (io_led_busy) return;
+    if (!io_led_retry){
+        if (spsc_queue_pop(&io_led_requests, &io_led_request)){
+            io_led_len = btstack_min(io_led_request.len, IO_TASK_MAX_LED_BYTES);
+            memcpy(io_led_pixels, io_led_request.pixels, io_led_len);
+            io_led_engine_frame = true;
+        } else if (io_beat_changed && (io_led_len > 0)){
+            io_led_engine_frame = false;
+        } else {
+            return;
+        }
+        io_beat_changed = false;
+        io_led_render();
+    }
+#ifdef RMT_LED_STRIP_GPIO_NUM
+    // lateness of the beat is taken here, a frame in flight delays it as well
+    uint32_t transmit_us = io_time_us();
+    esp_err_t err = rmt_transmit(led_chan, led_encoder, io_led_frame, io_led_len, &tx_config);
+    if (err != ESP_OK){
+        // keep request and retry, don't abort
+        io_stats.led_errors++;
+        io_led_retry = true;
+        return;
+    }
+    io_led_retry = false;
+    io_led_busy  = true;
+    io_stats.led_transmissions++;
+    if (io_led_frame_beat){
+        io_beat_transmitted(transmit_us);
+    }
+#else
+    if (io_led_engine_frame){
+        io_post_event(IO_EVENT_LED_DONE, 0, 0);
+    }
+#endif
+}
+
+static void io_beat_arm(uint32_t now_us){
+    int32_t delay_us = (int32_t)(io_beat_target_us - now_us);
+    esp_timer_start_once(io_beat_timer, (delay_us > 0) ? (uint64_t) delay_us : 0);
+}
+
+static void io_tempo_process(uint32_t notifications, uint32_t now_us){
+    if (notifications & IO_NOTIFY_TEMPO){
+        tempo_request_t request;
+        bool updated = false;
+        while (spsc_queue_pop(&io_tempo_requests, &request)){
+            io_tempo = request;
+            updated = true;
+        }
+        if (updated){
+            esp_timer_stop(io_beat_timer);
+            if (io_beat_on){
+                io_beat_on = false;
+                io_beat_changed = true;
+            }
+            io_beat_pending = false;
+            if (io_tempo.period_us > 0){
+                io_beat_target_us = io_tempo.first_beat_us;
+                io_beat_arm(now_us);
+            }
+        }
+    }
+    if ((notifications & IO_NOTIFY_BEAT) == 0) return;
+    if (io_tempo.period_us == 0) return;
+    io_beat_changed = true;
+    if (!io_beat_on){
+        io_beat_on = true;
+        io_beat_pending = true;
+        io_beat_pending_us = io_beat_target_us;
+        io_beat_target_us += btstack_min(IO_BEAT_ON_US, io_tempo.period_us / 2);
+    } else {
+        // a beat that was not transmitted within its on time is not counted
+        io_beat_on = false;
+        io_beat_pending = false;
+        // next beat on the grid, skip beats that were missed
+        io_beat_target_us -= btstack_min(IO_BEAT_ON_US, io_tempo.period_us / 2);
+        do {
+            io_beat_target_us += io_tempo.period_us;
+        } while ((int32_t)(io_beat_target_us - now_us) <= 0);
+    }
+    io_beat_arm(now_us);
+}
+
+static void io_expression_process(uint32_t notifications, uint32_t now_us){
+    if ((notifications & IO_NOTIFY_ADC) == 0) return;
+    int raw;
+    if (adc_oneshot_read(io_adc_handle, EXPRESSION_ADC_CHANNEL, &raw) != ESP_OK) return;
+    if (!expression_pedal_sample(&io_expression_pedal, (uint16_t) raw, now_us)) return;
+
+    // latest value wins, only one event until BTstack thread picked it up
+    taskENTER_CRITICAL(&io_expression_lock);
+    io_expression_position = expression_pedal_get_position(&io_expression_pedal);
+    io_expression_time_us  = now_us;
+    bool post = !io_expression_posted;
+    io_expression_posted = true;
+    taskEXIT_CRITICAL(&io_expression_lock);
+    if (post){
+        io_post_event(IO_EVENT_EXPRESSION, 0, now_us);
+    } else {
+        io_expression_dropped++;
+    }
+}
+
+static TickType_t io_wait_ticks(uint32_t now_us){
+    TickType_t ticks = portMAX_DELAY;
+    if (io_led_retry){
+        ticks = IO_LED_RETRY_TICKS;
+    }
+    const uint32_t tick_us = portTICK_PERIOD_MS * 1000;
+    uint8_t i;
+    for (i = 0; i < buttons_count; i++){
+        if (!buttons[i].settling) continue;
+        int32_t remaining_us = (int32_t)(buttons[i].settle_deadline_us - now_us);
+        TickType_t button_ticks = (remaining_us <= 0) ? 0 : (TickType_t)((remaining_us + tick_us - 1) / tick_us);
+        if (button_ticks < ticks){
+            ticks = button_ticks;
+        }
+    }
+    return ticks;
+}
+
+static void io_hardware_init(void){
+#ifdef RMT_LED_STRIP_GPIO_NUM
+    // setup led strip, RMT interrupt is allocated on this core
+    ESP_LOGI(TAG, "Create RMT TX channel");
+    rmt_tx_channel_config_t tx_chan_config = {
+            .clk_src = RMT_CLK_SRC_DEFAULT, // select source clock
+            .gpio_num = RMT_LED_STRIP_GPIO_NUM,
+            .mem_block_symbols = 64, // increase the block size can make the LED less flickering
+            .resolution_hz = RMT_LED_STRIP_RESOLUTION_HZ,
+            .trans_queue_depth = 4, // set the number of transactions that can be pending in the background
+    };
+    ESP_ERROR_CHECK(rmt_new_tx_channel(&tx_chan_config, &led_chan));
+
+    ESP_LOGI(TAG, "Install led strip encoder");
+    led_strip_encoder_config_t encoder_config = {
+            .resolution = RMT_LED_STRIP_RESOLUTION_HZ,
+    };
+    ESP_ERROR_CHECK(rmt_new_led_strip_encoder(&encoder_config, &led_encoder));
+
+    rmt_tx_event_callbacks_t led_callbacks = {
+            .on_trans_done = &led_transmit_done_isr,
+    };
+    ESP_ERROR_CHECK(rmt_tx_register_event_callbacks(led_chan, &led_callbacks, NULL));
+
+    ESP_LOGI(TAG, "Enable RMT TX channel");
+    ESP_ERROR_CHECK(rmt_enable(led_chan));
+#endif
+
+    // beats of tempo LED, callback runs in esp_timer task and only notifies this task
+    const esp_timer_create_args_t beat_timer_args = {
+            .callback = &io_beat_timer_callback,
+            .name = "beat",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&beat_timer_args, &io_beat_timer));
+
+    // setup GPIOs
+    gpio_config_t io_conf = { 0 };
+    io_conf.mode = GPIO_MODE_INPUT;
+    io_conf.pull_up_en   = 1;
+    io_conf.pull_down_en = 0;
+    io_conf.intr_type = GPIO_INTR_DISABLE;
+    uint8_t i;
+    for (i=0;i<gpio_pins_count;i++){
+        io_conf.pin_bit_mask |= 1ULL << gpio_pins[i];
+    }
+    gpio_config(&io_conf);
+
+    // interrupt on both edges of button GPIOs, ISR service runs on this core
+    io_conf.pin_bit_mask = 0;
+    io_conf.intr_type = GPIO_INTR_ANYEDGE;
+    for (i=0;i<buttons_count;i++){
+        io_conf.pin_bit_mask |= 1ULL << buttons[i].gpio;
+        buttons[i].pressed = gpio_get_level(buttons[i].gpio) == 0;
+    }
+    gpio_config(&io_conf);
+    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+    for (i=0;i<buttons_count;i++){
+        ESP_ERROR_CHECK(gpio_isr_handler_add(buttons[i].gpio, &button_isr_handler, (void *)(uintptr_t) i));
+    }
+
+#if EXPRESSION_PEDAL_ENABLED
+    // expression pedal, sampled periodically with esp_timer as the FreeRTOS tick is too coarse
+    // after gpio_config, so the pad stays analog without pull-up
+    adc_oneshot_unit_init_cfg_t adc_config = { .unit_id = ADC_UNIT_1 };
+    ESP_ERROR_CHECK(adc_oneshot_new_unit(&adc_config, &io_adc_handle));
+    adc_oneshot_chan_cfg_t channel_config = { .bitwidth = ADC_BITWIDTH_12, .atten = ADC_ATTEN_DB_12 };
+    ESP_ERROR_CHECK(adc_oneshot_config_channel(io_adc_handle, EXPRESSION_ADC_CHANNEL, &channel_config));
+    expression_pedal_init(&io_expression_pedal, EXPRESSION_RAW_MIN, EXPRESSION_RAW_MAX);
+    const esp_timer_create_args_t adc_timer_args = {
+            .callback = &io_adc_timer_callback,
+            .name = "adc",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&adc_timer_args, &io_adc_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(io_adc_timer, EXPRESSION_SAMPLE_PERIOD_US));
+#endif
+}
+
+static void io_task_main(void * arg){
+    UNUSED(arg);
+    // ISRs may fire before xTaskCreatePinnedToCore has returned the handle
+    io_task_handle = xTaskGetCurrentTaskHandle();
+    io_hardware_init();
+    ESP_LOGI(TAG, "I/O task running on core %d", xPortGetCoreID());
+
+    uint32_t notifications = 0;
+    while (true){
+        uint32_t start_us = io_time_us();
+        io_stats.wakeups++;
+
+        io_buttons_process(start_us);
+        io_tempo_process(notifications, start_us);
+        io_expression_process(notifications, start_us);
+        io_led_process(notifications);
+        if (io_events_posted){
+            io_events_posted = false;
+            btstack_run_loop_execute_on_main_thread(&io_events_callback);
+        }
+
+        uint32_t now_us  = io_time_us();
+        uint32_t busy_us = now_us - start_us;
+        io_stats.busy_us += busy_us;
+        if (busy_us > io_stats.busy_max_us){
+            io_stats.busy_max_us = busy_us;
+        }
+
+        notifications = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &notifications, io_wait_ticks(now_us));
+    }
+}
+
+void io_task_start(io_event_handler_t handler){
+    io_event_handler = handler;
+    io_btstack_task_handle = xTaskGetCurrentTaskHandle();
+    spsc_queue_init(&io_edges, io_edges_storage, sizeof(button_edge_t), IO_TASK_EDGE_QUEUE_SIZE);
+    spsc_queue_init(&io_events, io_events_storage, sizeof(io_event_t), IO_TASK_EVENT_QUEUE_SIZE);
+    spsc_queue_init(&io_led_requests, io_led_requests_storage, sizeof(led_request_t), IO_TASK_LED_QUEUE_SIZE);
+    spsc_queue_init(&io_tempo_requests, io_tempo_requests_storage, sizeof(tempo_request_t), IO_TASK_TEMPO_QUEUE_SIZE);
+    io_events_callback.callback = &io_events_process;
+    xTaskCreatePinnedToCore(&io_task_main, "io", IO_TASK_STACK_SIZE, NULL, IO_TASK_PRIORITY, &io_task_handle, IO_TASK_CORE);
+}
+
+// statistics
+
+#if (configGENERATE_RUN_TIME_STATS == 1) && (configUSE_TRACE_FACILITY == 1)
+static void io_dump_core_usage(void){
+    // usage since last call
+    static configRUN_TIME_COUNTER_TYPE last_total;
+    static configRUN_TIME_COUNTER_TYPE last_idle[portNUM_PROCESSORS];
+    static configRUN_TIME_COUNTER_TYPE last_io;
+    static configRUN_TIME_COUNTER_TYPE last_btstack;
+    static TaskStatus_t tasks[IO_STATS_MAX_TASKS];
+
+    configRUN_TIME_COUNTER_TYPE total = 0;
+    UBaseType_t num_tasks = uxTaskGetSystemState(tasks, IO_STATS_MAX_TASKS, &total);
+    if (num_tasks == 0){
+        printf("[!] Core usage: more than %u tasks\n", IO_STATS_MAX_TASKS);
+        return;
+    }
+    configRUN_TIME_COUNTER_TYPE idle[portNUM_PROCESSORS] = { 0 };
+    configRUN_TIME_COUNTER_TYPE io = 0;
+    configRUN_TIME_COUNTER_TYPE btstack = 0;
+    UBaseType_t i;
+    for (i = 0; i < num_tasks; i++){
+        int core;
+        for (core = 0; core < portNUM_PROCESSORS; core++){
+            if (tasks[i].xHandle == xTaskGetIdleTaskHandleForCore(core)){
+                idle[core] = tasks[i].ulRunTimeCounter;
+            }
+        }
+        if (tasks[i].xHandle == io_task_handle){
+            io = tasks[i].ulRunTimeCounter;
+        }
+        if (tasks[i].xHandle == io_btstack_task_handle){
+            btstack = tasks[i].ulRunTimeCounter;
+        }
+    }
+
+    configRUN_TIME_COUNTER_TYPE period = total - last_total;
+    if (period == 0) return;
+    printf("[-] Core usage:");
+    int core;
+    for (core = 0; core < portNUM_PROCESSORS; core++){
+        configRUN_TIME_COUNTER_TYPE core_idle = idle[core] - last_idle[core];
+        uint32_t busy_permille = (core_idle >= period) ? 0 : (uint32_t)(((uint64_t)(period - core_idle) * 1000) / period);
+        printf(" core %d %"PRIu32".%"PRIu32"%%,", core, busy_permille / 10, busy_permille % 10);
+        last_idle[core] = idle[core];
+    }
+    uint32_t io_permille      = (uint32_t)(((uint64_t)(io - last_io) * 1000) / period);
+    uint32_t btstack_permille = (uint32_t)(((uint64_t)(btstack - last_btstack) * 1000) / period);
+    printf(" BTstack thread %"PRIu32".%"PRIu32"%%, I/O task %"PRIu32".%"PRIu32"%%\n",
+           btstack_permille / 10, btstack_permille % 10, io_permille / 10, io_permille % 10);
+    last_total   = total;
+    last_io      = io;
+    last_btstack = btstack;
+}
+#endif
+
+void io_task_dump_stats(void){
+    uint32_t busy_avg_us = io_stats.wakeups ? (io_stats.busy_us / io_stats.wakeups) : 0;
+    printf("[-] I/O task: wakeups %"PRIu32", edges %"PRIu32", transitions %"PRIu32", LED transmissions %"PRIu32", LED errors %"PRIu32"\n",
+           io_stats.wakeups, io_stats.edges, io_stats.transitions, io_stats.led_transmissions, io_stats.led_errors);
+    printf("[-] I/O task: busy avg/max %"PRIu32"/%"PRIu32" us\n", busy_avg_us, io_stats.busy_max_us);
+    uint32_t beat_jitter_avg_us = io_stats.beats ? (io_stats.beat_jitter_total_us / io_stats.beats) : 0;
+    printf("[-] I/O task: tempo beats %"PRIu32", jitter avg/max %"PRIu32"/%"PRIu32" us\n",
+           io_stats.beats, beat_jitter_avg_us, io_stats.beat_jitter_max_us);
+    const expression_pedal_stats_t * expression = expression_pedal_get_stats(&io_expression_pedal);
+    printf("[-] I/O task: expression %s, samples %"PRIu32", undetected %"PRIu32", changes %"PRIu32", in deadband %"PRIu32", superseded %"PRIu32"\n",
+           expression_pedal_detected(&io_expression_pedal) ? "detected" : "not detected", expression->samples, expression->undetected,
+           expression->changes, expression->suppressed, io_expression_dropped);
+    printf("[-] I/O queues (high water/size, dropped): edges %u/%u %"PRIu32", events %u/%u %"PRIu32", LED requests %u/%u %"PRIu32"\n",
+           spsc_queue_get_high_water(&io_edges), IO_TASK_EDGE_QUEUE_SIZE, spsc_queue_get_dropped(&io_edges),
+           spsc_queue_get_high_water(&io_events), IO_TASK_EVENT_QUEUE_SIZE, spsc_queue_get_dropped(&io_events),
+           spsc_queue_get_high_water(&io_led_requests), IO_TASK_LED_QUEUE_SIZE, spsc_queue_get_dropped(&io_led_requests));
+#if (configGENERATE_RUN_TIME_STATS == 1) && (configUSE_TRACE_FACILITY == 1)
+    io_dump_core_usage();
+#endif
+}
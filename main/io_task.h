@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  io_task.h
+ *
+ *  FreeRTOS task pinned to the core that does not run the Bluetooth controller. It owns the button GPIOs and
+ *  the RMT channel of the LED strip: buttons are debounced and LED transmissions are started there, so HCI
+ *  processing on the BTstack thread and GPIO/RMT work don't delay each other.
+ *
+ *  Button events and LED completions are passed to the BTstack thread, LED transmissions to the I/O task,
+ *  each through a single-producer/single-consumer queue.
+ */
+
+#ifndef IO_TASK_H
+#define IO_TASK_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Bluetooth controller runs on core 0 (CONFIG_BTDM_CTRL_PINNED_TO_CORE)
+#define IO_TASK_CORE                1
+#define IO_TASK_PRIORITY            5
+#define IO_TASK_STACK_SIZE          4096
+
+// queue sizes, power of two
+#define IO_TASK_EDGE_QUEUE_SIZE     16
+#define IO_TASK_EVENT_QUEUE_SIZE    16
+#define IO_TASK_LED_QUEUE_SIZE      2
+#define IO_TASK_TEMPO_QUEUE_SIZE    2
+
+// LED data kept by the I/O task to blink in tempo on top of it
+#define IO_TASK_MAX_LED_BYTES       48
+
+typedef enum {
+    IO_EVENT_BUTTON_PRESSED = 0,
+    IO_EVENT_BUTTON_RELEASED,
+    IO_EVENT_LED_DONE,
+    // position is read with io_task_get_expression
+    IO_EVENT_EXPRESSION,
+} io_event_type_t;
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  button;
+    // time of button edge
+    uint32_t time_us;
+} io_event_t;
+
+/**
+ * @brief Handler for I/O events, called on BTstack thread
+ * @param event
+ */
+typedef void (*io_event_handler_t)(const io_event_t * event);
+
+typedef struct {
+    uint32_t wakeups;
+    uint32_t edges;
+    uint32_t transitions;
+    uint32_t led_transmissions;
+    uint32_t led_errors;
+    uint32_t busy_us;
+    uint32_t busy_max_us;
+    // tempo LED, lateness of rmt_transmit of the frame with the beat vs. beat, beats not shown are not counted
+    uint32_t beats;
+    uint32_t beat_jitter_total_us;
+    uint32_t beat_jitter_max_us;
+} io_task_stats_t;
+
+/* API_START */
+
+/**
+ * @brief Start I/O task, to be called on BTstack thread. Hardware is set up by the task on its own core,
+ *        so GPIO and RMT interrupts are handled there as well
+ * @param handler for events
+ */
+void io_task_start(io_event_handler_t handler);
+
+/**
+ * @brief Request LED transmission. IO_EVENT_LED_DONE is reported when done
+ * @param pixels GRB data, needs to stay valid until done
+ * @param len
+ * @return false if request queue is full
+ */
+bool io_task_led_transmit(const uint8_t * pixels, uint16_t len);
+
+/**
+ * @brief Blink LED in tempo. Beats are timed with esp_timer and transmitted by the I/O task, independent of
+ *        the FreeRTOS tick. The LED is lit on top of the frames of the LED engine for a short time per beat and
+ *        shows neither preset nor bank color during that time
+ * @param led index
+ * @param period_us of beats, 0 to stop
+ * @param first_beat_us in esp_timer time base, truncated to 32 bit
+ */
+void io_task_tempo_start(uint8_t led, uint32_t period_us, uint32_t first_beat_us);
+
+/**
+ * @brief Get latest expression pedal position. Intermediate positions are dropped if the BTstack thread
+ *        did not pick them up yet, the next change is reported with a new IO_EVENT_EXPRESSION
+ * @param position 0..EXPRESSION_PEDAL_RANGE
+ * @param time_us of ADC sample
+ */
+void io_task_get_expression(uint16_t * position, uint32_t * time_us);
+
+/**
+ * @brief Print task statistics, queue high water marks and core usage
+ */
+void io_task_dump_stats(void);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // IO_TASK_H
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "latency_histogram.c"
+
+#include <string.h>
+
+#include "latency_histogram.h"
+
+#define LINEAR_BUCKETS      16
+#define SUB_BUCKETS_LOG2    2
+
+static uint8_t latency_histogram_msb(uint32_t value){
+    uint8_t msb = 0;
+    while (value >>= 1){
+        msb++;
+    }
+    return msb;
+}
+
+static uint16_t latency_histogram_bucket_for_value(uint32_t value_us){
+    if (value_us < LINEAR_BUCKETS) return (uint16_t) value_us;
+    uint8_t  msb = latency_histogram_msb(value_us);
+    uint16_t sub = (value_us >> (msb - SUB_BUCKETS_LOG2)) & ((1 << SUB_BUCKETS_LOG2) - 1);
+    uint16_t bucket = LINEAR_BUCKETS + ((msb - 4) << SUB_BUCKETS_LOG2) + sub;
+    if (bucket >= LATENCY_HISTOGRAM_BUCKETS){
+        bucket = LATENCY_HISTOGRAM_BUCKETS - 1;
+    }
+    return bucket;
+}
+
+static uint32_t latency_histogram_bucket_upper_bound(uint16_t bucket){
+    if (bucket < LINEAR_BUCKETS) return bucket;
+    uint16_t index = bucket - LINEAR_BUCKETS;
+    uint8_t  msb   = (uint8_t) ((index >> SUB_BUCKETS_LOG2) + 4);
+    uint32_t sub   = index & ((1 << SUB_BUCKETS_LOG2) - 1);
+    return (1UL << msb) + ((sub + 1) << (msb - SUB_BUCKETS_LOG2)) - 1;
+}
+
+void latency_histogram_reset(latency_histogram_t * histogram){
+    memset(histogram, 0, sizeof(latency_histogram_t));
+}
+
+void latency_histogram_add(latency_histogram_t * histogram, uint32_t value_us){
+    if ((histogram->count == 0) || (value_us < histogram->min_us)){
+        histogram->min_us = value_us;
+    }
+    if (value_us > histogram->max_us){
+        histogram->max_us = value_us;
+    }
+    histogram->count++;
+    histogram->buckets[latency_histogram_bucket_for_value(value_us)]++;
+}
+
+uint32_t latency_histogram_get_percentile(const latency_histogram_t * histogram, uint8_t percent){
+    if (histogram->count == 0) return 0;
+    // rank of sample, rounded up
+    uint32_t rank = (uint32_t) (((uint64_t) histogram->count * percent + 99) / 100);
+    if (rank == 0){
+        rank = 1;
+    }
+    uint32_t seen = 0;
+    uint16_t bucket;
+    for (bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++){
+        seen += histogram->buckets[bucket];
+        if (seen >= rank) break;
+    }
+    // last bucket is open ended
+    if (bucket >= (LATENCY_HISTOGRAM_BUCKETS - 1)) return histogram->max_us;
+    uint32_t value_us = latency_histogram_bucket_upper_bound(bucket);
+    return (value_us < histogram->max_us) ? value_us : histogram->max_us;
+}
+
+static void latency_histogram_store_32(uint8_t * buffer, uint16_t pos, uint32_t value){
+    buffer[pos++] = (uint8_t) value;
+    buffer[pos++] = (uint8_t) (value >> 8);
+    buffer[pos++] = (uint8_t) (value >> 16);
+    buffer[pos]   = (uint8_t) (value >> 24);
+}
+
+uint16_t latency_histogram_store_record(const latency_histogram_t * histogram, uint8_t * buffer){
+    latency_histogram_store_32(buffer,  0, histogram->count);
+    latency_histogram_store_32(buffer,  4, histogram->min_us);
+    latency_histogram_store_32(buffer,  8, histogram->max_us);
+    latency_histogram_store_32(buffer, 12, latency_histogram_get_percentile(histogram, 50));
+    latency_histogram_store_32(buffer, 16, latency_histogram_get_percentile(histogram, 95));
+    latency_histogram_store_32(buffer, 20, latency_histogram_get_percentile(histogram, 99));
+    return LATENCY_HISTOGRAM_RECORD_LEN;
+}
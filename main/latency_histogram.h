@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  latency_histogram.h
+ *
+ *  Fixed-size histogram for latencies in microseconds. Values below 16 us get their own bucket, larger
+ *  values are grouped into four buckets per power of two, so percentiles are accurate to 25%.
+ */
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// covers up to 16.7 s, larger values are counted in the last bucket
+#define LATENCY_HISTOGRAM_BUCKETS       96
+
+// count, min, max, p50, p95, p99 as little endian uint32_t
+#define LATENCY_HISTOGRAM_RECORD_LEN    24
+
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+} latency_histogram_t;
+
+/* API_START */
+
+/**
+ * @brief Reset histogram
+ * @param histogram
+ */
+void latency_histogram_reset(latency_histogram_t * histogram);
+
+/**
+ * @brief Add sample
+ * @param histogram
+ * @param value_us
+ */
+void latency_histogram_add(latency_histogram_t * histogram, uint32_t value_us);
+
+/**
+ * @brief Get percentile as upper bound of the bucket that contains it. Max is exact
+ * @param histogram
+ * @param percent 0..100
+ * @return latency in us, 0 if empty
+ */
+uint32_t latency_histogram_get_percentile(const latency_histogram_t * histogram, uint8_t percent);
+
+/**
+ * @brief Store summary record
+ * @param histogram
+ * @param buffer of at least LATENCY_HISTOGRAM_RECORD_LEN bytes
+ * @return size of record
+ */
+uint16_t latency_histogram_store_record(const latency_histogram_t * histogram, uint8_t * buffer);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // LATENCY_HISTOGRAM_H
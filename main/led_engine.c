@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "led_engine.c"
+
+#include <string.h>
+
+#include "btstack_run_loop.h"
+
+#include "led_engine.h"
+
+// gamma 2.2
+static const uint8_t led_engine_gamma[256] = {
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+      3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+      6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+     12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+     20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+     30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+     42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+     56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+     73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+     91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+    113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+    137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+    163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+    192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+    223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255,
+};
+
+static const led_engine_output_t * led_output;
+static uint16_t               led_num_leds;
+static const led_color_t *    led_palette;
+static uint8_t                led_num_colors;
+
+// palette converted to GRB with gamma and brightness
+static uint8_t                led_palette_grb[LED_ENGINE_MAX_COLORS][3];
+
+static uint8_t                led_buffers[2][LED_ENGINE_MAX_LEDS * 3];
+static uint8_t                led_back;
+static bool                   led_busy;
+static bool                   led_pending;
+// range of LEDs changed in back buffer since last commit
+static uint16_t               led_dirty_first;
+static uint16_t               led_dirty_last;
+
+static const led_animation_t * led_animation;
+static const led_animation_t * led_animation_deferred;
+static uint8_t                led_animation_frame;
+static uint16_t               led_animation_op;
+static btstack_timer_source_t led_animation_timer;
+static btstack_timer_source_t led_retry_timer;
+
+static led_engine_stats_t     led_stats;
+
+static void led_engine_mark_clean(void){
+    led_dirty_first = led_num_leds;
+    led_dirty_last  = 0;
+}
+
+static void led_engine_transmit(void){
+    led_pending = false;
+    led_stats.transmissions++;
+    uint8_t front = led_back ^ 1;
+    switch ((*led_output->transmit)(led_buffers[front], led_num_leds * 3)){
+        case LED_ENGINE_TX_STARTED:
+            led_busy = true;
+            break;
+        case LED_ENGINE_TX_DONE:
+            break;
+        default:
+            led_stats.errors++;
+            led_pending = true;
+            btstack_run_loop_remove_timer(&led_retry_timer);
+            btstack_run_loop_set_timer(&led_retry_timer, LED_ENGINE_RETRY_MS);
+            btstack_run_loop_add_timer(&led_retry_timer);
+            break;
+    }
+}
+
+static void led_engine_retry_timeout(btstack_timer_source_t * ts){
+    (void) ts;
+    if (led_pending && !led_busy){
+        led_engine_transmit();
+    }
+}
+
+static void led_engine_render_frame(void){
+    uint8_t num_ops = led_animation->frame_ops[led_animation_frame];
+    uint8_t i;
+    for (i = 0; i < num_ops; i++){
+        const led_engine_op_t * op = &led_animation->ops[led_animation_op + i];
+        led_engine_set(op->led, op->color);
+    }
+    led_animation_op += num_ops;
+    led_stats.animation_frames++;
+    led_engine_show();
+}
+
+static void led_engine_start_animation(const led_animation_t * animation){
+    led_animation = animation;
+    led_animation_frame = 0;
+    led_animation_op = 0;
+    btstack_run_loop_remove_timer(&led_animation_timer);
+    led_engine_render_frame();
+    btstack_run_loop_set_timer(&led_animation_timer, animation->frame_ms);
+    btstack_run_loop_add_timer(&led_animation_timer);
+}
+
+static void led_engine_animation_timeout(btstack_timer_source_t * ts){
+    led_animation_frame++;
+    if (led_animation_frame >= led_animation->num_frames){
+        if (!led_animation->loop){
+            // keep last frame
+            led_animation = NULL;
+            if (led_animation_deferred != NULL){
+                const led_animation_t * next = led_animation_deferred;
+                led_animation_deferred = NULL;
+                led_engine_start_animation(next);
+            }
+            return;
+        }
+        led_animation_frame = 0;
+        led_animation_op = 0;
+    }
+    led_engine_render_frame();
+    btstack_run_loop_set_timer(ts, led_animation->frame_ms);
+    btstack_run_loop_add_timer(ts);
+}
+
+void led_engine_init(const led_engine_output_t * output, uint16_t num_leds, const led_color_t * palette, uint8_t num_colors, uint8_t brightness){
+    led_output     = output;
+    led_num_leds   = (num_leds < LED_ENGINE_MAX_LEDS) ? num_leds : LED_ENGINE_MAX_LEDS;
+    led_palette    = palette;
+    led_num_colors = (num_colors < LED_ENGINE_MAX_COLORS) ? num_colors : LED_ENGINE_MAX_COLORS;
+    memset(led_buffers, 0, sizeof(led_buffers));
+    memset(&led_stats, 0, sizeof(led_stats));
+    led_back    = 0;
+    led_busy    = false;
+    led_pending = false;
+    led_animation = NULL;
+    led_animation_deferred = NULL;
+    led_engine_mark_clean();
+    btstack_run_loop_set_timer_handler(&led_animation_timer, &led_engine_animation_timeout);
+    btstack_run_loop_set_timer_handler(&led_retry_timer, &led_engine_retry_timeout);
+    led_engine_set_brightness(brightness);
+}
+
+void led_engine_set_brightness(uint8_t brightness){
+    uint8_t i;
+    for (i = 0; i < led_num_colors; i++){
+        const led_color_t * color = &led_palette[i];
+        led_palette_grb[i][0] = (uint8_t)((led_engine_gamma[color->green] * brightness + 127) / 255);
+        led_palette_grb[i][1] = (uint8_t)((led_engine_gamma[color->red]   * brightness + 127) / 255);
+        led_palette_grb[i][2] = (uint8_t)((led_engine_gamma[color->blue]  * brightness + 127) / 255);
+    }
+}
+
+void led_engine_clear(void){
+    uint16_t i;
+    for (i = 0; i < led_num_leds; i++){
+        led_engine_set(i, 0);
+    }
+}
+
+void led_engine_set(uint16_t led, uint8_t color){
+    if ((led >= led_num_leds) || (color >= led_num_colors)) return;
+    uint8_t * pixel = &led_buffers[led_back][led * 3];
+    if (memcmp(pixel, led_palette_grb[color], 3) == 0) return;
+    memcpy(pixel, led_palette_grb[color], 3);
+    if (led < led_dirty_first){
+        led_dirty_first = led;
+    }
+    if (led > led_dirty_last){
+        led_dirty_last = led;
+    }
+}
+
+void led_engine_show(void){
+    led_stats.commits++;
+    if (led_dirty_first > led_dirty_last){
+        led_stats.unchanged++;
+        return;
+    }
+    if (led_busy){
+        // front buffer is still being sent, commit when done
+        led_stats.deferred++;
+        led_pending = true;
+        return;
+    }
+    // swap buffers and bring new back buffer up to date
+    uint16_t offset = led_dirty_first * 3;
+    uint16_t len    = (led_dirty_last - led_dirty_first + 1) * 3;
+    led_back ^= 1;
+    memcpy(&led_buffers[led_back][offset], &led_buffers[led_back ^ 1][offset], len);
+    led_engine_mark_clean();
+    led_engine_transmit();
+}
+
+void led_engine_play(const led_animation_t * animation){
+    if (led_animation == animation) return;
+    if ((led_animation != NULL) && !led_animation->loop){
+        led_animation_deferred = animation;
+        return;
+    }
+    led_engine_start_animation(animation);
+}
+
+void led_engine_stop(void){
+    led_animation = NULL;
+    led_animation_deferred = NULL;
+    btstack_run_loop_remove_timer(&led_animation_timer);
+}
+
+void led_engine_transmit_done(void){
+    led_busy = false;
+    if (led_pending){
+        led_engine_show();
+    }
+}
+
+const led_engine_stats_t * led_engine_get_stats(void){
+    return &led_stats;
+}
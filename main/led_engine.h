@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  led_engine.h
+ *
+ *  Event-driven renderer for WS2812 style LED strips. Drawing goes into a back buffer, a commit swaps it with
+ *  the front buffer only if pixels changed and starts a transmission if the output is idle. Changes made
+ *  during a transmission are sent when the output reports completion.
+ *
+ *  Colors are palette entries, converted once with a gamma and brightness lookup table. Animations are
+ *  constant tables of per-frame operations, so the cost of a frame only depends on the LEDs it changes.
+ *  The animation timer only runs while an animation is active.
+ */
+
+#ifndef LED_ENGINE_H
+#define LED_ENGINE_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef LED_ENGINE_MAX_LEDS
+#define LED_ENGINE_MAX_LEDS             64
+#endif
+
+#ifndef LED_ENGINE_MAX_COLORS
+#define LED_ENGINE_MAX_COLORS           16
+#endif
+
+#define LED_ENGINE_RETRY_MS             10
+
+typedef struct {
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+} led_color_t;
+
+/**
+ * Single operation of an animation frame: set LED to palette color
+ */
+typedef struct {
+    uint8_t led;
+    uint8_t color;
+} led_engine_op_t;
+
+typedef struct {
+    // operations of all frames, concatenated
+    const led_engine_op_t * ops;
+    // number of operations per frame
+    const uint8_t *         frame_ops;
+    uint8_t                 num_frames;
+    uint16_t                frame_ms;
+    // repeat animation, otherwise the last frame is kept and a deferred animation is started
+    bool                    loop;
+} led_animation_t;
+
+typedef enum {
+    LED_ENGINE_TX_STARTED = 0,  // led_engine_transmit_done will be called
+    LED_ENGINE_TX_DONE,         // completed synchronously
+    LED_ENGINE_TX_ERROR,        // retry later
+} led_engine_tx_status_t;
+
+typedef struct {
+    /**
+     * @brief Start transmission of GRB pixel data. Buffer stays valid until transmission is done
+     * @param pixels
+     * @param len
+     * @return status
+     */
+    led_engine_tx_status_t (*transmit)(const uint8_t * pixels, uint16_t len);
+} led_engine_output_t;
+
+typedef struct {
+    uint32_t commits;
+    uint32_t unchanged;
+    uint32_t deferred;
+    uint32_t transmissions;
+    uint32_t errors;
+    uint32_t animation_frames;
+} led_engine_stats_t;
+
+/* API_START */
+
+/**
+ * @brief Init engine
+ * @param output
+ * @param num_leds up to LED_ENGINE_MAX_LEDS
+ * @param palette of colors, up to LED_ENGINE_MAX_COLORS
+ * @param num_colors
+ * @param brightness 0..255
+ */
+void led_engine_init(const led_engine_output_t * output, uint16_t num_leds, const led_color_t * palette, uint8_t num_colors, uint8_t brightness);
+
+/**
+ * @brief Set brightness and recompute palette
+ * @param brightness 0..255
+ */
+void led_engine_set_brightness(uint8_t brightness);
+
+/**
+ * @brief Set all LEDs to color 0 in back buffer
+ */
+void led_engine_clear(void);
+
+/**
+ * @brief Set LED in back buffer
+ * @param led
+ * @param color index into palette
+ */
+void led_engine_set(uint16_t led, uint8_t color);
+
+/**
+ * @brief Commit back buffer, transmit if changed
+ */
+void led_engine_show(void);
+
+/**
+ * @brief Start animation. A running non-looping animation is completed first
+ * @param animation
+ */
+void led_engine_play(const led_animation_t * animation);
+
+/**
+ * @brief Stop animation, pixels are kept
+ */
+void led_engine_stop(void);
+
+/**
+ * @brief Report completed transmission, to be called from the main thread
+ */
+void led_engine_transmit_done(void);
+
+/**
+ * @brief Get statistics
+ * @return stats
+ */
+const led_engine_stats_t * led_engine_get_stats(void);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // LED_ENGINE_H
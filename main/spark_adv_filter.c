@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "spark_adv_filter.c"
+
+/*
+ *  spark_adv_filter.c
+ *
+ *  Stages are ordered by cost: event type, length and address only need the report header, the AD structures
+ *  are walked once and a report is dropped as soon as an AD structure rules it out. All model names share
+ *  the prefix " Spark ", which is compared once, the model is then picked by the first byte after it.
+ */
+
+#include <string.h>
+
+#include "spark_adv_filter.h"
+
+// AD types, see Bluetooth Assigned Numbers
+#define AD_TYPE_INCOMPLETE_16_BIT_UUIDS     0x02
+#define AD_TYPE_COMPLETE_16_BIT_UUIDS       0x03
+#define AD_TYPE_SHORTENED_LOCAL_NAME        0x08
+#define AD_TYPE_COMPLETE_LOCAL_NAME         0x09
+#define AD_TYPE_MANUFACTURER_SPECIFIC_DATA  0xff
+
+#define SPARK_SERVICE_UUID                  0xffc0
+#define SPARK_NAME_PREFIX                   " Spark "
+#define SPARK_NAME_PREFIX_LEN               7
+
+// random addresses with the two most significant bits 11 are static, everything else changes over time
+#define ADDR_TYPE_RANDOM                    0x01
+#define ADDR_RANDOM_STATIC_MASK             0xc0
+
+typedef struct {
+    const char * name;
+    const char * suffix;
+    uint8_t      suffix_len;
+} spark_model_info_t;
+
+// names are matched as prefix, like the amp's name was matched before
+static const spark_model_info_t spark_models[SPARK_MODEL_COUNT] = {
+    [SPARK_MODEL_40]   = { "Spark 40",   "40 BLE",   6 },
+    [SPARK_MODEL_MINI] = { "Spark MINI", "MINI BLE", 8 },
+    [SPARK_MODEL_GO]   = { "Spark GO",   "GO BLE",   6 },
+};
+
+// company IDs of manufacturer data that dominate crowded rooms: Microsoft, Apple, Samsung, Google
+static const uint16_t spark_adv_filter_foreign_companies[] = { 0x0006, 0x004c, 0x0075, 0x00e0 };
+
+static const char * spark_adv_filter_stage_names[SPARK_ADV_FILTER_STAGE_COUNT] = {
+    "length", "type", "address", "signature", "name"
+};
+
+static uint8_t spark_adv_filter_min_name_len;
+static uint8_t spark_adv_filter_min_adv_len;
+
+static spark_adv_filter_stats_t spark_adv_filter_stats;
+
+void spark_adv_filter_init(void){
+    uint8_t min_suffix_len = 0xff;
+    uint8_t i;
+    for (i = 0; i < SPARK_MODEL_COUNT; i++){
+        if (spark_models[i].suffix_len < min_suffix_len){
+            min_suffix_len = spark_models[i].suffix_len;
+        }
+    }
+    spark_adv_filter_min_name_len = SPARK_NAME_PREFIX_LEN + min_suffix_len;
+    // length and type byte of the name
+    spark_adv_filter_min_adv_len  = 2 + spark_adv_filter_min_name_len;
+    spark_adv_filter_reset_stats();
+}
+
+static spark_model_t spark_adv_filter_reject(spark_adv_filter_stage_t stage){
+    spark_adv_filter_stats.rejected[stage]++;
+    return SPARK_MODEL_NONE;
+}
+
+static bool spark_adv_filter_foreign_company(uint16_t company_id){
+    uint8_t i;
+    for (i = 0; i < sizeof(spark_adv_filter_foreign_companies) / sizeof(uint16_t); i++){
+        if (spark_adv_filter_foreign_companies[i] == company_id) return true;
+    }
+    return false;
+}
+
+static bool spark_adv_filter_has_service(const uint8_t * data, uint8_t len){
+    uint8_t pos;
+    for (pos = 0; (pos + 1) < len; pos += 2){
+        if ((data[pos] | (data[pos + 1] << 8)) == SPARK_SERVICE_UUID) return true;
+    }
+    return false;
+}
+
+static spark_model_t spark_adv_filter_match_name(const uint8_t * name, uint8_t name_len){
+    if (name_len < spark_adv_filter_min_name_len) return SPARK_MODEL_NONE;
+    if (memcmp(name, SPARK_NAME_PREFIX, SPARK_NAME_PREFIX_LEN) != 0) return SPARK_MODEL_NONE;
+    const uint8_t * suffix = &name[SPARK_NAME_PREFIX_LEN];
+    uint8_t suffix_len = name_len - SPARK_NAME_PREFIX_LEN;
+    uint8_t i;
+    for (i = 0; i < SPARK_MODEL_COUNT; i++){
+        const spark_model_info_t * model = &spark_models[i];
+        if (suffix[0] != (uint8_t) model->suffix[0]) continue;
+        if (suffix_len < model->suffix_len) continue;
+        if (memcmp(suffix, model->suffix, model->suffix_len) == 0) return (spark_model_t) i;
+    }
+    return SPARK_MODEL_NONE;
+}
+
+spark_model_t spark_adv_filter_match(uint8_t event_type, uint8_t addr_type, const uint8_t * addr,
+                                     const uint8_t * adv_data, uint8_t adv_len){
+    spark_adv_filter_stats.reports++;
+
+    // header only: amps are connectable and advertise their name, beacons and phones are not or rotate addresses
+    if (adv_len < spark_adv_filter_min_adv_len) return spark_adv_filter_reject(SPARK_ADV_FILTER_STAGE_LENGTH);
+    if ((event_type != SPARK_ADV_FILTER_EVENT_ADV_IND) && (event_type != SPARK_ADV_FILTER_EVENT_SCAN_RSP)){
+        return spark_adv_filter_reject(SPARK_ADV_FILTER_STAGE_TYPE);
+    }
+    if ((addr_type == ADDR_TYPE_RANDOM) && ((addr[0] & ADDR_RANDOM_STATIC_MASK) != ADDR_RANDOM_STATIC_MASK)){
+        return spark_adv_filter_reject(SPARK_ADV_FILTER_STAGE_ADDRESS);
+    }
+
+    // single pass over AD structures
+    const uint8_t * name = NULL;
+    uint8_t name_len = 0;
+    uint16_t pos = 0;
+    while ((pos + 1) < adv_len){
+        uint8_t len = adv_data[pos];
+        // padding
+        if (len == 0) break;
+        if ((pos + 1 + len) > adv_len) return spark_adv_filter_reject(SPARK_ADV_FILTER_STAGE_SIGNATURE);
+        uint8_t type = adv_data[pos + 1];
+        const uint8_t * data = &adv_data[pos + 2];
+        uint8_t data_len = len - 1;
+        switch (type){
+            case AD_TYPE_COMPLETE_16_BIT_UUIDS:
+                if (!spark_adv_filter_has_service(data, data_len)){
+                    return spark_adv_filter_reject(SPARK_ADV_FILTER_STAGE_SIGNATURE);
+                }
+                break;
+            case AD_TYPE_MANUFACTURER_SPECIFIC_DATA:
+                if ((data_len >= 2) && spark_adv_filter_foreign_company(data[0] | (data[1] << 8))){
+                    return spark_adv_filter_reject(SPARK_ADV_FILTER_STAGE_SIGNATURE);
+                }
+                break;
+            case AD_TYPE_SHORTENED_LOCAL_NAME:
+            case AD_TYPE_COMPLETE_LOCAL_NAME:
+                name = data;
+                name_len = data_len;
+                break;
+            default:
+                break;
+        }
+        pos += 1 + len;
+    }
+
+    if (name == NULL) return spark_adv_filter_reject(SPARK_ADV_FILTER_STAGE_NAME);
+    spark_model_t model = spark_adv_filter_match_name(name, name_len);
+    if (model == SPARK_MODEL_NONE) return spark_adv_filter_reject(SPARK_ADV_FILTER_STAGE_NAME);
+    spark_adv_filter_stats.accepted[model]++;
+    return model;
+}
+
+const char * spark_adv_filter_model_name(spark_model_t model){
+    if (model >= SPARK_MODEL_COUNT) return "unknown";
+    return spark_models[model].name;
+}
+
+const char * spark_adv_filter_stage_name(spark_adv_filter_stage_t stage){
+    if (stage >= SPARK_ADV_FILTER_STAGE_COUNT) return "?";
+    return spark_adv_filter_stage_names[stage];
+}
+
+const spark_adv_filter_stats_t * spark_adv_filter_get_stats(void){
+    return &spark_adv_filter_stats;
+}
+
+void spark_adv_filter_reset_stats(void){
+    memset(&spark_adv_filter_stats, 0, sizeof(spark_adv_filter_stats));
+}
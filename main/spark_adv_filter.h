@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  spark_adv_filter.h
+ *
+ *  Layered filter for advertising reports while scanning for amps. In a crowded room most reports are rejected
+ *  by their length, advertising event type or address type before the AD structures are looked at. The rest is
+ *  walked once: a complete list of 16-bit services without 0xFFC0 or manufacturer data of a phone or PC vendor
+ *  rejects the report right away, the local name is then matched against the table of supported amp models.
+ */
+
+#ifndef SPARK_ADV_FILTER_H
+#define SPARK_ADV_FILTER_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// advertising event types of GAP_EVENT_ADVERTISING_REPORT
+#define SPARK_ADV_FILTER_EVENT_ADV_IND          0x00
+#define SPARK_ADV_FILTER_EVENT_ADV_DIRECT_IND   0x01
+#define SPARK_ADV_FILTER_EVENT_ADV_SCAN_IND     0x02
+#define SPARK_ADV_FILTER_EVENT_ADV_NONCONN_IND  0x03
+#define SPARK_ADV_FILTER_EVENT_SCAN_RSP         0x04
+
+typedef enum {
+    SPARK_MODEL_40 = 0,
+    SPARK_MODEL_MINI,
+    SPARK_MODEL_GO,
+    SPARK_MODEL_COUNT,
+    SPARK_MODEL_NONE = SPARK_MODEL_COUNT
+} spark_model_t;
+
+typedef enum {
+    SPARK_ADV_FILTER_STAGE_LENGTH = 0,
+    SPARK_ADV_FILTER_STAGE_TYPE,
+    SPARK_ADV_FILTER_STAGE_ADDRESS,
+    SPARK_ADV_FILTER_STAGE_SIGNATURE,
+    SPARK_ADV_FILTER_STAGE_NAME,
+    SPARK_ADV_FILTER_STAGE_COUNT
+} spark_adv_filter_stage_t;
+
+typedef struct {
+    uint32_t reports;
+    uint32_t rejected[SPARK_ADV_FILTER_STAGE_COUNT];
+    uint32_t accepted[SPARK_MODEL_COUNT];
+} spark_adv_filter_stats_t;
+
+/* API_START */
+
+/**
+ * @brief Init filter, derives length limits from the model table
+ */
+void spark_adv_filter_init(void);
+
+/**
+ * @brief Check advertising report
+ * @param event_type advertising event type
+ * @param addr_type
+ * @param addr as returned by gap_event_advertising_report_get_address, most significant byte first
+ * @param adv_data
+ * @param adv_len
+ * @return model or SPARK_MODEL_NONE
+ */
+spark_model_t spark_adv_filter_match(uint8_t event_type, uint8_t addr_type, const uint8_t * addr,
+                                     const uint8_t * adv_data, uint8_t adv_len);
+
+/**
+ * @brief Get name of model
+ * @param model
+ * @return name
+ */
+const char * spark_adv_filter_model_name(spark_model_t model);
+
+/**
+ * @brief Get name of filter stage
+ * @param stage
+ * @return name
+ */
+const char * spark_adv_filter_stage_name(spark_adv_filter_stage_t stage);
+
+/**
+ * @brief Get statistics
+ * @return stats
+ */
+const spark_adv_filter_stats_t * spark_adv_filter_get_stats(void);
+
+/**
+ * @brief Reset statistics
+ */
+void spark_adv_filter_reset_stats(void);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // SPARK_ADV_FILTER_H
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "spark_amp_state.c"
+
+/*
+ *  spark_amp_state.c
+ *
+ *  Preset payload: <type> <preset> <uuid> <name> <version> <description> <icon> <bpm> <effects> <checksum>
+ *  with strings as 0xA0 | len or 0xD9 len, floats as 0xCA + 4 bytes, booleans as 0xC2 / 0xC3 and arrays as
+ *  0x90 | count. Each effect is <name> <on/off> <parameters>, each parameter <index> 0x91 <float>.
+ */
+
+#include <string.h>
+
+#include "spark_amp_state.h"
+
+#define SPARK_AMP_STATE_QUERY_ALL   (SPARK_AMP_STATE_DIRTY_CURRENT_PRESET | SPARK_AMP_STATE_DIRTY_CURRENT_TONE | \
+                                     SPARK_AMP_STATE_DIRTY_PRESET(0) | SPARK_AMP_STATE_DIRTY_PRESET(1) | \
+                                     SPARK_AMP_STATE_DIRTY_PRESET(2) | SPARK_AMP_STATE_DIRTY_PRESET(3))
+
+typedef struct {
+    const uint8_t * data;
+    uint16_t        len;
+    uint16_t        pos;
+    bool            error;
+} payload_reader_t;
+
+static uint8_t payload_read_byte(payload_reader_t * reader){
+    if (reader->pos >= reader->len){
+        reader->error = true;
+        return 0;
+    }
+    return reader->data[reader->pos++];
+}
+
+// copy string, truncated to buffer size. buffer can be NULL to skip string
+static void payload_read_string(payload_reader_t * reader, char * buffer, uint16_t size){
+    uint8_t marker = payload_read_byte(reader);
+    uint16_t len;
+    if ((marker & 0xe0) == 0xa0){
+        len = marker & 0x1f;
+    } else if (marker == 0xd9){
+        len = payload_read_byte(reader);
+    } else {
+        reader->error = true;
+        return;
+    }
+    if (reader->error || ((reader->pos + len) > reader->len)){
+        reader->error = true;
+        return;
+    }
+    if (buffer != NULL){
+        uint16_t copy_len = (len < size) ? len : (size - 1);
+        memcpy(buffer, &reader->data[reader->pos], copy_len);
+        buffer[copy_len] = 0;
+    }
+    reader->pos += len;
+}
+
+static bool payload_read_bool(payload_reader_t * reader){
+    uint8_t value = payload_read_byte(reader);
+    if ((value != 0xc2) && (value != 0xc3)){
+        reader->error = true;
+    }
+    return value == 0xc3;
+}
+
+static void payload_skip_float(payload_reader_t * reader){
+    if (payload_read_byte(reader) != 0xca){
+        reader->error = true;
+        return;
+    }
+    reader->pos += 4;
+    if (reader->pos > reader->len){
+        reader->error = true;
+    }
+}
+
+static uint8_t payload_read_array(payload_reader_t * reader){
+    uint8_t marker = payload_read_byte(reader);
+    if ((marker & 0xf0) != 0x90){
+        reader->error = true;
+        return 0;
+    }
+    return marker & 0x0f;
+}
+
+bool spark_amp_state_parse_preset(const uint8_t * payload, uint16_t payload_len, spark_amp_preset_t * preset){
+    payload_reader_t reader = { payload, payload_len, 2, false };
+    memset(preset, 0, sizeof(spark_amp_preset_t));
+    payload_read_string(&reader, NULL, 0);                                  // uuid
+    payload_read_string(&reader, preset->name, sizeof(preset->name));
+    payload_read_string(&reader, NULL, 0);                                  // version
+    payload_read_string(&reader, NULL, 0);                                  // description
+    payload_read_string(&reader, NULL, 0);                                  // icon
+    payload_skip_float(&reader);                                            // bpm
+    uint8_t num_effects = payload_read_array(&reader);
+    uint8_t i;
+    for (i = 0; (i < num_effects) && !reader.error; i++){
+        spark_amp_effect_t dummy;
+        spark_amp_effect_t * effect = (i < SPARK_AMP_STATE_NUM_EFFECTS) ? &preset->effects[i] : &dummy;
+        payload_read_string(&reader, effect->name, sizeof(effect->name));
+        effect->on = payload_read_bool(&reader);
+        uint8_t num_parameters = payload_read_array(&reader);
+        uint8_t j;
+        for (j = 0; (j < num_parameters) && !reader.error; j++){
+            payload_read_byte(&reader);                                     // index
+            payload_read_byte(&reader);                                     // 0x91
+            payload_skip_float(&reader);
+        }
+    }
+    preset->valid = !reader.error;
+    return preset->valid;
+}
+
+// received: parts of the state query answered by this update
+static void spark_amp_state_changed(spark_amp_state_t * state, uint16_t dirty, uint16_t received){
+    if (state->query_pending != 0){
+        state->query_pending &= ~received;
+        if (state->query_pending == 0){
+            state->synced = true;
+            dirty |= SPARK_AMP_STATE_DIRTY_SYNCED;
+        }
+    }
+    if (dirty == 0) return;
+    (*state->handler)(state->context, dirty);
+}
+
+static void spark_amp_state_select(spark_amp_state_t * state, uint8_t preset, uint16_t received){
+    uint16_t dirty = 0;
+    if (state->current_preset != preset){
+        state->current_preset = preset;
+        dirty |= SPARK_AMP_STATE_DIRTY_CURRENT_PRESET;
+    }
+    // current tone becomes the stored preset
+    if ((preset < SPARK_AMP_STATE_NUM_PRESETS) && state->presets[preset].valid){
+        if (memcmp(&state->current, &state->presets[preset], sizeof(spark_amp_preset_t)) != 0){
+            state->current = state->presets[preset];
+            dirty |= SPARK_AMP_STATE_DIRTY_CURRENT_TONE | SPARK_AMP_STATE_DIRTY_EFFECTS;
+        }
+    }
+    spark_amp_state_changed(state, dirty, received);
+}
+
+static void spark_amp_state_preset_received(spark_amp_state_t * state, const spark_message_t * message){
+    if (message->payload_len < 2) return;
+    spark_amp_preset_t preset;
+    if (!spark_amp_state_parse_preset(message->payload, message->payload_len, &preset)) return;
+
+    uint16_t dirty = 0;
+    if (message->payload[0] == SPARK_AMP_STATE_PRESET_TYPE_CURRENT){
+        if (memcmp(&state->current, &preset, sizeof(spark_amp_preset_t)) != 0){
+            state->current = preset;
+            dirty = SPARK_AMP_STATE_DIRTY_CURRENT_TONE | SPARK_AMP_STATE_DIRTY_EFFECTS;
+        }
+        spark_amp_state_changed(state, dirty, SPARK_AMP_STATE_DIRTY_CURRENT_TONE);
+        return;
+    }
+
+    uint8_t number = message->payload[1];
+    if (number >= SPARK_AMP_STATE_NUM_PRESETS) return;
+    if (memcmp(&state->presets[number], &preset, sizeof(spark_amp_preset_t)) != 0){
+        state->presets[number] = preset;
+        dirty = SPARK_AMP_STATE_DIRTY_PRESET(number);
+    }
+    spark_amp_state_changed(state, dirty, SPARK_AMP_STATE_DIRTY_PRESET(number));
+}
+
+void spark_amp_state_init(spark_amp_state_t * state, spark_amp_state_handler_t handler, void * context){
+    state->handler = handler;
+    state->context = context;
+    spark_amp_state_reset(state);
+}
+
+void spark_amp_state_reset(spark_amp_state_t * state){
+    state->current_preset = SPARK_AMP_STATE_PRESET_UNKNOWN;
+    memset(&state->current, 0, sizeof(state->current));
+    memset(state->presets, 0, sizeof(state->presets));
+    state->query_pending = 0;
+    state->synced = false;
+}
+
+void spark_amp_state_query_started(spark_amp_state_t * state){
+    state->query_pending = SPARK_AMP_STATE_QUERY_ALL;
+    state->synced = false;
+}
+
+static bool spark_amp_state_effect_onoff(spark_amp_state_t * state, const spark_message_t * message){
+    payload_reader_t reader = { message->payload, message->payload_len, 0, false };
+    char effect_name[SPARK_AMP_STATE_NAME_LEN];
+    payload_read_string(&reader, effect_name, sizeof(effect_name));
+    bool on = payload_read_bool(&reader);
+    if (reader.error) return false;
+    int index = spark_amp_state_find_effect(state, effect_name);
+    if ((index < 0) || (state->current.effects[index].on == on)) return true;
+    state->current.effects[index].on = on;
+    spark_amp_state_changed(state, SPARK_AMP_STATE_DIRTY_EFFECTS, 0);
+    return true;
+}
+
+// write by another client, e.g. the app in relay mode. The amp only acknowledges it
+static bool spark_amp_state_process_write(spark_amp_state_t * state, const spark_message_t * message){
+    spark_amp_preset_t preset;
+    switch (message->sub_command){
+        case SPARK_SUB_SELECT_PRESET:
+            if (message->payload_len < 2) return false;
+            spark_amp_state_select(state, message->payload[1], 0);
+            return true;
+        case SPARK_SUB_PRESET:
+            // uploaded preset becomes the current tone
+            if (!spark_amp_state_parse_preset(message->payload, message->payload_len, &preset)) return false;
+            spark_amp_state_set_current_tone(state, &preset);
+            return true;
+        case SPARK_SUB_EFFECT_ONOFF:
+            return spark_amp_state_effect_onoff(state, message);
+        default:
+            return false;
+    }
+}
+
+bool spark_amp_state_process_message(spark_amp_state_t * state, const spark_message_t * message){
+    if ((message->direction == SPARK_DIRECTION_TO_AMP) && (message->command == SPARK_CMD_WRITE)){
+        return spark_amp_state_process_write(state, message);
+    }
+    if (message->direction != SPARK_DIRECTION_FROM_AMP) return false;
+    if (message->command != SPARK_CMD_RESPONSE) return false;
+
+    switch (message->sub_command){
+        case SPARK_SUB_CURRENT_PRESET:
+        case SPARK_SUB_SELECT_PRESET:
+            // preset reported by amp, either requested or changed on amp or by app
+            if (message->payload_len < 2) return false;
+            spark_amp_state_select(state, message->payload[1], SPARK_AMP_STATE_DIRTY_CURRENT_PRESET);
+            return true;
+        case SPARK_SUB_PRESET:
+            spark_amp_state_preset_received(state, message);
+            return true;
+        case SPARK_SUB_EFFECT_ONOFF:
+            return spark_amp_state_effect_onoff(state, message);
+        default:
+            return false;
+    }
+}
+
+void spark_amp_state_set_current_preset(spark_amp_state_t * state, uint8_t preset){
+    spark_amp_state_select(state, preset, 0);
+}
+
+void spark_amp_state_set_current_tone(spark_amp_state_t * state, const spark_amp_preset_t * preset){
+    if (memcmp(&state->current, preset, sizeof(spark_amp_preset_t)) == 0) return;
+    state->current = *preset;
+    spark_amp_state_changed(state, SPARK_AMP_STATE_DIRTY_CURRENT_TONE | SPARK_AMP_STATE_DIRTY_EFFECTS, 0);
+}
+
+void spark_amp_state_set_effect_onoff(spark_amp_state_t * state, const char * effect_name, bool on){
+    int index = spark_amp_state_find_effect(state, effect_name);
+    if ((index < 0) || (state->current.effects[index].on == on)) return;
+    state->current.effects[index].on = on;
+    spark_amp_state_changed(state, SPARK_AMP_STATE_DIRTY_EFFECTS, 0);
+}
+
+int spark_amp_state_find_effect(const spark_amp_state_t * state, const char * effect_name){
+    int i;
+    for (i = 0; i < SPARK_AMP_STATE_NUM_EFFECTS; i++){
+        if (strncmp(state->current.effects[i].name, effect_name, SPARK_AMP_STATE_NAME_LEN - 1) == 0) return i;
+    }
+    return -1;
+}
+
+bool spark_amp_state_is_synced(const spark_amp_state_t * state){
+    return state->synced;
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  spark_amp_state.h
+ *
+ *  Local mirror of the amp state: current preset, name and effect chain of the current tone and of the
+ *  hardware presets, and the on/off state of each effect slot. The mirror is filled by a state query after
+ *  connect and kept up to date from the decoded messages of the amp and the writes of other clients, e.g. the
+ *  Spark app in relay mode, so readers never need a round trip.
+ *  Changes are reported to a single handler together with dirty flags.
+ */
+
+#ifndef SPARK_AMP_STATE_H
+#define SPARK_AMP_STATE_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "spark_protocol.h"
+
+#define SPARK_AMP_STATE_NUM_PRESETS         4
+#define SPARK_AMP_STATE_NUM_EFFECTS         7
+#define SPARK_AMP_STATE_NAME_LEN            24
+
+#define SPARK_AMP_STATE_PRESET_UNKNOWN      0xff
+
+// dirty flags
+#define SPARK_AMP_STATE_DIRTY_CURRENT_PRESET    (1u << 0)
+#define SPARK_AMP_STATE_DIRTY_CURRENT_TONE      (1u << 1)
+#define SPARK_AMP_STATE_DIRTY_EFFECTS           (1u << 2)
+#define SPARK_AMP_STATE_DIRTY_SYNCED            (1u << 3)
+#define SPARK_AMP_STATE_DIRTY_PRESET(preset)    (1u << (4 + (preset)))
+
+// preset type in preset request and response
+#define SPARK_AMP_STATE_PRESET_TYPE_HARDWARE    0x00
+#define SPARK_AMP_STATE_PRESET_TYPE_CURRENT     0x01
+
+typedef struct {
+    char name[SPARK_AMP_STATE_NAME_LEN];
+    bool on;
+} spark_amp_effect_t;
+
+typedef struct {
+    bool               valid;
+    char               name[SPARK_AMP_STATE_NAME_LEN];
+    spark_amp_effect_t effects[SPARK_AMP_STATE_NUM_EFFECTS];
+} spark_amp_preset_t;
+
+/**
+ * @brief Callback for state changes
+ * @param context provided in spark_amp_state_init
+ * @param dirty flags of changed parts
+ */
+typedef void (*spark_amp_state_handler_t)(void * context, uint16_t dirty);
+
+typedef struct {
+    spark_amp_state_handler_t handler;
+    void *                    context;
+
+    uint8_t            current_preset;
+    spark_amp_preset_t current;
+    spark_amp_preset_t presets[SPARK_AMP_STATE_NUM_PRESETS];
+
+    // responses expected for state query
+    uint16_t           query_pending;
+    bool               synced;
+} spark_amp_state_t;
+
+/* API_START */
+
+/**
+ * @brief Init state
+ * @param state
+ * @param handler for changes
+ * @param context passed to handler
+ */
+void spark_amp_state_init(spark_amp_state_t * state, spark_amp_state_handler_t handler, void * context);
+
+/**
+ * @brief Forget all state, e.g. after disconnect. The handler is not called
+ * @param state
+ */
+void spark_amp_state_reset(spark_amp_state_t * state);
+
+/**
+ * @brief Mark state as being queried. Sync completes when current preset, current tone and all hardware
+ *        presets have been received
+ * @param state
+ */
+void spark_amp_state_query_started(spark_amp_state_t * state);
+
+/**
+ * @brief Parse preset payload as used in preset response and preset write
+ * @param payload
+ * @param payload_len
+ * @param preset
+ * @return true if valid
+ */
+bool spark_amp_state_parse_preset(const uint8_t * payload, uint16_t payload_len, spark_amp_preset_t * preset);
+
+/**
+ * @brief Update state from decoded message of the amp, or from a write to the amp by another client, e.g. the
+ *        Spark app connected through the relay
+ * @param state
+ * @param message
+ * @return true if message was used
+ */
+bool spark_amp_state_process_message(spark_amp_state_t * state, const spark_message_t * message);
+
+/**
+ * @brief Update current preset for preset selected by pedal. Current tone is taken from the hardware preset
+ * @param state
+ * @param preset
+ */
+void spark_amp_state_set_current_preset(spark_amp_state_t * state, uint8_t preset);
+
+/**
+ * @brief Update current tone for preset uploaded by pedal. The selected hardware preset does not change
+ * @param state
+ * @param preset
+ */
+void spark_amp_state_set_current_tone(spark_amp_state_t * state, const spark_amp_preset_t * preset);
+
+/**
+ * @brief Update on/off state of effect in current tone for change requested by pedal
+ * @param state
+ * @param effect_name
+ * @param on
+ */
+void spark_amp_state_set_effect_onoff(spark_amp_state_t * state, const char * effect_name, bool on);
+
+/**
+ * @brief Get index of effect slot in current tone
+ * @param state
+ * @param effect_name
+ * @return index or -1 if not found
+ */
+int spark_amp_state_find_effect(const spark_amp_state_t * state, const char * effect_name);
+
+/**
+ * @brief Check if state query is complete
+ * @param state
+ * @return true if synced
+ */
+bool spark_amp_state_is_synced(const spark_amp_state_t * state);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // SPARK_AMP_STATE_H
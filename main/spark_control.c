@@ -48,589 +48,4037 @@
 
 #include "btstack.h"
 
-// #define LOG_MESSAGES
+#include "spark_control.h"
+#include "spark_protocol.h"
+#include "spark_amp_state.h"
+#include "latency_histogram.h"
+#include "led_engine.h"
+#include "tap_tempo.h"
+#include "expression_pedal.h"
+#include "spark_adv_filter.h"
+#include "trace_log.h"
+
+// GATT database of relay mode, generated from spark_relay_db.gatt
+#include "spark_relay_db.h"
+
+// amps driven concurrently, each one uses an LE connection of the controller
+#ifndef SPARK_MAX_AMPS
+#define SPARK_MAX_AMPS 2
+#endif
+
+// relay mode uses one more connection for the Spark app
+#if defined(CONFIG_BTDM_CTRL_BLE_MAX_CONN) && ((SPARK_MAX_AMPS + 1) > CONFIG_BTDM_CTRL_BLE_MAX_CONN)
+#error "SPARK_MAX_AMPS plus relay connection exceeds CONFIG_BTDM_CTRL_BLE_MAX_CONN"
+#endif
 
-static const char spark_40_device_name[]          = " Spark 40 BLE";
 static uint16_t   spark_40_service_uuid           = 0xffc0;
 static uint16_t   spark_40_characteristic_tx_uuid = 0xffc1;
 static uint16_t   spark_40_characteristic_rx_uuid = 0xffc2;
 
-static bd_addr_t                    spark_40_addr;
-static uint8_t                      spark_40_addr_type;
-static hci_con_handle_t             spark_40_connection_handle;
-static gatt_client_service_t        spark_40_service;
-static gatt_client_characteristic_t spark_40_characteristic_rx;
-static gatt_client_characteristic_t spark_40_characteristic_tx;
-static gatt_client_notification_t   spark_40_notification_listener;
-static uint8_t                      spark_40_preset;
+// outgoing commands, frames of up to COMMAND_MAX_FRAME_LEN are encoded into the command, larger ones into a shared buffer.
+// Frames are split into blocks that fit into a single write with the negotiated ATT MTU
+#define COMMAND_POOL_SIZE       (8 * SPARK_MAX_AMPS)
+#define COMMAND_MAX_FRAME_LEN   SPARK_BLOCK_MAX_LEN_TO_AMP
+#define COMMAND_LARGE_FRAME_LEN 1536
+#define COMMAND_MAX_RETRIES     3
+#define COMMAND_RETRY_DELAY_MS  10
+// no sequence: not written yet or lost, sequences of the amp are 7 bit
+#define COMMAND_SEQUENCE_NONE   0xff
+
+// writes that change the tone are kept until the amp acknowledges them. They are sent again once setup completes after a
+// reconnect, after a dropped write, and if the acknowledgement does not arrive in time, so the amp ends up with the latest
+// preset and effect states selected on the pedal. The amp does not acknowledge effects missing in its signal chain
+#define COMMAND_RETAINED_COUNT       (1 + SPARK_AMP_STATE_NUM_EFFECTS)
+#define COMMAND_RETAINED_PRESET      0
+#define COMMAND_RETAINED_MAX_PAYLOAD (SPARK_AMP_STATE_NAME_LEN + 2)
+#define COMMAND_RETAINED_TIMEOUT_MS  1000
+#define COMMAND_RETAINED_MAX_REPLAYS 5
+
+// identifies the short frame header kept in a command
+#define COMMAND_FRAME_KEY(command, sub_command, payload_len) \
+    (0x1000000u | ((uint32_t)(command) << 16) | ((uint32_t)(sub_command) << 8) | (payload_len))
+
+typedef struct {
+    btstack_linked_item_t item;
+    uint8_t   command;
+    uint8_t   sub_command;
+    uint8_t   retries;
+    // frame or large frame buffer, sent one block per write
+    uint8_t * data;
+    uint16_t  len;
+    uint16_t  sent;
+    uint16_t  block_len;
+    uint32_t  queued_us;
+    uint8_t   sequence;
+    uint32_t  frame_key;
+    uint8_t   frame_len;
+    uint8_t   frame[COMMAND_MAX_FRAME_LEN];
+} command_t;
+
+// latest preset selection or on/off state of one effect
+typedef struct {
+    bool     active;
+    uint8_t  sub_command;
+    // of the queued or written command, COMMAND_SEQUENCE_NONE to send it again
+    uint8_t  sequence;
+    uint8_t  replays;
+    uint8_t  payload_len;
+    uint8_t  payload[COMMAND_RETAINED_MAX_PAYLOAD];
+    uint32_t sent_ms;
+} command_retained_t;
+
+// pool and large frame buffer are shared by all amps
+static command_t              command_pool[COMMAND_POOL_SIZE];
+static btstack_linked_list_t  command_free_list;
+static uint8_t                command_large_frame[COMMAND_LARGE_FRAME_LEN];
+static command_t *            command_large_frame_owner;
+
+static struct {
+    uint32_t queued;
+    uint32_t coalesced;
+    uint32_t sent;
+    uint32_t retries;
+    uint32_t dropped;
+    uint32_t replayed;
+    uint8_t  depth;
+    uint8_t  depth_max;
+    uint32_t time_to_send_min_us;
+    uint32_t time_to_send_max_us;
+    uint64_t time_to_send_total_us;
+} command_stats;
+
+// connection parameter profiles, interval in 1.25 ms, supervision timeout in 10 ms units
+#define CONNECTION_PROFILE_PERFORMANCE          0
+#define CONNECTION_PROFILE_PERFORMANCE_FALLBACK 1
+#define CONNECTION_PROFILE_POWER                2
+#define CONNECTION_PROFILE_NONE                 0xff
+
+#define CONNECTION_IDLE_TIMEOUT_MS              30000
+
+typedef struct {
+    const char * name;
+    uint16_t     conn_interval_min;
+    uint16_t     conn_interval_max;
+    uint16_t     conn_latency;
+    uint16_t     supervision_timeout;
+    uint8_t      fallback;
+} connection_profile_t;
+
+static const connection_profile_t connection_profiles[] = {
+    // 7.5 - 15 ms, commands reach the amp in the next connection event
+    { "performance",          6, 12, 0, 200, CONNECTION_PROFILE_PERFORMANCE_FALLBACK },
+    { "performance fallback", 12, 24, 0, 200, CONNECTION_PROFILE_NONE },
+    // 60 - 75 ms, amp may skip up to 4 connection events while idle
+    { "power",                48, 60, 4, 500, CONNECTION_PROFILE_NONE },
+};
+
+// link negotiated per connection: ATT MTU, LE Data Length Extension and LE 2M PHY, both sides may lack support
+#define LINK_MAX_TX_OCTETS                      251
+#define LINK_MAX_TX_TIME_US                     2120
+#define LINK_DEFAULT_OCTETS                     27
+#define LINK_PHY_1M                             1
+#define LINK_PHY_2M                             2
+#define LINK_PHY_MASK_2M                        0x02
+#define LINK_RETRY_DELAY_MS                     10
+
+typedef struct {
+    uint16_t mtu;
+    uint16_t tx_octets;
+    uint16_t rx_octets;
+    uint8_t  tx_phy;
+    uint8_t  rx_phy;
+    uint8_t  data_length_requested;
+} link_info_t;
+
+// preset dump transfer time, from request written to complete response
+#define PRESET_DUMP_MAX_PENDING                 8
+#define PRESET_DUMP_TIMEOUT_US                  2000000
+
+static uint32_t               preset_dump_bytes;
+static latency_histogram_t    preset_dump_histogram;
+
+// press to amp latency, a press is fanned out to all connected amps
+typedef enum {
+    LATENCY_STAGE_EDGE_TO_SELECT = 0,
+    LATENCY_STAGE_SELECT_TO_QUEUED,
+    LATENCY_STAGE_QUEUED_TO_WRITTEN,
+    LATENCY_STAGE_WRITTEN_TO_CONFIRMED,
+    LATENCY_STAGE_EDGE_TO_CONFIRMED,
+    LATENCY_STAGE_AMP_SKEW,
+    LATENCY_STAGE_MACRO_COMMAND,
+    LATENCY_STAGE_MACRO_COMPLETE,
+    LATENCY_STAGE_EXPRESSION,
+    LATENCY_STAGE_EDGE_TO_UPLOADED,
+    LATENCY_STAGE_BANK_SWITCH,
+    LATENCY_STAGE_COUNT
+} latency_stage_t;
+
+static const char * latency_stage_names[LATENCY_STAGE_COUNT] = {
+    "edge -> select",
+    "select -> queued",
+    "queued -> written",
+    "written -> confirmed",
+    "edge -> confirmed",
+    "amp skew",
+    "macro command",
+    "edge -> macro done",
+    "pedal -> confirmed",
+    "edge -> uploaded",
+    "bank switch",
+};
+
+typedef enum {
+    PRESS_TRACE_IDLE = 0,
+    PRESS_TRACE_EDGE,
+    PRESS_TRACE_SELECTED,
+    PRESS_TRACE_QUEUED,
+    PRESS_TRACE_WRITTEN,
+} press_trace_state_t;
+
+static latency_histogram_t latency_histograms[LATENCY_STAGE_COUNT];
+static press_trace_state_t press_trace_state;
+static uint32_t            press_trace_edge_us;
+// skew between first and last amp that confirmed the press
+static uint8_t             press_trace_amps;
+static uint8_t             press_trace_confirmed_amps;
+static uint32_t            press_trace_first_confirmed_us;
+
+// macros: a button fires a sequence of commands. They are queued at once and written back to back, the preset
+// change goes first. Effect slots refer to the signal chain of the selected preset
+#define MACRO_MAX_STEPS             6
+
+// effect slots in the signal chain of a preset
+#define EFFECT_SLOT_NOISE_GATE      0
+#define EFFECT_SLOT_COMPRESSOR      1
+#define EFFECT_SLOT_DRIVE           2
+#define EFFECT_SLOT_AMP             3
+#define EFFECT_SLOT_MODULATION      4
+#define EFFECT_SLOT_DELAY           5
+#define EFFECT_SLOT_REVERB          6
+
+typedef enum {
+    MACRO_STEP_SELECT_PRESET = 0,
+    MACRO_STEP_EFFECT_ON,
+    MACRO_STEP_EFFECT_OFF,
+    MACRO_STEP_EFFECT_TOGGLE,
+    MACRO_STEP_TAP_TEMPO,
+} macro_step_type_t;
+
+typedef struct {
+    macro_step_type_t type;
+    // preset or effect slot
+    uint8_t           value;
+} macro_step_t;
+
+typedef struct {
+    uint8_t      num_steps;
+    macro_step_t steps[MACRO_MAX_STEPS];
+} macro_t;
+
+// indexed by button, the 4th macro is only reachable via the console, tap tempo also via the 4th footswitch
+static const macro_t macros[] = {
+    { 1, { { MACRO_STEP_SELECT_PRESET, 0 } } },
+    { 1, { { MACRO_STEP_SELECT_PRESET, 1 } } },
+    { 1, { { MACRO_STEP_SELECT_PRESET, 2 } } },
+    { 3, { { MACRO_STEP_SELECT_PRESET, 3 }, { MACRO_STEP_EFFECT_ON, EFFECT_SLOT_DELAY }, { MACRO_STEP_EFFECT_TOGGLE, EFFECT_SLOT_REVERB } } },
+    { 1, { { MACRO_STEP_TAP_TEMPO, 0 } } },
+};
+#define MACRO_TAP_TEMPO             4
+#define MACRO_COUNT (sizeof(macros) / sizeof(macro_t))
+
+// commands queued while a macro runs are tracked until acknowledged by the amp
+static bool     macro_running;
+static uint32_t macro_edge_us;
+
+// tap tempo sets the time of the delay in the current preset. The Spark delays take the time as a
+// normalized parameter, 1.0 is TAP_TEMPO_DELAY_MAX_US
+#define TAP_TEMPO_DELAY_PARAMETER   1
+#define TAP_TEMPO_DELAY_MAX_US      1000000
+#define TAP_TEMPO_LED               0
+
+static tap_tempo_t tap_tempo;
+
+// expression pedal sweeps the master volume of the amp. Positions are streamed latest value wins: at most one
+// parameter write per connection interval and only if nothing else is queued, so values don't queue up
+#define EXPRESSION_EFFECT_SLOT      EFFECT_SLOT_AMP
+#define EXPRESSION_PARAMETER        4
+#define EXPRESSION_POSITION_NONE    0xffff
+
+static bool     expression_valid;
+static uint16_t expression_position;
+static uint32_t expression_sample_us;
+
+static struct {
+    uint32_t changes;
+    uint32_t sent;
+    uint32_t superseded;
+    uint32_t skipped;
+    uint32_t second_start_ms;
+    uint32_t second_sent;
+    uint32_t seconds_active;
+    uint32_t max_per_second;
+} expression_stats;
+
+static struct {
+    uint32_t fired;
+    uint32_t commands;
+    uint32_t skipped;
+    uint32_t completed;
+    uint32_t incomplete;
+} macro_stats;
+
+// preset banks: bank 0 are the hardware presets of the amp, the other banks are stored on the pedal and
+// uploaded as current tone. The slots of the active bank and the slot of the next bank that a bank switch
+// lands on are encoded in the background, so a slot change or bank switch only copies a ready frame into the
+// large frame buffer. A long press switches to the next bank
+#define PRESET_BANK_COUNT               4
+#define PRESET_BANK_SLOTS               3
+#define PRESET_BANK_HARDWARE            0
+#define PRESET_BANK_NONE                0xff
+#define PRESET_BANK_MAX_PAYLOAD         SPARK_READER_MAX_PAYLOAD
+#define PRESET_BANK_FRAME_LEN           COMMAND_LARGE_FRAME_LEN
+#define PRESET_BANK_LONG_PRESS_MS       SPARK_CONTROL_LONG_PRESS_MS
+#define PRESET_BANK_PREFETCH_PERIOD_MS  2
+// active bank plus one slot of the next bank
+#define PRESET_BANK_CACHE_SIZE          (PRESET_BANK_SLOTS + 1)
+#define PRESET_BANK_TAG(bank, slot)     (((uint32_t) 'S' << 24) | ((uint32_t) 'P' << 16) | ((uint32_t) 'B' << 8) | ((bank) << 4) | (slot))
+
+typedef enum {
+    PRESET_BANK_SLOT_UNKNOWN = 0,
+    PRESET_BANK_SLOT_EMPTY,
+    PRESET_BANK_SLOT_READY,
+} preset_bank_slot_state_t;
+
+// upload frame of one slot, encoded with sequence 0 for the smallest block size of the connected amps
+typedef struct {
+    uint8_t                  bank;
+    uint8_t                  slot;
+    uint8_t                  block_max_len;
+    preset_bank_slot_state_t state;
+    uint16_t                 frame_len;
+    spark_amp_preset_t       tone;
+    uint8_t                  frame[PRESET_BANK_FRAME_LEN];
+} preset_bank_frame_t;
+
+static preset_bank_frame_t    bank_cache[PRESET_BANK_CACHE_SIZE];
+static uint8_t                bank_payload[PRESET_BANK_MAX_PAYLOAD];
+static uint8_t                bank_active;
+static uint8_t                bank_slot;
+static btstack_timer_source_t bank_prefetch_timer;
+static bool                   bank_prefetch_active;
+// uploads waiting for the large frame buffer
+static btstack_timer_source_t bank_pending_timer;
+static btstack_timer_source_t bank_long_press_timer;
+static uint8_t                bank_long_press_button;
+static bool                   bank_long_press_pending;
+// short presses of the footswitches that ran their slot or macro on release
+static uint32_t               footswitch_presses;
+static uint8_t                bank_capture_bank;
+static uint8_t                bank_capture_slot;
+
+// bank switch from request until all amps confirmed the new preset
+static uint32_t               bank_switch_start_us;
+static uint8_t                bank_switch_amps;
+static uint8_t                bank_switch_confirmed_amps;
+// bank switch from request until all uploads are queued
+static latency_histogram_t    bank_switch_prepare_histogram;
+
+static struct {
+    uint32_t switches;
+    uint32_t uploads;
+    uint32_t prefetched;
+    uint32_t encoded_on_demand;
+    uint32_t replaced;
+    uint32_t waited;
+    uint32_t empty;
+    uint32_t prefetch_steps;
+    uint32_t stored;
+} bank_stats;
 
 static btstack_packet_callback_registration_t hci_event_callback_registration;
 static btstack_packet_callback_registration_t sm_event_callback_registration;
 
-static enum {
-    APP_STATE_W4_SPARK_ADV,
-    APP_STATE_W4_SERVICE,
-    APP_STATE_W4_RX_CHARACTERISTIC,
-    APP_STATE_W4_TX_CHARACTERISTIC,
-    APP_STATE_W4_RX_SUBSCRIBED,
-    APP_STATE_CONNECTED
-} app_state;
+// cached amp address and GATT handles for fast reconnect, one entry per amp slot. Slot 0 uses 'SPKC'
+#define SPARK_40_CACHE_TAG(index)   (((uint32_t) 'S' << 24) | ((uint32_t) 'P' << 16) | ((uint32_t) 'K' << 8) | ('C' + (index)))
+#define FAST_RECONNECT_TIMEOUT_MS   3000
+
+typedef struct {
+    bd_addr_t                    addr;
+    uint8_t                      addr_type;
+    uint8_t                      handles_valid;
+    gatt_client_service_t        service;
+    gatt_client_characteristic_t characteristic_rx;
+    gatt_client_characteristic_t characteristic_tx;
+    uint16_t                     rx_cccd_handle;
+} spark_40_cache_t;
+
+// amps known to all idle slots are scanned for passively with the controller's filter accept list, otherwise
+// scanning is active to get the name of unknown amps
+typedef enum {
+    SCAN_MODE_DISCOVERY = 0,
+    SCAN_MODE_ACCEPT_LIST,
+    SCAN_MODE_COUNT
+} scan_mode_t;
+
+// duty cycle schedule after an amp was lost: aggressive first, then backing off. While an amp is connected,
+// scanning stays in the background to keep its connection events on time
+typedef enum {
+    SCAN_PHASE_AGGRESSIVE = 0,
+    SCAN_PHASE_RELAXED,
+    SCAN_PHASE_BACKGROUND,
+    SCAN_PHASE_COUNT
+} scan_phase_t;
+
+typedef struct {
+    const char * name;
+    // phase ends this long after the amp was lost, 0 = open end
+    uint32_t     until_ms;
+    uint16_t     scan_interval;
+    uint16_t     scan_window;
+} scan_phase_info_t;
+
+static const scan_phase_info_t scan_phases[SCAN_PHASE_COUNT] = {
+    [SCAN_PHASE_AGGRESSIVE] = { "aggressive", 5000,  0x0030, 0x0030 },
+    [SCAN_PHASE_RELAXED]    = { "relaxed",    30000, 0x0060, 0x0030 },
+    [SCAN_PHASE_BACKGROUND] = { "background", 0,     0x0300, 0x0030 },
+};
+
+static const char * scan_mode_names[SCAN_MODE_COUNT] = { "discovery", "accept list" };
+static const trace_event_t scan_mode_trace_events[SCAN_MODE_COUNT] = { TRACE_EVENT_SCAN_START_DISCOVERY, TRACE_EVENT_SCAN_START_ACCEPT_LIST };
+
+#define SCAN_TYPE_PASSIVE               0
+#define SCAN_TYPE_ACTIVE                1
+#define SCAN_FILTER_POLICY_ALL          0
+#define SCAN_FILTER_POLICY_ACCEPT_LIST  1
+
+typedef struct {
+    uint32_t time_ms;
+    uint32_t reports;
+} scan_phase_stats_t;
+
+typedef struct {
+    uint32_t            found;
+    // time from losing the amp (or boot) until it is found again
+    latency_histogram_t rediscover_ms;
+    scan_phase_stats_t  phases[SCAN_PHASE_COUNT];
+} scan_mode_stats_t;
+
+static bool                   scanning;
+static scan_mode_t            scan_mode;
+static scan_phase_t           scan_phase;
+static uint32_t               scan_phase_start_ms;
+static btstack_timer_source_t scan_phase_timer;
+static scan_mode_stats_t      scan_stats[SCAN_MODE_COUNT];
+static btstack_timer_source_t fast_reconnect_timer;
+
+// connection setup pipeline, steps are started as soon as the steps they require are done. The PHY update is
+// run by the controller and overlaps with the GATT Client queries
+typedef enum {
+    SETUP_STEP_UPDATE_PHY = 0,
+    SETUP_STEP_EXCHANGE_MTU,
+    SETUP_STEP_DISCOVER_SERVICE,
+    SETUP_STEP_DISCOVER_CHARACTERISTICS,
+    SETUP_STEP_ENABLE_NOTIFICATIONS,
+    SETUP_STEP_COUNT,
+    SETUP_STEP_NONE = SETUP_STEP_COUNT
+} setup_step_t;
+
+#define SETUP_STEP_FLAG(step) (1u << (step))
+#define SETUP_STEPS_ALL       (SETUP_STEP_FLAG(SETUP_STEP_COUNT) - 1u)
+
+typedef enum {
+    AMP_STATE_IDLE = 0,
+    AMP_STATE_W4_CONNECTION,
+    AMP_STATE_SETUP,
+    AMP_STATE_CONNECTED
+} amp_state_t;
+
+// per amp connection context from a static pool
+typedef struct {
+    uint8_t                      index;
+    amp_state_t                  state;
+
+    bd_addr_t                    addr;
+    uint8_t                      addr_type;
+    spark_model_t                model;
+    hci_con_handle_t             con_handle;
+    gatt_client_service_t        service;
+    gatt_client_characteristic_t characteristic_rx;
+    gatt_client_characteristic_t characteristic_tx;
+    uint16_t                     rx_cccd_handle;
+    gatt_client_notification_t   notification_listener;
+    spark_amp_state_t            spark_state;
+    uint32_t                     state_query_ms;
+    spark_reader_t               reader;
+
+    // fast reconnect
+    spark_40_cache_t             cache;
+    bool                         cache_valid;
+    bool                         cache_unreachable;
+    bool                         using_cache;
+
+    // setup pipeline
+    uint16_t                     setup_steps_started;
+    uint16_t                     setup_steps_done;
+    setup_step_t                 setup_gatt_step;
+    uint32_t                     setup_start_ms;
+    uint32_t                     setup_connected_ms;
+    uint32_t                     setup_step_start_ms[SETUP_STEP_COUNT];
+    bool                         setup_after_boot;
+
+    // outgoing commands
+    btstack_linked_list_t        command_queue;
+    command_t *                  command_in_flight;
+    btstack_timer_source_t       command_retry_timer;
+    uint8_t                      command_sequence;
+    command_retained_t           command_retained[COMMAND_RETAINED_COUNT];
+    btstack_timer_source_t       command_replay_timer;
 
-static void process_update(const uint8_t * data, uint16_t len);
+    // connection parameters
+    uint8_t                      profile_requested;
+    uint8_t                      profile_active;
+    uint16_t                     conn_interval;
+    uint16_t                     conn_latency;
+    uint16_t                     supervision_timeout;
+    btstack_timer_source_t       idle_timer;
+
+    link_info_t                  link;
+    uint32_t                     link_connections;
+    btstack_timer_source_t       link_timer;
+
+    uint32_t                     preset_dump_request_us[PRESET_DUMP_MAX_PENDING];
+    uint8_t                      preset_dump_head;
+    uint8_t                      preset_dump_pending;
+
+    press_trace_state_t          press_trace_state;
+    uint32_t                     press_trace_stage_us;
+
+    // commands of last macro waiting for acknowledgement
+    uint8_t                      macro_pending;
+    uint8_t                      macro_sequences[MACRO_MAX_STEPS];
+    uint32_t                     macro_queued_us[MACRO_MAX_STEPS];
+
+    // expression pedal stream
+    btstack_timer_source_t       expression_timer;
+    bool                         expression_timer_active;
+    uint16_t                     expression_sent_position;
+    uint32_t                     expression_sent_ms;
+    uint8_t                      expression_sequence;
+    bool                         expression_unconfirmed;
+    uint32_t                     expression_sent_sample_us;
+
+    // preset bank uploads, the frame is in the large frame buffer. While that is busy, the latest slot waits
+    command_t *                  bank_upload_command;
+    uint8_t                      bank_upload_pending_bank;
+    uint8_t                      bank_upload_pending_slot;
+    uint32_t                     bank_upload_pending_edge_us;
+    uint8_t                      bank_upload_sequence;
+    bool                         bank_upload_unconfirmed;
+    uint32_t                     bank_upload_edge_us;
+    uint8_t                      bank_switch_sequence;
+    // bank switch is tracked with the sequence of the next upload
+    bool                         bank_switch_pending;
+    bool                         bank_switch_unconfirmed;
+    bool                         bank_capture_pending;
+    // upload of the selected slot was not acknowledged before the link dropped
+    bool                         bank_upload_lost;
+} amp_t;
+
+static amp_t   amps[SPARK_MAX_AMPS];
+// LE Create Connection is not concurrent, at most one amp waits for its connection
+static amp_t * amp_connecting;
+
+// relay mode: the Spark app connects to the pedal, its writes are forwarded to the first connected amp and the
+// notifications of that amp back to the app. Data is forwarded from the event buffer if the other side can take
+// it, otherwise the rest is stored once in a fragment and sent from there. Off by default, toggled with 'r' and
+// stored in 'SPRL'
+#define RELAY_MODE_TAG              (((uint32_t) 'S' << 24) | ((uint32_t) 'P' << 16) | ((uint32_t) 'R' << 8) | 'L')
+#define RELAY_FIFO_SIZE             8
+// pedal commands wait for the rest of an app message at most this long after its last piece
+#define RELAY_APP_MESSAGE_TIMEOUT_MS 500
+#define RELAY_FRAGMENT_MAX_LEN      512
+#define RELAY_ADV_INTERVAL_MIN      0x0030
+#define RELAY_ADV_INTERVAL_MAX      0x0060
+
+#define RELAY_TX_VALUE_HANDLE       ATT_CHARACTERISTIC_FFC1_01_VALUE_HANDLE
+#define RELAY_RX_VALUE_HANDLE       ATT_CHARACTERISTIC_FFC2_01_VALUE_HANDLE
+#define RELAY_RX_CCCD_HANDLE        ATT_CHARACTERISTIC_FFC2_01_CLIENT_CONFIGURATION_HANDLE
+
+typedef struct {
+    uint8_t  data[RELAY_FRAGMENT_MAX_LEN];
+    uint16_t len;
+    uint16_t sent;
+    uint32_t received_us;
+    // stream is between messages after this fragment
+    bool     boundary;
+} relay_fragment_t;
+
+// one per direction
+typedef struct {
+    relay_fragment_t    fragments[RELAY_FIFO_SIZE];
+    uint8_t             head;
+    uint8_t             count;
+    uint8_t             count_max;
+    // forwarded stream is between messages, other messages can be inserted
+    bool                at_boundary;
+    uint32_t            fragments_forwarded;
+    uint32_t            bytes;
+    uint32_t            dropped;
+    uint32_t            throttled;
+    // receive to forwarded
+    latency_histogram_t histogram;
+} relay_fifo_t;
+
+typedef enum {
+    RELAY_STATE_IDLE = 0,
+    RELAY_STATE_ADVERTISING,
+    RELAY_STATE_CONNECTED
+} relay_state_t;
+
+static const uint8_t relay_adv_data[] = {
+    0x02, BLUETOOTH_DATA_TYPE_FLAGS, 0x06,
+    0x0e, BLUETOOTH_DATA_TYPE_COMPLETE_LOCAL_NAME, ' ', 'S', 'p', 'a', 'r', 'k', ' ', '4', '0', ' ', 'B', 'L', 'E',
+    0x03, BLUETOOTH_DATA_TYPE_COMPLETE_LIST_OF_16_BIT_SERVICE_CLASS_UUIDS, 0xc0, 0xff,
+};
+
+static struct {
+    bool             enabled;
+    // ATT Server and advertising data are set up when relay mode is enabled first
+    bool             server_ready;
+    relay_state_t    state;
+    hci_con_handle_t con_handle;
+    uint16_t         mtu;
+    bool             notifications_enabled;
+    amp_t *          amp;
+    // app to amp stream, decoded to mirror the changes made by the app and to find message boundaries
+    spark_reader_t   reader;
+    relay_fifo_t     to_amp;
+    relay_fifo_t     to_app;
+    // piece of app data written with response
+    uint16_t         to_amp_write_len;
+    // write request of the app is answered when a fragment is free again
+    bool             to_amp_response_pending;
+    // app stopped in the middle of a message
+    btstack_timer_source_t to_amp_timer;
+    uint32_t         app_message_timeouts;
+    // preset selected by the pedal, reported to the app between two messages of the amp
+    uint8_t          preset_report;
+    uint8_t          sequence;
+    uint32_t         connections;
+    uint32_t         preset_reports;
+} relay;
+
+typedef struct {
+    const char * name;
+    uint16_t     requires;
+    // GATT Client handles only a single query per connection
+    bool         uses_gatt_client;
+    uint8_t   (* start)(amp_t * amp);
+    void      (* handle_gatt_event)(amp_t * amp, uint8_t * packet);
+} setup_step_info_t;
+
+static void handle_gatt_client_event(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+static void process_update(amp_t * amp, const uint8_t * data, uint16_t len);
 static void select_preset(uint8_t preset);
+static void amp_state_query(amp_t * amp);
+static uint8_t amps_count(amp_state_t state);
+static void start_scanning(void);
+static void button_pressed(uint8_t button, uint32_t time_us);
+static void command_queue_run(amp_t * amp);
+static void command_queue_flush(amp_t * amp);
+static void command_write_complete(amp_t * amp, uint8_t att_status);
+static void command_drop(amp_t * amp, command_t * command);
+static void command_replay(amp_t * amp);
+static void command_retained_acknowledged(amp_t * amp, uint8_t sequence);
+static void press_trace_edge(uint32_t edge_us);
+static void press_trace_confirmed(amp_t * amp);
+static void macro_command_queued(amp_t * amp, uint8_t sequence);
+static void macro_command_acknowledged(amp_t * amp, uint8_t sequence);
+static void expression_acknowledged(amp_t * amp, uint8_t sequence);
+static void expression_amp_stop(amp_t * amp);
+static void expression_changed(uint16_t position, uint32_t sample_us);
+static void preset_dump_received(amp_t * amp, uint16_t payload_len);
+static void bank_select_slot(uint8_t slot, uint32_t edge_us, bool bank_switch);
+static void footswitch_changed(uint8_t button, bool pressed, uint32_t time_us);
+static void bank_prefetch_start(void);
+static void bank_acknowledged(amp_t * amp, uint8_t sequence);
+static void bank_capture_received(amp_t * amp, const spark_message_t * message);
+static void bank_upload_released(const command_t * command);
+static void bank_amp_stop(amp_t * amp);
+static void bank_amp_ready(amp_t * amp);
+static bool relay_is_amp(const amp_t * amp);
+static void relay_update(void);
+static void relay_set_enabled(bool enabled);
+static void relay_handle_connection_complete(const uint8_t * packet);
+static void relay_handle_disconnection_complete(void);
+static void relay_forward_to_app(const uint8_t * data, uint16_t len, bool boundary);
+static void relay_report_preset(void);
+static void relay_preset_selected(uint8_t preset);
+static bool relay_to_amp_in_flight(const amp_t * amp);
+static bool relay_to_amp_first(const amp_t * amp, const command_t * command);
+static bool relay_to_amp_run(amp_t * amp);
+static void relay_to_amp_write_complete(amp_t * amp, uint8_t att_status);
+
+// LED palette, scaled by LED_BRIGHTNESS
+enum {
+    LED_COLOR_OFF = 0,
+    LED_COLOR_SCAN,
+    LED_COLOR_ERROR,
+    LED_COLOR_PRESET_0,
+    LED_COLOR_PRESET_1,
+    LED_COLOR_PRESET_2,
+    // one per stored bank
+    LED_COLOR_BANK_1,
+    LED_COLOR_BANK_2,
+    LED_COLOR_BANK_3,
+    LED_COLOR_COUNT
+};
+
+static const led_color_t led_palette[LED_COLOR_COUNT] = {
+    [LED_COLOR_OFF]      = { 0x00, 0x00, 0x00 },
+    [LED_COLOR_SCAN]     = { 0x00, 0x00, 0xff },
+    [LED_COLOR_ERROR]    = { 0xff, 0x00, 0x00 },
+    [LED_COLOR_PRESET_0] = { 0x00, 0xff, 0x00 },
+    [LED_COLOR_PRESET_1] = { 0x00, 0xff, 0xff },
+    [LED_COLOR_PRESET_2] = { 0xff, 0x00, 0x00 },
+    [LED_COLOR_BANK_1]   = { 0xff, 0xa0, 0x00 },
+    [LED_COLOR_BANK_2]   = { 0xff, 0x00, 0xff },
+    [LED_COLOR_BANK_3]   = { 0xff, 0xff, 0xff },
+};
+
+// chaser 0-1-2-off-2-1-0-off, frames only change the LEDs that differ from the previous frame
+static const led_engine_op_t led_scan_ops[] = {
+    { 0, LED_COLOR_SCAN }, { 1, LED_COLOR_OFF }, { 2, LED_COLOR_OFF },
+    { 0, LED_COLOR_OFF  }, { 1, LED_COLOR_SCAN },
+    { 1, LED_COLOR_OFF  }, { 2, LED_COLOR_SCAN },
+    { 2, LED_COLOR_OFF  },
+    { 2, LED_COLOR_SCAN },
+    { 2, LED_COLOR_OFF  }, { 1, LED_COLOR_SCAN },
+    { 1, LED_COLOR_OFF  }, { 0, LED_COLOR_SCAN },
+    { 0, LED_COLOR_OFF  },
+};
+static const uint8_t led_scan_frame_ops[] = { 3, 2, 2, 1, 1, 2, 2, 1 };
+static const led_animation_t led_animation_scan = {
+    .ops        = led_scan_ops,
+    .frame_ops  = led_scan_frame_ops,
+    .num_frames = sizeof(led_scan_frame_ops),
+    .frame_ms   = 150,
+    .loop       = true,
+};
+
+// all LEDs blink while connecting to a known amp and during setup
+static const led_engine_op_t led_connecting_ops[] = {
+    { 0, LED_COLOR_SCAN }, { 1, LED_COLOR_SCAN }, { 2, LED_COLOR_SCAN },
+    { 0, LED_COLOR_OFF  }, { 1, LED_COLOR_OFF  }, { 2, LED_COLOR_OFF  },
+};
+static const uint8_t led_connecting_frame_ops[] = { 3, 3 };
+static const led_animation_t led_animation_connecting = {
+    .ops        = led_connecting_ops,
+    .frame_ops  = led_connecting_frame_ops,
+    .num_frames = sizeof(led_connecting_frame_ops),
+    .frame_ms   = 300,
+    .loop       = true,
+};
+
+// setup failed: blink red three times
+static const led_engine_op_t led_error_ops[] = {
+    { 0, LED_COLOR_ERROR }, { 1, LED_COLOR_ERROR }, { 2, LED_COLOR_ERROR },
+    { 0, LED_COLOR_OFF   }, { 1, LED_COLOR_OFF   }, { 2, LED_COLOR_OFF   },
+    { 0, LED_COLOR_ERROR }, { 1, LED_COLOR_ERROR }, { 2, LED_COLOR_ERROR },
+    { 0, LED_COLOR_OFF   }, { 1, LED_COLOR_OFF   }, { 2, LED_COLOR_OFF   },
+    { 0, LED_COLOR_ERROR }, { 1, LED_COLOR_ERROR }, { 2, LED_COLOR_ERROR },
+    { 0, LED_COLOR_OFF   }, { 1, LED_COLOR_OFF   }, { 2, LED_COLOR_OFF   },
+};
+static const uint8_t led_error_frame_ops[] = { 3, 3, 3, 3, 3, 3 };
+static const led_animation_t led_animation_error = {
+    .ops        = led_error_ops,
+    .frame_ops  = led_error_frame_ops,
+    .num_frames = sizeof(led_error_frame_ops),
+    .frame_ms   = 100,
+    .loop       = false,
+};
 
 #ifdef ESP_PLATFORM
 
-#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "esp_log.h"
-#include "driver/rmt_tx.h"
-#include "driver/gpio.h"
-#include "led_strip_encoder.h"
-
-#define RMT_LED_STRIP_RESOLUTION_HZ 10000000 // 10MHz resolution, 1 tick = 0.1us (led strip needs a high resolution)
-#define RMT_LED_STRIP_GPIO_NUM      0
+#include "esp_timer.h"
+#include "io_task.h"
 
 #define EXAMPLE_LED_NUMBERS         3
 
-#define BUTTON_GPIO_A_NUM     18
-#define BUTTON_GPIO_B_NUM     19
-#define BUTTON_GPIO_C_NUM     21
+// trace log is printed by a low-priority task so the BTstack thread never blocks on the UART
+#define TRACE_TASK_PRIORITY         (tskIDLE_PRIORITY + 1)
+#define TRACE_TASK_STACK_SIZE       3072
+#define TRACE_TASK_PERIOD_MS        20
 
-#define BUTTON_POLL_PERIOD_MS 50
-#define LED_UPDATE_PERIOD_MS  150
+#define LED_BRIGHTNESS        50
+
+static uint32_t platform_time_us(void){
+    return (uint32_t) esp_timer_get_time();
+}
+
+static led_engine_tx_status_t led_transmit(const uint8_t * pixels, uint16_t len){
+    // request queue full: engine retries
+    return io_task_led_transmit(pixels, len) ? LED_ENGINE_TX_STARTED : LED_ENGINE_TX_ERROR;
+}
+
+static const led_engine_output_t led_output = {
+    .transmit = &led_transmit,
+};
+
+static void platform_handle_io_event(const io_event_t * event){
+    uint16_t position;
+    uint32_t time_us;
+    switch (event->type){
+        case IO_EVENT_BUTTON_PRESSED:
+            footswitch_changed(event->button, true, event->time_us);
+            break;
+        case IO_EVENT_BUTTON_RELEASED:
+            footswitch_changed(event->button, false, event->time_us);
+            break;
+        case IO_EVENT_LED_DONE:
+            led_engine_transmit_done();
+            break;
+        case IO_EVENT_EXPRESSION:
+            io_task_get_expression(&position, &time_us);
+            expression_changed(position, time_us);
+            break;
+        default:
+            break;
+    }
+}
+
+static void trace_task_main(void * arg){
+    UNUSED(arg);
+    while (true){
+        trace_log_process();
+        vTaskDelay(pdMS_TO_TICKS(TRACE_TASK_PERIOD_MS));
+    }
+}
+
+static void platform_init(void){
+    xTaskCreate(&trace_task_main, "trace", TRACE_TASK_STACK_SIZE, NULL, TRACE_TASK_PRIORITY, NULL);
+    // GPIOs and LED strip are handled by I/O task on the other core
+    io_task_start(&platform_handle_io_event);
+    led_engine_init(&led_output, EXAMPLE_LED_NUMBERS, led_palette, LED_COLOR_COUNT, LED_BRIGHTNESS);
+}
+
+static void platform_tempo_start(uint32_t period_us, uint32_t first_beat_us){
+    io_task_tempo_start(TAP_TEMPO_LED, period_us, first_beat_us);
+}
+
+static void platform_dump_stats(void){
+    io_task_dump_stats();
+}
+#else
+
+#include <time.h>
 
 #define LED_BRIGHTNESS        50
 
-static const char *TAG = "spark_control";
+#define EXAMPLE_LED_NUMBERS   3
+
+// trace log is printed from the run loop, there is no UART to block on
+#define TRACE_PROCESS_PERIOD_MS 20
+
+static btstack_timer_source_t trace_timer;
+
+static led_engine_tx_status_t led_transmit(const uint8_t * pixels, uint16_t len){
+    UNUSED(pixels);
+    UNUSED(len);
+    return LED_ENGINE_TX_DONE;
+}
 
-#ifdef RMT_LED_STRIP_GPIO_NUM
-static uint8_t led_strip_pixels[EXAMPLE_LED_NUMBERS * 3];
-static rmt_channel_handle_t led_chan = NULL;
-static rmt_encoder_handle_t led_encoder = NULL;
-static rmt_transmit_config_t tx_config = {
-        .loop_count = 0, // no transfer loop
+static const led_engine_output_t led_output = {
+    .transmit = &led_transmit,
 };
+
+static void trace_timeout(btstack_timer_source_t * ts){
+    trace_log_process();
+    btstack_run_loop_set_timer(ts, TRACE_PROCESS_PERIOD_MS);
+    btstack_run_loop_add_timer(ts);
+}
+
+static void platform_init(void){
+    btstack_run_loop_set_timer_handler(&trace_timer, &trace_timeout);
+    btstack_run_loop_set_timer(&trace_timer, TRACE_PROCESS_PERIOD_MS);
+    btstack_run_loop_add_timer(&trace_timer);
+    led_engine_init(&led_output, EXAMPLE_LED_NUMBERS, led_palette, LED_COLOR_COUNT, LED_BRIGHTNESS);
+}
+
+static void platform_tempo_start(uint32_t period_us, uint32_t first_beat_us){
+    UNUSED(period_us);
+    UNUSED(first_beat_us);
+}
+
+static void platform_dump_stats(void){}
+
+static uint32_t platform_clock_us(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) ((uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000);
+}
+
+static uint32_t (*platform_time_source)(void) = &platform_clock_us;
+
+static uint32_t platform_time_us(void){
+    return (*platform_time_source)();
+}
+
+void spark_control_set_time_source(uint32_t (*time_us)(void)){
+    platform_time_source = time_us;
+}
+
+void spark_control_set_relay_enabled(bool enabled){
+    relay_set_enabled(enabled);
+}
+
+void spark_control_get_status(spark_control_status_t * status){
+    status->amps_connected          = amps_count(AMP_STATE_CONNECTED);
+    status->commands_free           = (uint16_t) btstack_linked_list_count(&command_free_list);
+    status->footswitch_presses      = footswitch_presses;
+    status->bank_switches           = bank_stats.switches;
+    status->tone_writes_unconfirmed = 0;
+    uint8_t i;
+    uint8_t j;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        for (j = 0; j < COMMAND_RETAINED_COUNT; j++){
+            if (amps[i].command_retained[j].active){
+                status->tone_writes_unconfirmed++;
+            }
+        }
+    }
+}
+
+void spark_control_button_pressed(uint8_t button, uint32_t time_us){
+    button_pressed(button, time_us);
+}
+
+void spark_control_footswitch_changed(uint8_t button, bool pressed, uint32_t time_us){
+    footswitch_changed(button, pressed, time_us);
+}
+
+void spark_control_expression_changed(uint16_t position, uint32_t time_us){
+    expression_changed(position, time_us);
+}
 #endif
 
-static btstack_timer_source_t button_poller;
-static bool button_pressed;
 
-static btstack_timer_source_t led_updater;
-static uint8_t led_chaser_position;
+static uint8_t amps_count(amp_state_t state){
+    uint8_t count = 0;
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        if (amps[i].state == state){
+            count++;
+        }
+    }
+    return count;
+}
+
+// amps with an LE connection, i.e. in setup or connected
+static uint8_t amps_count_linked(void){
+    return amps_count(AMP_STATE_SETUP) + amps_count(AMP_STATE_CONNECTED);
+}
+
+static amp_t * amp_for_con_handle(hci_con_handle_t con_handle){
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amp_t * amp = &amps[i];
+        if ((amp->state == AMP_STATE_SETUP) || (amp->state == AMP_STATE_CONNECTED)){
+            if (amp->con_handle == con_handle) return amp;
+        }
+    }
+    return NULL;
+}
+
+static amp_t * amp_for_addr(const bd_addr_t addr){
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amp_t * amp = &amps[i];
+        if ((amp->state != AMP_STATE_IDLE) && (bd_addr_cmp(amp->addr, addr) == 0)) return amp;
+    }
+    return NULL;
+}
+
+// prefer the slot that knows the amp, then an unused slot
+static amp_t * amp_slot_for_addr(const bd_addr_t addr){
+    amp_t * unused = NULL;
+    amp_t * idle = NULL;
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amp_t * amp = &amps[i];
+        if (amp->state != AMP_STATE_IDLE) continue;
+        if (amp->cache_valid && (bd_addr_cmp(amp->cache.addr, addr) == 0)) return amp;
+        if ((unused == NULL) && !amp->cache_valid){
+            unused = amp;
+        }
+        if (idle == NULL){
+            idle = amp;
+        }
+    }
+    return (unused != NULL) ? unused : idle;
+}
+
+// LEDs show the preset as soon as one amp is connected
+static void led_show_connection_state(void){
+    if (amps_count(AMP_STATE_CONNECTED) > 0) return;
+    if ((amp_connecting != NULL) || (amps_count(AMP_STATE_SETUP) > 0)){
+        led_engine_play(&led_animation_connecting);
+    } else {
+        led_engine_play(&led_animation_scan);
+    }
+}
+
+// accept list is only usable if no idle slot waits for an unknown amp
+static scan_mode_t scan_select_mode(void){
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        const amp_t * amp = &amps[i];
+        if ((amp->state == AMP_STATE_IDLE) && !amp->cache_valid) return SCAN_MODE_DISCOVERY;
+    }
+    return SCAN_MODE_ACCEPT_LIST;
+}
+
+// time since the most recently lost amp
+static uint32_t scan_lost_ms(uint32_t now){
+    uint32_t lost_ms = UINT32_MAX;
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        const amp_t * amp = &amps[i];
+        if (amp->state != AMP_STATE_IDLE) continue;
+        lost_ms = btstack_min(lost_ms, now - amp->setup_start_ms);
+    }
+    return lost_ms;
+}
+
+static scan_phase_t scan_select_phase(uint32_t lost_ms){
+    if (amps_count_linked() > 0) return SCAN_PHASE_BACKGROUND;
+    uint8_t phase;
+    for (phase = 0; phase < SCAN_PHASE_BACKGROUND; phase++){
+        if (lost_ms < scan_phases[phase].until_ms) break;
+    }
+    return (scan_phase_t) phase;
+}
+
+static void scan_account(uint32_t now){
+    if (!scanning) return;
+    scan_stats[scan_mode].phases[scan_phase].time_ms += now - scan_phase_start_ms;
+    scan_phase_start_ms = now;
+}
+
+static void scan_phase_timeout(btstack_timer_source_t * ts){
+    UNUSED(ts);
+    start_scanning();
+}
+
+static void scan_fill_accept_list(void){
+    gap_whitelist_clear();
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        const amp_t * amp = &amps[i];
+        if ((amp->state != AMP_STATE_IDLE) || !amp->cache_valid) continue;
+        gap_whitelist_add((bd_addr_type_t) amp->cache.addr_type, amp->cache.addr);
+    }
+}
+
+// (re)starts scanning if mode or phase changed
+static void start_scanning(void){
+    uint32_t now = btstack_run_loop_get_time_ms();
+    uint32_t lost_ms = scan_lost_ms(now);
+    scan_mode_t  mode  = scan_select_mode();
+    scan_phase_t phase = scan_select_phase(lost_ms);
+
+    // schedule next phase
+    btstack_run_loop_remove_timer(&scan_phase_timer);
+    if ((phase != SCAN_PHASE_BACKGROUND) && (lost_ms < scan_phases[phase].until_ms)){
+        btstack_run_loop_set_timer_handler(&scan_phase_timer, &scan_phase_timeout);
+        btstack_run_loop_set_timer(&scan_phase_timer, scan_phases[phase].until_ms - lost_ms);
+        btstack_run_loop_add_timer(&scan_phase_timer);
+    }
+
+    if (scanning && (scan_mode == mode) && (scan_phase == phase)) return;
+    if (scanning){
+        scan_account(now);
+        gap_stop_scan();
+    }
+    scanning            = true;
+    scan_mode           = mode;
+    scan_phase          = phase;
+    scan_phase_start_ms = now;
+
+    const scan_phase_info_t * info = &scan_phases[phase];
+    trace_log_data(scan_mode_trace_events[mode], amps_count(AMP_STATE_IDLE), (info->scan_window * 100) / info->scan_interval, 0,
+                   (const uint8_t *) info->name, (uint16_t) strlen(info->name));
+    if (mode == SCAN_MODE_ACCEPT_LIST){
+        // known addresses, the name is not needed
+        scan_fill_accept_list();
+        gap_set_scan_params(SCAN_TYPE_PASSIVE, info->scan_interval, info->scan_window, SCAN_FILTER_POLICY_ACCEPT_LIST);
+    } else {
+        gap_set_scan_params(SCAN_TYPE_ACTIVE, info->scan_interval, info->scan_window, SCAN_FILTER_POLICY_ALL);
+    }
+    gap_start_scan();
+}
+
+static void stop_scanning(void){
+    if (!scanning) return;
+    scan_account(btstack_run_loop_get_time_ms());
+    btstack_run_loop_remove_timer(&scan_phase_timer);
+    scanning = false;
+    gap_stop_scan();
+}
+
+static void cache_load(amp_t * amp){
+    const btstack_tlv_t * tlv_impl;
+    void * tlv_context;
+    btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+    if (tlv_impl == NULL) return;
+    int size = tlv_impl->get_tag(tlv_context, SPARK_40_CACHE_TAG(amp->index), (uint8_t *) &amp->cache, sizeof(amp->cache));
+    amp->cache_valid = size == sizeof(amp->cache);
+}
+
+static void cache_store(amp_t * amp){
+    spark_40_cache_t cache;
+    memset(&cache, 0, sizeof(cache));
+    bd_addr_copy(cache.addr, amp->addr);
+    cache.addr_type         = amp->addr_type;
+    cache.handles_valid     = 1;
+    cache.service           = amp->service;
+    cache.characteristic_rx = amp->characteristic_rx;
+    cache.characteristic_tx = amp->characteristic_tx;
+    cache.rx_cccd_handle    = amp->rx_cccd_handle;
+    if (amp->cache_valid && (memcmp(&cache, &amp->cache, sizeof(cache)) == 0)) return;
+
+    const btstack_tlv_t * tlv_impl;
+    void * tlv_context;
+    btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+    if (tlv_impl == NULL) return;
+    amp->cache = cache;
+    amp->cache_valid = true;
+    tlv_impl->store_tag(tlv_context, SPARK_40_CACHE_TAG(amp->index), (const uint8_t *) &amp->cache, sizeof(amp->cache));
+    trace_log_event(TRACE_EVENT_AMP_CACHE_STORED, amp->index, 0, 0);
+}
+
+static void cache_invalidate_handles(amp_t * amp){
+    if (!amp->cache_valid) return;
+    amp->cache.handles_valid = 0;
+    amp->using_cache = false;
+
+    const btstack_tlv_t * tlv_impl;
+    void * tlv_context;
+    btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+    if (tlv_impl == NULL) return;
+    tlv_impl->store_tag(tlv_context, SPARK_40_CACHE_TAG(amp->index), (const uint8_t *) &amp->cache, sizeof(amp->cache));
+}
+
+static void fast_reconnect_timeout(btstack_timer_source_t * ts){
+    UNUSED(ts);
+    amp_t * amp = amp_connecting;
+    if (amp == NULL) return;
+    trace_log_event(TRACE_EVENT_AMP_UNREACHABLE, amp->index, 0, 0);
+    amp->cache_unreachable = true;
+    // connection complete with error follows, or connection complete if the amp was faster
+    gap_connect_cancel();
+}
+
+static void start_connecting(amp_t * amp){
+    // connect directly to amp known to this slot
+    amp->state = AMP_STATE_W4_CONNECTION;
+    amp_connecting = amp;
+    bd_addr_copy(amp->addr, amp->cache.addr);
+    amp->addr_type = amp->cache.addr_type;
+    trace_log_data(TRACE_EVENT_AMP_CONNECT_KNOWN, amp->index, 0, 0, amp->addr, BD_ADDR_LEN);
+    gap_connect(amp->addr, amp->addr_type);
+    btstack_run_loop_set_timer_handler(&fast_reconnect_timer, &fast_reconnect_timeout);
+    btstack_run_loop_set_timer(&fast_reconnect_timer, FAST_RECONNECT_TIMEOUT_MS);
+    btstack_run_loop_add_timer(&fast_reconnect_timer);
+}
+
+// connect known amps first, then scan while slots are free
+static void amps_connect_next(void){
+    if (amp_connecting == NULL){
+        uint8_t i;
+        for (i = 0; i < SPARK_MAX_AMPS; i++){
+            amp_t * amp = &amps[i];
+            if ((amp->state != AMP_STATE_IDLE) || !amp->cache_valid || amp->cache_unreachable) continue;
+            stop_scanning();
+            start_connecting(amp);
+            break;
+        }
+        if (amp_connecting == NULL){
+            if (amps_count(AMP_STATE_IDLE) > 0){
+                start_scanning();
+            } else {
+                stop_scanning();
+            }
+        }
+    }
+    led_show_connection_state();
+}
+
+static void connection_parameters_report(const amp_t * amp, const char * reason){
+    printf("[-] Amp %u: Connection parameters (%s): interval %u.%02u ms, latency %u, supervision timeout %u ms, profile %s\n",
+           amp->index, reason, (amp->conn_interval * 125) / 100, (amp->conn_interval * 125) % 100, amp->conn_latency,
+           amp->supervision_timeout * 10,
+           amp->profile_active == CONNECTION_PROFILE_NONE ? "-" : connection_profiles[amp->profile_active].name);
+}
+
+static void connection_parameters_trace(const amp_t * amp, const char * reason){
+    trace_log_data(TRACE_EVENT_CONNECTION_PARAMETERS, amp->index, amp->conn_interval * 1250, amp->conn_latency,
+                   (const uint8_t *) reason, (uint16_t) strlen(reason));
+}
+
+static bool connection_profile_matches(const amp_t * amp, uint8_t profile){
+    const connection_profile_t * params = &connection_profiles[profile];
+    if (amp->conn_interval < params->conn_interval_min) return false;
+    if (amp->conn_interval > params->conn_interval_max) return false;
+    return amp->conn_latency == params->conn_latency;
+}
+
+static void connection_profile_request(amp_t * amp, uint8_t profile){
+    if (profile == CONNECTION_PROFILE_NONE) return;
+    if (amp->profile_requested != CONNECTION_PROFILE_NONE) return;
+    if (connection_profile_matches(amp, profile)){
+        amp->profile_active = profile;
+        return;
+    }
+    const connection_profile_t * params = &connection_profiles[profile];
+    trace_log_data(TRACE_EVENT_CONNECTION_PROFILE_REQUEST, amp->index, 0, 0, (const uint8_t *) params->name, (uint16_t) strlen(params->name));
+    int status = gap_update_connection_parameters(amp->con_handle, params->conn_interval_min,
+        params->conn_interval_max, params->conn_latency, params->supervision_timeout);
+    if (status != ERROR_CODE_SUCCESS){
+        trace_log_event(TRACE_EVENT_CONNECTION_PROFILE_FAILED, amp->index, status, 0);
+        connection_profile_request(amp, params->fallback);
+        return;
+    }
+    amp->profile_requested = profile;
+}
+
+static void connection_parameters_updated(amp_t * amp, const uint8_t * packet){
+    uint8_t profile = amp->profile_requested;
+    amp->profile_requested = CONNECTION_PROFILE_NONE;
+    uint8_t status = hci_subevent_le_connection_update_complete_get_status(packet);
+    if (status != ERROR_CODE_SUCCESS){
+        trace_log_event(TRACE_EVENT_CONNECTION_PARAMETERS_REJECTED, amp->index, status, 0);
+        if (profile != CONNECTION_PROFILE_NONE){
+            connection_profile_request(amp, connection_profiles[profile].fallback);
+        }
+        return;
+    }
+    amp->conn_interval       = hci_subevent_le_connection_update_complete_get_conn_interval(packet);
+    amp->conn_latency        = hci_subevent_le_connection_update_complete_get_conn_latency(packet);
+    amp->supervision_timeout = hci_subevent_le_connection_update_complete_get_supervision_timeout(packet);
+    amp->profile_active      = CONNECTION_PROFILE_NONE;
+    uint8_t i;
+    for (i = 0; i < (sizeof(connection_profiles) / sizeof(connection_profile_t)); i++){
+        if (connection_profile_matches(amp, i)){
+            amp->profile_active = i;
+            break;
+        }
+    }
+    connection_parameters_trace(amp, "updated");
+}
+
+static void connection_idle_timeout(btstack_timer_source_t * ts){
+    amp_t * amp = (amp_t *) btstack_run_loop_get_timer_context(ts);
+    if (amp->state != AMP_STATE_CONNECTED) return;
+    connection_profile_request(amp, CONNECTION_PROFILE_POWER);
+}
+
+static void connection_activity(amp_t * amp){
+    if (amp->state != AMP_STATE_CONNECTED) return;
+    btstack_run_loop_remove_timer(&amp->idle_timer);
+    btstack_run_loop_set_timer_handler(&amp->idle_timer, &connection_idle_timeout);
+    btstack_run_loop_set_timer_context(&amp->idle_timer, amp);
+    btstack_run_loop_set_timer(&amp->idle_timer, CONNECTION_IDLE_TIMEOUT_MS);
+    btstack_run_loop_add_timer(&amp->idle_timer);
+    if (amp->profile_active != CONNECTION_PROFILE_PERFORMANCE){
+        connection_profile_request(amp, CONNECTION_PROFILE_PERFORMANCE);
+    }
+}
+
+static const char * link_phy_name(uint8_t phy){
+    return (phy == LINK_PHY_2M) ? "2M" : "1M";
+}
+
+static void link_report(const amp_t * amp, const char * reason){
+    const link_info_t * link = &amp->link;
+    printf("[-] Amp %u: Link (%s): connection %"PRIu32", MTU %u, data length tx %u rx %u octets, PHY tx %s rx %s\n",
+           amp->index, reason, amp->link_connections, link->mtu, link->tx_octets, link->rx_octets,
+           link_phy_name(link->tx_phy), link_phy_name(link->rx_phy));
+}
+
+static void link_trace_ready(const amp_t * amp){
+    const char * phy = link_phy_name(amp->link.tx_phy);
+    trace_log_data(TRACE_EVENT_LINK_READY, amp->index, amp->link.mtu, amp->link.tx_octets, (const uint8_t *) phy, (uint16_t) strlen(phy));
+}
+
+static void link_request_data_length(amp_t * amp);
+
+static void link_retry_timeout(btstack_timer_source_t * ts){
+    link_request_data_length((amp_t *) btstack_run_loop_get_timer_context(ts));
+}
+
+static void link_request_data_length(amp_t * amp){
+    if (amp->link.data_length_requested) return;
+    if ((amp->state != AMP_STATE_SETUP) && (amp->state != AMP_STATE_CONNECTED)) return;
+    if (!hci_can_send_command_packet_now()){
+        btstack_run_loop_remove_timer(&amp->link_timer);
+        btstack_run_loop_set_timer_handler(&amp->link_timer, &link_retry_timeout);
+        btstack_run_loop_set_timer_context(&amp->link_timer, amp);
+        btstack_run_loop_set_timer(&amp->link_timer, LINK_RETRY_DELAY_MS);
+        btstack_run_loop_add_timer(&amp->link_timer);
+        return;
+    }
+    amp->link.data_length_requested = 1;
+    hci_send_cmd(&hci_le_set_data_length, amp->con_handle, LINK_MAX_TX_OCTETS, LINK_MAX_TX_TIME_US);
+}
+
+// request largest data length, 2M PHY is requested by the setup pipeline
+static void link_start(amp_t * amp){
+    link_info_t * link = &amp->link;
+    memset(link, 0, sizeof(link_info_t));
+    link->mtu       = ATT_DEFAULT_MTU;
+    link->tx_octets = LINK_DEFAULT_OCTETS;
+    link->rx_octets = LINK_DEFAULT_OCTETS;
+    link->tx_phy    = LINK_PHY_1M;
+    link->rx_phy    = LINK_PHY_1M;
+    amp->link_connections++;
+    link_request_data_length(amp);
+}
+
+static void link_stop(amp_t * amp){
+    // commands queued while disconnected use default MTU
+    amp->link.mtu = ATT_DEFAULT_MTU;
+    btstack_run_loop_remove_timer(&amp->link_timer);
+}
+
+static void setup_phy_updated(amp_t * amp);
+
+static void link_handle_hci_event(const uint8_t * packet){
+    amp_t * amp;
+    const uint8_t * return_parameters;
+    uint8_t i;
+    switch (hci_event_packet_get_type(packet)){
+        case HCI_EVENT_COMMAND_COMPLETE:
+            if (hci_event_command_complete_get_command_opcode(packet) != HCI_OPCODE_HCI_LE_SET_DATA_LENGTH) break;
+            // status and connection handle
+            return_parameters = hci_event_command_complete_get_return_parameters(packet);
+            if (return_parameters[0] == ERROR_CODE_SUCCESS) break;
+            amp = amp_for_con_handle(little_endian_read_16(return_parameters, 1));
+            if (amp == NULL) break;
+            trace_log_event(TRACE_EVENT_LINK_DATA_LENGTH_FAILED, amp->index, return_parameters[0], amp->link.tx_octets);
+            break;
+        case HCI_EVENT_COMMAND_STATUS:
+            // e.g. controller without LE 2M PHY, not specific to an amp
+            if (hci_event_command_status_get_command_opcode(packet) != HCI_OPCODE_HCI_LE_SET_PHY) break;
+            if (hci_event_command_status_get_status(packet) == ERROR_CODE_SUCCESS) break;
+            trace_log_event(TRACE_EVENT_LINK_PHY_UNSUPPORTED, hci_event_command_status_get_status(packet), 0, 0);
+            for (i = 0; i < SPARK_MAX_AMPS; i++){
+                setup_phy_updated(&amps[i]);
+            }
+            break;
+        case HCI_EVENT_LE_META:
+            switch (hci_event_le_meta_get_subevent_code(packet)){
+                case HCI_SUBEVENT_LE_DATA_LENGTH_CHANGE:
+                    amp = amp_for_con_handle(hci_subevent_le_data_length_change_get_connection_handle(packet));
+                    if (amp == NULL) break;
+                    amp->link.tx_octets = hci_subevent_le_data_length_change_get_max_tx_octets(packet);
+                    amp->link.rx_octets = hci_subevent_le_data_length_change_get_max_rx_octets(packet);
+                    trace_log_event(TRACE_EVENT_LINK_DATA_LENGTH, amp->index, amp->link.tx_octets, amp->link.rx_octets);
+                    break;
+                case HCI_SUBEVENT_LE_PHY_UPDATE_COMPLETE:
+                    amp = amp_for_con_handle(hci_subevent_le_phy_update_complete_get_connection_handle(packet));
+                    if (amp == NULL) break;
+                    if (hci_subevent_le_phy_update_complete_get_status(packet) != ERROR_CODE_SUCCESS){
+                        trace_log_event(TRACE_EVENT_LINK_PHY_REJECTED, amp->index,
+                                        hci_subevent_le_phy_update_complete_get_status(packet), amp->link.tx_phy);
+                    } else {
+                        amp->link.tx_phy = hci_subevent_le_phy_update_complete_get_tx_phy(packet);
+                        amp->link.rx_phy = hci_subevent_le_phy_update_complete_get_rx_phy(packet);
+                        trace_log_event(TRACE_EVENT_LINK_PHY, amp->index, amp->link.tx_phy, amp->link.rx_phy);
+                    }
+                    setup_phy_updated(amp);
+                    break;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// commands are split into blocks that fit into a single write
+static uint8_t link_block_max_len(const amp_t * amp){
+    return (uint8_t) btstack_min(SPARK_BLOCK_MAX_LEN_TO_AMP, amp->link.mtu - 3);
+}
+
+static void setup_step_done(amp_t * amp, setup_step_t step);
+static void setup_step_failed(amp_t * amp, setup_step_t step, uint8_t status);
+static void setup_start(amp_t * amp, bool use_cache);
+
+static uint8_t setup_update_phy_start(amp_t * amp){
+    uint8_t status = gap_le_set_phy(amp->con_handle, 0, LINK_PHY_MASK_2M, LINK_PHY_MASK_2M, 0);
+    if (status != ERROR_CODE_SUCCESS){
+        // not fatal, setup continues on LE 1M
+        trace_log_event(TRACE_EVENT_LINK_PHY_FAILED, amp->index, status, 0);
+        setup_step_done(amp, SETUP_STEP_UPDATE_PHY);
+    }
+    return ERROR_CODE_SUCCESS;
+}
+
+// PHY Update Complete, also if rejected or not changed
+static void setup_phy_updated(amp_t * amp){
+    if (amp->state != AMP_STATE_SETUP) return;
+    if ((amp->setup_steps_started & SETUP_STEP_FLAG(SETUP_STEP_UPDATE_PHY)) == 0) return;
+    if ((amp->setup_steps_done & SETUP_STEP_FLAG(SETUP_STEP_UPDATE_PHY)) != 0) return;
+    setup_step_done(amp, SETUP_STEP_UPDATE_PHY);
+}
+
+static uint8_t setup_exchange_mtu_start(amp_t * amp){
+    uint8_t status = gatt_client_send_mtu_negotiation(&handle_gatt_client_event, amp->con_handle);
+    if (status != GATT_CLIENT_IN_WRONG_STATE) return status;
+    // already exchanged, e.g. by the amp
+    gatt_client_get_mtu(amp->con_handle, &amp->link.mtu);
+    setup_step_done(amp, SETUP_STEP_EXCHANGE_MTU);
+    return ERROR_CODE_SUCCESS;
+}
+
+static void setup_exchange_mtu_handle_gatt_event(amp_t * amp, uint8_t * packet){
+    switch(hci_event_packet_get_type(packet)){
+        case GATT_EVENT_MTU:
+            amp->link.mtu = gatt_event_mtu_get_MTU(packet);
+            setup_step_done(amp, SETUP_STEP_EXCHANGE_MTU);
+            break;
+        case GATT_EVENT_QUERY_COMPLETE:
+            // amp does not support the exchange, keep default MTU
+            trace_log_event(TRACE_EVENT_LINK_MTU_FAILED, amp->index, gatt_event_query_complete_get_att_status(packet), amp->link.mtu);
+            setup_step_done(amp, SETUP_STEP_EXCHANGE_MTU);
+            break;
+        default:
+            break;
+    }
+}
+
+static uint8_t setup_discover_service_start(amp_t * amp){
+    memset(&amp->service, 0, sizeof(amp->service));
+    return gatt_client_discover_primary_services_by_uuid16(&handle_gatt_client_event, amp->con_handle, spark_40_service_uuid);
+}
+
+static void setup_discover_service_handle_gatt_event(amp_t * amp, uint8_t * packet){
+    uint8_t att_status;
+    switch(hci_event_packet_get_type(packet)){
+        case GATT_EVENT_SERVICE_QUERY_RESULT:
+            // store service (we expect only one)
+            gatt_event_service_query_result_get_service(packet, &amp->service);
+            break;
+        case GATT_EVENT_QUERY_COMPLETE:
+            att_status = gatt_event_query_complete_get_att_status(packet);
+            if ((att_status == ATT_ERROR_SUCCESS) && (amp->service.start_group_handle == 0)){
+                att_status = ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+            }
+            if (att_status != ATT_ERROR_SUCCESS){
+                setup_step_failed(amp, SETUP_STEP_DISCOVER_SERVICE, att_status);
+                break;
+            }
+            setup_step_done(amp, SETUP_STEP_DISCOVER_SERVICE);
+            break;
+        default:
+            break;
+    }
+}
+
+static uint8_t setup_discover_characteristics_start(amp_t * amp){
+    // get RX and TX characteristic in a single query
+    memset(&amp->characteristic_rx, 0, sizeof(amp->characteristic_rx));
+    memset(&amp->characteristic_tx, 0, sizeof(amp->characteristic_tx));
+    return gatt_client_discover_characteristics_for_service(&handle_gatt_client_event, amp->con_handle, &amp->service);
+}
+
+static void setup_discover_characteristics_handle_gatt_event(amp_t * amp, uint8_t * packet){
+    gatt_client_characteristic_t characteristic;
+    uint8_t att_status;
+    switch(hci_event_packet_get_type(packet)){
+        case GATT_EVENT_CHARACTERISTIC_QUERY_RESULT:
+            gatt_event_characteristic_query_result_get_characteristic(packet, &characteristic);
+            if (characteristic.uuid16 == spark_40_characteristic_rx_uuid){
+                amp->characteristic_rx = characteristic;
+            } else if (characteristic.uuid16 == spark_40_characteristic_tx_uuid){
+                amp->characteristic_tx = characteristic;
+            }
+            break;
+        case GATT_EVENT_QUERY_COMPLETE:
+            att_status = gatt_event_query_complete_get_att_status(packet);
+            if ((att_status == ATT_ERROR_SUCCESS) &&
+                ((amp->characteristic_rx.value_handle == 0) || (amp->characteristic_tx.value_handle == 0))){
+                att_status = ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+            }
+            if (att_status != ATT_ERROR_SUCCESS){
+                setup_step_failed(amp, SETUP_STEP_DISCOVER_CHARACTERISTICS, att_status);
+                break;
+            }
+            // CCCD usually directly follows the value, verified by the write
+            if (amp->characteristic_rx.end_handle > amp->characteristic_rx.value_handle){
+                amp->rx_cccd_handle = amp->characteristic_rx.value_handle + 1;
+            } else {
+                amp->rx_cccd_handle = 0;
+            }
+            setup_step_done(amp, SETUP_STEP_DISCOVER_CHARACTERISTICS);
+            break;
+        default:
+            break;
+    }
+}
+
+static uint8_t setup_enable_notifications_start(amp_t * amp){
+    // register handler for notifications
+    gatt_client_listen_for_characteristic_value_updates(&amp->notification_listener,
+        handle_gatt_client_event, amp->con_handle, &amp->characteristic_rx);
+    if (amp->rx_cccd_handle == 0){
+        // let GATT Client look up the CCCD
+        return gatt_client_write_client_characteristic_configuration(handle_gatt_client_event, amp->con_handle,
+            &amp->characteristic_rx, GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION);
+    }
+    static uint8_t enable_notifications[] = { GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION, 0x00 };
+    return gatt_client_write_characteristic_descriptor_using_descriptor_handle(handle_gatt_client_event, amp->con_handle,
+        amp->rx_cccd_handle, sizeof(enable_notifications), enable_notifications);
+}
+
+static void setup_enable_notifications_handle_gatt_event(amp_t * amp, uint8_t * packet){
+    uint8_t att_status;
+    uint8_t status;
+    switch(hci_event_packet_get_type(packet)){
+        case GATT_EVENT_QUERY_COMPLETE:
+            att_status = gatt_event_query_complete_get_att_status(packet);
+            if (att_status == ATT_ERROR_SUCCESS){
+                setup_step_done(amp, SETUP_STEP_ENABLE_NOTIFICATIONS);
+                break;
+            }
+            gatt_client_stop_listening_for_characteristic_value_updates(&amp->notification_listener);
+            if (amp->using_cache){
+                // cached handles are stale
+                trace_log_event(TRACE_EVENT_AMP_CACHE_INVALID, amp->index, 0, 0);
+                cache_invalidate_handles(amp);
+                setup_start(amp, false);
+                break;
+            }
+            if (amp->rx_cccd_handle != 0){
+                // CCCD is not next to value
+                amp->rx_cccd_handle = 0;
+                status = setup_enable_notifications_start(amp);
+                if (status != ERROR_CODE_SUCCESS){
+                    setup_step_failed(amp, SETUP_STEP_ENABLE_NOTIFICATIONS, status);
+                }
+                break;
+            }
+            setup_step_failed(amp, SETUP_STEP_ENABLE_NOTIFICATIONS, att_status);
+            break;
+        default:
+            break;
+    }
+}
+
+static const setup_step_info_t setup_steps[SETUP_STEP_COUNT] = {
+    // LL procedure of the controller, runs next to MTU exchange and discovery
+    [SETUP_STEP_UPDATE_PHY] = {
+        .name = "update PHY", .requires = 0, .uses_gatt_client = false,
+        .start = &setup_update_phy_start,
+        .handle_gatt_event = NULL },
+    [SETUP_STEP_EXCHANGE_MTU] = {
+        .name = "exchange MTU", .requires = 0, .uses_gatt_client = true,
+        .start = &setup_exchange_mtu_start,
+        .handle_gatt_event = &setup_exchange_mtu_handle_gatt_event },
+    // larger MTU speeds up discovery
+    [SETUP_STEP_DISCOVER_SERVICE] = {
+        .name = "discover service", .requires = SETUP_STEP_FLAG(SETUP_STEP_EXCHANGE_MTU), .uses_gatt_client = true,
+        .start = &setup_discover_service_start,
+        .handle_gatt_event = &setup_discover_service_handle_gatt_event },
+    [SETUP_STEP_DISCOVER_CHARACTERISTICS] = {
+        .name = "discover characteristics", .requires = SETUP_STEP_FLAG(SETUP_STEP_DISCOVER_SERVICE), .uses_gatt_client = true,
+        .start = &setup_discover_characteristics_start,
+        .handle_gatt_event = &setup_discover_characteristics_handle_gatt_event },
+    [SETUP_STEP_ENABLE_NOTIFICATIONS] = {
+        .name = "enable notifications",
+        .requires = SETUP_STEP_FLAG(SETUP_STEP_EXCHANGE_MTU) | SETUP_STEP_FLAG(SETUP_STEP_DISCOVER_CHARACTERISTICS),
+        .uses_gatt_client = true,
+        .start = &setup_enable_notifications_start,
+        .handle_gatt_event = &setup_enable_notifications_handle_gatt_event },
+};
+
+static const char * setup_ready_reasons[] = {
+    "disconnect (discovery)", "disconnect (cached handles)", "power on (discovery)", "power on (cached handles)"
+};
+
+static void setup_complete(amp_t * amp){
+    amp->state = AMP_STATE_CONNECTED;
+    uint32_t now = btstack_run_loop_get_time_ms();
+    trace_log_event(TRACE_EVENT_AMP_SETUP_COMPLETE, amp->index, now - amp->setup_connected_ms, 0);
+    const char * reason = setup_ready_reasons[(amp->setup_after_boot ? 2 : 0) + (amp->using_cache ? 1 : 0)];
+    trace_log_data(TRACE_EVENT_AMP_READY, amp->index, now - amp->setup_start_ms, 0, (const uint8_t *) reason, (uint16_t) strlen(reason));
+    amp->setup_after_boot = false;
+    link_trace_ready(amp);
+    // frames of prefetched banks must fit the blocks of this amp
+    bank_prefetch_start();
+    if (!amp->using_cache){
+        cache_store(amp);
+    }
+    spark_reader_reset(&amp->reader);
+    // switch to performance profile, also starts idle timer
+    connection_activity(amp);
+    if (amps_count(AMP_STATE_CONNECTED) == 1){
+        // first amp: keep tone selected on the amp, LEDs are set when current preset is known
+        led_engine_stop();
+        led_engine_clear();
+        led_engine_show();
+    }
+    // tone selected while the link was down goes out before the state is queried
+    command_replay(amp);
+    bank_amp_ready(amp);
+    amp_state_query(amp);
+    relay_update();
+}
+
+static void setup_run(amp_t * amp){
+    uint8_t step;
+    for (step = 0; step < SETUP_STEP_COUNT; step++){
+        if (amp->state != AMP_STATE_SETUP) return;
+        const setup_step_info_t * info = &setup_steps[step];
+        if ((amp->setup_steps_started & SETUP_STEP_FLAG(step)) != 0) continue;
+        if ((info->requires & ~amp->setup_steps_done) != 0) continue;
+        if (info->uses_gatt_client){
+            if (amp->setup_gatt_step != SETUP_STEP_NONE) continue;
+            amp->setup_gatt_step = (setup_step_t) step;
+        }
+        amp->setup_steps_started |= SETUP_STEP_FLAG(step);
+        amp->setup_step_start_ms[step] = btstack_run_loop_get_time_ms();
+        uint8_t status = (*info->start)(amp);
+        if (status != ERROR_CODE_SUCCESS){
+            setup_step_failed(amp, (setup_step_t) step, status);
+            return;
+        }
+    }
+    if ((amp->state == AMP_STATE_SETUP) && (amp->setup_steps_done == SETUP_STEPS_ALL)){
+        setup_complete(amp);
+    }
+}
+
+static void setup_step_done(amp_t * amp, setup_step_t step){
+    const char * name = setup_steps[step].name;
+    trace_log_data(TRACE_EVENT_AMP_SETUP_STEP_DONE, amp->index, btstack_run_loop_get_time_ms() - amp->setup_step_start_ms[step], 0,
+                   (const uint8_t *) name, (uint16_t) strlen(name));
+    amp->setup_steps_done |= SETUP_STEP_FLAG(step);
+    if (amp->setup_gatt_step == step){
+        amp->setup_gatt_step = SETUP_STEP_NONE;
+    }
+    setup_run(amp);
+}
+
+static void setup_step_failed(amp_t * amp, setup_step_t step, uint8_t status){
+    const char * name = setup_steps[step].name;
+    trace_log_data(TRACE_EVENT_AMP_SETUP_STEP_FAILED, amp->index, status, 0, (const uint8_t *) name, (uint16_t) strlen(name));
+    amp->setup_gatt_step = SETUP_STEP_NONE;
+    if (amps_count(AMP_STATE_CONNECTED) == 0){
+        led_engine_play(&led_animation_error);
+    }
+    gap_disconnect(amp->con_handle);
+}
+
+static void setup_start(amp_t * amp, bool use_cache){
+    amp->state = AMP_STATE_SETUP;
+    amp->using_cache         = use_cache;
+    amp->setup_steps_started = 0;
+    amp->setup_steps_done    = 0;
+    amp->setup_gatt_step     = SETUP_STEP_NONE;
+    if (use_cache){
+        amp->setup_steps_started = SETUP_STEP_FLAG(SETUP_STEP_DISCOVER_SERVICE) | SETUP_STEP_FLAG(SETUP_STEP_DISCOVER_CHARACTERISTICS);
+        amp->setup_steps_done    = amp->setup_steps_started;
+    }
+    setup_run(amp);
+}
+
+static void handle_gatt_client_event(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size) {
+    UNUSED(packet_type);
+    UNUSED(channel);
+    UNUSED(size);
+
+    // all GATT Client events start with the connection handle
+    amp_t * amp = amp_for_con_handle(little_endian_read_16(packet, 2));
+    if (amp == NULL) return;
+
+    switch (amp->state) {
+        case AMP_STATE_SETUP:
+            // forward to step using the GATT Client
+            if (amp->setup_gatt_step == SETUP_STEP_NONE) break;
+            (*setup_steps[amp->setup_gatt_step].handle_gatt_event)(amp, packet);
+            break;
+        case AMP_STATE_CONNECTED:
+            switch(hci_event_packet_get_type(packet)){
+                case GATT_EVENT_NOTIFICATION:
+                    process_update(amp, gatt_event_notification_get_value(packet), gatt_event_notification_get_value_length(packet));
+                    break;
+                case GATT_EVENT_QUERY_COMPLETE:
+                    // write with response complete
+                    if (relay_to_amp_in_flight(amp)){
+                        relay_to_amp_write_complete(amp, gatt_event_query_complete_get_att_status(packet));
+                    } else {
+                        command_write_complete(amp, gatt_event_query_complete_get_att_status(packet));
+                    }
+                    break;
+                case GATT_EVENT_CAN_WRITE_WITHOUT_RESPONSE:
+                    command_queue_run(amp);
+                    break;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void handle_advertising_report(uint8_t * packet){
+    if (!scanning || (amp_connecting != NULL)) return;
+    scan_stats[scan_mode].phases[scan_phase].reports++;
+    bd_addr_t addr;
+    gap_event_advertising_report_get_address(packet, addr);
+    uint8_t addr_type = gap_event_advertising_report_get_address_type(packet);
+    amp_t * amp;
+    if (scan_mode == SCAN_MODE_ACCEPT_LIST){
+        // controller only reports known amps, no need to look at the advertisement
+        amp = amp_slot_for_addr(addr);
+        if ((amp == NULL) || !amp->cache_valid || (bd_addr_cmp(amp->cache.addr, addr) != 0)) return;
+    } else {
+        spark_model_t model = spark_adv_filter_match(gap_event_advertising_report_get_advertising_event_type(packet), addr_type, addr,
+            gap_event_advertising_report_get_data(packet), gap_event_advertising_report_get_data_length(packet));
+        if (model == SPARK_MODEL_NONE) return;
+        // already connected or connecting
+        if (amp_for_addr(addr) != NULL) return;
+        amp = amp_slot_for_addr(addr);
+        if (amp == NULL) return;
+        amp->model = model;
+    }
+
+    // store address and type
+    bd_addr_copy(amp->addr, addr);
+    amp->addr_type = addr_type;
+    scan_stats[scan_mode].found++;
+    latency_histogram_add(&scan_stats[scan_mode].rediscover_ms, btstack_run_loop_get_time_ms() - amp->setup_start_ms);
+    stop_scanning();
+    trace_log_data(TRACE_EVENT_AMP_FOUND, amp->index, 0, 0, amp->addr, BD_ADDR_LEN);
+    amp->state = AMP_STATE_W4_CONNECTION;
+    amp_connecting = amp;
+    led_show_connection_state();
+    gap_connect(amp->addr, amp->addr_type);
+}
+
+static void handle_connection_complete(uint8_t * packet){
+    amp_t * amp = amp_connecting;
+    if (amp == NULL) return;
+    btstack_run_loop_remove_timer(&fast_reconnect_timer);
+    amp_connecting = NULL;
+
+    if (hci_subevent_le_connection_complete_get_status(packet) != ERROR_CODE_SUCCESS){
+        // cancelled by fast reconnect timeout or failed
+        amp->state = AMP_STATE_IDLE;
+        amps_connect_next();
+        return;
+    }
+
+    amp->cache_unreachable   = false;
+    amp->con_handle          = hci_subevent_le_connection_complete_get_connection_handle(packet);
+    amp->setup_connected_ms  = btstack_run_loop_get_time_ms();
+    amp->conn_interval       = hci_subevent_le_connection_complete_get_conn_interval(packet);
+    amp->conn_latency        = hci_subevent_le_connection_complete_get_conn_latency(packet);
+    amp->supervision_timeout = hci_subevent_le_connection_complete_get_supervision_timeout(packet);
+    amp->profile_requested   = CONNECTION_PROFILE_NONE;
+    amp->profile_active      = CONNECTION_PROFILE_NONE;
+    amp->state               = AMP_STATE_SETUP;
+    connection_parameters_trace(amp, "connected");
+    link_start(amp);
+
+    if (amp->cache_valid && amp->cache.handles_valid && (bd_addr_cmp(amp->addr, amp->cache.addr) == 0)){
+        trace_log_event(TRACE_EVENT_AMP_CONNECTED_CACHED, amp->index, 0, 0);
+        amp->service           = amp->cache.service;
+        amp->characteristic_rx = amp->cache.characteristic_rx;
+        amp->characteristic_tx = amp->cache.characteristic_tx;
+        amp->rx_cccd_handle    = amp->cache.rx_cccd_handle;
+        setup_start(amp, true);
+    } else {
+        trace_log_event(TRACE_EVENT_AMP_CONNECTED_DISCOVER, amp->index, 0, 0);
+        // general gatt client request to trigger mandatory authentication
+        setup_start(amp, false);
+    }
+
+    // look for further amps
+    amps_connect_next();
+}
+
+static void handle_disconnection_complete(uint8_t * packet){
+    hci_con_handle_t con_handle = hci_event_disconnection_complete_get_connection_handle(packet);
+    if ((relay.state == RELAY_STATE_CONNECTED) && (con_handle == relay.con_handle)){
+        relay_handle_disconnection_complete();
+        return;
+    }
+    amp_t * amp = amp_for_con_handle(con_handle);
+    if (amp == NULL) return;
+    trace_log_event(TRACE_EVENT_AMP_DISCONNECTED, amp->index, 0, 0);
+    link_stop(amp);
+    amp->preset_dump_pending = 0;
+    command_queue_flush(amp);
+    spark_amp_state_reset(&amp->spark_state);
+    btstack_run_loop_remove_timer(&amp->idle_timer);
+    amp->state = AMP_STATE_IDLE;
+    amp->press_trace_state = PRESS_TRACE_IDLE;
+    amp->macro_pending = 0;
+    expression_amp_stop(amp);
+    bank_amp_stop(amp);
+    amp->setup_start_ms = btstack_run_loop_get_time_ms();
+    amps_connect_next();
+    relay_update();
+}
+
+static void hci_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    UNUSED(channel);
+    UNUSED(size);
+
+    if (packet_type != HCI_EVENT_PACKET) return;
+
+    link_handle_hci_event(packet);
+
+    amp_t * amp;
+    uint8_t i;
+    switch (hci_event_packet_get_type(packet)) {
+        case BTSTACK_EVENT_STATE:
+            // BTstack activated, get started
+            if (btstack_event_state_get_state(packet) == HCI_STATE_WORKING){
+                for (i = 0; i < SPARK_MAX_AMPS; i++){
+                    amps[i].setup_start_ms = btstack_run_loop_get_time_ms();
+                    amps[i].setup_after_boot = true;
+                    cache_load(&amps[i]);
+                }
+                // stored banks are read from TLV
+                bank_prefetch_start();
+                amps_connect_next();
+            }
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            handle_disconnection_complete(packet);
+            break;
+        case GAP_EVENT_ADVERTISING_REPORT:
+            handle_advertising_report(packet);
+            break;
+        case HCI_EVENT_LE_META:
+            switch (hci_event_le_meta_get_subevent_code(packet)){
+                case HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE:
+                    amp = amp_for_con_handle(hci_subevent_le_connection_update_complete_get_connection_handle(packet));
+                    if (amp == NULL) break;
+                    connection_parameters_updated(amp, packet);
+                    break;
+                case HCI_SUBEVENT_LE_CONNECTION_COMPLETE:
+                    // the app connects to the relay, the pedal connects to the amps
+                    if (hci_subevent_le_connection_complete_get_role(packet) == HCI_ROLE_SLAVE){
+                        relay_handle_connection_complete(packet);
+                    } else {
+                        handle_connection_complete(packet);
+                    }
+                    break;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void sm_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    UNUSED(channel);
+    UNUSED(size);
+
+    if (packet_type != HCI_EVENT_PACKET) return;
+
+    bd_addr_t addr;
+    bd_addr_type_t addr_type;
+
+    switch (hci_event_packet_get_type(packet)) {
+        case SM_EVENT_JUST_WORKS_REQUEST:
+            trace_log_event(TRACE_EVENT_SM_JUST_WORKS, 0, 0, 0);
+            sm_just_works_confirm(sm_event_just_works_request_get_handle(packet));
+            break;
+        case SM_EVENT_NUMERIC_COMPARISON_REQUEST:
+            trace_log_event(TRACE_EVENT_SM_NUMERIC_COMPARISON, sm_event_numeric_comparison_request_get_passkey(packet), 0, 0);
+            sm_numeric_comparison_confirm(sm_event_passkey_display_number_get_handle(packet));
+            break;
+        case SM_EVENT_PAIRING_STARTED:
+            trace_log_event(TRACE_EVENT_SM_PAIRING_STARTED, 0, 0, 0);
+            break;
+        case SM_EVENT_PAIRING_COMPLETE:
+            switch (sm_event_pairing_complete_get_status(packet)){
+                case ERROR_CODE_SUCCESS:
+                    trace_log_event(TRACE_EVENT_SM_PAIRING_COMPLETE, 0, 0, 0);
+                    break;
+                case ERROR_CODE_CONNECTION_TIMEOUT:
+                    trace_log_event(TRACE_EVENT_SM_PAIRING_TIMEOUT, 0, 0, 0);
+                    break;
+                case ERROR_CODE_REMOTE_USER_TERMINATED_CONNECTION:
+                    trace_log_event(TRACE_EVENT_SM_PAIRING_DISCONNECTED, 0, 0, 0);
+                    break;
+                case ERROR_CODE_AUTHENTICATION_FAILURE:
+                    trace_log_event(TRACE_EVENT_SM_PAIRING_FAILED, sm_event_pairing_complete_get_reason(packet), 0, 0);
+                    break;
+                default:
+                    break;
+            }
+            break;
+        case SM_EVENT_REENCRYPTION_STARTED:
+            sm_event_reencryption_complete_get_address(packet, addr);
+            trace_log_data(TRACE_EVENT_SM_REENCRYPTION_STARTED, sm_event_reencryption_started_get_addr_type(packet), 0, 0,
+                           addr, BD_ADDR_LEN);
+            break;
+        case SM_EVENT_REENCRYPTION_COMPLETE:
+            switch (sm_event_reencryption_complete_get_status(packet)){
+                case ERROR_CODE_SUCCESS:
+                    trace_log_event(TRACE_EVENT_SM_REENCRYPTION_COMPLETE, 0, 0, 0);
+                    break;
+                case ERROR_CODE_CONNECTION_TIMEOUT:
+                    trace_log_event(TRACE_EVENT_SM_REENCRYPTION_TIMEOUT, 0, 0, 0);
+                    break;
+                case ERROR_CODE_REMOTE_USER_TERMINATED_CONNECTION:
+                    trace_log_event(TRACE_EVENT_SM_REENCRYPTION_DISCONNECTED, 0, 0, 0);
+                    break;
+                case ERROR_CODE_PIN_OR_KEY_MISSING:
+                    trace_log_event(TRACE_EVENT_SM_REENCRYPTION_BONDING_MISSING, 0, 0, 0);
+                    sm_event_reencryption_complete_get_address(packet, addr);
+                    addr_type = sm_event_reencryption_started_get_addr_type(packet);
+                    gap_delete_bonding(addr_type, addr);
+                    sm_request_pairing(sm_event_reencryption_complete_get_handle(packet));
+                    break;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void led_show_preset(uint8_t preset){
+    led_engine_stop();
+    led_engine_clear();
+    switch (preset){
+        case 0: // clean
+            led_engine_set(0, LED_COLOR_PRESET_0);
+            break;
+        case 1: // crunchy
+            led_engine_set(1, LED_COLOR_PRESET_1);
+            break;
+        case 2: // distortion
+            led_engine_set(2, LED_COLOR_PRESET_2);
+            break;
+        default:
+            break;
+    }
+    led_engine_show();
+}
+
+static void on_preset_updated(amp_t * amp){
+    trace_log_event(TRACE_EVENT_AMP_PRESET, amp->index, amp->spark_state.current_preset, 0);
+    // in a stored bank, LEDs keep showing bank and slot selected on the pedal
+    if (bank_active != PRESET_BANK_HARDWARE) return;
+    // presets are fanned out, LEDs show the last change
+    led_show_preset(amp->spark_state.current_preset);
+}
+
+static void handle_amp_state_changed(void * context, uint16_t dirty){
+    amp_t * amp = (amp_t *) context;
+    if (dirty & SPARK_AMP_STATE_DIRTY_CURRENT_PRESET){
+        on_preset_updated(amp);
+    }
+    if (dirty & SPARK_AMP_STATE_DIRTY_CURRENT_TONE){
+        const char * name = amp->spark_state.current.name;
+        trace_log_data(TRACE_EVENT_AMP_TONE, amp->index, 0, 0, (const uint8_t *) name, (uint16_t) strlen(name));
+    }
+    if (dirty & SPARK_AMP_STATE_DIRTY_SYNCED){
+        trace_log_event(TRACE_EVENT_AMP_SYNCED, amp->index, btstack_run_loop_get_time_ms() - amp->state_query_ms, 0);
+    }
+}
+
+static void dump_amp_state(const amp_t * amp){
+    if (!spark_amp_state_is_synced(&amp->spark_state)){
+        printf("[-] Amp %u: Amp state not synced\n", amp->index);
+        return;
+    }
+    printf("[-] Amp %u: %s, current preset %u, tone '%s'\n", amp->index, spark_adv_filter_model_name(amp->model),
+           amp->spark_state.current_preset, amp->spark_state.current.name);
+    uint8_t i;
+    for (i = 0; i < SPARK_AMP_STATE_NUM_EFFECTS; i++){
+        const spark_amp_effect_t * effect = &amp->spark_state.current.effects[i];
+        printf("    %u: %-20s %s\n", i, effect->name, effect->on ? "on" : "off");
+    }
+    for (i = 0; i < SPARK_AMP_STATE_NUM_PRESETS; i++){
+        printf("[-] Amp %u: Preset %u: '%s'\n", amp->index, i, amp->spark_state.presets[i].name);
+    }
+}
+
+// message format from
+// https://github.com/jrnelson90/tinderboxpedal/blob/master/src/BLE%20message%20format.md
+
+static void handle_spark_message(void * context, const spark_message_t * message){
+    amp_t * amp = (amp_t *) context;
+
+    trace_log_data(TRACE_EVENT_RX_MESSAGE, amp->index, (message->command << 8) | message->sub_command, message->sequence,
+                   message->payload, message->payload_len);
+
+    switch (message->command){
+        case SPARK_CMD_RESPONSE:
+            switch (message->sub_command){
+                case SPARK_SUB_SELECT_PRESET:
+                    // preset changed on amp or by app
+                    press_trace_confirmed(amp);
+                    break;
+                case SPARK_SUB_PRESET:
+                    preset_dump_received(amp, message->payload_len);
+                    bank_capture_received(amp, message);
+                    break;
+                default:
+                    break;
+            }
+            break;
+        case SPARK_CMD_ACK:
+            command_retained_acknowledged(amp, message->sequence);
+            macro_command_acknowledged(amp, message->sequence);
+            expression_acknowledged(amp, message->sequence);
+            bank_acknowledged(amp, message->sequence);
+            switch (message->sub_command){
+                case SPARK_SUB_SELECT_PRESET:
+                    press_trace_confirmed(amp);
+                    break;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+
+    spark_amp_state_process_message(&amp->spark_state, message);
+}
+
+static void process_update(amp_t * amp, const uint8_t * data, uint16_t len){
+
+    trace_log_data(TRACE_EVENT_RX, amp->index, 0, 0, data, len);
+
+    // notifications are fragments of the message stream
+    spark_reader_process(&amp->reader, data, len);
+
+    if (!relay_is_amp(amp)) return;
+    relay_forward_to_app(data, len, spark_reader_at_message_boundary(&amp->reader));
+    relay_report_preset();
+}
+
+static void press_trace_edge(uint32_t edge_us){
+    press_trace_state          = PRESS_TRACE_EDGE;
+    press_trace_edge_us        = edge_us;
+    press_trace_amps           = 0;
+    press_trace_confirmed_amps = 0;
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amps[i].press_trace_state = PRESS_TRACE_IDLE;
+    }
+}
+
+static void press_trace_stage(amp_t * amp, press_trace_state_t from_state, press_trace_state_t to_state, latency_stage_t stage){
+    if (amp->press_trace_state != from_state) return;
+    uint32_t now_us = platform_time_us();
+    latency_histogram_add(&latency_histograms[stage], now_us - amp->press_trace_stage_us);
+    amp->press_trace_stage_us = now_us;
+    amp->press_trace_state = to_state;
+}
+
+static void press_trace_confirmed(amp_t * amp){
+    if (amp->press_trace_state != PRESS_TRACE_WRITTEN) return;
+    press_trace_stage(amp, PRESS_TRACE_WRITTEN, PRESS_TRACE_IDLE, LATENCY_STAGE_WRITTEN_TO_CONFIRMED);
+    latency_histogram_add(&latency_histograms[LATENCY_STAGE_EDGE_TO_CONFIRMED], amp->press_trace_stage_us - press_trace_edge_us);
+    // skew once all amps that got the press confirmed it
+    press_trace_confirmed_amps++;
+    if (press_trace_confirmed_amps == 1){
+        press_trace_first_confirmed_us = amp->press_trace_stage_us;
+    }
+    if ((press_trace_confirmed_amps == press_trace_amps) && (press_trace_amps > 1)){
+        latency_histogram_add(&latency_histograms[LATENCY_STAGE_AMP_SKEW], amp->press_trace_stage_us - press_trace_first_confirmed_us);
+    }
+}
+
+static bool command_is_select_preset(const command_t * command){
+    return (command->command == SPARK_CMD_WRITE) && (command->sub_command == SPARK_SUB_SELECT_PRESET);
+}
+
+static void dump_latency(void){
+    printf("[-] Latency (us)        count      min      p50      p95      p99      max\n");
+    uint8_t record[4 + LATENCY_STAGE_COUNT * LATENCY_HISTOGRAM_RECORD_LEN];
+    uint16_t pos = 0;
+    record[pos++] = 'L';
+    record[pos++] = 'A';
+    record[pos++] = 'T';
+    record[pos++] = LATENCY_STAGE_COUNT;
+    uint8_t stage;
+    for (stage = 0; stage < LATENCY_STAGE_COUNT; stage++){
+        const latency_histogram_t * histogram = &latency_histograms[stage];
+        printf("    %-20s %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32"\n", latency_stage_names[stage],
+               histogram->count, histogram->min_us, latency_histogram_get_percentile(histogram, 50),
+               latency_histogram_get_percentile(histogram, 95), latency_histogram_get_percentile(histogram, 99),
+               histogram->max_us);
+        pos += latency_histogram_store_record(histogram, &record[pos]);
+    }
+    // compact binary record for tools
+    printf("LAT: ");
+    printf_hexdump(record, pos);
+}
+
+static void reset_latency(void){
+    uint8_t stage;
+    for (stage = 0; stage < LATENCY_STAGE_COUNT; stage++){
+        latency_histogram_reset(&latency_histograms[stage]);
+    }
+    latency_histogram_reset(&preset_dump_histogram);
+    latency_histogram_reset(&bank_switch_prepare_histogram);
+    latency_histogram_reset(&relay.to_amp.histogram);
+    latency_histogram_reset(&relay.to_app.histogram);
+    preset_dump_bytes = 0;
+    press_trace_state = PRESS_TRACE_IDLE;
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amps[i].press_trace_state = PRESS_TRACE_IDLE;
+    }
+}
+
+static void command_release(command_t * command){
+    command_stats.depth--;
+    if (command_large_frame_owner == command){
+        command_large_frame_owner = NULL;
+    }
+    bank_upload_released(command);
+    btstack_linked_list_add(&command_free_list, (btstack_linked_item_t *) command);
+}
+
+static void preset_dump_requested(amp_t * amp){
+    if (amp->preset_dump_pending == PRESET_DUMP_MAX_PENDING){
+        // drop oldest
+        amp->preset_dump_head = (amp->preset_dump_head + 1) % PRESET_DUMP_MAX_PENDING;
+        amp->preset_dump_pending--;
+    }
+    amp->preset_dump_request_us[(amp->preset_dump_head + amp->preset_dump_pending) % PRESET_DUMP_MAX_PENDING] = platform_time_us();
+    amp->preset_dump_pending++;
+}
+
+// responses arrive in request order, requests without response expire
+static void preset_dump_received(amp_t * amp, uint16_t payload_len){
+    uint32_t now_us = platform_time_us();
+    while (amp->preset_dump_pending > 0){
+        uint32_t duration_us = now_us - amp->preset_dump_request_us[amp->preset_dump_head];
+        amp->preset_dump_head = (amp->preset_dump_head + 1) % PRESET_DUMP_MAX_PENDING;
+        amp->preset_dump_pending--;
+        if (duration_us > PRESET_DUMP_TIMEOUT_US) continue;
+        latency_histogram_add(&preset_dump_histogram, duration_us);
+        preset_dump_bytes += payload_len;
+        return;
+    }
+}
+
+static void dump_preset_dump_stats(void){
+    const latency_histogram_t * histogram = &preset_dump_histogram;
+    uint32_t avg_bytes = (histogram->count > 0) ? (preset_dump_bytes / histogram->count) : 0;
+    printf("[-] Preset dumps: %"PRIu32", avg %"PRIu32" bytes, request to response min/p50/max %"PRIu32"/%"PRIu32"/%"PRIu32" us\n",
+           histogram->count, avg_bytes, histogram->min_us, latency_histogram_get_percentile(histogram, 50), histogram->max_us);
+}
+
+static void command_sent(amp_t * amp, command_t * command){
+    uint32_t time_to_send_us = platform_time_us() - command->queued_us;
+    if ((command_stats.sent == 0) || (time_to_send_us < command_stats.time_to_send_min_us)){
+        command_stats.time_to_send_min_us = time_to_send_us;
+    }
+    if (time_to_send_us > command_stats.time_to_send_max_us){
+        command_stats.time_to_send_max_us = time_to_send_us;
+    }
+    command_stats.time_to_send_total_us += time_to_send_us;
+    command_stats.sent++;
+    if (command_is_select_preset(command)){
+        press_trace_stage(amp, PRESS_TRACE_QUEUED, PRESS_TRACE_WRITTEN, LATENCY_STAGE_QUEUED_TO_WRITTEN);
+    }
+    if ((command->command == SPARK_CMD_REQUEST) && (command->sub_command == SPARK_SUB_PRESET)){
+        preset_dump_requested(amp);
+    }
+    command_release(command);
+}
+
+static void command_retry_timeout(btstack_timer_source_t * ts){
+    command_queue_run((amp_t *) btstack_run_loop_get_timer_context(ts));
+}
+
+static void command_retry_later(amp_t * amp){
+    btstack_run_loop_remove_timer(&amp->command_retry_timer);
+    btstack_run_loop_set_timer_handler(&amp->command_retry_timer, &command_retry_timeout);
+    btstack_run_loop_set_timer_context(&amp->command_retry_timer, amp);
+    btstack_run_loop_set_timer(&amp->command_retry_timer, COMMAND_RETRY_DELAY_MS);
+    btstack_run_loop_add_timer(&amp->command_retry_timer);
+}
+
+static bool amp_write_without_response(const amp_t * amp){
+    return (amp->characteristic_tx.properties & ATT_PROPERTY_WRITE_WITHOUT_RESPONSE) != 0;
+}
+
+// write could not be started, returns true if it is retried later
+static bool amp_write_busy(amp_t * amp, uint8_t status){
+    switch (status){
+        case GATT_CLIENT_BUSY:
+            if (amp_write_without_response(amp)){
+                // outgoing buffers full, continue when we can send again
+                gatt_client_request_can_write_without_response_event(handle_gatt_client_event, amp->con_handle);
+            } else {
+                command_retry_later(amp);
+            }
+            return true;
+        case GATT_CLIENT_IN_WRONG_STATE:
+            // other GATT query in progress
+            command_retry_later(amp);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void command_queue_run(amp_t * amp){
+    if (amp->state != AMP_STATE_CONNECTED) return;
+    bool write_without_response = amp_write_without_response(amp);
+    while ((amp->command_in_flight == NULL) && !relay_to_amp_in_flight(amp)){
+        command_t * command = (command_t *) btstack_linked_list_get_first_item(&amp->command_queue);
+
+        // data from the app in relay mode
+        if (relay_to_amp_first(amp, command)){
+            if (!relay_to_amp_run(amp)) return;
+            continue;
+        }
+        if (command == NULL) return;
+        // wait for the rest of a message from the app
+        if (relay_is_amp(amp) && !relay.to_amp.at_boundary && (command->sent == 0)) return;
+
+        // one block per write, block length is stored in its header
+        uint8_t * block = &command->data[command->sent];
+        uint16_t block_len = block[6];
+
+        trace_log_data(TRACE_EVENT_TX, amp->index, 0, 0, block, block_len);
+
+        uint8_t status;
+        if (write_without_response){
+            status = gatt_client_write_value_of_characteristic_without_response(amp->con_handle,
+                amp->characteristic_tx.value_handle, block_len, block);
+        } else {
+            status = gatt_client_write_value_of_characteristic(handle_gatt_client_event, amp->con_handle,
+                amp->characteristic_tx.value_handle, block_len, block);
+        }
+
+        switch (status){
+            case ERROR_CODE_SUCCESS:
+                if (write_without_response){
+                    // keep command at head until all blocks are sent
+                    command->sent += block_len;
+                    if (command->sent < command->len) break;
+                    btstack_linked_list_pop(&amp->command_queue);
+                    command_sent(amp, command);
+                } else {
+                    btstack_linked_list_pop(&amp->command_queue);
+                    command->block_len    = block_len;
+                    amp->command_in_flight = command;
+                }
+                break;
+            default:
+                if (amp_write_busy(amp, status)) return;
+                trace_log_event(TRACE_EVENT_COMMAND_WRITE_FAILED, amp->index, status, (command->command << 8) | command->sub_command);
+                btstack_linked_list_pop(&amp->command_queue);
+                command_drop(amp, command);
+                break;
+        }
+    }
+}
+
+static void command_write_complete(amp_t * amp, uint8_t att_status){
+    command_t * command = amp->command_in_flight;
+    if (command == NULL) return;
+    amp->command_in_flight = NULL;
+
+    if (att_status == ATT_ERROR_SUCCESS){
+        command->sent += command->block_len;
+        if (command->sent < command->len){
+            // continue with next block before other commands
+            btstack_linked_list_add(&amp->command_queue, (btstack_linked_item_t *) command);
+        } else {
+            command_sent(amp, command);
+        }
+    } else if ((att_status == ATT_ERROR_INVALID_HANDLE) && amp->using_cache){
+        // cached handles are stale, rediscover on reconnect
+        trace_log_event(TRACE_EVENT_COMMAND_HANDLES_INVALID, amp->index, 0, 0);
+        command_release(command);
+        cache_invalidate_handles(amp);
+        gap_disconnect(amp->con_handle);
+        return;
+    } else if (command->retries < COMMAND_MAX_RETRIES){
+        trace_log_event(TRACE_EVENT_COMMAND_ATT_RETRY, amp->index, att_status, (command->command << 8) | command->sub_command);
+        command->retries++;
+        command_stats.retries++;
+        btstack_linked_list_add(&amp->command_queue, (btstack_linked_item_t *) command);
+    } else {
+        trace_log_event(TRACE_EVENT_COMMAND_ATT_DROP, amp->index, att_status, (command->command << 8) | command->sub_command);
+        command_drop(amp, command);
+    }
+    command_queue_run(amp);
+}
+
+static void command_queue_flush(amp_t * amp){
+    btstack_run_loop_remove_timer(&amp->command_retry_timer);
+    btstack_run_loop_remove_timer(&amp->command_replay_timer);
+    command_t * command;
+    while ((command = (command_t *) btstack_linked_list_pop(&amp->command_queue)) != NULL){
+        command_release(command);
+    }
+    // response for write in flight will not arrive after disconnect
+    if (amp->command_in_flight != NULL){
+        command_release(amp->command_in_flight);
+        amp->command_in_flight = NULL;
+    }
+    // neither will acknowledgements, kept writes are sent again once setup completes
+    uint8_t i;
+    for (i = 0; i < COMMAND_RETAINED_COUNT; i++){
+        amp->command_retained[i].sequence = COMMAND_SEQUENCE_NONE;
+    }
+}
+
+static void command_replay_timeout(btstack_timer_source_t * ts){
+    command_replay((amp_t *) btstack_run_loop_get_timer_context(ts));
+}
+
+static void command_replay_later(amp_t * amp, uint32_t delay_ms){
+    btstack_run_loop_remove_timer(&amp->command_replay_timer);
+    btstack_run_loop_set_timer_handler(&amp->command_replay_timer, &command_replay_timeout);
+    btstack_run_loop_set_timer_context(&amp->command_replay_timer, amp);
+    btstack_run_loop_set_timer(&amp->command_replay_timer, delay_ms);
+    btstack_run_loop_add_timer(&amp->command_replay_timer);
+}
+
+static bool command_is_retained(uint8_t command, uint8_t sub_command){
+    return (command == SPARK_CMD_WRITE) && ((sub_command == SPARK_SUB_SELECT_PRESET) || (sub_command == SPARK_SUB_EFFECT_ONOFF));
+}
+
+// entry of the preset or of the effect named at the start of the payload, an unused one for a new effect
+static command_retained_t * command_retained_get(amp_t * amp, uint8_t sub_command, const uint8_t * payload){
+    if (sub_command == SPARK_SUB_SELECT_PRESET) return &amp->command_retained[COMMAND_RETAINED_PRESET];
+    uint16_t name_len = 1 + (payload[0] & 0x1f);
+    command_retained_t * unused = NULL;
+    uint8_t i;
+    for (i = COMMAND_RETAINED_PRESET + 1; i < COMMAND_RETAINED_COUNT; i++){
+        command_retained_t * retained = &amp->command_retained[i];
+        if (!retained->active){
+            if (unused == NULL){
+                unused = retained;
+            }
+            continue;
+        }
+        if ((retained->sub_command == sub_command) && (retained->payload_len > name_len) &&
+            (memcmp(retained->payload, payload, name_len) == 0)){
+            return retained;
+        }
+    }
+    return unused;
+}
+
+// latest write replaces the one kept before. A new preset brings its own effect states, older ones are obsolete
+static command_retained_t * command_retain(amp_t * amp, uint8_t command, uint8_t sub_command, const uint8_t * payload, uint16_t payload_len){
+    if (!command_is_retained(command, sub_command)) return NULL;
+    if ((payload_len == 0) || (payload_len > COMMAND_RETAINED_MAX_PAYLOAD)) return NULL;
+    uint8_t i;
+    if (sub_command == SPARK_SUB_SELECT_PRESET){
+        for (i = COMMAND_RETAINED_PRESET + 1; i < COMMAND_RETAINED_COUNT; i++){
+            amp->command_retained[i].active = false;
+        }
+    }
+    command_retained_t * retained = command_retained_get(amp, sub_command, payload);
+    if (retained == NULL) return NULL;
+    retained->active      = true;
+    retained->sub_command = sub_command;
+    retained->sequence    = COMMAND_SEQUENCE_NONE;
+    retained->replays     = 0;
+    retained->payload_len = (uint8_t) payload_len;
+    memcpy(retained->payload, payload, payload_len);
+    return retained;
+}
+
+static void command_retained_acknowledged(amp_t * amp, uint8_t sequence){
+    uint8_t i;
+    for (i = 0; i < COMMAND_RETAINED_COUNT; i++){
+        command_retained_t * retained = &amp->command_retained[i];
+        if (retained->active && (retained->sequence == sequence)){
+            retained->active = false;
+        }
+    }
+}
+
+// write did not reach the amp, send a kept one again soon
+static void command_drop(amp_t * amp, command_t * command){
+    command_stats.dropped++;
+    uint8_t i;
+    for (i = 0; i < COMMAND_RETAINED_COUNT; i++){
+        command_retained_t * retained = &amp->command_retained[i];
+        if (!retained->active || (retained->sequence != command->sequence)) continue;
+        retained->sequence = COMMAND_SEQUENCE_NONE;
+        command_replay_later(amp, COMMAND_RETRY_DELAY_MS);
+    }
+    command_release(command);
+}
+
+static void command_queue_init(void){
+    uint8_t i;
+    for (i=0;i<COMMAND_POOL_SIZE;i++){
+        btstack_linked_list_add(&command_free_list, (btstack_linked_item_t *) &command_pool[i]);
+    }
+}
+
+// a newer command makes queued ones with the same effect obsolete
+static bool command_supersedes(uint8_t command, uint8_t sub_command){
+    return (command == SPARK_CMD_WRITE) && (sub_command == SPARK_SUB_SELECT_PRESET);
+}
+
+static command_t * command_find_superseded(amp_t * amp, uint8_t command, uint8_t sub_command){
+    if (!command_supersedes(command, sub_command)) return NULL;
+    btstack_linked_item_t * it;
+    for (it = amp->command_queue; it != NULL; it = it->next){
+        command_t * queued = (command_t *) it;
+        // first blocks already written, the rest must follow unchanged
+        if (queued->sent > 0) continue;
+        if ((queued->command == command) && (queued->sub_command == sub_command)){
+            return queued;
+        }
+    }
+    return NULL;
+}
+
+static bool command_build_frame(amp_t * amp, command_t * entry, uint8_t command, uint8_t sub_command, const uint8_t * payload, uint16_t payload_len){
+    uint8_t sequence = amp->command_sequence;
+    amp->command_sequence = (amp->command_sequence + 1) & 0x7f;
+    entry->sequence = sequence;
+    uint8_t block_max_len = link_block_max_len(amp);
+
+    // short frame: header is kept from last use of this entry, only sequence, payload and checksum change
+    if ((payload_len <= SPARK_SHORT_MAX_PAYLOAD) && !spark_message_is_multi_chunk(command, sub_command)){
+        uint32_t key = COMMAND_FRAME_KEY(command, sub_command, payload_len);
+        if (entry->frame_key != key){
+            entry->frame_key = key;
+            entry->frame_len = (uint8_t) spark_short_frame_init(entry->frame, SPARK_DIRECTION_TO_AMP, command, sub_command, (uint8_t) payload_len);
+        }
+        // with default MTU, even short frames are split into several blocks
+        if (entry->frame_len <= block_max_len){
+            spark_short_frame_patch(entry->frame, sequence, payload, (uint8_t) payload_len);
+            entry->data = entry->frame;
+            entry->len  = entry->frame_len;
+            return true;
+        }
+    }
+
+    // encode into entry
+    spark_writer_t writer;
+    entry->frame_key = 0;
+    spark_writer_init(&writer, entry->frame, sizeof(entry->frame), SPARK_DIRECTION_TO_AMP, block_max_len);
+    if (spark_writer_add_message(&writer, command, sub_command, sequence, payload, payload_len)){
+        entry->data = entry->frame;
+        entry->len  = spark_writer_get_len(&writer);
+        return true;
+    }
+
+    // several blocks: encode into large frame buffer, one large message at a time
+    if (command_large_frame_owner != NULL) return false;
+    spark_writer_init(&writer, command_large_frame, sizeof(command_large_frame), SPARK_DIRECTION_TO_AMP, block_max_len);
+    if (!spark_writer_add_message(&writer, command, sub_command, sequence, payload, payload_len)) return false;
+    command_large_frame_owner = entry;
+    entry->data = command_large_frame;
+    entry->len  = spark_writer_get_len(&writer);
+    return true;
+}
+
+// coalesced entry keeps its place in the queue
+static void command_enqueue(amp_t * amp, command_t * entry, bool coalesced, uint8_t command, uint8_t sub_command){
+    if (coalesced){
+        command_stats.coalesced++;
+    } else {
+        btstack_linked_list_add_tail(&amp->command_queue, (btstack_linked_item_t *) entry);
+        command_stats.depth++;
+        if (command_stats.depth > command_stats.depth_max){
+            command_stats.depth_max = command_stats.depth;
+        }
+    }
+    command_stats.queued++;
+    connection_activity(amp);
+
+    entry->command     = command;
+    entry->sub_command = sub_command;
+    entry->retries     = 0;
+    entry->sent        = 0;
+    entry->queued_us   = platform_time_us();
+}
+
+// kept write waits for its acknowledgement, or is sent again soon if it could not be queued
+static bool command_send(amp_t * amp, uint8_t command, uint8_t sub_command, const uint8_t * payload, uint16_t payload_len,
+                         command_retained_t * retained){
+    uint8_t sequence = amp->command_sequence;
+
+    // replace superseded command that is still queued or get free one
+    command_t * entry = command_find_superseded(amp, command, sub_command);
+    bool coalesced = entry != NULL;
+    if (!coalesced){
+        entry = (command_t *) btstack_linked_list_pop(&command_free_list);
+        if (entry == NULL){
+            trace_log_event(TRACE_EVENT_COMMAND_QUEUE_FULL, amp->index, (command << 8) | sub_command, 0);
+            command_stats.dropped++;
+            if (retained != NULL){
+                command_replay_later(amp, COMMAND_RETRY_DELAY_MS);
+            }
+            return false;
+        }
+    }
+
+    // build frame in place
+    if (!command_build_frame(amp, entry, command, sub_command, payload, payload_len)){
+        trace_log_event(TRACE_EVENT_COMMAND_TOO_LARGE, amp->index, (command << 8) | sub_command, payload_len);
+        command_stats.dropped++;
+        if (!coalesced){
+            btstack_linked_list_add(&command_free_list, (btstack_linked_item_t *) entry);
+        }
+        return false;
+    }
+
+    command_enqueue(amp, entry, coalesced, command, sub_command);
+    if (retained != NULL){
+        retained->sequence = sequence;
+        retained->sent_ms  = btstack_run_loop_get_time_ms();
+        command_replay_later(amp, COMMAND_RETAINED_TIMEOUT_MS);
+    }
+
+    if (command_is_select_preset(entry)){
+        press_trace_stage(amp, PRESS_TRACE_SELECTED, PRESS_TRACE_QUEUED, LATENCY_STAGE_SELECT_TO_QUEUED);
+    }
+    if (macro_running){
+        macro_command_queued(amp, sequence);
+    }
+
+    command_queue_run(amp);
+    return true;
+}
+
+static bool send_command(amp_t * amp, uint8_t command, uint8_t sub_command, const uint8_t * payload, uint16_t payload_len){
+    command_retained_t * retained = command_retain(amp, command, sub_command, payload, payload_len);
+    return command_send(amp, command, sub_command, payload, payload_len, retained);
+}
+
+// kept writes without sequence or acknowledgement in time go out again, in the order preset then effects
+static void command_replay(amp_t * amp){
+    if (amp->state != AMP_STATE_CONNECTED) return;
+    uint32_t now = btstack_run_loop_get_time_ms();
+    bool waiting = false;
+    bool sent    = false;
+    uint8_t i;
+    for (i = 0; i < COMMAND_RETAINED_COUNT; i++){
+        command_retained_t * retained = &amp->command_retained[i];
+        if (!retained->active) continue;
+        if ((retained->sequence != COMMAND_SEQUENCE_NONE) && ((now - retained->sent_ms) < COMMAND_RETAINED_TIMEOUT_MS)){
+            waiting = true;
+            continue;
+        }
+        if (retained->replays == COMMAND_RETAINED_MAX_REPLAYS){
+            trace_log_event(TRACE_EVENT_COMMAND_NOT_ACKNOWLEDGED, amp->index, (SPARK_CMD_WRITE << 8) | retained->sub_command,
+                            retained->replays + 1);
+            command_stats.dropped++;
+            retained->active = false;
+            continue;
+        }
+        trace_log_event(TRACE_EVENT_COMMAND_REPLAY, amp->index, (SPARK_CMD_WRITE << 8) | retained->sub_command, 0);
+        retained->replays++;
+        command_stats.replayed++;
+        command_send(amp, SPARK_CMD_WRITE, retained->sub_command, retained->payload, retained->payload_len, retained);
+        sent = true;
+    }
+    // sending restarts the timer
+    if (waiting && !sent){
+        command_replay_later(amp, COMMAND_RETAINED_TIMEOUT_MS);
+    }
+}
+
+// relay mode
+
+static bool relay_is_amp(const amp_t * amp){
+    return (relay.state == RELAY_STATE_CONNECTED) && (relay.amp == amp);
+}
+
+static bool relay_to_amp_in_flight(const amp_t * amp){
+    return relay_is_amp(amp) && (relay.to_amp_write_len > 0);
+}
+
+static void relay_fifo_reset(relay_fifo_t * fifo){
+    fifo->head        = 0;
+    fifo->count       = 0;
+    fifo->at_boundary = true;
+}
+
+static relay_fragment_t * relay_fifo_head(relay_fifo_t * fifo){
+    return (fifo->count > 0) ? &fifo->fragments[fifo->head] : NULL;
+}
+
+// fragment at the tail, filled in place by the caller
+static relay_fragment_t * relay_fifo_reserve(relay_fifo_t * fifo){
+    if (fifo->count == RELAY_FIFO_SIZE) return NULL;
+    relay_fragment_t * fragment = &fifo->fragments[(fifo->head + fifo->count) % RELAY_FIFO_SIZE];
+    fragment->len         = 0;
+    fragment->sent        = 0;
+    fragment->received_us = platform_time_us();
+    fragment->boundary    = true;
+    fifo->count++;
+    if (fifo->count > fifo->count_max){
+        fifo->count_max = fifo->count;
+    }
+    return fragment;
+}
+
+static void relay_fifo_forwarded(relay_fifo_t * fifo, uint32_t received_us, uint16_t len, bool boundary){
+    latency_histogram_add(&fifo->histogram, platform_time_us() - received_us);
+    fifo->fragments_forwarded++;
+    fifo->bytes += len;
+    fifo->at_boundary = boundary;
+}
+
+static void relay_fifo_pop(relay_fifo_t * fifo){
+    relay_fragment_t * fragment = &fifo->fragments[fifo->head];
+    relay_fifo_forwarded(fifo, fragment->received_us, fragment->len, fragment->boundary);
+    fifo->head = (fifo->head + 1) % RELAY_FIFO_SIZE;
+    fifo->count--;
+}
+
+// keep data that could not be forwarded from the event buffer
+static void relay_fifo_store(relay_fifo_t * fifo, const uint8_t * data, uint16_t len, bool boundary, uint32_t received_us){
+    relay_fragment_t * fragment = (len <= RELAY_FRAGMENT_MAX_LEN) ? relay_fifo_reserve(fifo) : NULL;
+    if (fragment == NULL){
+        fifo->dropped++;
+        return;
+    }
+    memcpy(fragment->data, data, len);
+    fragment->len         = len;
+    fragment->boundary    = boundary;
+    fragment->received_us = received_us;
+}
+
+// amp to app: notifications in pieces that fit the ATT MTU of the app, returns false if the app cannot take more now
+static bool relay_send_to_app(const uint8_t * data, uint16_t len, uint16_t * sent){
+    while (*sent < len){
+        uint16_t piece_len = btstack_min(len - *sent, relay.mtu - 3);
+        uint8_t status = att_server_notify(relay.con_handle, RELAY_RX_VALUE_HANDLE, &data[*sent], piece_len);
+        if (status == BTSTACK_ACL_BUFFERS_FULL){
+            // continue on ATT_EVENT_CAN_SEND_NOW
+            relay.to_app.throttled++;
+            att_server_request_can_send_now_event(relay.con_handle);
+            return false;
+        }
+        if (status != ERROR_CODE_SUCCESS){
+            relay.to_app.dropped++;
+            *sent = len;
+            break;
+        }
+        *sent += piece_len;
+    }
+    return true;
+}
+
+static void relay_to_app_run(void){
+    relay_fragment_t * fragment;
+    while ((fragment = relay_fifo_head(&relay.to_app)) != NULL){
+        if (!relay_send_to_app(fragment->data, fragment->len, &fragment->sent)) return;
+        relay_fifo_pop(&relay.to_app);
+    }
+}
+
+static void relay_forward_to_app(const uint8_t * data, uint16_t len, bool boundary){
+    if (!relay.notifications_enabled) return;
+    uint32_t received_us = platform_time_us();
+    uint16_t sent = 0;
+    if (relay_fifo_head(&relay.to_app) == NULL){
+        if (relay_send_to_app(data, len, &sent)){
+            relay_fifo_forwarded(&relay.to_app, received_us, len, boundary);
+            return;
+        }
+    }
+    relay_fifo_store(&relay.to_app, &data[sent], len - sent, boundary, received_us);
+}
+
+// the amp only acknowledges a preset selected by the pedal, so the app gets the response sent for a change on the amp.
+// It is inserted between two messages of the amp and built in place
+static void relay_report_preset(void){
+    if (relay.preset_report == SPARK_AMP_STATE_PRESET_UNKNOWN) return;
+    if (!spark_reader_at_message_boundary(&relay.amp->reader)) return;
+    relay_fragment_t * fragment = relay_fifo_reserve(&relay.to_app);
+    if (fragment == NULL) return;
+    const uint8_t payload[] = { 0x00, relay.preset_report };
+    fragment->len = spark_short_frame_init(fragment->data, SPARK_DIRECTION_FROM_AMP, SPARK_CMD_RESPONSE,
+                                           SPARK_SUB_SELECT_PRESET, sizeof(payload));
+    spark_short_frame_patch(fragment->data, relay.sequence, payload, sizeof(payload));
+    relay.sequence = (relay.sequence + 1) & 0x7f;
+    relay.preset_report = SPARK_AMP_STATE_PRESET_UNKNOWN;
+    relay.preset_reports++;
+    relay_to_app_run();
+}
+
+static void relay_preset_selected(uint8_t preset){
+    if ((relay.state != RELAY_STATE_CONNECTED) || !relay.notifications_enabled) return;
+    relay.preset_report = preset;
+    relay_report_preset();
+}
+
+// app to amp: pieces that fit the ATT MTU of the amp, with Write With Response one piece at a time
+static uint8_t relay_write_to_amp(amp_t * amp, uint8_t * data, uint16_t len, uint16_t * sent){
+    while (*sent < len){
+        uint16_t piece_len = btstack_min(len - *sent, amp->link.mtu - 3);
+        uint8_t status;
+        if (!amp_write_without_response(amp)){
+            status = gatt_client_write_value_of_characteristic(handle_gatt_client_event, amp->con_handle,
+                amp->characteristic_tx.value_handle, piece_len, &data[*sent]);
+            if (status == ERROR_CODE_SUCCESS){
+                relay.to_amp_write_len = piece_len;
+            }
+            return status;
+        }
+        status = gatt_client_write_value_of_characteristic_without_response(amp->con_handle,
+            amp->characteristic_tx.value_handle, piece_len, &data[*sent]);
+        if (status != ERROR_CODE_SUCCESS) return status;
+        *sent += piece_len;
+    }
+    return ERROR_CODE_SUCCESS;
+}
+
+// app write request waits while all fragments are in use
+static void relay_to_amp_resume_app(void){
+    if (!relay.to_amp_response_pending) return;
+    if (relay.to_amp.count == RELAY_FIFO_SIZE) return;
+    relay.to_amp_response_pending = false;
+    att_server_response_ready(relay.con_handle);
+}
+
+// pedal and app messages are interleaved between messages, the pedal goes first. Multi-block commands are not interrupted
+static bool relay_to_amp_first(const amp_t * amp, const command_t * command){
+    if (!relay_is_amp(amp) || (relay_fifo_head(&relay.to_amp) == NULL)) return false;
+    if (command == NULL) return true;
+    if (command->sent > 0) return false;
+    return !relay.to_amp.at_boundary;
+}
+
+// returns false if the amp cannot take more now
+static bool relay_to_amp_run(amp_t * amp){
+    relay_fragment_t * fragment = relay_fifo_head(&relay.to_amp);
+    uint8_t status = relay_write_to_amp(amp, fragment->data, fragment->len, &fragment->sent);
+    if (amp_write_busy(amp, status)) return false;
+    if (status != ERROR_CODE_SUCCESS){
+        trace_log_event(TRACE_EVENT_RELAY_WRITE_FAILED, amp->index, status, fragment->len - fragment->sent);
+        relay.to_amp.dropped++;
+        fragment->sent = fragment->len;
+    }
+    if (relay.to_amp_write_len > 0) return false;
+    relay_fifo_pop(&relay.to_amp);
+    relay_to_amp_resume_app();
+    return true;
+}
+
+static void relay_to_amp_write_complete(amp_t * amp, uint8_t att_status){
+    relay_fragment_t * fragment = relay_fifo_head(&relay.to_amp);
+    uint16_t write_len = relay.to_amp_write_len;
+    relay.to_amp_write_len = 0;
+    if (fragment != NULL){
+        if (att_status == ATT_ERROR_SUCCESS){
+            fragment->sent += write_len;
+        } else {
+            trace_log_event(TRACE_EVENT_RELAY_WRITE_ATT_FAILED, amp->index, att_status, fragment->len - fragment->sent);
+            relay.to_amp.dropped++;
+            fragment->sent = fragment->len;
+        }
+        if (fragment->sent == fragment->len){
+            relay_fifo_pop(&relay.to_amp);
+            relay_to_amp_resume_app();
+        }
+    }
+    command_queue_run(amp);
+}
+
+// data has to stay valid until the write response, so only Write Without Response is used from the event buffer
+static bool relay_to_amp_can_write_directly(const amp_t * amp){
+    if ((amp->state != AMP_STATE_CONNECTED) || !amp_write_without_response(amp)) return false;
+    if (relay_fifo_head(&relay.to_amp) != NULL) return false;
+    const command_t * command = (const command_t *) btstack_linked_list_get_first_item((btstack_linked_list_t *) &amp->command_queue);
+    if (command == NULL) return true;
+    return (command->sent == 0) && !relay.to_amp.at_boundary;
+}
+
+// app went quiet in the middle of a message, e.g. sent to the background: the rest is not waited for, the reader
+// resyncs on the next message and pedal commands go out again
+static void relay_to_amp_timeout(btstack_timer_source_t * ts){
+    UNUSED(ts);
+    if (relay.state != RELAY_STATE_CONNECTED) return;
+    // amp still takes queued pieces of it
+    if (relay_fifo_head(&relay.to_amp) != NULL){
+        btstack_run_loop_set_timer(&relay.to_amp_timer, RELAY_APP_MESSAGE_TIMEOUT_MS);
+        btstack_run_loop_add_timer(&relay.to_amp_timer);
+        return;
+    }
+    trace_log_event(TRACE_EVENT_RELAY_APP_MESSAGE_TIMEOUT, RELAY_APP_MESSAGE_TIMEOUT_MS, 0, 0);
+    relay.app_message_timeouts++;
+    spark_reader_reset(&relay.reader);
+    relay.to_amp.at_boundary = true;
+    command_queue_run(relay.amp);
+}
+
+static void relay_to_amp_watch(bool boundary){
+    btstack_run_loop_remove_timer(&relay.to_amp_timer);
+    if (boundary) return;
+    btstack_run_loop_set_timer_handler(&relay.to_amp_timer, &relay_to_amp_timeout);
+    btstack_run_loop_set_timer(&relay.to_amp_timer, RELAY_APP_MESSAGE_TIMEOUT_MS);
+    btstack_run_loop_add_timer(&relay.to_amp_timer);
+}
+
+static int relay_handle_app_write(uint8_t * data, uint16_t len){
+    amp_t * amp = relay.amp;
+    if ((relay.state != RELAY_STATE_CONNECTED) || (amp->state != AMP_STATE_CONNECTED)){
+        relay.to_amp.dropped++;
+        return 0;
+    }
+
+    // mirror changes made by the app
+    spark_reader_process(&relay.reader, data, len);
+    bool boundary = spark_reader_at_message_boundary(&relay.reader);
+    relay_to_amp_watch(boundary);
+
+    uint32_t received_us = platform_time_us();
+    uint16_t sent = 0;
+    if (relay_to_amp_can_write_directly(amp)){
+        uint8_t status = relay_write_to_amp(amp, data, len, &sent);
+        if ((status != ERROR_CODE_SUCCESS) && !amp_write_busy(amp, status)){
+            trace_log_event(TRACE_EVENT_RELAY_WRITE_FAILED, amp->index, status, len - sent);
+            relay.to_amp.dropped++;
+            sent = len;
+        }
+    }
+    if (sent == len){
+        relay_fifo_forwarded(&relay.to_amp, received_us, len, boundary);
+    } else {
+        relay_fifo_store(&relay.to_amp, &data[sent], len - sent, boundary, received_us);
+    }
+    command_queue_run(amp);
+
+#ifdef ENABLE_ATT_DELAYED_RESPONSE
+    if (relay.to_amp.count == RELAY_FIFO_SIZE){
+        // answer write request when a fragment is free. Write Commands cannot be delayed, they are dropped if full
+        relay.to_amp.throttled++;
+        relay.to_amp_response_pending = true;
+        return ATT_ERROR_WRITE_RESPONSE_PENDING;
+    }
+#endif
+    return 0;
+}
+
+static void relay_handle_app_message(void * context, const spark_message_t * message){
+    UNUSED(context);
+    amp_t * relay_amp = relay.amp;
+    if (relay_amp == NULL) return;
+    // LEDs follow the app, other amps the preset selected by the app
+    spark_amp_state_process_message(&relay_amp->spark_state, message);
+    if ((message->command != SPARK_CMD_WRITE) || (message->sub_command != SPARK_SUB_SELECT_PRESET)) return;
+    if (message->payload_len < 2) return;
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amp_t * amp = &amps[i];
+        if ((amp == relay_amp) || (amp->state != AMP_STATE_CONNECTED)) continue;
+        send_command(amp, SPARK_CMD_WRITE, SPARK_SUB_SELECT_PRESET, message->payload, 2);
+        spark_amp_state_set_current_preset(&amp->spark_state, message->payload[1]);
+    }
+}
+
+static uint16_t relay_att_read_callback(hci_con_handle_t con_handle, uint16_t attribute_handle, uint16_t offset,
+                                        uint8_t * buffer, uint16_t buffer_size){
+    UNUSED(con_handle);
+    UNUSED(offset);
+    if (attribute_handle != RELAY_RX_CCCD_HANDLE) return 0;
+    if ((buffer != NULL) && (buffer_size >= 2)){
+        little_endian_store_16(buffer, 0, relay.notifications_enabled ? GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION : 0);
+    }
+    return 2;
+}
+
+static int relay_att_write_callback(hci_con_handle_t con_handle, uint16_t attribute_handle, uint16_t transaction_mode,
+                                    uint16_t offset, uint8_t * buffer, uint16_t buffer_size){
+    const char * state;
+    if ((relay.state != RELAY_STATE_CONNECTED) || (con_handle != relay.con_handle)) return 0;
+    // app data is forwarded as it arrives, Prepare Writes are rejected and nothing is queued to execute or cancel
+    if (transaction_mode == ATT_TRANSACTION_MODE_CANCEL) return 0;
+    if (transaction_mode != ATT_TRANSACTION_MODE_NONE) return ATT_ERROR_REQUEST_NOT_SUPPORTED;
+    if (offset != 0) return ATT_ERROR_INVALID_OFFSET;
+    switch (attribute_handle){
+        case RELAY_TX_VALUE_HANDLE:
+            return relay_handle_app_write(buffer, buffer_size);
+        case RELAY_RX_CCCD_HANDLE:
+            if (buffer_size < 2) return ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH;
+            relay.notifications_enabled = (little_endian_read_16(buffer, 0) & GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION) != 0;
+            state = relay.notifications_enabled ? "enabled" : "disabled";
+            trace_log_data(TRACE_EVENT_RELAY_NOTIFICATIONS, 0, 0, 0, (const uint8_t *) state, (uint16_t) strlen(state));
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+static void relay_att_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    UNUSED(channel);
+    UNUSED(size);
+    if (packet_type != HCI_EVENT_PACKET) return;
+    if (relay.state != RELAY_STATE_CONNECTED) return;
+    switch (hci_event_packet_get_type(packet)){
+        case ATT_EVENT_MTU_EXCHANGE_COMPLETE:
+            if (att_event_mtu_exchange_complete_get_handle(packet) != relay.con_handle) break;
+            relay.mtu = att_event_mtu_exchange_complete_get_MTU(packet);
+            trace_log_event(TRACE_EVENT_RELAY_MTU, relay.mtu, 0, 0);
+            break;
+        case ATT_EVENT_CAN_SEND_NOW:
+            relay_to_app_run();
+            relay_report_preset();
+            break;
+        default:
+            break;
+    }
+}
+
+// advertise as Spark 40 while relay mode is enabled, an amp is connected and the app does not use the relay
+static void relay_update(void){
+    bool advertise = relay.enabled && (amps_count(AMP_STATE_CONNECTED) > 0);
+    switch (relay.state){
+        case RELAY_STATE_IDLE:
+            if (!advertise) break;
+            trace_log_event(TRACE_EVENT_RELAY_ADVERTISE, 0, 0, 0);
+            relay.state = RELAY_STATE_ADVERTISING;
+            gap_advertisements_enable(1);
+            break;
+        case RELAY_STATE_ADVERTISING:
+            if (advertise) break;
+            relay.state = RELAY_STATE_IDLE;
+            gap_advertisements_enable(0);
+            break;
+        case RELAY_STATE_CONNECTED:
+            // app sees the amp disconnect or relay mode turned off
+            if (relay.enabled && (relay.amp->state == AMP_STATE_CONNECTED)) break;
+            gap_disconnect(relay.con_handle);
+            break;
+        default:
+            break;
+    }
+}
+
+static amp_t * relay_select_amp(void){
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        if (amps[i].state == AMP_STATE_CONNECTED) return &amps[i];
+    }
+    return NULL;
+}
+
+static void relay_handle_connection_complete(const uint8_t * packet){
+    if (hci_subevent_le_connection_complete_get_status(packet) != ERROR_CODE_SUCCESS) return;
+    hci_con_handle_t con_handle = hci_subevent_le_connection_complete_get_connection_handle(packet);
+    amp_t * amp = relay_select_amp();
+    if (!relay.enabled || (relay.state == RELAY_STATE_CONNECTED) || (amp == NULL)){
+        gap_disconnect(con_handle);
+        return;
+    }
+    // single app
+    gap_advertisements_enable(0);
+    relay.state                   = RELAY_STATE_CONNECTED;
+    relay.con_handle              = con_handle;
+    relay.amp                     = amp;
+    relay.mtu                     = ATT_DEFAULT_MTU;
+    relay.notifications_enabled   = false;
+    relay.to_amp_write_len        = 0;
+    relay.to_amp_response_pending = false;
+    relay.preset_report           = SPARK_AMP_STATE_PRESET_UNKNOWN;
+    relay.connections++;
+    relay_fifo_reset(&relay.to_amp);
+    relay_fifo_reset(&relay.to_app);
+    spark_reader_reset(&relay.reader);
+    trace_log_event(TRACE_EVENT_RELAY_CONNECTED, amp->index, 0, 0);
+}
+
+static void relay_handle_disconnection_complete(void){
+    amp_t * amp = relay.amp;
+    trace_log_event(TRACE_EVENT_RELAY_DISCONNECTED, 0, 0, 0);
+    relay.state = RELAY_STATE_IDLE;
+    relay.amp   = NULL;
+    relay.notifications_enabled = false;
+    relay.to_amp_write_len = 0;
+    btstack_run_loop_remove_timer(&relay.to_amp_timer);
+    relay_fifo_reset(&relay.to_amp);
+    relay_fifo_reset(&relay.to_app);
+    spark_reader_reset(&relay.reader);
+    // commands no longer wait for the rest of a message from the app
+    command_queue_run(amp);
+    relay_update();
+}
+
+static void relay_server_init(void){
+    if (relay.server_ready) return;
+    relay.server_ready = true;
+
+    att_server_init(profile_data, &relay_att_read_callback, &relay_att_write_callback);
+    att_server_register_packet_handler(&relay_att_packet_handler);
+
+    bd_addr_t null_addr;
+    memset(null_addr, 0, sizeof(null_addr));
+    gap_advertisements_set_params(RELAY_ADV_INTERVAL_MIN, RELAY_ADV_INTERVAL_MAX, 0, 0, null_addr, 0x07, 0x00);
+    gap_advertisements_set_data(sizeof(relay_adv_data), (uint8_t *) relay_adv_data);
+}
+
+static void relay_set_enabled(bool enabled){
+    relay.enabled = enabled;
+    const btstack_tlv_t * tlv_impl;
+    void * tlv_context;
+    btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+    if (tlv_impl != NULL){
+        uint8_t value = enabled ? 1 : 0;
+        tlv_impl->store_tag(tlv_context, RELAY_MODE_TAG, &value, sizeof(value));
+    }
+    printf("[-] Relay: %s\n", enabled ? "enabled" : "disabled");
+    if (enabled){
+        relay_server_init();
+    }
+    relay_update();
+}
+
+static void relay_init(void){
+    memset(&relay, 0, sizeof(relay));
+    relay.preset_report = SPARK_AMP_STATE_PRESET_UNKNOWN;
+    relay_fifo_reset(&relay.to_amp);
+    relay_fifo_reset(&relay.to_app);
+    latency_histogram_reset(&relay.to_amp.histogram);
+    latency_histogram_reset(&relay.to_app.histogram);
+    spark_reader_init(&relay.reader, &relay_handle_app_message, NULL);
+
+    const btstack_tlv_t * tlv_impl;
+    void * tlv_context;
+    btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+    if (tlv_impl == NULL) return;
+    uint8_t value = 0;
+    if (tlv_impl->get_tag(tlv_context, RELAY_MODE_TAG, &value, sizeof(value)) != sizeof(value)) return;
+    relay.enabled = value != 0;
+    if (relay.enabled){
+        printf("[-] Relay: enabled\n");
+        relay_server_init();
+    }
+}
+
+static void dump_relay_fifo(const char * name, const relay_fifo_t * fifo){
+    printf("[-] Relay %s: %"PRIu32" fragments, %"PRIu32" bytes, queued max %u, throttled %"PRIu32", dropped %"PRIu32"\n",
+           name, fifo->fragments_forwarded, fifo->bytes, fifo->count_max, fifo->throttled, fifo->dropped);
+}
+
+static void dump_relay_stats(void){
+    printf("[-] Relay: %s, app connections %"PRIu32", app messages %"PRIu32", resyncs %"PRIu32", incomplete %"PRIu32", preset reports %"PRIu32"\n",
+           relay.enabled ? "enabled" : "disabled", relay.connections, relay.reader.stats.messages, relay.reader.stats.resyncs,
+           relay.app_message_timeouts, relay.preset_reports);
+    dump_relay_fifo("app -> amp", &relay.to_amp);
+    dump_relay_fifo("amp -> app", &relay.to_app);
+    printf("[-] Forwarding (us)     count      min      p50      p95      p99      max\n");
+    const relay_fifo_t * fifos[] = { &relay.to_amp, &relay.to_app };
+    const char * names[] = { "app -> amp", "amp -> app" };
+    uint8_t i;
+    for (i = 0; i < 2; i++){
+        const latency_histogram_t * histogram = &fifos[i]->histogram;
+        printf("    %-20s %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32"\n", names[i],
+               histogram->count, histogram->min_us, latency_histogram_get_percentile(histogram, 50),
+               latency_histogram_get_percentile(histogram, 95), latency_histogram_get_percentile(histogram, 99),
+               histogram->max_us);
+    }
+}
+
+static void dump_command_stats(void){
+    uint32_t time_to_send_avg_us = 0;
+    if (command_stats.sent > 0){
+        time_to_send_avg_us = (uint32_t) (command_stats.time_to_send_total_us / command_stats.sent);
+    }
+    printf("[-] Commands: queued %"PRIu32", coalesced %"PRIu32", sent %"PRIu32", retries %"PRIu32", dropped %"PRIu32", sent again %"PRIu32"\n",
+           command_stats.queued, command_stats.coalesced, command_stats.sent, command_stats.retries, command_stats.dropped,
+           command_stats.replayed);
+    printf("[-] Command queue depth %u (max %u), time to send min/avg/max %"PRIu32"/%"PRIu32"/%"PRIu32" us\n",
+           command_stats.depth, command_stats.depth_max, command_stats.time_to_send_min_us, time_to_send_avg_us,
+           command_stats.time_to_send_max_us);
+}
+
+static void dump_macro_stats(void){
+    printf("[-] Macros: fired %"PRIu32", commands %"PRIu32", skipped %"PRIu32", completed %"PRIu32", incomplete %"PRIu32"\n",
+           macro_stats.fired, macro_stats.commands, macro_stats.skipped, macro_stats.completed, macro_stats.incomplete);
+}
+
+static void dump_tap_tempo_stats(void){
+    const tap_tempo_stats_t * stats = tap_tempo_get_stats(&tap_tempo);
+    uint16_t bpm_x10 = tap_tempo_get_bpm_x10(&tap_tempo);
+    printf("[-] Tap tempo: %u.%u BPM, taps %"PRIu32", accepted %"PRIu32", outliers %"PRIu32", bounces %"PRIu32", sequences %"PRIu32"\n",
+           bpm_x10 / 10, bpm_x10 % 10, stats->taps, stats->accepted, stats->outliers, stats->bounces, stats->sequences);
+}
+
+static void dump_expression_stats(void){
+    uint32_t rate_x10 = expression_stats.seconds_active ? ((expression_stats.sent * 10) / expression_stats.seconds_active) : 0;
+    printf("[-] Expression: position %u, changes %"PRIu32", sent %"PRIu32", superseded %"PRIu32", skipped %"PRIu32"\n",
+           expression_position, expression_stats.changes, expression_stats.sent, expression_stats.superseded, expression_stats.skipped);
+    printf("[-] Expression: messages per second avg %"PRIu32".%"PRIu32", max %"PRIu32" over %"PRIu32" s\n",
+           rate_x10 / 10, rate_x10 % 10, expression_stats.max_per_second, expression_stats.seconds_active);
+}
+
+static void dump_led_stats(void){
+    const led_engine_stats_t * stats = led_engine_get_stats();
+    printf("[-] LEDs: commits %"PRIu32", unchanged %"PRIu32", deferred %"PRIu32", transmissions %"PRIu32", errors %"PRIu32", animation frames %"PRIu32"\n",
+           stats->commits, stats->unchanged, stats->deferred, stats->transmissions, stats->errors, stats->animation_frames);
+}
+
+static void dump_scan_stats(void){
+    const spark_adv_filter_stats_t * stats = spark_adv_filter_get_stats();
+    printf("[-] Scan: reports %"PRIu32", rejected by length %"PRIu32", type %"PRIu32", address %"PRIu32", signature %"PRIu32", name %"PRIu32"\n",
+           stats->reports, stats->rejected[SPARK_ADV_FILTER_STAGE_LENGTH], stats->rejected[SPARK_ADV_FILTER_STAGE_TYPE],
+           stats->rejected[SPARK_ADV_FILTER_STAGE_ADDRESS], stats->rejected[SPARK_ADV_FILTER_STAGE_SIGNATURE],
+           stats->rejected[SPARK_ADV_FILTER_STAGE_NAME]);
+    printf("[-] Scan: accepted %s %"PRIu32", %s %"PRIu32", %s %"PRIu32"\n",
+           spark_adv_filter_model_name(SPARK_MODEL_40), stats->accepted[SPARK_MODEL_40],
+           spark_adv_filter_model_name(SPARK_MODEL_MINI), stats->accepted[SPARK_MODEL_MINI],
+           spark_adv_filter_model_name(SPARK_MODEL_GO), stats->accepted[SPARK_MODEL_GO]);
+}
+
+static void dump_scan_modes(void){
+    scan_account(btstack_run_loop_get_time_ms());
+    uint8_t mode;
+    uint8_t phase;
+    for (mode = 0; mode < SCAN_MODE_COUNT; mode++){
+        const scan_mode_stats_t * stats = &scan_stats[mode];
+        for (phase = 0; phase < SCAN_PHASE_COUNT; phase++){
+            const scan_phase_stats_t * phase_stats = &stats->phases[phase];
+            if (phase_stats->time_ms == 0) continue;
+            printf("[-] Scan %s, %s: %"PRIu32".%"PRIu32" s, %"PRIu32" reports/s\n", scan_mode_names[mode], scan_phases[phase].name,
+                   phase_stats->time_ms / 1000, (phase_stats->time_ms % 1000) / 100,
+                   (uint32_t) (((uint64_t) phase_stats->reports * 1000) / phase_stats->time_ms));
+        }
+        if (stats->found == 0) continue;
+        printf("[-] Scan %s: found %"PRIu32", time to rediscover p50 %"PRIu32" ms, max %"PRIu32" ms\n", scan_mode_names[mode],
+               stats->found, latency_histogram_get_percentile(&stats->rediscover_ms, 50), stats->rediscover_ms.max_us);
+    }
+}
+
+static void dump_trace_stats(void){
+    const trace_log_stats_t * stats = trace_log_get_stats();
+    printf("[-] Trace: level %s%s, events %"PRIu32", dropped %"PRIu32", ring max %u of %u records\n",
+           trace_log_level_name(trace_log_get_level()), trace_log_get_binary() ? " (binary)" : "",
+           stats->events, stats->dropped, stats->high_water, TRACE_LOG_SIZE);
+}
+
+static void dump_connection_stats(void){
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        const amp_t * amp = &amps[i];
+        if (amp->state != AMP_STATE_CONNECTED) continue;
+        connection_parameters_report(amp, "current");
+        link_report(amp, "current");
+    }
+}
+
+static void macro_command_queued(amp_t * amp, uint8_t sequence){
+    if (amp->macro_pending == MACRO_MAX_STEPS) return;
+    amp->macro_sequences[amp->macro_pending] = sequence;
+    amp->macro_queued_us[amp->macro_pending] = platform_time_us();
+    amp->macro_pending++;
+    macro_stats.commands++;
+}
+
+// amp acknowledges writes in order, but coalesced or dropped commands are never acknowledged
+static void macro_command_acknowledged(amp_t * amp, uint8_t sequence){
+    uint8_t i;
+    for (i = 0; i < amp->macro_pending; i++){
+        if (amp->macro_sequences[i] == sequence) break;
+    }
+    if (i == amp->macro_pending) return;
+    uint32_t now_us = platform_time_us();
+    latency_histogram_add(&latency_histograms[LATENCY_STAGE_MACRO_COMMAND], now_us - amp->macro_queued_us[i]);
+    amp->macro_pending--;
+    amp->macro_sequences[i] = amp->macro_sequences[amp->macro_pending];
+    amp->macro_queued_us[i] = amp->macro_queued_us[amp->macro_pending];
+    if (amp->macro_pending > 0) return;
+    latency_histogram_add(&latency_histograms[LATENCY_STAGE_MACRO_COMPLETE], now_us - macro_edge_us);
+    macro_stats.completed++;
+}
+
+// Spark strings: 0xA0 | len for short strings, booleans as 0xC2 / 0xC3
+static uint16_t macro_effect_onoff_payload(uint8_t * payload, const char * effect_name, bool on){
+    uint16_t name_len = (uint16_t) strlen(effect_name);
+    payload[0] = 0xa0 | name_len;
+    memcpy(&payload[1], effect_name, name_len);
+    payload[1 + name_len] = on ? 0xc3 : 0xc2;
+    return name_len + 2;
+}
+
+// effect name, parameter index and float as 0xCA + big endian IEEE 754
+static uint16_t effect_parameter_payload(uint8_t * payload, const char * effect_name, uint8_t parameter, float value){
+    uint16_t name_len = (uint16_t) strlen(effect_name);
+    payload[0] = 0xa0 | name_len;
+    memcpy(&payload[1], effect_name, name_len);
+    uint16_t pos = 1 + name_len;
+    payload[pos++] = parameter;
+    payload[pos++] = 0xca;
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    big_endian_store_32(payload, pos, bits);
+    return pos + 4;
+}
+
+static void tap_tempo_set_delay(amp_t * amp, uint32_t period_us){
+    const spark_amp_effect_t * effect = &amp->spark_state.current.effects[EFFECT_SLOT_DELAY];
+    if (effect->name[0] == '\0'){
+        trace_log_event(TRACE_EVENT_TAP_TEMPO_DELAY_UNKNOWN, amp->index, 0, 0);
+        return;
+    }
+    float value = (float) btstack_min(period_us, TAP_TEMPO_DELAY_MAX_US) / TAP_TEMPO_DELAY_MAX_US;
+    uint8_t payload[SPARK_AMP_STATE_NAME_LEN + 7];
+    uint16_t payload_len = effect_parameter_payload(payload, effect->name, TAP_TEMPO_DELAY_PARAMETER, value);
+    send_command(amp, SPARK_CMD_WRITE, SPARK_SUB_EFFECT_PARAMETER, payload, payload_len);
+}
+
+static void tap_tempo_handle_tap(uint32_t edge_us){
+    // first tap of a sequence, bounces and outliers don't change the tempo
+    if (!tap_tempo_tap(&tap_tempo, edge_us)) return;
+    uint32_t period_us = tap_tempo_get_period_us(&tap_tempo);
+    uint16_t bpm_x10 = tap_tempo_get_bpm_x10(&tap_tempo);
+    trace_log_event(TRACE_EVENT_TAP_TEMPO, bpm_x10 / 10, bpm_x10 % 10, period_us);
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amp_t * amp = &amps[i];
+        if (amp->state != AMP_STATE_CONNECTED) continue;
+        tap_tempo_set_delay(amp, period_us);
+    }
+    platform_tempo_start(period_us, tap_tempo_get_next_beat_us(&tap_tempo, platform_time_us()));
+}
+
+static void macro_effect_onoff(amp_t * amp, const macro_step_t * step){
+    if (step->value >= SPARK_AMP_STATE_NUM_EFFECTS) return;
+    const spark_amp_effect_t * effect = &amp->spark_state.current.effects[step->value];
+    if (effect->name[0] == '\0'){
+        // signal chain of preset not known yet
+        trace_log_event(TRACE_EVENT_MACRO_SLOT_UNKNOWN, amp->index, step->value, 0);
+        macro_stats.skipped++;
+        return;
+    }
+    bool on;
+    switch (step->type){
+        case MACRO_STEP_EFFECT_ON:
+            on = true;
+            break;
+        case MACRO_STEP_EFFECT_OFF:
+            on = false;
+            break;
+        default:
+            on = !effect->on;
+            break;
+    }
+    uint8_t payload[SPARK_AMP_STATE_NAME_LEN + 2];
+    uint16_t payload_len = macro_effect_onoff_payload(payload, effect->name, on);
+    if (!send_command(amp, SPARK_CMD_WRITE, SPARK_SUB_EFFECT_ONOFF, payload, payload_len)) return;
+    spark_amp_state_set_effect_onoff(&amp->spark_state, effect->name, on);
+}
+
+// expression pedal
+
+// ATT writes go out with the next connection event, more than one value per interval would only queue up
+static uint32_t expression_spacing_ms(const amp_t * amp){
+    return btstack_max(1, ((uint32_t) amp->conn_interval * 5 + 3) / 4);
+}
+
+static bool expression_link_idle(const amp_t * amp){
+    return (amp->command_in_flight == NULL) && (amp->command_queue == NULL) && !relay_to_amp_in_flight(amp);
+}
+
+static void expression_count_sent(uint32_t now_ms){
+    expression_stats.sent++;
+    if ((now_ms - expression_stats.second_start_ms) >= 1000){
+        expression_stats.second_start_ms = now_ms;
+        expression_stats.second_sent = 0;
+        expression_stats.seconds_active++;
+    }
+    expression_stats.second_sent++;
+    if (expression_stats.second_sent > expression_stats.max_per_second){
+        expression_stats.max_per_second = expression_stats.second_sent;
+    }
+}
+
+static void expression_amp_run(amp_t * amp);
+
+static void expression_timeout(btstack_timer_source_t * ts){
+    amp_t * amp = (amp_t *) btstack_run_loop_get_timer_context(ts);
+    amp->expression_timer_active = false;
+    expression_amp_run(amp);
+}
+
+static void expression_amp_wait(amp_t * amp, uint32_t wait_ms){
+    if (amp->expression_timer_active) return;
+    amp->expression_timer_active = true;
+    btstack_run_loop_set_timer_handler(&amp->expression_timer, &expression_timeout);
+    btstack_run_loop_set_timer_context(&amp->expression_timer, amp);
+    btstack_run_loop_set_timer(&amp->expression_timer, wait_ms);
+    btstack_run_loop_add_timer(&amp->expression_timer);
+}
+
+static void expression_amp_run(amp_t * amp){
+    if (amp->state != AMP_STATE_CONNECTED) return;
+    if (!expression_valid || (amp->expression_sent_position == expression_position)) return;
+
+    uint32_t now_ms = btstack_run_loop_get_time_ms();
+    uint32_t spacing_ms = expression_spacing_ms(amp);
+    int32_t wait_ms = (int32_t) (amp->expression_sent_ms + spacing_ms - now_ms);
+    if ((wait_ms <= 0) && !expression_link_idle(amp)){
+        // link busy, try again with next connection event
+        wait_ms = (int32_t) spacing_ms;
+    }
+    if ((amp->expression_sent_position != EXPRESSION_POSITION_NONE) && (wait_ms > 0)){
+        expression_amp_wait(amp, (uint32_t) wait_ms);
+        return;
+    }
+
+    const spark_amp_effect_t * effect = &amp->spark_state.current.effects[EXPRESSION_EFFECT_SLOT];
+    if (effect->name[0] == '\0'){
+        // signal chain of preset not known yet, next change tries again
+        expression_stats.skipped++;
+        return;
+    }
+    float value = (float) expression_position / EXPRESSION_PEDAL_RANGE;
+    uint8_t payload[SPARK_AMP_STATE_NAME_LEN + 7];
+    uint16_t payload_len = effect_parameter_payload(payload, effect->name, EXPRESSION_PARAMETER, value);
+    uint8_t sequence = amp->command_sequence;
+    if (!send_command(amp, SPARK_CMD_WRITE, SPARK_SUB_EFFECT_PARAMETER, payload, payload_len)) return;
+    amp->expression_sent_position  = expression_position;
+    amp->expression_sent_ms        = now_ms;
+    amp->expression_sequence       = sequence;
+    amp->expression_unconfirmed    = true;
+    amp->expression_sent_sample_us = expression_sample_us;
+    expression_count_sent(now_ms);
+}
+
+static void expression_acknowledged(amp_t * amp, uint8_t sequence){
+    if (!amp->expression_unconfirmed || (amp->expression_sequence != sequence)) return;
+    amp->expression_unconfirmed = false;
+    latency_histogram_add(&latency_histograms[LATENCY_STAGE_EXPRESSION], platform_time_us() - amp->expression_sent_sample_us);
+}
+
+static void expression_amp_stop(amp_t * amp){
+    btstack_run_loop_remove_timer(&amp->expression_timer);
+    amp->expression_timer_active  = false;
+    amp->expression_unconfirmed   = false;
+    amp->expression_sent_position = EXPRESSION_POSITION_NONE;
+}
+
+static void expression_changed(uint16_t position, uint32_t sample_us){
+    expression_stats.changes++;
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        const amp_t * amp = &amps[i];
+        // value waiting for its slot is replaced
+        if (amp->expression_timer_active){
+            expression_stats.superseded++;
+        }
+    }
+    expression_valid     = true;
+    expression_position  = position;
+    expression_sample_us = sample_us;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        expression_amp_run(&amps[i]);
+    }
+}
+
+static void macro_run(const macro_t * macro, uint32_t edge_us){
+    macro_stats.fired++;
+    macro_edge_us = edge_us;
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        if (amps[i].macro_pending > 0){
+            macro_stats.incomplete++;
+        }
+        amps[i].macro_pending = 0;
+    }
+
+    macro_running = true;
+    // audible preset change first, effect changes refer to its signal chain
+    uint8_t step;
+    for (step = 0; step < macro->num_steps; step++){
+        if (macro->steps[step].type != MACRO_STEP_SELECT_PRESET) continue;
+        select_preset(macro->steps[step].value);
+    }
+    for (step = 0; step < macro->num_steps; step++){
+        if (macro->steps[step].type == MACRO_STEP_SELECT_PRESET) continue;
+        if (macro->steps[step].type == MACRO_STEP_TAP_TEMPO){
+            tap_tempo_handle_tap(edge_us);
+            continue;
+        }
+        for (i = 0; i < SPARK_MAX_AMPS; i++){
+            amp_t * amp = &amps[i];
+            if (amp->state != AMP_STATE_CONNECTED) continue;
+            macro_effect_onoff(amp, &macro->steps[step]);
+        }
+    }
+    macro_running = false;
+}
+
+static void button_pressed(uint8_t button, uint32_t time_us){
+    // button was pressed, run its macro or select the slot of the stored bank
+    if (button >= MACRO_COUNT) return;
+    if (button < PRESET_BANK_SLOTS){
+        if (bank_active != PRESET_BANK_HARDWARE){
+            bank_select_slot(button, time_us, false);
+            return;
+        }
+        // slot of the next bank is prefetched for a long press
+        bank_slot = button;
+        bank_prefetch_start();
+    }
+    press_trace_edge(time_us);
+    macro_run(&macros[button], time_us);
+}
+
+// fan out to all connected amps
+static void select_preset(uint8_t preset){
+    if (amps_count(AMP_STATE_CONNECTED) == 0){
+        press_trace_state = PRESS_TRACE_IDLE;
+        return;
+    }
+
+    bool traced = press_trace_state == PRESS_TRACE_EDGE;
+    uint32_t now_us = platform_time_us();
+    if (traced){
+        latency_histogram_add(&latency_histograms[LATENCY_STAGE_EDGE_TO_SELECT], now_us - press_trace_edge_us);
+    }
+
+    const uint8_t payload[] = { 0x00, preset };
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amp_t * amp = &amps[i];
+        if (amp->state != AMP_STATE_CONNECTED) continue;
+        if (traced){
+            amp->press_trace_state    = PRESS_TRACE_SELECTED;
+            amp->press_trace_stage_us = now_us;
+            press_trace_amps++;
+        }
+        send_command(amp, SPARK_CMD_WRITE, SPARK_SUB_SELECT_PRESET, payload, sizeof(payload));
+        spark_amp_state_set_current_preset(&amp->spark_state, preset);
+    }
+    press_trace_state = PRESS_TRACE_IDLE;
+    relay_preset_selected(preset);
+}
+
+static void amp_state_query(amp_t * amp){
+    uint8_t get_preset[] = { SPARK_AMP_STATE_PRESET_TYPE_CURRENT, 0x00 };
+    amp->state_query_ms = btstack_run_loop_get_time_ms();
+    spark_amp_state_query_started(&amp->spark_state);
+    send_command(amp, SPARK_CMD_REQUEST, SPARK_SUB_CURRENT_PRESET, NULL, 0);
+    send_command(amp, SPARK_CMD_REQUEST, SPARK_SUB_PRESET, get_preset, sizeof(get_preset));
+    uint8_t i;
+    for (i = 0; i < SPARK_AMP_STATE_NUM_PRESETS; i++){
+        get_preset[0] = SPARK_AMP_STATE_PRESET_TYPE_HARDWARE;
+        get_preset[1] = i;
+        send_command(amp, SPARK_CMD_REQUEST, SPARK_SUB_PRESET, get_preset, sizeof(get_preset));
+    }
+}
+
+// preset banks
 
-static void clear_leds(void){
-#ifdef RMT_LED_STRIP_GPIO_NUM
-    memset(led_strip_pixels, 0, sizeof(led_strip_pixels));
-#endif
+static uint8_t bank_next(uint8_t bank){
+    return (bank + 1) % PRESET_BANK_COUNT;
 }
 
-static const uint8_t gpio_pins[] = { 4, 13, 14, 18, 19, 21, 22, 23, 25, 26, 27, 32, 33, 34, 35, 36};
-static const uint8_t gpio_pins_count = sizeof(gpio_pins);
+// slots of the active stored bank first, then the slot of the next bank that a bank switch lands on
+static uint8_t bank_prefetch_targets(uint8_t * banks, uint8_t * slots){
+    uint8_t count = 0;
+    uint8_t slot;
+    if (bank_active != PRESET_BANK_HARDWARE){
+        for (slot = 0; slot < PRESET_BANK_SLOTS; slot++){
+            banks[count]   = bank_active;
+            slots[count++] = slot;
+        }
+    }
+    if (bank_next(bank_active) != PRESET_BANK_HARDWARE){
+        banks[count]   = bank_next(bank_active);
+        slots[count++] = bank_slot;
+    }
+    return count;
+}
 
-static void set_led(uint8_t pos, uint8_t red, uint8_t green, uint8_t blue){
-#ifdef RMT_LED_STRIP_GPIO_NUM
-    led_strip_pixels[pos*3+0] = green;
-    led_strip_pixels[pos*3+1] = red;
-    led_strip_pixels[pos*3+2] = blue;
-#endif
+static preset_bank_frame_t * bank_cache_find(uint8_t bank, uint8_t slot){
+    uint8_t i;
+    for (i = 0; i < PRESET_BANK_CACHE_SIZE; i++){
+        if ((bank_cache[i].bank == bank) && (bank_cache[i].slot == slot)) return &bank_cache[i];
+    }
+    return NULL;
 }
 
-static void update_leds(void){
-#ifdef RMT_LED_STRIP_GPIO_NUM
-    ESP_ERROR_CHECK(rmt_transmit(led_chan, led_encoder, led_strip_pixels, sizeof(led_strip_pixels), &tx_config));
-#endif
+// frames are sent to all amps, so they are encoded for the smallest blocks
+static uint8_t bank_block_max_len(void){
+    uint8_t block_max_len = SPARK_BLOCK_MAX_LEN_TO_AMP;
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        if (amps[i].state != AMP_STATE_CONNECTED) continue;
+        block_max_len = btstack_min(block_max_len, link_block_max_len(&amps[i]));
+    }
+    return block_max_len;
 }
 
-static void button_poll(btstack_timer_source_t * ts) {
+// slots are stored as preset write payload, returns payload len or 0 if empty
+static uint16_t bank_load(uint8_t bank, uint8_t slot){
+    const btstack_tlv_t * tlv_impl;
+    void * tlv_context;
+    btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+    if (tlv_impl == NULL) return 0;
+    int size = tlv_impl->get_tag(tlv_context, PRESET_BANK_TAG(bank, slot), bank_payload, sizeof(bank_payload));
+    if ((size <= 2) || (size > (int) sizeof(bank_payload))) return 0;
+    return (uint16_t) size;
+}
 
-#if 0
-    uint8_t i;
-    for (i=0;i<gpio_pins_count;i++){
-        printf(" %02u", gpio_pins[i]);
+static void bank_store(uint8_t bank, uint8_t slot, const uint8_t * payload, uint16_t payload_len){
+    const btstack_tlv_t * tlv_impl;
+    void * tlv_context;
+    btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+    if (tlv_impl == NULL) return;
+    if (payload_len > sizeof(bank_payload)) return;
+    // upload replaces the current tone
+    memcpy(bank_payload, payload, payload_len);
+    bank_payload[0] = 0x00;
+    bank_payload[1] = 0x7f;
+    if (tlv_impl->store_tag(tlv_context, PRESET_BANK_TAG(bank, slot), bank_payload, payload_len) != 0){
+        printf("[!] Bank %u: Storing slot %u failed\n", bank, slot);
+        return;
     }
-    printf("\n");
-    for (i=0;i<gpio_pins_count;i++){
-        printf("  %u", gpio_get_level(gpio_pins[i]));
+    bank_stats.stored++;
+    printf("[-] Bank %u: Slot %u stored, %u bytes\n", bank, slot, payload_len);
+    preset_bank_frame_t * frame = bank_cache_find(bank, slot);
+    if (frame != NULL){
+        frame->state = PRESET_BANK_SLOT_UNKNOWN;
     }
-    printf("\n\n");
-#else
-    uint button = 0;
-    if (gpio_get_level(BUTTON_GPIO_A_NUM) == 0){
-        button = 1;
-    } else if (gpio_get_level(BUTTON_GPIO_B_NUM) == 0){
-        button = 2;
-    } else if (gpio_get_level(BUTTON_GPIO_C_NUM) == 0){
-        button = 3;
+    bank_prefetch_start();
+}
+
+static void bank_encode(preset_bank_frame_t * frame){
+    frame->state = PRESET_BANK_SLOT_EMPTY;
+    uint16_t payload_len = bank_load(frame->bank, frame->slot);
+    if (payload_len == 0) return;
+    if (!spark_amp_state_parse_preset(bank_payload, payload_len, &frame->tone)) return;
+    spark_writer_t writer;
+    spark_writer_init(&writer, frame->frame, PRESET_BANK_FRAME_LEN, SPARK_DIRECTION_TO_AMP, frame->block_max_len);
+    if (!spark_writer_add_message(&writer, SPARK_CMD_WRITE, SPARK_SUB_PRESET, 0, bank_payload, payload_len)){
+        trace_log_event(TRACE_EVENT_BANK_SLOT_TOO_LARGE, frame->bank, frame->slot, frame->block_max_len);
+        return;
     }
+    frame->frame_len = spark_writer_get_len(&writer);
+    frame->state     = PRESET_BANK_SLOT_READY;
+}
 
-    bool pressed = button != 0;
-    if (pressed && !button_pressed){
-        // button was pressed, select other preset
-        select_preset(button - 1);
+// one slot per step keeps the run loop responsive, active bank first
+static bool bank_prefetch_step(void){
+    uint8_t banks[PRESET_BANK_CACHE_SIZE];
+    uint8_t slots[PRESET_BANK_CACHE_SIZE];
+    uint8_t count = bank_prefetch_targets(banks, slots);
+    uint8_t i;
+    for (i = 0; i < count; i++){
+        preset_bank_frame_t * frame = bank_cache_find(banks[i], slots[i]);
+        if ((frame == NULL) || (frame->state != PRESET_BANK_SLOT_UNKNOWN)) continue;
+        bank_encode(frame);
+        bank_stats.prefetch_steps++;
+        return true;
     }
-    button_pressed = pressed;
-#endif
+    return false;
+}
 
-    btstack_run_loop_set_timer(ts, BUTTON_POLL_PERIOD_MS);
+static void bank_prefetch_timeout(btstack_timer_source_t * ts){
+    if (!bank_prefetch_step()){
+        bank_prefetch_active = false;
+        return;
+    }
+    btstack_run_loop_set_timer(ts, PRESET_BANK_PREFETCH_PERIOD_MS);
     btstack_run_loop_add_timer(ts);
 }
 
-static void led_update(btstack_timer_source_t * ts) {
-
-    if (app_state != APP_STATE_CONNECTED) {
-
-        // LED chaser
-        clear_leds();
-        switch (led_chaser_position){
-            case 0:
-            case 6:
-                set_led(0, 0, 0, LED_BRIGHTNESS);
-                break;
-            case 1:
-            case 5:
-                set_led(1, 0, 0, LED_BRIGHTNESS);
-                break;
-            case 2:
-            case 4:
-                set_led(2, 0, 0, LED_BRIGHTNESS);
-                break;
-            default:
-                break;
+// frames of the targets are kept, the other entries are reused. There are never more targets than entries
+static void bank_prefetch_start(void){
+    uint8_t banks[PRESET_BANK_CACHE_SIZE];
+    uint8_t slots[PRESET_BANK_CACHE_SIZE];
+    uint8_t count = bank_prefetch_targets(banks, slots);
+    bool    kept[PRESET_BANK_CACHE_SIZE];
+    uint8_t block_max_len = bank_block_max_len();
+    uint8_t i;
+    uint8_t j;
+    for (i = 0; i < PRESET_BANK_CACHE_SIZE; i++){
+        kept[i] = false;
+        for (j = 0; j < count; j++){
+            kept[i] |= (bank_cache[i].bank == banks[j]) && (bank_cache[i].slot == slots[j]);
         }
-        update_leds();
-
-        // next state
-        led_chaser_position = (led_chaser_position + 1) & 7;
     }
+    for (j = 0; j < count; j++){
+        preset_bank_frame_t * frame = bank_cache_find(banks[j], slots[j]);
+        if (frame == NULL){
+            i = 0;
+            while (kept[i]){
+                i++;
+            }
+            kept[i] = true;
+            frame = &bank_cache[i];
+        } else if (frame->block_max_len <= block_max_len){
+            continue;
+        }
+        // new target or amp with smaller blocks connected
+        frame->bank          = banks[j];
+        frame->slot          = slots[j];
+        frame->block_max_len = block_max_len;
+        frame->state         = PRESET_BANK_SLOT_UNKNOWN;
+    }
+    if (bank_prefetch_active) return;
+    bank_prefetch_active = true;
+    btstack_run_loop_set_timer_handler(&bank_prefetch_timer, &bank_prefetch_timeout);
+    btstack_run_loop_set_timer(&bank_prefetch_timer, PRESET_BANK_PREFETCH_PERIOD_MS);
+    btstack_run_loop_add_timer(&bank_prefetch_timer);
+}
 
-    btstack_run_loop_set_timer(ts, LED_UPDATE_PERIOD_MS);
-    btstack_run_loop_add_timer(ts);
+// ready frame of a slot, encoded now if the prefetch did not get to it yet
+static const preset_bank_frame_t * bank_frame_get(uint8_t bank, uint8_t slot){
+    preset_bank_frame_t * frame = bank_cache_find(bank, slot);
+    if (frame == NULL){
+        bank_prefetch_start();
+        frame = bank_cache_find(bank, slot);
+        if (frame == NULL) return NULL;
+    }
+    if (frame->state == PRESET_BANK_SLOT_UNKNOWN){
+        bank_encode(frame);
+        bank_stats.encoded_on_demand++;
+    } else if (frame->state == PRESET_BANK_SLOT_READY){
+        bank_stats.prefetched++;
+    }
+    return (frame->state == PRESET_BANK_SLOT_READY) ? frame : NULL;
 }
 
-static void platform_init(void){
-#ifdef RMT_LED_STRIP_GPIO_NUM
-    // setup led strip
-    ESP_LOGI(TAG, "Create RMT TX channel");
-    rmt_tx_channel_config_t tx_chan_config = {
-            .clk_src = RMT_CLK_SRC_DEFAULT, // select source clock
-            .gpio_num = RMT_LED_STRIP_GPIO_NUM,
-            .mem_block_symbols = 64, // increase the block size can make the LED less flickering
-            .resolution_hz = RMT_LED_STRIP_RESOLUTION_HZ,
-            .trans_queue_depth = 4, // set the number of transactions that can be pending in the background
-    };
-    ESP_ERROR_CHECK(rmt_new_tx_channel(&tx_chan_config, &led_chan));
-
-    ESP_LOGI(TAG, "Install led strip encoder");
-    led_strip_encoder_config_t encoder_config = {
-            .resolution = RMT_LED_STRIP_RESOLUTION_HZ,
-    };
-    ESP_ERROR_CHECK(rmt_new_led_strip_encoder(&encoder_config, &led_encoder));
-
-    ESP_LOGI(TAG, "Enable RMT TX channel");
-    ESP_ERROR_CHECK(rmt_enable(led_chan));
-
-    ESP_LOGI(TAG, "Start LED rainbow chase");
-#endif
+// slot LED in the color of the stored bank, the hardware presets keep their colors
+static void bank_show(void){
+    if (bank_active == PRESET_BANK_HARDWARE){
+        led_show_preset(bank_slot);
+        return;
+    }
+    led_engine_stop();
+    led_engine_clear();
+    led_engine_set(bank_slot, LED_COLOR_BANK_1 + bank_active - 1);
+    led_engine_show();
+}
 
-    // setup GPIOs
-    gpio_config_t io_conf = { 0 };
-    io_conf.mode = GPIO_MODE_INPUT;
-    io_conf.pull_up_en   = 1;
-    io_conf.pull_down_en = 0;
-    io_conf.intr_type = GPIO_INTR_DISABLE;
-    uint8_t i;
-    for (i=0;i<gpio_pins_count;i++){
-        io_conf.pin_bit_mask |= 1ULL << gpio_pins[i];
+// copy of the prefetched frame with the sequence of this amp in the large frame buffer. Its own upload that has not
+// started yet is replaced, otherwise the upload waits for the buffer and the latest slot wins
+static void bank_upload(amp_t * amp, const preset_bank_frame_t * frame, uint32_t edge_us){
+    command_t * owner = command_large_frame_owner;
+    bool replaced = (owner != NULL) && (owner == amp->bank_upload_command) && (owner->sent == 0) &&
+                    (amp->command_in_flight != owner);
+    if ((owner != NULL) && !replaced){
+        amp->bank_upload_pending_bank    = frame->bank;
+        amp->bank_upload_pending_slot    = frame->slot;
+        amp->bank_upload_pending_edge_us = edge_us;
+        bank_stats.waited++;
+        return;
+    }
+    amp->bank_upload_pending_bank = PRESET_BANK_NONE;
+    command_t * entry = replaced ? owner : (command_t *) btstack_linked_list_pop(&command_free_list);
+    if (entry == NULL){
+        trace_log_event(TRACE_EVENT_COMMAND_QUEUE_FULL, amp->index, (SPARK_CMD_WRITE << 8) | SPARK_SUB_PRESET, 0);
+        command_stats.dropped++;
+        return;
     }
-    gpio_config(&io_conf);
-    
-    // poll button
-    btstack_run_loop_set_timer_handler(&button_poller, &button_poll);
-    btstack_run_loop_set_timer(&button_poller, BUTTON_POLL_PERIOD_MS);
-    btstack_run_loop_add_timer(&button_poller);
 
-    // LED update
-    btstack_run_loop_set_timer_handler(&led_updater, &led_update);
-    btstack_run_loop_set_timer(&led_updater, LED_UPDATE_PERIOD_MS);
-    btstack_run_loop_add_timer(&led_updater);
+    // a replaced upload of a bank switch passes the tracking on
+    bool track_switch = amp->bank_switch_pending ||
+                        (replaced && amp->bank_switch_unconfirmed && (amp->bank_switch_sequence == amp->bank_upload_sequence));
+    uint8_t sequence = amp->command_sequence;
+    amp->command_sequence = (amp->command_sequence + 1) & 0x7f;
+    memcpy(command_large_frame, frame->frame, frame->frame_len);
+    spark_frame_patch_sequence(command_large_frame, frame->frame_len, sequence);
+
+    command_enqueue(amp, entry, replaced, SPARK_CMD_WRITE, SPARK_SUB_PRESET);
+    command_large_frame_owner = entry;
+    entry->data = command_large_frame;
+    entry->len  = frame->frame_len;
+    amp->bank_upload_command = entry;
+    if (replaced){
+        bank_stats.replaced++;
+    }
+    bank_stats.uploads++;
 
+    amp->bank_upload_sequence    = sequence;
+    amp->bank_upload_unconfirmed = true;
+    amp->bank_upload_edge_us     = edge_us;
+    if (track_switch){
+        amp->bank_switch_pending     = false;
+        amp->bank_switch_sequence    = sequence;
+        amp->bank_switch_unconfirmed = true;
+    }
+    spark_amp_state_set_current_tone(&amp->spark_state, &frame->tone);
+    command_queue_run(amp);
 }
-#else
-static void platform_init(void){}
-static void set_led(uint8_t red, uint8_t green, uint8_t blue){}
-#endif
 
-static void start_scanning(void){
-    app_state = APP_STATE_W4_SPARK_ADV;
-    printf("[-] Start scanning!\n");
-    gap_set_scan_parameters(1,0x0030, 0x0030);
-    gap_start_scan(); 
-}
-
-// returns 1 if name is found in advertisement
-static bool advertisement_report_contains_name(const char * name, uint8_t * advertisement_report){
-    // get advertisement from report event
-    const uint8_t * adv_data = gap_event_advertising_report_get_data(advertisement_report);
-    uint8_t         adv_len  = gap_event_advertising_report_get_data_length(advertisement_report);
-    uint16_t        name_len = (uint8_t) strlen(name);
-
-    // iterate over advertisement data
-    ad_context_t context;
-    for (ad_iterator_init(&context, adv_len, adv_data) ; ad_iterator_has_more(&context) ; ad_iterator_next(&context)){
-        uint8_t data_type    = ad_iterator_get_data_type(&context);
-        uint8_t data_size    = ad_iterator_get_data_len(&context);
-        const uint8_t * data = ad_iterator_get_data(&context);
-        switch (data_type){
-            case BLUETOOTH_DATA_TYPE_SHORTENED_LOCAL_NAME:
-            case BLUETOOTH_DATA_TYPE_COMPLETE_LOCAL_NAME:
-                // compare prefix
-                if (data_size >= name_len){
-                    if (memcmp(data, name, name_len) == 0){
-                        return true;
-                    }
-                }
-                break;
-            default:
-                break;
+// first waiting amp gets the buffer, outside of the command queue that released it
+static void bank_pending_timeout(btstack_timer_source_t * ts){
+    UNUSED(ts);
+    if (command_large_frame_owner != NULL) return;
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amp_t * amp = &amps[i];
+        if (amp->bank_upload_pending_bank == PRESET_BANK_NONE) continue;
+        const preset_bank_frame_t * frame = bank_frame_get(amp->bank_upload_pending_bank, amp->bank_upload_pending_slot);
+        if (frame == NULL){
+            amp->bank_upload_pending_bank = PRESET_BANK_NONE;
+            continue;
         }
+        bank_upload(amp, frame, amp->bank_upload_pending_edge_us);
+        return;
     }
-    return false;
 }
 
-static void handle_gatt_client_event(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size) {
-    UNUSED(packet_type);
-    UNUSED(channel);
-    UNUSED(size);
-
-    uint8_t att_status;
-    switch (app_state) {
-        case APP_STATE_W4_SERVICE:
-            switch(hci_event_packet_get_type(packet)){
-                case GATT_EVENT_SERVICE_QUERY_RESULT:
-                    // store service (we expect only one)
-                    gatt_event_service_query_result_get_service(packet, &spark_40_service);
-                    break;
-                case GATT_EVENT_QUERY_COMPLETE:
-                    att_status = gatt_event_query_complete_get_att_status(packet);
-                    if (att_status != ATT_ERROR_SUCCESS){
-                        printf("[!] SERVICE_QUERY_RESULT - Error status %x.\n", att_status);
-                        gap_disconnect(spark_40_connection_handle);
-                        break;
-                    }
-                    app_state = APP_STATE_W4_RX_CHARACTERISTIC;
-                    printf("[-] Search for Spark 40 RX characteristic.\n");
-                    gatt_client_discover_characteristics_for_service_by_uuid16(handle_gatt_client_event,
-                        spark_40_connection_handle, &spark_40_service, spark_40_characteristic_rx_uuid);
-                    break;
-                default:
-                    break;
-            }
-            break;
-        case APP_STATE_W4_RX_CHARACTERISTIC:
-            switch(hci_event_packet_get_type(packet)){
-                case GATT_EVENT_CHARACTERISTIC_QUERY_RESULT:
-                    gatt_event_characteristic_query_result_get_characteristic(packet, &spark_40_characteristic_rx);
-                    break;
-                case GATT_EVENT_QUERY_COMPLETE:
-                    att_status = gatt_event_query_complete_get_att_status(packet);
-                    if (att_status != ATT_ERROR_SUCCESS){
-                        printf("[!] CHARACTERISTIC_QUERY_RESULT - Error status %x.\n", att_status);
-                        gap_disconnect(spark_40_connection_handle);
-                        break;
-                    }
-                    app_state = APP_STATE_W4_TX_CHARACTERISTIC;
-                    printf("[-] Search for Spark 40 TX characteristic.\n");
-                    gatt_client_discover_characteristics_for_service_by_uuid16(handle_gatt_client_event,
-                               spark_40_connection_handle, &spark_40_service, spark_40_characteristic_tx_uuid);
-                    break;
-                default:
-                    break;
-            }
-            break;
-        case APP_STATE_W4_TX_CHARACTERISTIC:
-            switch(hci_event_packet_get_type(packet)){
-                case GATT_EVENT_CHARACTERISTIC_QUERY_RESULT:
-                    gatt_event_characteristic_query_result_get_characteristic(packet, &spark_40_characteristic_tx);
-                    break;
-                case GATT_EVENT_QUERY_COMPLETE:
-                    att_status = gatt_event_query_complete_get_att_status(packet);
-                    if (att_status != ATT_ERROR_SUCCESS){
-                        printf("[!] CHARACTERISTIC_QUERY_RESULT - Error status %x.\n", att_status);
-                        gap_disconnect(spark_40_connection_handle);
-                        break;
-                    }
-                    printf("[-] Subscribe for Spark 40 RX characteristic.\n");
-                    // register handler for notifications
-                    gatt_client_listen_for_characteristic_value_updates(&spark_40_notification_listener,
-                        handle_gatt_client_event, spark_40_connection_handle, &spark_40_characteristic_rx);
-                    app_state = APP_STATE_W4_RX_SUBSCRIBED;
-                    gatt_client_write_client_characteristic_configuration(handle_gatt_client_event, spark_40_connection_handle,
-                        &spark_40_characteristic_rx, GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION);
-                    break;
-                default:
-                    break;
-            }
-            break;
-        case APP_STATE_W4_RX_SUBSCRIBED:
-            switch(hci_event_packet_get_type(packet)){
-                case GATT_EVENT_QUERY_COMPLETE:
-                    printf("[-] Notifications enabled, ATT status %02x\n", gatt_event_query_complete_get_att_status(packet));
-                    if (gatt_event_query_complete_get_att_status(packet) != ATT_ERROR_SUCCESS) break;
-                    app_state = APP_STATE_CONNECTED;
-                    select_preset(0);
-                    break;
-                default:
-                    break;
-            }
-            break;
-        case APP_STATE_CONNECTED:
-            switch(hci_event_packet_get_type(packet)){
-                case GATT_EVENT_NOTIFICATION:
-                    process_update(gatt_event_notification_get_value(packet), gatt_event_notification_get_value_length(packet));
-                    break;
-                default:
-                    break;
-            }
-            break;
-        default:
-            break;
+static void bank_upload_released(const command_t * command){
+    uint8_t i;
+    bool pending = false;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        if (amps[i].bank_upload_command == command){
+            amps[i].bank_upload_command = NULL;
+        }
+        pending |= amps[i].bank_upload_pending_bank != PRESET_BANK_NONE;
     }
+    if (!pending || (command_large_frame_owner != NULL)) return;
+    btstack_run_loop_remove_timer(&bank_pending_timer);
+    btstack_run_loop_set_timer_handler(&bank_pending_timer, &bank_pending_timeout);
+    btstack_run_loop_set_timer(&bank_pending_timer, 0);
+    btstack_run_loop_add_timer(&bank_pending_timer);
 }
 
+static void bank_switch_track(amp_t * amp, uint8_t sequence){
+    amp->bank_switch_sequence    = sequence;
+    amp->bank_switch_unconfirmed = true;
+    bank_switch_amps++;
+}
 
-static void hci_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
-    UNUSED(channel);
-    UNUSED(size);
+// upload slot of the active stored bank to all connected amps
+static void bank_select_slot(uint8_t slot, uint32_t edge_us, bool bank_switch){
+    bank_slot = slot;
+    bank_show();
+    // next bank follows the selected slot
+    bank_prefetch_start();
+    if (amps_count(AMP_STATE_CONNECTED) == 0) return;
 
-    if (packet_type != HCI_EVENT_PACKET) return;
+    const preset_bank_frame_t * frame = bank_frame_get(bank_active, slot);
+    if (frame == NULL){
+        bank_stats.empty++;
+        trace_log_event(TRACE_EVENT_BANK_SLOT_EMPTY, bank_active, slot, 0);
+        return;
+    }
 
-    switch (hci_event_packet_get_type(packet)) {
-        case BTSTACK_EVENT_STATE:
-            // BTstack activated, get started
-            if (btstack_event_state_get_state(packet) == HCI_STATE_WORKING){
-                start_scanning();
-            }
-            break;
-        case HCI_EVENT_DISCONNECTION_COMPLETE:
-            printf("[+] Disconnected\n");
-            start_scanning();
-            break;
-        case GAP_EVENT_ADVERTISING_REPORT:{
-            // check name in advertisement
-            if (advertisement_report_contains_name(spark_40_device_name, packet)){
-                // store address and type
-                gap_event_advertising_report_get_address(packet, spark_40_addr);
-                spark_40_addr_type = gap_event_advertising_report_get_address_type(packet);
-                gap_stop_scan();
-                printf("[+] Found Spark 40 - %s.\n", bd_addr_to_str(spark_40_addr));
-                gap_connect(spark_40_addr,spark_40_addr_type);
-            }
-            break;
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amp_t * amp = &amps[i];
+        if (amp->state != AMP_STATE_CONNECTED) continue;
+        if (bank_switch){
+            amp->bank_switch_pending = true;
+            bank_switch_amps++;
         }
-        case HCI_EVENT_LE_META:
-            // wait for connection complete
-            if (hci_event_le_meta_get_subevent_code(packet) != HCI_SUBEVENT_LE_CONNECTION_COMPLETE) break;
-            spark_40_connection_handle = hci_subevent_le_connection_complete_get_connection_handle(packet);
-            printf("[-] Connection complete, discover services\n");
-
-            // general gatt client request to trigger mandatory authentication
-            app_state = APP_STATE_W4_SERVICE;
-            gatt_client_discover_primary_services_by_uuid16(&handle_gatt_client_event, spark_40_connection_handle, spark_40_service_uuid);
-            break;
-        default:
-            break;
+        bank_upload(amp, frame, edge_us);
     }
 }
 
-static void sm_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
-    UNUSED(channel);
-    UNUSED(size);
-
-    if (packet_type != HCI_EVENT_PACKET) return;
+// next bank starts with the slot of the held button
+static void bank_switch(uint8_t slot){
+    uint32_t start_us = platform_time_us();
+    bank_stats.switches++;
+    bank_active = bank_next(bank_active);
+    trace_log_event(TRACE_EVENT_BANK_SWITCH, bank_active, slot, 0);
 
-    bd_addr_t addr;
-    bd_addr_type_t addr_type;
+    bank_switch_start_us       = start_us;
+    bank_switch_amps           = 0;
+    bank_switch_confirmed_amps = 0;
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amps[i].bank_switch_pending     = false;
+        amps[i].bank_switch_unconfirmed = false;
+    }
 
-    switch (hci_event_packet_get_type(packet)) {
-        case SM_EVENT_JUST_WORKS_REQUEST:
-            printf("[-] Just works requested\n");
-            sm_just_works_confirm(sm_event_just_works_request_get_handle(packet));
-            break;
-        case SM_EVENT_NUMERIC_COMPARISON_REQUEST:
-            printf("[-] Confirming numeric comparison: %"PRIu32"\n", sm_event_numeric_comparison_request_get_passkey(packet));
-            sm_numeric_comparison_confirm(sm_event_passkey_display_number_get_handle(packet));
-            break;
-        case SM_EVENT_PAIRING_STARTED:
-            printf("[-] Pairing started\n");
-            break;
-        case SM_EVENT_PAIRING_COMPLETE:
-            switch (sm_event_pairing_complete_get_status(packet)){
-                case ERROR_CODE_SUCCESS:
-                    printf("[-] Pairing complete, success\n");
-                    break;
-                case ERROR_CODE_CONNECTION_TIMEOUT:
-                    printf("[-]Pairing failed, timeout\n");
-                    break;
-                case ERROR_CODE_REMOTE_USER_TERMINATED_CONNECTION:
-                    printf("[-]Pairing failed, disconnected\n");
-                    break;
-                case ERROR_CODE_AUTHENTICATION_FAILURE:
-                    printf("[-] Pairing failed, authentication failure with reason = %u\n", sm_event_pairing_complete_get_reason(packet));
-                    break;
-                default:
-                    break;
-            }
-            break;
-        case SM_EVENT_REENCRYPTION_STARTED:
-            sm_event_reencryption_complete_get_address(packet, addr);
-            printf("[-] Bonding information exists for addr type %u, identity addr %s -> start re-encryption\n",
-                   sm_event_reencryption_started_get_addr_type(packet), bd_addr_to_str(addr));
-            break;
-        case SM_EVENT_REENCRYPTION_COMPLETE:
-            switch (sm_event_reencryption_complete_get_status(packet)){
-                case ERROR_CODE_SUCCESS:
-                    printf("[-] Re-encryption complete, success\n");
-                    break;
-                case ERROR_CODE_CONNECTION_TIMEOUT:
-                    printf("[-] Re-encryption failed, timeout\n");
-                    break;
-                case ERROR_CODE_REMOTE_USER_TERMINATED_CONNECTION:
-                    printf("[-] Re-encryption failed, disconnected\n");
-                    break;
-                case ERROR_CODE_PIN_OR_KEY_MISSING:
-                    printf("[-] Re-encryption failed, bonding information missing\n\n");
-                    printf("[-] Assuming remote lost bonding information\n");
-                    printf("[-] Deleting local bonding information and start new pairing...\n");
-                    sm_event_reencryption_complete_get_address(packet, addr);
-                    addr_type = sm_event_reencryption_started_get_addr_type(packet);
-                    gap_delete_bonding(addr_type, addr);
-                    sm_request_pairing(sm_event_reencryption_complete_get_handle(packet));
-                    break;
-                default:
-                    break;
-            }
-            break;
-        default:
-            break;
+    if (bank_active == PRESET_BANK_HARDWARE){
+        // preset selection is the first command of the macro
+        for (i = 0; i < SPARK_MAX_AMPS; i++){
+            amp_t * amp = &amps[i];
+            if (amp->state != AMP_STATE_CONNECTED) continue;
+            bank_switch_track(amp, amp->command_sequence);
+        }
+        bank_slot = slot;
+        bank_show();
+        bank_prefetch_start();
+        press_trace_edge(start_us);
+        macro_run(&macros[slot], start_us);
+    } else {
+        bank_select_slot(slot, start_us, true);
     }
+    if (bank_switch_amps == 0) return;
+    latency_histogram_add(&bank_switch_prepare_histogram, platform_time_us() - start_us);
 }
 
-static void on_preset_updated(void){
-    printf("[+] Preset: %u\n", spark_40_preset);
-    clear_leds();
-    switch (spark_40_preset){
-        case 0: // clean
-            set_led(0, 0x00, LED_BRIGHTNESS, 0x00);
-            break;
-        case 1: // crunchy
-            set_led(1, 0x00, LED_BRIGHTNESS, LED_BRIGHTNESS);
-            break;
-        case 2: // distortion
-            set_led(2, LED_BRIGHTNESS, 0x00, 0x00);
-            break;
-        default:
-            break;
+static void bank_acknowledged(amp_t * amp, uint8_t sequence){
+    uint32_t now_us = platform_time_us();
+    if (amp->bank_upload_unconfirmed && (amp->bank_upload_sequence == sequence)){
+        amp->bank_upload_unconfirmed = false;
+        latency_histogram_add(&latency_histograms[LATENCY_STAGE_EDGE_TO_UPLOADED], now_us - amp->bank_upload_edge_us);
     }
-    update_leds();
+    if (!amp->bank_switch_unconfirmed || (amp->bank_switch_sequence != sequence)) return;
+    amp->bank_switch_unconfirmed = false;
+    bank_switch_confirmed_amps++;
+    if (bank_switch_confirmed_amps < bank_switch_amps) return;
+    latency_histogram_add(&latency_histograms[LATENCY_STAGE_BANK_SWITCH], now_us - bank_switch_start_us);
 }
 
-// message format from
-// https://github.com/jrnelson90/tinderboxpedal/blob/master/src/BLE%20message%20format.md
+// footswitches with press and release, i.e. the I/O task or scenario holds. Console keys act on press
 
-static void process_update(const uint8_t * data, uint16_t len){
+// macro per footswitch: presets 0-2 and tap tempo
+static const uint8_t footswitch_macros[] = { 0, 1, 2, MACRO_TAP_TEMPO };
 
-#ifdef LOG_MESSAGES
-    printf("RX: ");
-    printf_hexdump(data, len);
-#endif
+static void bank_long_press_timeout(btstack_timer_source_t * ts){
+    UNUSED(ts);
+    bank_long_press_pending = false;
+    bank_switch(bank_long_press_button);
+}
+
+static void bank_long_press_start(uint8_t button){
+    // a second button held at the same time takes over
+    bank_long_press_button  = button;
+    bank_long_press_pending = true;
+    // slot of the next bank is prefetched for a long press
+    bank_slot = button;
+    bank_prefetch_start();
+    btstack_run_loop_remove_timer(&bank_long_press_timer);
+    btstack_run_loop_set_timer_handler(&bank_long_press_timer, &bank_long_press_timeout);
+    btstack_run_loop_set_timer(&bank_long_press_timer, PRESET_BANK_LONG_PRESS_MS);
+    btstack_run_loop_add_timer(&bank_long_press_timer);
+}
+
+// returns true for a short press, i.e. the bank was not switched yet
+static bool bank_long_press_stop(uint8_t button){
+    if (!bank_long_press_pending || (bank_long_press_button != button)) return false;
+    bank_long_press_pending = false;
+    btstack_run_loop_remove_timer(&bank_long_press_timer);
+    return true;
+}
+
+// preset footswitches act on release, so a long press only switches the bank and does not change the tone twice.
+// Tap tempo has no long press and acts on the edge
+static void footswitch_changed(uint8_t button, bool pressed, uint32_t time_us){
+    if (button >= sizeof(footswitch_macros)) return;
+    if (button >= PRESET_BANK_SLOTS){
+        if (!pressed) return;
+    } else if (pressed){
+        bank_long_press_start(button);
+        return;
+    } else if (!bank_long_press_stop(button)){
+        return;
+    }
+    footswitch_presses++;
+    button_pressed(footswitch_macros[button], time_us);
+}
 
-    // check for preset change
-    if (len < 7){
+// current tone of the first connected amp goes into the selected slot, e.g. after dialing it in with the app
+static void bank_capture(void){
+    if (bank_active == PRESET_BANK_HARDWARE){
+        printf("[!] Bank %u: Presets are stored on the amp, switch to a stored bank first\n", bank_active);
         return;
     }
-    if ((data[6] == 0x1A) && (len == 0x1a)){
-        if ((data[20] == 0x03) && data[21] == 0x38){
-            spark_40_preset = data[24];
-            on_preset_updated();
-        }
+    const uint8_t get_preset[] = { SPARK_AMP_STATE_PRESET_TYPE_CURRENT, 0x00 };
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amp_t * amp = &amps[i];
+        if (amp->state != AMP_STATE_CONNECTED) continue;
+        bank_capture_bank = bank_active;
+        bank_capture_slot = bank_slot;
+        amp->bank_capture_pending = send_command(amp, SPARK_CMD_REQUEST, SPARK_SUB_PRESET, get_preset, sizeof(get_preset));
+        return;
     }
+    printf("[!] Bank %u: No amp connected\n", bank_active);
 }
 
-static void send_command(const uint8_t * command, uint16_t command_len){
-    uint8_t message[100];
-    uint8_t prefix[] = { 0x01, 0xFE, 0x00, 0x00, 0x53, 0xFE };
-    uint8_t middle[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0, 0x00, 0xf0, 0x01, 0x01, 0x01 };
-    uint8_t suffix[] = { 0xf7 };
-    uint16_t len = sizeof(prefix) + 1 + sizeof(middle) + command_len + sizeof(suffix);
-    uint16_t pos = 0;
-    memcpy(&message[pos], prefix, sizeof(prefix));
-    pos += sizeof(prefix);
-    message[pos++] = len;
-    memcpy(&message[pos], middle, sizeof(middle));
-    pos += sizeof(middle);
-    memcpy(&message[pos], command, command_len);
-    pos += command_len;
-    message[pos++] = 0x0f7;
-
-#ifdef LOG_MESSAGES
-    printf("TX: ");
-    printf_hexdump(message, pos);
-#endif
+static void bank_capture_received(amp_t * amp, const spark_message_t * message){
+    if (!amp->bank_capture_pending) return;
+    if ((message->payload_len < 2) || (message->payload[0] != SPARK_AMP_STATE_PRESET_TYPE_CURRENT)) return;
+    amp->bank_capture_pending = false;
+    bank_store(bank_capture_bank, bank_capture_slot, message->payload, message->payload_len);
+}
 
-    gatt_client_write_value_of_characteristic(handle_gatt_client_event, spark_40_connection_handle, spark_40_characteristic_tx.value_handle, len, message);
+static void bank_amp_stop(amp_t * amp){
+    amp->bank_upload_lost         = amp->bank_upload_unconfirmed || (amp->bank_upload_pending_bank != PRESET_BANK_NONE);
+    amp->bank_upload_pending_bank = PRESET_BANK_NONE;
+    amp->bank_upload_unconfirmed  = false;
+    amp->bank_switch_pending      = false;
+    amp->bank_switch_unconfirmed  = false;
+    amp->bank_capture_pending    = false;
 }
 
-static void select_preset(uint8_t preset){
-    if (app_state != APP_STATE_CONNECTED){
-        return;
+// slot selected while the link was down goes out once setup completes
+static void bank_amp_ready(amp_t * amp){
+    if (!amp->bank_upload_lost) return;
+    amp->bank_upload_lost = false;
+    if (bank_active == PRESET_BANK_HARDWARE) return;
+    const preset_bank_frame_t * frame = bank_frame_get(bank_active, bank_slot);
+    if (frame == NULL) return;
+    bank_upload(amp, frame, platform_time_us());
+}
+
+static void bank_init(void){
+    uint8_t i;
+    for (i = 0; i < PRESET_BANK_CACHE_SIZE; i++){
+        bank_cache[i].bank = PRESET_BANK_NONE;
+    }
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amps[i].bank_upload_pending_bank = PRESET_BANK_NONE;
     }
+    bank_active = PRESET_BANK_HARDWARE;
+}
+
+static void dump_bank_stats(void){
+    const latency_histogram_t * histogram = &bank_switch_prepare_histogram;
+    printf("[-] Banks: bank %u, slot %u, switches %"PRIu32", uploads %"PRIu32", prefetched %"PRIu32", encoded on demand %"PRIu32", replaced %"PRIu32", waited %"PRIu32", empty %"PRIu32"\n",
+           bank_active, bank_slot, bank_stats.switches, bank_stats.uploads, bank_stats.prefetched, bank_stats.encoded_on_demand,
+           bank_stats.replaced, bank_stats.waited, bank_stats.empty);
+    printf("[-] Banks: prefetch steps %"PRIu32", stored %"PRIu32", switch to uploads queued min/p50/max %"PRIu32"/%"PRIu32"/%"PRIu32" us\n",
+           bank_stats.prefetch_steps, bank_stats.stored, histogram->min_us, latency_histogram_get_percentile(histogram, 50),
+           histogram->max_us);
+}
 
-    uint8_t tone[]   = {0x01, 0x38, 0x00, 0x00, 0x00};
-    spark_40_preset = preset;
-    tone[4] = preset;
-    send_command(tone, sizeof(tone));
-    on_preset_updated();
+void spark_control_dump_stats(void){
+    dump_command_stats();
+    dump_macro_stats();
+    dump_tap_tempo_stats();
+    dump_expression_stats();
+    dump_led_stats();
+    platform_dump_stats();
+    dump_scan_stats();
+    dump_scan_modes();
+    dump_connection_stats();
+    dump_preset_dump_stats();
+    dump_bank_stats();
+    dump_relay_stats();
+    dump_trace_stats();
+    dump_latency();
 }
 
 static void stdin_handler(char c){
-    static uint8_t config[] = {0x02, 0x01, 0x00, 0x00, 0x00};
-    static uint8_t get_hw_id[] = { 0x02, 0x23 };
+    uint8_t get_preset[] = { SPARK_AMP_STATE_PRESET_TYPE_HARDWARE, 0x00 };
+    uint8_t i;
     switch (c){
         case '1':
         case '2':
         case '3':
         case '4':
-            select_preset(c - '1');
+            button_pressed(c - '1', platform_time_us());
+            break;
+        case 't':
+            button_pressed(MACRO_TAP_TEMPO, platform_time_us());
             break;
         case '5':
         case '6':
         case '7':
         case '8':
-            config[4] = c - '5';
-            send_command(config, sizeof(config));
+            get_preset[1] = c - '5';
+            for (i = 0; i < SPARK_MAX_AMPS; i++){
+                if (amps[i].state != AMP_STATE_CONNECTED) continue;
+                send_command(&amps[i], SPARK_CMD_REQUEST, SPARK_SUB_PRESET, get_preset, sizeof(get_preset));
+            }
             break;
         case '9':
-            send_command(get_hw_id, sizeof(get_hw_id));
+            for (i = 0; i < SPARK_MAX_AMPS; i++){
+                if (amps[i].state != AMP_STATE_CONNECTED) continue;
+                send_command(&amps[i], SPARK_CMD_REQUEST, SPARK_SUB_HARDWARE_ID, NULL, 0);
+            }
+            break;
+        case 'n':
+            bank_switch(bank_slot);
+            break;
+        case 'c':
+            bank_capture();
+            break;
+        case 'r':
+            relay_set_enabled(!relay.enabled);
+            break;
+        case 'a':
+            for (i = 0; i < SPARK_MAX_AMPS; i++){
+                dump_amp_state(&amps[i]);
+            }
+            break;
+        case 'l':
+            dump_latency();
+            break;
+        case 'L':
+            reset_latency();
+            break;
+        case 's':
+            spark_control_dump_stats();
+            break;
+        case 'v':
+            trace_log_set_level((trace_level_t) ((trace_log_get_level() + 1) % TRACE_LEVEL_COUNT));
+            printf("[-] Trace: level %s\n", trace_log_level_name(trace_log_get_level()));
+            break;
+        case 'b':
+            trace_log_set_binary(!trace_log_get_binary());
+            printf("[-] Trace: %s output\n", trace_log_get_binary() ? "binary" : "text");
             break;
         default:
             break;
     }
 }
 
-int btstack_main(void);
 int btstack_main(void)
 {
+    trace_log_init(&platform_time_us);
     platform_init();
 
+    uint8_t i;
+    for (i = 0; i < SPARK_MAX_AMPS; i++){
+        amp_t * amp = &amps[i];
+        amp->index = i;
+        amp->model = SPARK_MODEL_NONE;
+        amp->expression_sent_position = EXPRESSION_POSITION_NONE;
+        amp->profile_requested = CONNECTION_PROFILE_NONE;
+        amp->profile_active    = CONNECTION_PROFILE_NONE;
+        spark_reader_init(&amp->reader, &handle_spark_message, amp);
+        spark_amp_state_init(&amp->spark_state, &handle_amp_state_changed, amp);
+        link_stop(amp);
+    }
+    command_queue_init();
+
     l2cap_init();
 
     // setup SM: Display only
     sm_init();
 
-    // setup GATT Client
+    // setup GATT Client, MTU is exchanged as first setup step
     gatt_client_init();
+    gatt_client_mtu_enable_auto_negotiation(0);
+
+    // connect with performance profile
+    const connection_profile_t * performance = &connection_profiles[CONNECTION_PROFILE_PERFORMANCE];
+    gap_set_connection_parameters(0x0060, 0x0030, performance->conn_interval_min, performance->conn_interval_max,
+        performance->conn_latency, performance->supervision_timeout, 0, 0);
+
+    // relay mode setting, ATT Server and advertisements only if enabled
+    relay_init();
+
+    tap_tempo_init(&tap_tempo);
+    spark_adv_filter_init();
+    bank_init();
 
     // register handler
     hci_event_callback_registration.callback = &hci_packet_handler;
@@ -643,7 +4091,7 @@ int btstack_main(void)
 
     // turn on!
     hci_power_control(HCI_POWER_ON);
-        
+
     return 0;
 }
 
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  spark_control.h
+ *
+ *  Entry point and platform hooks of the Spark 40 foot pedal. On the ESP32, buttons and LEDs are handled in
+ *  spark_control.c. Other platforms, e.g. the host build, report button presses via the hooks below.
+ */
+
+#ifndef SPARK_CONTROL_H
+#define SPARK_CONTROL_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// preset footswitch held this long switches to the next bank
+#define SPARK_CONTROL_LONG_PRESS_MS     600
+
+typedef struct {
+    uint8_t  amps_connected;
+    uint16_t commands_free;
+    // footswitch presses that ran their slot or macro, bank switches by long press or console
+    uint32_t footswitch_presses;
+    uint32_t bank_switches;
+    // preset and effect writes not acknowledged by the amps yet, connected or not
+    uint8_t  tone_writes_unconfirmed;
+} spark_control_status_t;
+
+/* API_START */
+
+/**
+ * @brief Setup pedal, to be called before entering the run loop
+ * @return 0
+ */
+int btstack_main(void);
+
+/**
+ * @brief Print command, connection and latency statistics
+ */
+void spark_control_dump_stats(void);
+
+#ifndef ESP_PLATFORM
+
+/**
+ * @brief Report debounced button press
+ * @param button index, starting at 0
+ * @param time_us of the button edge
+ */
+void spark_control_button_pressed(uint8_t button, uint32_t time_us);
+
+/**
+ * @brief Report debounced footswitch edge. Preset footswitches act on release, held long they switch banks
+ * @param button index of the footswitch, starting at 0
+ * @param pressed or released
+ * @param time_us of the button edge
+ */
+void spark_control_footswitch_changed(uint8_t button, bool pressed, uint32_t time_us);
+
+/**
+ * @brief Report filtered expression pedal position
+ * @param position 0..EXPRESSION_PEDAL_RANGE
+ * @param time_us of ADC sample
+ */
+void spark_control_expression_changed(uint16_t position, uint32_t time_us);
+
+/**
+ * @brief Set clock for latencies and trace timestamps, e.g. virtual time of soak tests. Default: CLOCK_MONOTONIC
+ * @param time_us returns time in us
+ */
+void spark_control_set_time_source(uint32_t (*time_us)(void));
+
+/**
+ * @brief Enable or disable relay mode for the Spark app, stored like the 'r' console key
+ * @param enabled
+ */
+void spark_control_set_relay_enabled(bool enabled);
+
+/**
+ * @brief Get connected amps and unused command queue entries, e.g. to check for leaks
+ * @param status
+ */
+void spark_control_get_status(spark_control_status_t * status);
+
+#endif
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // SPARK_CONTROL_H
@@ -0,0 +1,491 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+#define BTSTACK_FILE__ "spark_protocol.c"
+
+/*
+ *  spark_protocol.c
+ *
+ *  The reader is a byte-wise state machine with two layers: the block layer strips the block headers,
+ *  the chunk layer unpacks the chunk data directly into the payload buffer of the current message.
+ *  As bytes are consumed when they arrive, no raw data needs to be buffered between fragments.
+ *
+ *  The writer mirrors this: it packs the payload directly into the output buffer, inserts block headers when
+ *  a block is full and patches checksum, MSB bytes and block length in place. Short frames have a fixed
+ *  layout, so the headers are written once and only sequence, payload and checksum are updated per message.
+ */
+
+#include <string.h>
+
+#include "spark_protocol.h"
+
+enum {
+    CHUNK_STATE_W4_START = 0,
+    CHUNK_STATE_W4_MARKER,
+    CHUNK_STATE_W4_SEQUENCE,
+    CHUNK_STATE_W4_CHECKSUM,
+    CHUNK_STATE_W4_COMMAND,
+    CHUNK_STATE_W4_SUB_COMMAND,
+    CHUNK_STATE_DATA,
+};
+
+bool spark_message_is_multi_chunk(uint8_t command, uint8_t sub_command){
+    if (sub_command != SPARK_SUB_PRESET) return false;
+    return (command == SPARK_CMD_WRITE) || (command == SPARK_CMD_RESPONSE);
+}
+
+static void spark_reader_drop_message(spark_reader_t * reader){
+    if (reader->next_chunk_index > 0){
+        reader->stats.dropped++;
+    }
+    reader->next_chunk_index = 0;
+}
+
+static void spark_reader_lost_sync(spark_reader_t * reader){
+    reader->stats.resyncs++;
+    reader->synced = 0;
+    reader->chunk_state = CHUNK_STATE_W4_START;
+    spark_reader_drop_message(reader);
+}
+
+static void spark_reader_emit_message(spark_reader_t * reader){
+    reader->next_chunk_index = 0;
+    if (reader->overflow){
+        reader->stats.dropped++;
+        return;
+    }
+    spark_message_t message;
+    message.direction   = reader->direction;
+    message.command     = reader->command;
+    message.sub_command = reader->sub_command;
+    message.sequence    = reader->sequence;
+    message.payload_len = reader->payload_len;
+    message.payload     = reader->payload;
+    reader->stats.messages++;
+    (*reader->handler)(reader->context, &message);
+}
+
+static void spark_reader_chunk_complete(spark_reader_t * reader){
+    if (reader->chunk_xor != reader->chunk_checksum){
+        // commands with a constant checksum are accepted by the amp, so we only count mismatches
+        reader->stats.checksum_errors++;
+    }
+
+    if (reader->multi_chunk == 0){
+        spark_reader_emit_message(reader);
+        return;
+    }
+
+    uint8_t num_chunks  = reader->chunk_header[0];
+    uint8_t chunk_index = reader->chunk_header[1];
+    if ((reader->chunk_header_len < sizeof(reader->chunk_header)) || (chunk_index != reader->next_chunk_index)){
+        // malformed chunk or chunk missing, e.g. after connect in the middle of a message
+        reader->next_chunk_index = 1;
+        spark_reader_drop_message(reader);
+        return;
+    }
+    if ((chunk_index + 1) >= num_chunks){
+        spark_reader_emit_message(reader);
+        return;
+    }
+    reader->next_chunk_index++;
+}
+
+static void spark_reader_data_byte(spark_reader_t * reader, uint8_t byte){
+    reader->chunk_xor ^= byte;
+
+    // first byte of each group holds the MSBs of the following (up to) 7 bytes
+    if (reader->group_pos == 0){
+        reader->group_msbs = byte;
+        reader->group_pos  = 1;
+        return;
+    }
+    uint8_t value = byte | ((uint8_t)(reader->group_msbs << (8 - reader->group_pos)) & 0x80);
+    reader->group_pos = (reader->group_pos == 7) ? 0 : (reader->group_pos + 1);
+
+    if (reader->multi_chunk && (reader->chunk_header_len < sizeof(reader->chunk_header))){
+        reader->chunk_header[reader->chunk_header_len++] = value;
+        return;
+    }
+    if (reader->payload_len < SPARK_READER_MAX_PAYLOAD){
+        reader->payload[reader->payload_len++] = value;
+    } else {
+        reader->overflow = 1;
+    }
+}
+
+static void spark_reader_start_chunk(spark_reader_t * reader){
+    reader->chunk_state      = CHUNK_STATE_W4_MARKER;
+    reader->chunk_xor        = 0;
+    reader->group_pos        = 0;
+    reader->chunk_header_len = 0;
+}
+
+static void spark_reader_start_message(spark_reader_t * reader, uint8_t sub_command){
+    spark_reader_drop_message(reader);
+    reader->sub_command = sub_command;
+    reader->sequence    = reader->chunk_sequence;
+    reader->multi_chunk = spark_message_is_multi_chunk(reader->command, sub_command) ? 1 : 0;
+    reader->overflow    = 0;
+    reader->payload_len = 0;
+}
+
+static void spark_reader_chunk_byte(spark_reader_t * reader, uint8_t byte){
+    switch (reader->chunk_state){
+        case CHUNK_STATE_W4_START:
+            if (byte == SPARK_CHUNK_START){
+                spark_reader_start_chunk(reader);
+            }
+            break;
+        case CHUNK_STATE_W4_MARKER:
+            reader->chunk_state = CHUNK_STATE_W4_SEQUENCE;
+            break;
+        case CHUNK_STATE_W4_SEQUENCE:
+            reader->chunk_sequence = byte;
+            reader->chunk_state = CHUNK_STATE_W4_CHECKSUM;
+            break;
+        case CHUNK_STATE_W4_CHECKSUM:
+            reader->chunk_checksum = byte;
+            reader->chunk_state = CHUNK_STATE_W4_COMMAND;
+            break;
+        case CHUNK_STATE_W4_COMMAND:
+            // keep command of the message in progress until sub command has been checked
+            reader->chunk_command = byte;
+            reader->chunk_state = CHUNK_STATE_W4_SUB_COMMAND;
+            break;
+        case CHUNK_STATE_W4_SUB_COMMAND:
+            if ((reader->next_chunk_index == 0) || (reader->chunk_command != reader->command) || (byte != reader->sub_command)){
+                reader->command = reader->chunk_command;
+                spark_reader_start_message(reader, byte);
+            }
+            reader->chunk_state = CHUNK_STATE_DATA;
+            break;
+        case CHUNK_STATE_DATA:
+            if ((byte & 0x80) == 0){
+                spark_reader_data_byte(reader, byte);
+                break;
+            }
+            if (byte == SPARK_CHUNK_END){
+                reader->chunk_state = CHUNK_STATE_W4_START;
+                spark_reader_chunk_complete(reader);
+                break;
+            }
+            // unexpected control byte, drop partial message
+            spark_reader_drop_message(reader);
+            reader->stats.resyncs++;
+            if (byte == SPARK_CHUNK_START){
+                spark_reader_start_chunk(reader);
+            } else {
+                reader->chunk_state = CHUNK_STATE_W4_START;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void spark_reader_header_byte(spark_reader_t * reader, uint8_t byte){
+    bool valid;
+    switch (reader->header_pos){
+        case 0:
+            valid = byte == 0x01;
+            break;
+        case 1:
+            valid = byte == 0xfe;
+            break;
+        case 2:
+        case 3:
+            valid = byte == 0x00;
+            break;
+        case 4:
+            valid = (byte == (SPARK_DIRECTION_TO_AMP >> 8)) || (byte == (SPARK_DIRECTION_FROM_AMP >> 8));
+            reader->direction = (uint16_t) byte << 8;
+            break;
+        case 5:
+            valid = (byte == (SPARK_DIRECTION_TO_AMP & 0xff)) || (byte == (SPARK_DIRECTION_FROM_AMP & 0xff));
+            reader->direction |= byte;
+            break;
+        case 6:
+            valid = byte > SPARK_BLOCK_HEADER_LEN;
+            reader->block_len = byte;
+            break;
+        default:
+            valid = true;
+            break;
+    }
+
+    if (!valid){
+        if (reader->synced){
+            spark_reader_lost_sync(reader);
+        }
+        reader->header_pos = (byte == 0x01) ? 1 : 0;
+        return;
+    }
+
+    reader->header_pos++;
+    if (reader->header_pos < SPARK_BLOCK_HEADER_LEN) return;
+
+    // header complete
+    reader->header_pos      = 0;
+    reader->block_remaining = reader->block_len - SPARK_BLOCK_HEADER_LEN;
+    reader->synced          = 1;
+    reader->stats.blocks++;
+}
+
+void spark_reader_init(spark_reader_t * reader, spark_message_handler_t handler, void * context){
+    memset(reader, 0, sizeof(spark_reader_t));
+    reader->handler = handler;
+    reader->context = context;
+}
+
+void spark_reader_reset(spark_reader_t * reader){
+    reader->header_pos       = 0;
+    reader->block_remaining  = 0;
+    reader->synced           = 0;
+    reader->chunk_state      = CHUNK_STATE_W4_START;
+    reader->next_chunk_index = 0;
+}
+
+void spark_reader_process(spark_reader_t * reader, const uint8_t * data, uint16_t len){
+    reader->stats.bytes += len;
+    uint16_t pos;
+    for (pos = 0; pos < len; pos++){
+        uint8_t byte = data[pos];
+        if (reader->block_remaining == 0){
+            spark_reader_header_byte(reader, byte);
+            continue;
+        }
+        reader->block_remaining--;
+        spark_reader_chunk_byte(reader, byte);
+    }
+}
+
+bool spark_reader_at_message_boundary(const spark_reader_t * reader){
+    if ((reader->block_remaining != 0) || (reader->header_pos != 0)) return false;
+    return (reader->chunk_state == CHUNK_STATE_W4_START) && (reader->next_chunk_index == 0);
+}
+
+// writer
+
+// offsets in short frame
+#define SHORT_FRAME_SEQUENCE_POS    (SPARK_BLOCK_HEADER_LEN + 2)
+#define SHORT_FRAME_CHECKSUM_POS    (SPARK_BLOCK_HEADER_LEN + 3)
+#define SHORT_FRAME_DATA_POS        (SPARK_BLOCK_HEADER_LEN + SPARK_CHUNK_HEADER_LEN)
+
+#define WRITER_NO_BLOCK             0xffff
+
+static void spark_block_header_init(uint8_t * header, uint16_t direction, uint8_t block_len){
+    memset(header, 0, SPARK_BLOCK_HEADER_LEN);
+    header[0] = 0x01;
+    header[1] = 0xfe;
+    header[4] = (uint8_t)(direction >> 8);
+    header[5] = (uint8_t)(direction & 0xff);
+    header[6] = block_len;
+}
+
+static void spark_writer_close_block(spark_writer_t * writer){
+    if (writer->block_start == WRITER_NO_BLOCK) return;
+    writer->buffer[writer->block_start + 6] = (uint8_t)(writer->len - writer->block_start);
+    writer->block_start = WRITER_NO_BLOCK;
+}
+
+// append byte of chunk stream, start new block if needed
+static void spark_writer_stream_byte(spark_writer_t * writer, uint8_t byte){
+    if (writer->overflow) return;
+    if ((writer->block_start != WRITER_NO_BLOCK) && ((writer->len - writer->block_start) >= writer->block_max_len)){
+        spark_writer_close_block(writer);
+    }
+    if (writer->block_start == WRITER_NO_BLOCK){
+        if ((writer->len + SPARK_BLOCK_HEADER_LEN + 1) > writer->size){
+            writer->overflow = 1;
+            return;
+        }
+        writer->block_start = writer->len;
+        spark_block_header_init(&writer->buffer[writer->len], writer->direction, 0);
+        writer->len += SPARK_BLOCK_HEADER_LEN;
+    }
+    if (writer->len >= writer->size){
+        writer->overflow = 1;
+        return;
+    }
+    writer->buffer[writer->len++] = byte;
+}
+
+static void spark_writer_start_chunk(spark_writer_t * writer, uint8_t command, uint8_t sub_command, uint8_t sequence){
+    spark_writer_stream_byte(writer, SPARK_CHUNK_START);
+    spark_writer_stream_byte(writer, 0x01);
+    spark_writer_stream_byte(writer, sequence);
+    spark_writer_stream_byte(writer, 0x00);
+    writer->checksum_pos = writer->len - 1;
+    spark_writer_stream_byte(writer, command);
+    spark_writer_stream_byte(writer, sub_command);
+    writer->checksum  = 0;
+    writer->group_pos = 0;
+}
+
+static void spark_writer_data_byte(spark_writer_t * writer, uint8_t value){
+    if (writer->group_pos == 0){
+        spark_writer_stream_byte(writer, 0x00);
+        writer->group_msbs_pos = writer->len - 1;
+    }
+    if (writer->overflow) return;
+    if (value & 0x80){
+        // XOR of the MSB byte is the XOR of its bits
+        uint8_t msb = (uint8_t)(1 << writer->group_pos);
+        writer->buffer[writer->group_msbs_pos] |= msb;
+        writer->checksum ^= msb;
+    }
+    value &= 0x7f;
+    writer->checksum ^= value;
+    spark_writer_stream_byte(writer, value);
+    writer->group_pos = (writer->group_pos == 6) ? 0 : (writer->group_pos + 1);
+}
+
+static void spark_writer_end_chunk(spark_writer_t * writer){
+    if (!writer->overflow){
+        writer->buffer[writer->checksum_pos] = writer->checksum;
+    }
+    spark_writer_stream_byte(writer, SPARK_CHUNK_END);
+}
+
+void spark_writer_init(spark_writer_t * writer, uint8_t * buffer, uint16_t size, uint16_t direction, uint8_t block_max_len){
+    memset(writer, 0, sizeof(spark_writer_t));
+    writer->buffer        = buffer;
+    writer->size          = size;
+    writer->direction     = direction;
+    writer->block_max_len = block_max_len;
+    writer->block_start   = WRITER_NO_BLOCK;
+}
+
+bool spark_writer_add_message(spark_writer_t * writer, uint8_t command, uint8_t sub_command, uint8_t sequence,
+                              const uint8_t * payload, uint16_t payload_len){
+    uint16_t pos;
+    if (spark_message_is_multi_chunk(command, sub_command)){
+        uint16_t num_chunks = (payload_len + SPARK_CHUNK_MAX_DATA - 1) / SPARK_CHUNK_MAX_DATA;
+        if (num_chunks == 0){
+            num_chunks = 1;
+        }
+        if (num_chunks > 0x7f) return false;
+        uint16_t chunk;
+        pos = 0;
+        for (chunk = 0; chunk < num_chunks; chunk++){
+            uint16_t chunk_len = payload_len - pos;
+            if (chunk_len > SPARK_CHUNK_MAX_DATA){
+                chunk_len = SPARK_CHUNK_MAX_DATA;
+            }
+            spark_writer_start_chunk(writer, command, sub_command, sequence);
+            spark_writer_data_byte(writer, (uint8_t) num_chunks);
+            spark_writer_data_byte(writer, (uint8_t) chunk);
+            spark_writer_data_byte(writer, (uint8_t) chunk_len);
+            uint16_t end = pos + chunk_len;
+            for (; pos < end; pos++){
+                spark_writer_data_byte(writer, payload[pos]);
+            }
+            spark_writer_end_chunk(writer);
+        }
+    } else {
+        spark_writer_start_chunk(writer, command, sub_command, sequence);
+        for (pos = 0; pos < payload_len; pos++){
+            spark_writer_data_byte(writer, payload[pos]);
+        }
+        spark_writer_end_chunk(writer);
+    }
+    spark_writer_close_block(writer);
+    return writer->overflow == 0;
+}
+
+uint16_t spark_writer_get_len(const spark_writer_t * writer){
+    return writer->len;
+}
+
+uint16_t spark_short_frame_init(uint8_t * frame, uint16_t direction, uint8_t command, uint8_t sub_command, uint8_t payload_len){
+    uint16_t len = SPARK_BLOCK_HEADER_LEN + SPARK_CHUNK_HEADER_LEN + ((payload_len > 0) ? (1 + payload_len) : 0) + 1;
+    spark_block_header_init(frame, direction, (uint8_t) len);
+    uint8_t * chunk = &frame[SPARK_BLOCK_HEADER_LEN];
+    chunk[0] = SPARK_CHUNK_START;
+    chunk[1] = 0x01;
+    chunk[2] = 0x00;
+    chunk[3] = 0x00;
+    chunk[4] = command;
+    chunk[5] = sub_command;
+    memset(&frame[SHORT_FRAME_DATA_POS], 0, len - SHORT_FRAME_DATA_POS - 1);
+    frame[len - 1] = SPARK_CHUNK_END;
+    return len;
+}
+
+void spark_short_frame_patch(uint8_t * frame, uint8_t sequence, const uint8_t * payload, uint8_t payload_len){
+    frame[SHORT_FRAME_SEQUENCE_POS] = sequence;
+    if (payload_len == 0) {
+        frame[SHORT_FRAME_CHECKSUM_POS] = 0;
+        return;
+    }
+    uint8_t * data = &frame[SHORT_FRAME_DATA_POS];
+    uint8_t msbs = 0;
+    uint8_t checksum = 0;
+    uint8_t i;
+    for (i = 0; i < payload_len; i++){
+        uint8_t value = payload[i];
+        msbs |= (uint8_t)((value >> 7) << i);
+        data[1 + i] = value & 0x7f;
+        checksum ^= value & 0x7f;
+    }
+    data[0] = msbs;
+    frame[SHORT_FRAME_CHECKSUM_POS] = checksum ^ msbs;
+}
+
+void spark_frame_patch_sequence(uint8_t * frame, uint16_t len, uint8_t sequence){
+    // checksum does not cover the sequence. Data is 7-bit, so only chunk starts have the MSB set. A chunk header
+    // may continue in the next block
+    uint8_t header_pos = 0;
+    uint16_t block_start = 0;
+    while ((block_start + SPARK_BLOCK_HEADER_LEN) < len){
+        uint16_t block_end = block_start + frame[block_start + 6];
+        if ((block_end <= (block_start + SPARK_BLOCK_HEADER_LEN)) || (block_end > len)) return;
+        uint16_t pos;
+        for (pos = block_start + SPARK_BLOCK_HEADER_LEN; pos < block_end; pos++){
+            if (frame[pos] == SPARK_CHUNK_START){
+                header_pos = 1;
+            } else if (header_pos == 2){
+                frame[pos] = sequence;
+                header_pos = 0;
+            } else if (header_pos > 0){
+                header_pos++;
+            }
+        }
+        block_start = block_end;
+    }
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+/*
+ *  spark_protocol.h
+ *
+ *  Spark 40 BLE message format, see
+ *  https://github.com/jrnelson90/tinderboxpedal/blob/master/src/BLE%20message%20format.md
+ *
+ *  Each GATT write or notification carries a byte stream of blocks. A block starts with a 16 byte header
+ *  (01 FE 00 00 <direction> <block len> 00...) followed by the block body. The bodies of consecutive blocks
+ *  form a stream of chunks (F0 01 <seq> <checksum> <cmd> <sub cmd> <data> F7) and chunks may span
+ *  notifications as well as blocks. Chunk data is 7-bit packed: every group of up to 7 bytes is preceded
+ *  by a byte that holds their MSBs. Large messages (e.g. presets) are split into several chunks, each of
+ *  them starting with a 3 byte chunk header (<num chunks> <chunk index> <chunk len>). The checksum is the XOR
+ *  of all packed data bytes.
+ */
+
+#ifndef SPARK_PROTOCOL_H
+#define SPARK_PROTOCOL_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SPARK_BLOCK_HEADER_LEN          16
+
+// block direction, bytes 4 and 5 of the block header
+#define SPARK_DIRECTION_TO_AMP          0x53fe
+#define SPARK_DIRECTION_FROM_AMP        0x41ff
+
+#define SPARK_CHUNK_START               0xf0
+#define SPARK_CHUNK_END                 0xf7
+
+// commands
+#define SPARK_CMD_WRITE                 0x01
+#define SPARK_CMD_REQUEST               0x02
+#define SPARK_CMD_RESPONSE              0x03
+#define SPARK_CMD_ACK                   0x04
+
+// sub commands
+#define SPARK_SUB_PRESET                0x01
+#define SPARK_SUB_EFFECT_PARAMETER      0x04
+#define SPARK_SUB_CURRENT_PRESET        0x10
+#define SPARK_SUB_EFFECT_ONOFF          0x15
+#define SPARK_SUB_HARDWARE_ID           0x23
+#define SPARK_SUB_PARAMETER_CHANGED     0x37
+#define SPARK_SUB_SELECT_PRESET         0x38
+
+// max block length incl. header
+#define SPARK_BLOCK_MAX_LEN_TO_AMP      0xad
+#define SPARK_BLOCK_MAX_LEN_FROM_AMP    0x6a
+
+// start, marker, sequence, checksum, command, sub command
+#define SPARK_CHUNK_HEADER_LEN          6
+
+// max payload per chunk of multi-chunk messages
+#define SPARK_CHUNK_MAX_DATA            0x80
+
+// short frame: single block with a single chunk and up to one 7-bit group of payload
+#define SPARK_SHORT_MAX_PAYLOAD         7
+#define SPARK_SHORT_FRAME_MAX_LEN       (SPARK_BLOCK_HEADER_LEN + SPARK_CHUNK_HEADER_LEN + 1 + SPARK_SHORT_MAX_PAYLOAD + 1)
+
+#ifndef SPARK_READER_MAX_PAYLOAD
+#define SPARK_READER_MAX_PAYLOAD        1024
+#endif
+
+/**
+ * Decoded Spark message. Payload is unpacked and chunk headers of multi-chunk messages are removed
+ */
+typedef struct {
+    uint16_t        direction;
+    uint8_t         command;
+    uint8_t         sub_command;
+    uint8_t         sequence;
+    uint16_t        payload_len;
+    const uint8_t * payload;
+} spark_message_t;
+
+/**
+ * @brief Callback for complete messages. Message and payload are only valid during the callback
+ * @param context provided in spark_reader_init
+ * @param message
+ */
+typedef void (*spark_message_handler_t)(void * context, const spark_message_t * message);
+
+typedef struct {
+    uint32_t bytes;
+    uint32_t blocks;
+    uint32_t messages;
+    uint32_t resyncs;
+    uint32_t checksum_errors;
+    uint32_t dropped;
+} spark_reader_stats_t;
+
+typedef struct {
+    spark_message_handler_t handler;
+    void *                  context;
+
+    // block layer
+    uint8_t  synced;
+    uint8_t  header_pos;
+    uint8_t  block_len;
+    uint8_t  block_remaining;
+    uint16_t direction;
+
+    // chunk layer
+    uint8_t  chunk_state;
+    uint8_t  chunk_sequence;
+    uint8_t  chunk_checksum;
+    uint8_t  chunk_command;
+    uint8_t  chunk_xor;
+    uint8_t  group_pos;
+    uint8_t  group_msbs;
+    uint8_t  chunk_header[3];
+    uint8_t  chunk_header_len;
+
+    // message being assembled
+    uint8_t  command;
+    uint8_t  sub_command;
+    uint8_t  sequence;
+    uint8_t  multi_chunk;
+    uint8_t  next_chunk_index;
+    uint8_t  overflow;
+    uint16_t payload_len;
+    uint8_t  payload[SPARK_READER_MAX_PAYLOAD];
+
+    spark_reader_stats_t stats;
+} spark_reader_t;
+
+typedef struct {
+    uint8_t * buffer;
+    uint16_t  size;
+    uint16_t  len;
+    uint16_t  direction;
+    uint8_t   block_max_len;
+    uint8_t   overflow;
+
+    // current block and chunk
+    uint16_t  block_start;
+    uint16_t  checksum_pos;
+    uint8_t   checksum;
+    uint16_t  group_msbs_pos;
+    uint8_t   group_pos;
+} spark_writer_t;
+
+/* API_START */
+
+/**
+ * @brief Init reader
+ * @param reader
+ * @param handler for complete messages
+ * @param context passed to handler
+ */
+void spark_reader_init(spark_reader_t * reader, spark_message_handler_t handler, void * context);
+
+/**
+ * @brief Discard partial message, e.g. after disconnect. Statistics are kept
+ * @param reader
+ */
+void spark_reader_reset(spark_reader_t * reader);
+
+/**
+ * @brief Process next fragment of the byte stream, e.g. a GATT notification. Fragments can have any length.
+ *        Each byte is decoded in place into the payload buffer, complete messages are reported via handler.
+ * @param reader
+ * @param data
+ * @param len
+ */
+void spark_reader_process(spark_reader_t * reader, const uint8_t * data, uint16_t len);
+
+/**
+ * @brief Check if the stream processed so far ends between messages, i.e. not within a block, a chunk or
+ *        a multi-chunk message. Other messages can be inserted into the stream only there
+ * @param reader
+ * @return true if at message boundary
+ */
+bool spark_reader_at_message_boundary(const spark_reader_t * reader);
+
+/**
+ * @brief Check if message is sent as sequence of chunks with chunk headers
+ * @param command
+ * @param sub_command
+ * @return true if multi-chunk
+ */
+bool spark_message_is_multi_chunk(uint8_t command, uint8_t sub_command);
+
+/**
+ * @brief Init writer that encodes messages directly into the given buffer, e.g. the buffer passed to GATT
+ * @param writer
+ * @param buffer
+ * @param size of buffer
+ * @param direction SPARK_DIRECTION_TO_AMP or SPARK_DIRECTION_FROM_AMP
+ * @param block_max_len of blocks incl. header, each block can be sent as a single write or notification
+ */
+void spark_writer_init(spark_writer_t * writer, uint8_t * buffer, uint16_t size, uint16_t direction, uint8_t block_max_len);
+
+/**
+ * @brief Append message. Payload is 7-bit packed with checksum, multi-chunk messages are split into chunks
+ *        of SPARK_CHUNK_MAX_DATA bytes and the chunk stream is split into blocks
+ * @param writer
+ * @param command
+ * @param sub_command
+ * @param sequence
+ * @param payload
+ * @param payload_len
+ * @return false if buffer is too small, buffer content is invalid then
+ */
+bool spark_writer_add_message(spark_writer_t * writer, uint8_t command, uint8_t sub_command, uint8_t sequence,
+                              const uint8_t * payload, uint16_t payload_len);
+
+/**
+ * @brief Get length of encoded data
+ * @param writer
+ * @return len
+ */
+uint16_t spark_writer_get_len(const spark_writer_t * writer);
+
+/**
+ * @brief Init short frame, e.g. once per buffer and command. Sequence and payload are set by spark_short_frame_patch
+ * @param frame buffer of at least SPARK_SHORT_FRAME_MAX_LEN bytes
+ * @param direction
+ * @param command
+ * @param sub_command
+ * @param payload_len up to SPARK_SHORT_MAX_PAYLOAD
+ * @return frame len
+ */
+uint16_t spark_short_frame_init(uint8_t * frame, uint16_t direction, uint8_t command, uint8_t sub_command, uint8_t payload_len);
+
+/**
+ * @brief Set sequence, payload and checksum of short frame in place
+ * @param frame initialized with spark_short_frame_init
+ * @param sequence
+ * @param payload
+ * @param payload_len as used for spark_short_frame_init
+ */
+void spark_short_frame_patch(uint8_t * frame, uint8_t sequence, const uint8_t * payload, uint8_t payload_len);
+
+/**
+ * @brief Set sequence of all chunks of an encoded frame in place, e.g. to send a frame that was encoded ahead of time
+ * @param frame encoded by spark_writer
+ * @param len of frame
+ * @param sequence
+ */
+void spark_frame_patch_sequence(uint8_t * frame, uint16_t len, uint8_t sequence);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // SPARK_PROTOCOL_H
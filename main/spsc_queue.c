@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "spsc_queue.c"
+
+/*
+ *  spsc_queue.c
+ *
+ *  Element data is written before head is published with release semantics and read after head is loaded
+ *  with acquire semantics (and vice versa for tail), which orders the accesses across cores.
+ */
+
+#include <string.h>
+
+#include "spsc_queue.h"
+
+void spsc_queue_init(spsc_queue_t * queue, void * storage, uint16_t element_size, uint16_t capacity){
+    memset(queue, 0, sizeof(spsc_queue_t));
+    queue->storage      = (uint8_t *) storage;
+    queue->element_size = element_size;
+    queue->capacity     = capacity;
+}
+
+bool spsc_queue_push(spsc_queue_t * queue, const void * element){
+    uint16_t head = queue->head;
+    uint16_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    uint16_t used = (uint16_t)(head - tail);
+    if (used >= queue->capacity){
+        queue->dropped++;
+        return false;
+    }
+    uint16_t index = head & (queue->capacity - 1);
+    memcpy(&queue->storage[index * queue->element_size], element, queue->element_size);
+    __atomic_store_n(&queue->head, (uint16_t)(head + 1), __ATOMIC_RELEASE);
+    if (used + 1 > queue->high_water){
+        queue->high_water = used + 1;
+    }
+    return true;
+}
+
+bool spsc_queue_pop(spsc_queue_t * queue, void * element){
+    uint16_t tail = queue->tail;
+    uint16_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (head == tail) return false;
+    uint16_t index = tail & (queue->capacity - 1);
+    memcpy(element, &queue->storage[index * queue->element_size], queue->element_size);
+    __atomic_store_n(&queue->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+    return true;
+}
+
+uint16_t spsc_queue_count(const spsc_queue_t * queue){
+    return (uint16_t)(queue->head - queue->tail);
+}
+
+uint16_t spsc_queue_get_high_water(const spsc_queue_t * queue){
+    return queue->high_water;
+}
+
+uint32_t spsc_queue_get_dropped(const spsc_queue_t * queue){
+    return queue->dropped;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  spsc_queue.h
+ *
+ *  Lock-free queue of fixed-size elements between exactly one producer and one consumer, e.g. an ISR and a
+ *  task or two tasks on different cores. The producer only writes head, the consumer only writes tail, so
+ *  neither side needs a lock or a critical section. Capacity must be a power of two.
+ */
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    uint8_t *         storage;
+    uint16_t          element_size;
+    uint16_t          capacity;
+    // free running indices, only written by producer / consumer
+    volatile uint16_t head;
+    volatile uint16_t tail;
+    // updated by producer
+    uint16_t          high_water;
+    volatile uint32_t dropped;
+} spsc_queue_t;
+
+/* API_START */
+
+/**
+ * @brief Init queue
+ * @param queue
+ * @param storage for capacity elements
+ * @param element_size
+ * @param capacity power of two
+ */
+void spsc_queue_init(spsc_queue_t * queue, void * storage, uint16_t element_size, uint16_t capacity);
+
+/**
+ * @brief Add element, producer only
+ * @param queue
+ * @param element
+ * @return false if queue is full, element is counted as dropped
+ */
+bool spsc_queue_push(spsc_queue_t * queue, const void * element);
+
+/**
+ * @brief Remove oldest element, consumer only
+ * @param queue
+ * @param element buffer of element_size bytes
+ * @return false if queue is empty
+ */
+bool spsc_queue_pop(spsc_queue_t * queue, void * element);
+
+/**
+ * @brief Get number of queued elements, exact for producer and consumer, a snapshot for others
+ * @param queue
+ * @return count
+ */
+uint16_t spsc_queue_count(const spsc_queue_t * queue);
+
+/**
+ * @brief Get max number of queued elements seen by producer
+ * @param queue
+ * @return high water mark
+ */
+uint16_t spsc_queue_get_high_water(const spsc_queue_t * queue);
+
+/**
+ * @brief Get number of elements dropped because queue was full
+ * @param queue
+ * @return dropped
+ */
+uint32_t spsc_queue_get_dropped(const spsc_queue_t * queue);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // SPSC_QUEUE_H
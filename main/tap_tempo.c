@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+
+#define BTSTACK_FILE__ "tap_tempo.c"
+
+#include <string.h>
+
+#include "tap_tempo.h"
+
+static uint32_t tap_tempo_median(const tap_tempo_t * tempo){
+    uint32_t sorted[TAP_TEMPO_WINDOW];
+    memcpy(sorted, tempo->intervals_us, tempo->count * sizeof(uint32_t));
+    // insertion sort, window is small
+    uint8_t i;
+    for (i = 1; i < tempo->count; i++){
+        uint32_t value = sorted[i];
+        uint8_t j = i;
+        while ((j > 0) && (sorted[j - 1] > value)){
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = value;
+    }
+    if ((tempo->count & 1) != 0) return sorted[tempo->count / 2];
+    return (sorted[tempo->count / 2 - 1] + sorted[tempo->count / 2]) / 2;
+}
+
+static bool tap_tempo_is_outlier(const tap_tempo_t * tempo, uint32_t interval_us){
+    if (tempo->count == 0) return false;
+    uint32_t median_us = tap_tempo_median(tempo);
+    uint32_t deviation_us = (interval_us > median_us) ? (interval_us - median_us) : (median_us - interval_us);
+    return ((uint64_t) deviation_us * 100) > ((uint64_t) median_us * TAP_TEMPO_TOLERANCE_PERCENT);
+}
+
+static void tap_tempo_restart(tap_tempo_t * tempo){
+    tempo->head  = 0;
+    tempo->count = 0;
+    tempo->outliers_in_row = 0;
+}
+
+static void tap_tempo_add_interval(tap_tempo_t * tempo, uint32_t interval_us){
+    tempo->intervals_us[tempo->head] = interval_us;
+    tempo->head = (tempo->head + 1) % TAP_TEMPO_WINDOW;
+    if (tempo->count < TAP_TEMPO_WINDOW){
+        tempo->count++;
+    }
+    uint64_t total_us = 0;
+    uint8_t i;
+    for (i = 0; i < tempo->count; i++){
+        total_us += tempo->intervals_us[i];
+    }
+    tempo->period_us = (uint32_t) ((total_us + tempo->count / 2) / tempo->count);
+    tempo->stats.accepted++;
+}
+
+void tap_tempo_init(tap_tempo_t * tempo){
+    memset(tempo, 0, sizeof(tap_tempo_t));
+}
+
+bool tap_tempo_tap(tap_tempo_t * tempo, uint32_t time_us){
+    tempo->stats.taps++;
+    if (!tempo->has_last_tap){
+        tempo->has_last_tap = true;
+        tempo->last_tap_us  = time_us;
+        tempo->stats.sequences++;
+        return false;
+    }
+
+    uint32_t interval_us = time_us - tempo->last_tap_us;
+    if (interval_us < TAP_TEMPO_MIN_INTERVAL_US){
+        // doubled tap, keep first one
+        tempo->stats.bounces++;
+        return false;
+    }
+    tempo->last_tap_us = time_us;
+    if (interval_us > TAP_TEMPO_MAX_INTERVAL_US){
+        // pause, first tap of new sequence. Tempo is kept until replaced
+        tap_tempo_restart(tempo);
+        tempo->stats.sequences++;
+        return false;
+    }
+
+    if (tap_tempo_is_outlier(tempo, interval_us)){
+        tempo->stats.outliers++;
+        tempo->outliers_in_row++;
+        if (tempo->outliers_in_row <= TAP_TEMPO_MAX_OUTLIERS) return false;
+        // consistent change, start over with new tempo
+        tap_tempo_restart(tempo);
+    }
+    tempo->outliers_in_row = 0;
+    tap_tempo_add_interval(tempo, interval_us);
+    return true;
+}
+
+uint32_t tap_tempo_get_period_us(const tap_tempo_t * tempo){
+    return tempo->period_us;
+}
+
+uint16_t tap_tempo_get_bpm_x10(const tap_tempo_t * tempo){
+    if (tempo->period_us == 0) return 0;
+    return (uint16_t) ((600000000UL + tempo->period_us / 2) / tempo->period_us);
+}
+
+uint32_t tap_tempo_get_next_beat_us(const tap_tempo_t * tempo, uint32_t now_us){
+    if (tempo->period_us == 0) return now_us;
+    uint32_t since_tap_us = now_us - tempo->last_tap_us;
+    uint32_t beats = since_tap_us / tempo->period_us + 1;
+    return tempo->last_tap_us + beats * tempo->period_us;
+}
+
+const tap_tempo_stats_t * tap_tempo_get_stats(const tap_tempo_t * tempo){
+    return &tempo->stats;
+}
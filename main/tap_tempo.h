@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  tap_tempo.h
+ *  Tap tempo from button press timestamps in microseconds. Intervals that deviate too much from the median of
+ *  the recent intervals are rejected as outliers, e.g. a missed or doubled tap. The tempo is the average of a
+ *  sliding window of accepted intervals. A pause longer than the slowest tempo starts a new tap sequence, a few
+ *  outliers in a row are taken as a new tempo.
+ */
+
+#ifndef TAP_TEMPO_H
+#define TAP_TEMPO_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// sliding window of intervals
+#define TAP_TEMPO_WINDOW                6
+
+// 300 - 30 BPM
+#define TAP_TEMPO_MIN_INTERVAL_US       200000
+#define TAP_TEMPO_MAX_INTERVAL_US       2000000
+
+// max deviation from median of window
+#define TAP_TEMPO_TOLERANCE_PERCENT     20
+
+// outliers in a row that start over with the new tempo
+#define TAP_TEMPO_MAX_OUTLIERS          2
+
+typedef struct {
+    uint32_t taps;
+    uint32_t accepted;
+    uint32_t outliers;
+    uint32_t bounces;
+    uint32_t sequences;
+} tap_tempo_stats_t;
+
+typedef struct {
+    bool     has_last_tap;
+    uint32_t last_tap_us;
+    uint32_t intervals_us[TAP_TEMPO_WINDOW];
+    uint8_t  head;
+    uint8_t  count;
+    uint8_t  outliers_in_row;
+    uint32_t period_us;
+    tap_tempo_stats_t stats;
+} tap_tempo_t;
+
+/* API_START */
+
+/**
+ * @brief Init tap tempo, no tempo known
+ * @param tempo
+ */
+void tap_tempo_init(tap_tempo_t * tempo);
+
+/**
+ * @brief Process tap
+ * @param tempo
+ * @param time_us of button edge
+ * @return true if tempo was updated
+ */
+bool tap_tempo_tap(tap_tempo_t * tempo, uint32_t time_us);
+
+/**
+ * @brief Get beat period
+ * @param tempo
+ * @return period in us, 0 if no tempo known
+ */
+uint32_t tap_tempo_get_period_us(const tap_tempo_t * tempo);
+
+/**
+ * @brief Get tempo in beats per minute times 10
+ * @param tempo
+ * @return bpm x 10, 0 if no tempo known
+ */
+uint16_t tap_tempo_get_bpm_x10(const tap_tempo_t * tempo);
+
+/**
+ * @brief Get next beat after given time, beats are aligned to the last tap
+ * @param tempo
+ * @param now_us
+ * @return time of next beat, now_us if no tempo known
+ */
+uint32_t tap_tempo_get_next_beat_us(const tap_tempo_t * tempo, uint32_t now_us);
+
+/**
+ * @brief Get statistics
+ * @param tempo
+ * @return stats
+ */
+const tap_tempo_stats_t * tap_tempo_get_stats(const tap_tempo_t * tempo);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // TAP_TEMPO_H
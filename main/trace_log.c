@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+#define BTSTACK_FILE__ "trace_log.c"
+
+/*
+ *  trace_log.c
+ *
+ *  An event with data occupies 1 + ceil(len / sizeof(record)) consecutive records. The producer writes all of
+ *  them before head is published with release semantics, so the consumer never sees a partial event.
+ *
+ *  Formats are printf-like: %u and %x with optional zero flag and width take the next argument, %C takes a
+ *  command / sub command pair packed as (command << 8) | sub command. Data is shown by %s as string, %a as
+ *  Bluetooth address and %h as hexdump.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "trace_log.h"
+
+#define TRACE_LOG_DATA_RECORDS(len) (((len) + sizeof(trace_log_record_t) - 1) / sizeof(trace_log_record_t))
+
+typedef struct {
+    trace_level_t level;
+    const char *  format;
+} trace_event_info_t;
+
+static const trace_event_info_t trace_events[TRACE_EVENT_COUNT] = {
+    [TRACE_EVENT_NONE]                          = { TRACE_LEVEL_DEBUG, "[-] Unknown event" },
+    [TRACE_EVENT_AMP_FOUND]                     = { TRACE_LEVEL_INFO,  "[+] Amp %u: Found Spark 40 - %a." },
+    [TRACE_EVENT_AMP_CONNECTED_CACHED]          = { TRACE_LEVEL_INFO,  "[-] Amp %u: Connection complete, use cached GATT handles" },
+    [TRACE_EVENT_AMP_CONNECTED_DISCOVER]        = { TRACE_LEVEL_INFO,  "[-] Amp %u: Connection complete, discover services" },
+    [TRACE_EVENT_AMP_DISCONNECTED]              = { TRACE_LEVEL_INFO,  "[+] Amp %u: Disconnected" },
+    [TRACE_EVENT_AMP_SETUP_STEP_DONE]           = { TRACE_LEVEL_INFO,  "[-] Amp %u: Setup: %s took %u ms" },
+    [TRACE_EVENT_AMP_SETUP_STEP_FAILED]         = { TRACE_LEVEL_ERROR, "[!] Amp %u: Setup: %s failed, status %02x" },
+    [TRACE_EVENT_AMP_SETUP_COMPLETE]            = { TRACE_LEVEL_INFO,  "[-] Amp %u: Setup complete in %u ms" },
+    [TRACE_EVENT_AMP_READY]                     = { TRACE_LEVEL_INFO,  "[-] Amp %u: Ready %u ms after %s" },
+    [TRACE_EVENT_AMP_PRESET]                    = { TRACE_LEVEL_INFO,  "[+] Amp %u: Preset: %u" },
+    [TRACE_EVENT_AMP_TONE]                      = { TRACE_LEVEL_INFO,  "[+] Amp %u: Tone: %s" },
+    [TRACE_EVENT_AMP_SYNCED]                    = { TRACE_LEVEL_INFO,  "[-] Amp %u: Amp state synced in %u ms" },
+    [TRACE_EVENT_AMP_CACHE_STORED]              = { TRACE_LEVEL_INFO,  "[-] Amp %u: Stored Spark 40 address and GATT handles" },
+    [TRACE_EVENT_AMP_CACHE_INVALID]             = { TRACE_LEVEL_INFO,  "[-] Amp %u: Cached GATT handles invalid, discover services" },
+    [TRACE_EVENT_AMP_CONNECT_KNOWN]             = { TRACE_LEVEL_INFO,  "[-] Amp %u: Connect to known Spark 40 - %a." },
+    [TRACE_EVENT_AMP_UNREACHABLE]               = { TRACE_LEVEL_INFO,  "[-] Amp %u: Spark 40 not reachable, fall back to scanning" },
+    [TRACE_EVENT_SCAN_START_DISCOVERY]          = { TRACE_LEVEL_INFO,  "[-] Start scanning for %u amp(s): discovery, %s duty cycle %u%%" },
+    [TRACE_EVENT_SCAN_START_ACCEPT_LIST]        = { TRACE_LEVEL_INFO,  "[-] Start scanning for %u amp(s): accept list, %s duty cycle %u%%" },
+    [TRACE_EVENT_CONNECTION_PARAMETERS]         = { TRACE_LEVEL_INFO,  "[-] Amp %u: Connection parameters (%s): interval %u us, latency %u" },
+    [TRACE_EVENT_CONNECTION_PROFILE_REQUEST]    = { TRACE_LEVEL_INFO,  "[-] Amp %u: Request %s connection parameters" },
+    [TRACE_EVENT_CONNECTION_PROFILE_FAILED]     = { TRACE_LEVEL_ERROR, "[!] Amp %u: Connection parameter update failed, status %02x" },
+    [TRACE_EVENT_CONNECTION_PARAMETERS_REJECTED] = { TRACE_LEVEL_ERROR, "[!] Amp %u: Connection parameters rejected, status %02x" },
+    [TRACE_EVENT_LINK_READY]                    = { TRACE_LEVEL_INFO,  "[-] Amp %u: Link (setup): MTU %u, data length tx %u octets, PHY %s" },
+    [TRACE_EVENT_LINK_DATA_LENGTH]              = { TRACE_LEVEL_INFO,  "[-] Amp %u: Link (data length): tx %u rx %u octets" },
+    [TRACE_EVENT_LINK_DATA_LENGTH_FAILED]       = { TRACE_LEVEL_ERROR, "[!] Amp %u: Data length update failed, status %02x, keep %u octets" },
+    [TRACE_EVENT_LINK_PHY]                      = { TRACE_LEVEL_INFO,  "[-] Amp %u: Link (PHY): tx LE %uM rx LE %uM" },
+    [TRACE_EVENT_LINK_PHY_REJECTED]             = { TRACE_LEVEL_ERROR, "[!] Amp %u: PHY update rejected, status %02x, stay on LE %uM" },
+    [TRACE_EVENT_LINK_PHY_FAILED]               = { TRACE_LEVEL_ERROR, "[!] Amp %u: PHY update failed, status %02x, stay on LE 1M" },
+    [TRACE_EVENT_LINK_PHY_UNSUPPORTED]          = { TRACE_LEVEL_ERROR, "[!] PHY update failed, status %02x, stay on LE 1M" },
+    [TRACE_EVENT_LINK_MTU_FAILED]               = { TRACE_LEVEL_ERROR, "[!] Amp %u: MTU exchange failed, ATT status %02x, keep MTU %u" },
+    [TRACE_EVENT_SM_JUST_WORKS]                 = { TRACE_LEVEL_INFO,  "[-] Just works requested" },
+    [TRACE_EVENT_SM_NUMERIC_COMPARISON]         = { TRACE_LEVEL_INFO,  "[-] Confirming numeric comparison: %u" },
+    [TRACE_EVENT_SM_PAIRING_STARTED]            = { TRACE_LEVEL_INFO,  "[-] Pairing started" },
+    [TRACE_EVENT_SM_PAIRING_COMPLETE]           = { TRACE_LEVEL_INFO,  "[-] Pairing complete, success" },
+    [TRACE_EVENT_SM_PAIRING_TIMEOUT]            = { TRACE_LEVEL_ERROR, "[-] Pairing failed, timeout" },
+    [TRACE_EVENT_SM_PAIRING_DISCONNECTED]       = { TRACE_LEVEL_ERROR, "[-] Pairing failed, disconnected" },
+    [TRACE_EVENT_SM_PAIRING_FAILED]             = { TRACE_LEVEL_ERROR, "[-] Pairing failed, authentication failure with reason = %u" },
+    [TRACE_EVENT_SM_REENCRYPTION_STARTED]       = { TRACE_LEVEL_INFO,  "[-] Bonding information exists for addr type %u, identity addr %a -> start re-encryption" },
+    [TRACE_EVENT_SM_REENCRYPTION_COMPLETE]      = { TRACE_LEVEL_INFO,  "[-] Re-encryption complete, success" },
+    [TRACE_EVENT_SM_REENCRYPTION_TIMEOUT]       = { TRACE_LEVEL_ERROR, "[-] Re-encryption failed, timeout" },
+    [TRACE_EVENT_SM_REENCRYPTION_DISCONNECTED]  = { TRACE_LEVEL_ERROR, "[-] Re-encryption failed, disconnected" },
+    [TRACE_EVENT_SM_REENCRYPTION_BONDING_MISSING] = { TRACE_LEVEL_ERROR, "[-] Re-encryption failed, bonding information missing\n"
+                                                                     "[-] Assuming remote lost bonding information\n"
+                                                                     "[-] Deleting local bonding information and start new pairing..." },
+    [TRACE_EVENT_COMMAND_WRITE_FAILED]          = { TRACE_LEVEL_ERROR, "[!] Amp %u: Write failed, status %02x, drop command %C" },
+    [TRACE_EVENT_COMMAND_HANDLES_INVALID]       = { TRACE_LEVEL_ERROR, "[!] Amp %u: Write failed, cached GATT handles invalid" },
+    [TRACE_EVENT_COMMAND_ATT_RETRY]             = { TRACE_LEVEL_ERROR, "[!] Amp %u: Write failed, ATT status %02x, retry command %C" },
+    [TRACE_EVENT_COMMAND_ATT_DROP]              = { TRACE_LEVEL_ERROR, "[!] Amp %u: Write failed, ATT status %02x, drop command %C" },
+    [TRACE_EVENT_COMMAND_QUEUE_FULL]            = { TRACE_LEVEL_ERROR, "[!] Amp %u: Command queue full, drop command %C" },
+    [TRACE_EVENT_COMMAND_TOO_LARGE]             = { TRACE_LEVEL_ERROR, "[!] Amp %u: Command %C with %u bytes payload too large, drop" },
+    [TRACE_EVENT_COMMAND_REPLAY]                = { TRACE_LEVEL_INFO,  "[-] Amp %u: Command %C not acknowledged, send again" },
+    [TRACE_EVENT_COMMAND_NOT_ACKNOWLEDGED]      = { TRACE_LEVEL_ERROR, "[!] Amp %u: Command %C not acknowledged after %u attempts, drop" },
+    [TRACE_EVENT_RELAY_CONNECTED]               = { TRACE_LEVEL_INFO,  "[+] Relay: App connected, relay to amp %u" },
+    [TRACE_EVENT_RELAY_DISCONNECTED]            = { TRACE_LEVEL_INFO,  "[+] Relay: App disconnected" },
+    [TRACE_EVENT_RELAY_WRITE_FAILED]            = { TRACE_LEVEL_ERROR, "[!] Relay: Write to amp %u failed, status %02x, drop %u bytes" },
+    [TRACE_EVENT_RELAY_WRITE_ATT_FAILED]        = { TRACE_LEVEL_ERROR, "[!] Relay: Write to amp %u failed, ATT status %02x, drop %u bytes" },
+    [TRACE_EVENT_RELAY_APP_MESSAGE_TIMEOUT]     = { TRACE_LEVEL_ERROR, "[!] Relay: App message incomplete for %u ms, drop it and resync" },
+    [TRACE_EVENT_RELAY_ADVERTISE]               = { TRACE_LEVEL_INFO,  "[-] Relay: Advertise Spark 40 service for the app" },
+    [TRACE_EVENT_RELAY_NOTIFICATIONS]           = { TRACE_LEVEL_INFO,  "[-] Relay: App %s notifications" },
+    [TRACE_EVENT_RELAY_MTU]                     = { TRACE_LEVEL_INFO,  "[-] Relay: App MTU %u" },
+    [TRACE_EVENT_MACRO_SLOT_UNKNOWN]            = { TRACE_LEVEL_ERROR, "[!] Amp %u: Macro effect slot %u unknown, skip" },
+    [TRACE_EVENT_TAP_TEMPO]                     = { TRACE_LEVEL_INFO,  "[-] Tap tempo: %u.%u BPM, period %u us" },
+    [TRACE_EVENT_TAP_TEMPO_DELAY_UNKNOWN]       = { TRACE_LEVEL_ERROR, "[!] Amp %u: Delay of current preset unknown, skip tap tempo" },
+    [TRACE_EVENT_BANK_SWITCH]                   = { TRACE_LEVEL_INFO,  "[+] Bank %u: Slot %u" },
+    [TRACE_EVENT_BANK_SLOT_EMPTY]               = { TRACE_LEVEL_ERROR, "[!] Bank %u: Slot %u empty, skip" },
+    [TRACE_EVENT_BANK_SLOT_TOO_LARGE]           = { TRACE_LEVEL_ERROR, "[!] Bank %u: Slot %u does not fit into frame with %u byte blocks" },
+    [TRACE_EVENT_RX]                            = { TRACE_LEVEL_DEBUG, "RX amp %u: %h" },
+    [TRACE_EVENT_RX_MESSAGE]                    = { TRACE_LEVEL_DEBUG, "RX message amp %u: cmd %C, seq %u, payload: %h" },
+    [TRACE_EVENT_TX]                            = { TRACE_LEVEL_DEBUG, "TX amp %u: %h" },
+};
+
+static const char * trace_level_names[TRACE_LEVEL_COUNT] = { "off", "error", "info", "debug" };
+
+static trace_log_record_t trace_records[TRACE_LOG_SIZE];
+
+// free running indices, only written by producer / consumer
+static volatile uint16_t trace_head;
+static volatile uint16_t trace_tail;
+
+static volatile trace_level_t trace_level = TRACE_LEVEL_INFO;
+static bool trace_binary;
+static uint32_t (*trace_time_us)(void);
+
+static trace_log_stats_t trace_stats;
+
+// consumer
+static uint32_t trace_dropped_reported;
+static uint8_t  trace_data[TRACE_LOG_MAX_DATA];
+static char     trace_line[TRACE_LOG_LINE_SIZE];
+
+void trace_log_init(uint32_t (*time_us)(void)){
+    trace_time_us = time_us;
+    trace_head = 0;
+    trace_tail = 0;
+    trace_dropped_reported = 0;
+    memset(&trace_stats, 0, sizeof(trace_stats));
+}
+
+void trace_log_set_level(trace_level_t level){
+    if (level >= TRACE_LEVEL_COUNT) return;
+    trace_level = level;
+}
+
+trace_level_t trace_log_get_level(void){
+    return trace_level;
+}
+
+const char * trace_log_level_name(trace_level_t level){
+    if (level >= TRACE_LEVEL_COUNT) return "?";
+    return trace_level_names[level];
+}
+
+void trace_log_set_binary(bool binary){
+    trace_binary = binary;
+}
+
+bool trace_log_get_binary(void){
+    return trace_binary;
+}
+
+void trace_log_data(trace_event_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2, const uint8_t * data, uint16_t len){
+    if (event >= TRACE_EVENT_COUNT) return;
+    if (trace_events[event].level > trace_level) return;
+    if (len > TRACE_LOG_MAX_DATA){
+        len = TRACE_LOG_MAX_DATA;
+    }
+    uint16_t needed = (uint16_t)(1 + TRACE_LOG_DATA_RECORDS(len));
+    uint16_t head = trace_head;
+    uint16_t tail = __atomic_load_n(&trace_tail, __ATOMIC_ACQUIRE);
+    uint16_t used = (uint16_t)(head - tail);
+    if ((used + needed) > TRACE_LOG_SIZE){
+        trace_stats.dropped++;
+        return;
+    }
+    trace_log_record_t * record = &trace_records[head & (TRACE_LOG_SIZE - 1)];
+    record->time_us  = (trace_time_us != NULL) ? (*trace_time_us)() : 0;
+    record->event    = (uint16_t) event;
+    record->data_len = len;
+    record->args[0]  = arg0;
+    record->args[1]  = arg1;
+    record->args[2]  = arg2;
+    // continuation records, may wrap around
+    uint16_t pos = 0;
+    uint16_t index = (uint16_t)(head + 1);
+    while (pos < len){
+        uint16_t chunk = len - pos;
+        if (chunk > sizeof(trace_log_record_t)){
+            chunk = sizeof(trace_log_record_t);
+        }
+        memcpy(&trace_records[index & (TRACE_LOG_SIZE - 1)], &data[pos], chunk);
+        pos += chunk;
+        index++;
+    }
+    __atomic_store_n(&trace_head, (uint16_t)(head + needed), __ATOMIC_RELEASE);
+    trace_stats.events++;
+    if ((used + needed) > trace_stats.high_water){
+        trace_stats.high_water = used + needed;
+    }
+}
+
+void trace_log_event(trace_event_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2){
+    trace_log_data(event, arg0, arg1, arg2, NULL, 0);
+}
+
+// formatting
+
+static uint16_t trace_format_append(uint16_t size, uint16_t pos, int written){
+    if (written < 0) return pos;
+    if ((pos + written) >= size) return size - 1;
+    return (uint16_t)(pos + written);
+}
+
+void trace_log_format(const trace_log_record_t * record, const uint8_t * data, char * buffer, uint16_t size){
+    if (size == 0) return;
+    buffer[0] = 0;
+    const char * format = trace_events[TRACE_EVENT_NONE].format;
+    if (record->event < TRACE_EVENT_COUNT){
+        format = trace_events[record->event].format;
+    }
+    uint16_t pos = 0;
+    uint8_t  arg = 0;
+    uint16_t i;
+    while ((*format != 0) && (pos < (size - 1))){
+        if (*format != '%'){
+            buffer[pos++] = *format++;
+            continue;
+        }
+        format++;
+        bool zero = false;
+        int width = 0;
+        if (*format == '0'){
+            zero = true;
+            format++;
+        }
+        while ((*format >= '0') && (*format <= '9')){
+            width = width * 10 + (*format++ - '0');
+        }
+        uint32_t value = 0;
+        char conversion = *format;
+        if ((conversion == 'u') || (conversion == 'x') || (conversion == 'C')){
+            if (arg < 3){
+                value = record->args[arg];
+            }
+            arg++;
+        }
+        switch (conversion){
+            case 'u':
+                pos = trace_format_append(size, pos,
+                    snprintf(&buffer[pos], size - pos, zero ? "%0*"PRIu32 : "%*"PRIu32, width, value));
+                break;
+            case 'x':
+                pos = trace_format_append(size, pos,
+                    snprintf(&buffer[pos], size - pos, zero ? "%0*"PRIx32 : "%*"PRIx32, width, value));
+                break;
+            case 'C':
+                pos = trace_format_append(size, pos,
+                    snprintf(&buffer[pos], size - pos, "%02x/%02x", (unsigned int) ((value >> 8) & 0xff), (unsigned int) (value & 0xff)));
+                break;
+            case 's':
+                pos = trace_format_append(size, pos,
+                    snprintf(&buffer[pos], size - pos, "%.*s", (int) record->data_len, (const char *) data));
+                break;
+            case 'a':
+                // same as bd_addr_to_str
+                for (i = 0; (i < record->data_len) && (i < 6); i++){
+                    pos = trace_format_append(size, pos,
+                        snprintf(&buffer[pos], size - pos, (i == 0) ? "%02X" : ":%02X", data[i]));
+                }
+                break;
+            case 'h':
+                // same as printf_hexdump
+                for (i = 0; i < record->data_len; i++){
+                    pos = trace_format_append(size, pos, snprintf(&buffer[pos], size - pos, "%02X ", data[i]));
+                }
+                break;
+            case '%':
+                buffer[pos++] = '%';
+                break;
+            default:
+                // unknown conversion or end of format
+                if (conversion == 0) continue;
+                break;
+        }
+        format++;
+    }
+    buffer[pos] = 0;
+}
+
+// consumer
+
+static void trace_log_print(const trace_log_record_t * record, const uint8_t * data){
+    uint16_t i;
+    if (trace_binary){
+        const uint8_t * bytes = (const uint8_t *) record;
+        printf(TRACE_LOG_BINARY_PREFIX);
+        for (i = 0; i < sizeof(trace_log_record_t); i++){
+            printf("%02x", bytes[i]);
+        }
+        for (i = 0; i < record->data_len; i++){
+            printf("%02x", data[i]);
+        }
+        printf("\n");
+        return;
+    }
+    trace_log_format(record, data, trace_line, sizeof(trace_line));
+    printf("%4"PRIu32".%06"PRIu32" %s\n", record->time_us / 1000000, record->time_us % 1000000, trace_line);
+}
+
+void trace_log_process(void){
+    uint16_t tail = trace_tail;
+    uint16_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    while (tail != head){
+        trace_log_record_t record = trace_records[tail & (TRACE_LOG_SIZE - 1)];
+        uint16_t pos = 0;
+        uint16_t index = (uint16_t)(tail + 1);
+        while (pos < record.data_len){
+            uint16_t chunk = record.data_len - pos;
+            if (chunk > sizeof(trace_log_record_t)){
+                chunk = sizeof(trace_log_record_t);
+            }
+            memcpy(&trace_data[pos], &trace_records[index & (TRACE_LOG_SIZE - 1)], chunk);
+            pos += chunk;
+            index++;
+        }
+        tail = index;
+        // release records before formatting, data has been copied
+        __atomic_store_n(&trace_tail, tail, __ATOMIC_RELEASE);
+        trace_log_print(&record, trace_data);
+    }
+    uint32_t dropped = trace_stats.dropped;
+    if (dropped != trace_dropped_reported){
+        printf("[!] Trace: %"PRIu32" events dropped\n", dropped - trace_dropped_reported);
+        trace_dropped_reported = dropped;
+    }
+}
+
+const trace_log_stats_t * trace_log_get_stats(void){
+    return &trace_stats;
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2022 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL BLUEKITCHEN
+ * GMBH OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  trace_log.h
+ *
+ *  Deferred binary trace log. Each event is a fixed-size record with timestamp, event ID and three arguments,
+ *  optional data like a hexdump or a name follows in continuation records. Recording is a level check, a
+ *  timestamp and a copy into a lock-free ring in RAM; formatting happens later on the consumer side, either as
+ *  text or as binary lines for the host tool trace_decode. One producer (BTstack thread) and one consumer.
+ */
+
+#ifndef TRACE_LOG_H
+#define TRACE_LOG_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// records in ring, power of two
+#define TRACE_LOG_SIZE                  256
+
+// data per event, longer data is cut
+#define TRACE_LOG_MAX_DATA              512
+
+// formatted line incl. hexdump of max data
+#define TRACE_LOG_LINE_SIZE             (3 * TRACE_LOG_MAX_DATA + 160)
+
+// prefix of records in binary output
+#define TRACE_LOG_BINARY_PREFIX         "TRC "
+
+typedef enum {
+    TRACE_LEVEL_OFF = 0,
+    TRACE_LEVEL_ERROR,
+    TRACE_LEVEL_INFO,
+    TRACE_LEVEL_DEBUG,
+    TRACE_LEVEL_COUNT
+} trace_level_t;
+
+// append only, IDs are part of the binary format
+typedef enum {
+    TRACE_EVENT_NONE = 0,
+    TRACE_EVENT_AMP_FOUND,
+    TRACE_EVENT_AMP_CONNECTED_CACHED,
+    TRACE_EVENT_AMP_CONNECTED_DISCOVER,
+    TRACE_EVENT_AMP_DISCONNECTED,
+    TRACE_EVENT_AMP_SETUP_STEP_DONE,
+    TRACE_EVENT_AMP_SETUP_STEP_FAILED,
+    TRACE_EVENT_AMP_SETUP_COMPLETE,
+    TRACE_EVENT_AMP_READY,
+    TRACE_EVENT_AMP_PRESET,
+    TRACE_EVENT_AMP_TONE,
+    TRACE_EVENT_AMP_SYNCED,
+    TRACE_EVENT_AMP_CACHE_STORED,
+    TRACE_EVENT_AMP_CACHE_INVALID,
+    TRACE_EVENT_AMP_CONNECT_KNOWN,
+    TRACE_EVENT_AMP_UNREACHABLE,
+    TRACE_EVENT_SCAN_START_DISCOVERY,
+    TRACE_EVENT_SCAN_START_ACCEPT_LIST,
+    TRACE_EVENT_CONNECTION_PARAMETERS,
+    TRACE_EVENT_CONNECTION_PROFILE_REQUEST,
+    TRACE_EVENT_CONNECTION_PROFILE_FAILED,
+    TRACE_EVENT_CONNECTION_PARAMETERS_REJECTED,
+    TRACE_EVENT_LINK_READY,
+    TRACE_EVENT_LINK_DATA_LENGTH,
+    TRACE_EVENT_LINK_DATA_LENGTH_FAILED,
+    TRACE_EVENT_LINK_PHY,
+    TRACE_EVENT_LINK_PHY_REJECTED,
+    TRACE_EVENT_LINK_PHY_FAILED,
+    TRACE_EVENT_LINK_PHY_UNSUPPORTED,
+    TRACE_EVENT_LINK_MTU_FAILED,
+    TRACE_EVENT_SM_JUST_WORKS,
+    TRACE_EVENT_SM_NUMERIC_COMPARISON,
+    TRACE_EVENT_SM_PAIRING_STARTED,
+    TRACE_EVENT_SM_PAIRING_COMPLETE,
+    TRACE_EVENT_SM_PAIRING_TIMEOUT,
+    TRACE_EVENT_SM_PAIRING_DISCONNECTED,
+    TRACE_EVENT_SM_PAIRING_FAILED,
+    TRACE_EVENT_SM_REENCRYPTION_STARTED,
+    TRACE_EVENT_SM_REENCRYPTION_COMPLETE,
+    TRACE_EVENT_SM_REENCRYPTION_TIMEOUT,
+    TRACE_EVENT_SM_REENCRYPTION_DISCONNECTED,
+    TRACE_EVENT_SM_REENCRYPTION_BONDING_MISSING,
+    TRACE_EVENT_COMMAND_WRITE_FAILED,
+    TRACE_EVENT_COMMAND_HANDLES_INVALID,
+    TRACE_EVENT_COMMAND_ATT_RETRY,
+    TRACE_EVENT_COMMAND_ATT_DROP,
+    TRACE_EVENT_COMMAND_QUEUE_FULL,
+    TRACE_EVENT_COMMAND_TOO_LARGE,
+    TRACE_EVENT_COMMAND_REPLAY,
+    TRACE_EVENT_COMMAND_NOT_ACKNOWLEDGED,
+    TRACE_EVENT_RELAY_CONNECTED,
+    TRACE_EVENT_RELAY_DISCONNECTED,
+    TRACE_EVENT_RELAY_WRITE_FAILED,
+    TRACE_EVENT_RELAY_WRITE_ATT_FAILED,
+    TRACE_EVENT_RELAY_APP_MESSAGE_TIMEOUT,
+    TRACE_EVENT_RELAY_ADVERTISE,
+    TRACE_EVENT_RELAY_NOTIFICATIONS,
+    TRACE_EVENT_RELAY_MTU,
+    TRACE_EVENT_MACRO_SLOT_UNKNOWN,
+    TRACE_EVENT_TAP_TEMPO,
+    TRACE_EVENT_TAP_TEMPO_DELAY_UNKNOWN,
+    TRACE_EVENT_BANK_SWITCH,
+    TRACE_EVENT_BANK_SLOT_EMPTY,
+    TRACE_EVENT_BANK_SLOT_TOO_LARGE,
+    TRACE_EVENT_RX,
+    TRACE_EVENT_RX_MESSAGE,
+    TRACE_EVENT_TX,
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+// record layout is also the binary format, little endian. Continuation records hold raw data bytes
+typedef struct {
+    uint32_t time_us;
+    uint16_t event;
+    uint16_t data_len;
+    uint32_t args[3];
+} trace_log_record_t;
+
+typedef struct {
+    uint32_t          events;
+    // read by consumer
+    volatile uint32_t dropped;
+    uint16_t          high_water;
+} trace_log_stats_t;
+
+/* API_START */
+
+/**
+ * @brief Init trace log
+ * @param time_us source of timestamps
+ */
+void trace_log_init(uint32_t (*time_us)(void));
+
+/**
+ * @brief Set verbosity, events above level are not recorded
+ * @param level
+ */
+void trace_log_set_level(trace_level_t level);
+
+/**
+ * @brief Get verbosity
+ * @return level
+ */
+trace_level_t trace_log_get_level(void);
+
+/**
+ * @brief Get name of level
+ * @param level
+ * @return name
+ */
+const char * trace_log_level_name(trace_level_t level);
+
+/**
+ * @brief Print records as binary lines for trace_decode instead of text
+ * @param binary
+ */
+void trace_log_set_binary(bool binary);
+
+/**
+ * @brief Get binary output
+ * @return true if binary
+ */
+bool trace_log_get_binary(void);
+
+/**
+ * @brief Record event, producer only
+ * @param event
+ * @param arg0
+ * @param arg1
+ * @param arg2
+ */
+void trace_log_event(trace_event_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+/**
+ * @brief Record event with data, producer only. Event and data are dropped together if the ring is full
+ * @param event
+ * @param arg0
+ * @param arg1
+ * @param arg2
+ * @param data
+ * @param len
+ */
+void trace_log_data(trace_event_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2, const uint8_t * data, uint16_t len);
+
+/**
+ * @brief Print recorded events, consumer only
+ */
+void trace_log_process(void);
+
+/**
+ * @brief Format event as text without newline
+ * @param record
+ * @param data of continuation records, record->data_len bytes
+ * @param buffer
+ * @param size of buffer
+ */
+void trace_log_format(const trace_log_record_t * record, const uint8_t * data, char * buffer, uint16_t size);
+
+/**
+ * @brief Get statistics
+ * @return stats
+ */
+const trace_log_stats_t * trace_log_get_stats(void);
+
+/* API_END */
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // TRACE_LOG_H